@@ -0,0 +1,58 @@
+/*Sequential file throughput. Writes a large file through my_fputc() in 
+fixed-size chunks, then reads it back through my_fgetc(), and reports MB/s 
+for a few chunk sizes.*/
+#include <string.h>
+#include <time.h>
+#include "filesystem.h"
+
+#define FILE_SIZE (48 * 1024 * 1024)
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int run(_u32 chunk, Byte *data) {
+    if (format("bench.disk", 4096, 16384, 128) < 0)
+        return -1;
+    unload();
+    if (load("bench.disk", 0) < 0)
+        return -1;
+    my_file *file = my_fopen("big");
+    if (file == NULL)
+        return -1;
+    double start = now();
+    for (_u32 done = 0; done < FILE_SIZE; done += chunk) {
+        if (my_fputc(file, data + done, chunk) != 0)
+            return -1;
+    }
+    fsync();
+    double write_time = now() - start;
+    my_fseek(file, 0);
+    start = now();
+    for (_u32 done = 0; done < FILE_SIZE; done += chunk) {
+        if (my_fgetc(file, data + done, chunk) != 0)
+            return -1;
+    }
+    double read_time = now() - start;
+    my_fclose(file);
+    unload();
+    printf("chunk %7u B: write %8.1f MB/s  read %8.1f MB/s\n", chunk,
+           FILE_SIZE / write_time / 1e6, FILE_SIZE / read_time / 1e6);
+    return 0;
+}
+
+int main()
+{
+    _u32 chunks[] = {512, 4096, 65536, 1048576};
+    Byte *data = malloc(FILE_SIZE);
+    memset(data, 'x', FILE_SIZE);
+    for (int i = 0; i < 4; i++) {
+        if (run(chunks[i], data) < 0)
+            return -1;
+    }
+    free(data);
+    remove("bench.disk");
+    return 0;
+}
@@ -0,0 +1,43 @@
+/*Benchmark for format(). Formats images from 16 MB to 4 GB, with the inode
+table written in full and initialised lazily, and reports the time taken
+and the space the image really occupies.*/
+#include <time.h>
+#include "filesystem.h"
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long allocated_kb(void) {
+    long kb = -1;
+    FILE *du = popen("du -k bench.disk", "r");
+    if (du != NULL) {
+        if (fscanf(du, "%ld", &kb) != 1)
+            kb = -1;
+        pclose(du);
+    }
+    return kb;
+}
+
+int main()
+{
+    _u32 sizes_mb[] = {16, 256, 1024, 4095};
+    for (int lazy = 0; lazy < 2; lazy++) {
+        set_format_flags(lazy ? FS_FORMAT_LAZY_ITABLE : 0);
+        for (int i = 0; i < 4; i++) {
+            _u32 num_blocks = sizes_mb[i] * 256;
+            // One inode for every four blocks
+            double start = now();
+            if (format("bench.disk", 4096, num_blocks, num_blocks / 4) < 0)
+                return -1;
+            unload();
+            double elapsed = now() - start;
+            printf("%-5s %5u MB: %8.2f ms, %8ld KB on disk\n",
+                   lazy ? "lazy" : "full", sizes_mb[i], elapsed * 1e3, allocated_kb());
+        }
+    }
+    remove("bench.disk");
+    return 0;
+}
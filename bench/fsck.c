@@ -0,0 +1,62 @@
+/*Benchmark for fsck_run(). Builds a 4 GB sparse image holding a tree of 
+directories with many small files and some large ones, then checks it 
+with 1, 2 and 4 worker threads and reports the time spent in each phase.*/
+#include <string.h>
+#include <time.h>
+#include "filesystem.h"
+
+#define BLOCK_SIZE 4096
+#define NUM_BLOCKS (1024 * 1024)
+#define NUM_DIRS 64
+#define FILES_PER_DIR 256
+#define LARGE_FILES 16
+#define LARGE_SIZE (16 * 1024 * 1024)
+
+static int build(Byte *data) {
+    char name[64];
+    if (format("bench.disk", BLOCK_SIZE, NUM_BLOCKS, 65536) < 0)
+        return -1;
+    unload();
+    if (load("bench.disk", 256) < 0)
+        return -1;
+    for (int d = 0; d < NUM_DIRS; d++) {
+        sprintf(name, "/d%d", d);
+        if (mkdir(name) != 0)
+            return -1;
+        for (int f = 0; f < FILES_PER_DIR; f++) {
+            sprintf(name, "/d%d/f%d", d, f);
+            my_file *file = my_fopen(name);
+            if (file == NULL || my_fputc(file, data, 100 + f * 40) != 0)
+                return -1;
+            my_fclose(file);
+        }
+    }
+    for (int i = 0; i < LARGE_FILES; i++) {
+        sprintf(name, "/large%d", i);
+        my_file *file = my_fopen(name);
+        if (file == NULL || my_fputc(file, data, LARGE_SIZE) != 0)
+            return -1;
+        my_fclose(file);
+    }
+    return unload();
+}
+
+int main()
+{
+    Byte *data = calloc(1, LARGE_SIZE);
+    if (data == NULL || build(data) < 0)
+        return -1;
+    _u32 threads[] = {1, 2, 4};
+    for (int i = 0; i < 3; i++) {
+        fsck_report_t report;
+        if (load("bench.disk", 0) < 0 || fsck_run(0, threads[i], &report) != 0)
+            return -1;
+        unload();
+        printf("%u threads: %u inodes, %u blocks, scan %.1f ms, walk %.1f ms, compare %.1f ms\n",
+               report.threads, report.used_inodes, report.used_blocks,
+               report.phase_ms[FSCK_SCAN], report.phase_ms[FSCK_WALK], report.phase_ms[FSCK_COMPARE]);
+    }
+    free(data);
+    remove("bench.disk");
+    return 0;
+}
@@ -0,0 +1,77 @@
+/*Compares the pread and mmap ways of accessing the disk image on a 
+metadata-heavy workload (creating directories and small files) and a 
+data-heavy one (writing and reading back a large file).*/
+#include <string.h>
+#include <time.h>
+#include "filesystem.h"
+
+#define NUM_DIRS 20
+#define FILES_PER_DIR 50
+#define FILE_SIZE (32 * 1024 * 1024)
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double metadata(void) {
+    char name[64];
+    if (format("bench.disk", 1024, 16384, 2048) < 0)
+        return -1;
+    double start = now();
+    for (int d = 0; d < NUM_DIRS; d++) {
+        sprintf(name, "/dir%d", d);
+        if (mkdir(name) != 0)
+            return -1;
+        for (int f = 0; f < FILES_PER_DIR; f++) {
+            sprintf(name, "/dir%d/file%d", d, f);
+            my_file *file = my_fopen(name);
+            if (file == NULL)
+                return -1;
+            my_fputc(file, (Byte *) name, strlen(name));
+            my_fclose(file);
+        }
+    }
+    fsync();
+    double elapsed = now() - start;
+    unload();
+    return elapsed;
+}
+
+static double data(Byte *buffer) {
+    if (format("bench.disk", 4096, 16384, 128) < 0)
+        return -1;
+    double start = now();
+    my_file *file = my_fopen("big");
+    for (_u32 done = 0; done < FILE_SIZE; done += 65536)
+        my_fputc(file, buffer + done, 65536);
+    my_fseek(file, 0);
+    for (_u32 done = 0; done < FILE_SIZE; done += 65536)
+        my_fgetc(file, buffer + done, 65536);
+    my_fclose(file);
+    fsync();
+    double elapsed = now() - start;
+    unload();
+    return elapsed;
+}
+
+int main()
+{
+    const char *names[] = {"pread", "mmap"};
+    int modes[] = {FS_IO_PREAD, FS_IO_MMAP};
+    Byte *buffer = malloc(FILE_SIZE);
+    memset(buffer, 'x', FILE_SIZE);
+    for (int i = 0; i < 2; i++) {
+        set_io_mode(modes[i]);
+        double meta = metadata();
+        double bulk = data(buffer);
+        if (meta < 0 || bulk < 0)
+            return -1;
+        printf("%-6s metadata: %7.1f us/create   data: %7.1f MB/s\n", names[i],
+               meta * 1e6 / (NUM_DIRS * (FILES_PER_DIR + 1)), 2.0 * FILE_SIZE / bulk / 1e6);
+    }
+    free(buffer);
+    remove("bench.disk");
+    return 0;
+}
@@ -0,0 +1,86 @@
+/*Benchmark for the io_uring backend. Compares the pread/pwrite path with
+io_uring at queue depths 1, 8 and 32 on a local image, for a scattered
+batch of block writes (like a bitmap and inode table flush) and for reading
+back a file whose blocks are spread over many runs. The image is in the
+page cache, so this shows the cost of submission rather than device
+parallelism.*/
+#include <string.h>
+#include <time.h>
+#include "filesystem.h"
+
+#define BLOCK_SIZE 4096
+#define NUM_BLOCKS 32768
+#define SCATTERED 4096
+#define FILE_SIZE (32 * 1024 * 1024)
+#define CHUNK (4 * BLOCK_SIZE)
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Two files written in turns, so each one is made of short runs
+static int build(Byte *data) {
+    set_io_mode(FS_IO_PREAD);
+    if (format("bench.disk", BLOCK_SIZE, NUM_BLOCKS, 1024) < 0)
+        return -1;
+    my_file *a = my_fopen("a");
+    my_file *b = my_fopen("b");
+    for (int i = 0; i < FILE_SIZE; i += CHUNK) {
+        if (my_fputc(a, data + i, CHUNK) != 0 || my_fputc(b, data + i, CHUNK) != 0)
+            return -1;
+    }
+    my_fclose(a);
+    my_fclose(b);
+    return unload();
+}
+
+static int run(const char *label, int mode, _u32 depth, Byte *data, Byte *buffer) {
+    set_io_mode(mode);
+    set_io_queue_depth(depth);
+    if (load("bench.disk", 0) < 0)
+        return -1;
+    // Every other block of the far end of the disk
+    block_request_t requests[SCATTERED];
+    for (int i = 0; i < SCATTERED; i++) {
+        requests[i].index = NUM_BLOCKS - 2 * SCATTERED + 2 * i;
+        requests[i].buffer = data + (size_t) i * BLOCK_SIZE;
+    }
+    double start = now();
+    if (write_blocks(requests, SCATTERED) != 0)
+        return -1;
+    double write_time = now() - start;
+
+    my_file *file = my_fopen("a");
+    start = now();
+    if (file == NULL || my_fgetc(file, buffer, FILE_SIZE) != 0)
+        return -1;
+    double read_time = now() - start;
+    my_fclose(file);
+    unload();
+    if (memcmp(buffer, data, FILE_SIZE) != 0)
+        return -1;
+    printf("%-10s: %8.1f us scattered write, %8.1f MB/s file read\n",
+           label, write_time * 1e6, FILE_SIZE / (1024.0 * 1024.0) / read_time);
+    return 0;
+}
+
+int main()
+{
+    Byte *data = malloc(FILE_SIZE);
+    Byte *buffer = malloc(FILE_SIZE);
+    for (int i = 0; i < FILE_SIZE; i++)
+        data[i] = (Byte) (i * 31 + i / BLOCK_SIZE);
+    if (build(data) < 0)
+        return -1;
+    if (run("pread", FS_IO_PREAD, 1, data, buffer) < 0
+        || run("uring QD1", FS_IO_URING, 1, data, buffer) < 0
+        || run("uring QD8", FS_IO_URING, 8, data, buffer) < 0
+        || run("uring QD32", FS_IO_URING, 32, data, buffer) < 0)
+        return -1;
+    free(data);
+    free(buffer);
+    remove("bench.disk");
+    return 0;
+}
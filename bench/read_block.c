@@ -0,0 +1,81 @@
+/*Microbenchmark for the block read path. It compares read_block() on the 
+cached mount context against the old behaviour, where every primitive 
+fetched the rootblock again (fseek to 0, fread and a malloc) before doing 
+its own seek and read. The read syscalls are taken from /proc/self/io.*/
+#include <string.h>
+#include <time.h>
+#include "filesystem.h"
+
+#define NUM_READS 200000
+
+// A second handle on the image, used to replay the old rootblock fetch
+static FILE *image;
+
+static long read_syscalls(void) {
+    FILE *io = fopen("/proc/self/io", "r");
+    char line[64];
+    long value = -1;
+    if (io == NULL) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), io) != NULL) {
+        if (sscanf(line, "syscr: %ld", &value) == 1) {
+            break;
+        }
+    }
+    fclose(io);
+    return value;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*The rootblock fetch each primitive used to do before the mount context*/
+static void legacy_get_rootblock(void) {
+    rootblock_t *rb = malloc(sizeof(rootblock_t));
+    fseek(image, 0, SEEK_SET);
+    fread(rb, sizeof(rootblock_t), 1, image);
+    free(rb);
+}
+
+static void run(const char *label, int legacy) {
+    rootblock_t *rb = get_rootblock();
+    Byte buffer[rb->block_size];
+    _u32 index = 1;
+    long before = read_syscalls();
+    double start = now();
+    for (int i = 0; i < NUM_READS; i++) {
+        // Scatter the reads so that the stdio buffer can't absorb them
+        index = (index * 1103515245u + 12345u) % rb->num_blocks;
+        if (legacy) {
+            legacy_get_rootblock();
+        }
+        read_block(index, buffer);
+    }
+    double elapsed = now() - start;
+    long after = read_syscalls();
+    printf("%-8s %8.1f ns/read  %.2f read syscalls/read\n", label,
+           elapsed * 1e9 / NUM_READS, (double) (after - before) / NUM_READS);
+}
+
+int main()
+{
+    if (format("bench.disk", 128, 4096, 80) < 0)
+        return -1;
+    unload();
+    if (load("bench.disk", 0) < 0)
+        return -1;
+    image = fopen("bench.disk", "r");
+    if (image == NULL)
+        return -1;
+    setvbuf(image, NULL, _IONBF, 0);
+    run("legacy", 1);
+    run("cached", 0);
+    fclose(image);
+    unload();
+    remove("bench.disk");
+    return 0;
+}
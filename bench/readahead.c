@@ -0,0 +1,63 @@
+/*Benchmark for sequential readahead. Streams a file back with my_fgetc()
+in pieces of different sizes and reports the read syscalls issued (from
+/proc/self/io) and the throughput. Without readahead every piece cost at
+least one block read.*/
+#include <time.h>
+#include "filesystem.h"
+
+#define FILE_SIZE (8 * 1024 * 1024)
+
+static long read_syscalls(void) {
+    FILE *io = fopen("/proc/self/io", "r");
+    char line[64];
+    long value = -1;
+    if (io == NULL) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), io) != NULL) {
+        if (sscanf(line, "syscr: %ld", &value) == 1) {
+            break;
+        }
+    }
+    fclose(io);
+    return value;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main()
+{
+    static Byte data[FILE_SIZE];
+    if (format("bench.disk", 4096, 8192, 128) < 0)
+        return -1;
+    my_file *file = my_fopen("stream");
+    if (file == NULL || my_fputc(file, data, FILE_SIZE) != 0)
+        return -1;
+    my_fclose(file);
+    unload();
+
+    _u32 pieces[] = {16, 256, 4096, 65536};
+    for (int i = 0; i < 4; i++) {
+        if (load("bench.disk", 0) < 0)
+            return -1;
+        file = my_fopen("stream");
+        long before = read_syscalls();
+        double start = now();
+        for (_u32 done = 0; done < FILE_SIZE; done += pieces[i]) {
+            if (my_fgetc(file, data, pieces[i]) != 0)
+                return -1;
+        }
+        double elapsed = now() - start;
+        long after = read_syscalls();
+        my_fclose(file);
+        unload();
+        printf("%6u byte reads: %6ld read syscalls, %8.1f MB/s\n",
+               pieces[i], after - before, FILE_SIZE / (1024.0 * 1024.0) / elapsed);
+    }
+    remove("bench.disk");
+    return 0;
+}
@@ -0,0 +1,64 @@
+/*Benchmark for the per-handle block buffer. Appends a file with my_fputc() 
+in small pieces through a write-through mount (write_buffer_size 0) and 
+reports the write syscalls issued per file block (from /proc/self/io) and 
+the time per call. Before the buffer every call wrote its block and the 
+inode table block.*/
+#include <time.h>
+#include "filesystem.h"
+
+#define BLOCK_SIZE 4096
+#define FILE_SIZE (2 * 1024 * 1024)
+
+static long write_syscalls(void) {
+    FILE *io = fopen("/proc/self/io", "r");
+    char line[64];
+    long value = -1;
+    if (io == NULL) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), io) != NULL) {
+        if (sscanf(line, "syscw: %ld", &value) == 1) {
+            break;
+        }
+    }
+    fclose(io);
+    return value;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main()
+{
+    static Byte data[FILE_SIZE];
+    _u32 pieces[] = {1, 16, 100, 1000};
+    for (int i = 0; i < 4; i++) {
+        if (format("bench.disk", BLOCK_SIZE, 4096, 128) < 0)
+            return -1;
+        unload();
+        if (load("bench.disk", 0) < 0)
+            return -1;
+        my_file *file = my_fopen("log");
+        if (file == NULL)
+            return -1;
+        _u32 calls = 0;
+        long before = write_syscalls();
+        double start = now();
+        for (_u32 done = 0; done < FILE_SIZE; done += pieces[i], calls++) {
+            _u32 num = FILE_SIZE - done < pieces[i] ? FILE_SIZE - done : pieces[i];
+            if (my_fputc(file, data + done, num) != 0)
+                return -1;
+        }
+        my_fclose(file);
+        double elapsed = now() - start;
+        long after = write_syscalls();
+        unload();
+        printf("%4u byte writes: %6.2f write syscalls per block, %6.3f us/call\n",
+               pieces[i], (after - before) / (double) (FILE_SIZE / BLOCK_SIZE), elapsed * 1e6 / calls);
+    }
+    remove("bench.disk");
+    return 0;
+}
@@ -0,0 +1,225 @@
+/*Benchmark suite run by `make bench`. Times the main operations of the 
+library and prints the results as JSON on stdout, one object per 
+benchmark with the number of operations, ops/sec and the p50 and p99 
+latencies in microseconds (plus MB/s for the throughput runs), so that 
+two versions can be compared. Every run uses bench.disk in the current 
+directory, mounted with a 64 block write buffer.*/
+#include <string.h>
+#include <time.h>
+#include "filesystem.h"
+
+#define WRITE_BUFFER 64
+#define NUM_FILES 2000
+#define FANOUT 32
+#define SMALL_IO 64
+#define LARGE_IO (1024 * 1024)
+#define IO_FILE_SIZE (32 * 1024 * 1024)
+#define COUNTER_BATCH 1000
+
+static Byte io_data[IO_FILE_SIZE];
+
+/*Latencies of one benchmark, in nanoseconds*/
+typedef struct samples {
+    double *ns;
+    _u32 count;
+    double total;
+} samples;
+
+static int first_result = 1;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int samples_init(samples *s, _u32 capacity) {
+    s->ns = malloc(capacity * sizeof(double));
+    s->count = 0;
+    s->total = 0;
+    return s->ns == NULL ? -1 : 0;
+}
+
+static void samples_add(samples *s, double ns) {
+    s->ns[s->count++] = ns;
+    s->total += ns;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(samples *s, double p) {
+    _u32 index = (_u32) (p * (s->count - 1) + 0.5);
+    return s->ns[index] / 1e3;
+}
+
+/*Prints one result. ops_per_sample is the number of operations each sample 
+timed, bytes_per_op is used for MB/s when non-zero.*/
+static void report(const char *name, samples *s, _u32 ops_per_sample, double bytes_per_op) {
+    qsort(s->ns, s->count, sizeof(double), compare_doubles);
+    double ops = (double) s->count * ops_per_sample;
+    double seconds = s->total / 1e9;
+    printf("%s    {\"name\": \"%s\", \"ops\": %.0f, \"seconds\": %.6f, \"ops_per_sec\": %.1f, "
+           "\"p50_us\": %.3f, \"p99_us\": %.3f",
+           first_result ? "" : ",\n", name, ops, seconds, ops / seconds,
+           percentile(s, 0.50) / ops_per_sample, percentile(s, 0.99) / ops_per_sample);
+    if (bytes_per_op > 0) {
+        printf(", \"mb_per_sec\": %.1f", ops * bytes_per_op / (1024.0 * 1024.0) / seconds);
+    }
+    printf("}");
+    first_result = 0;
+    free(s->ns);
+}
+
+static int fresh_image(_u32 block_size, _u32 num_blocks, _u32 num_inodes) {
+    if (format("bench.disk", block_size, num_blocks, num_inodes) < 0)
+        return -1;
+    unload();
+    return load("bench.disk", WRITE_BUFFER);
+}
+
+static int bench_format(void) {
+    _u32 sizes_mb[] = {4, 64, 1024};
+    _u32 repeats[] = {50, 20, 5};
+    char name[64];
+    for (int i = 0; i < 3; i++) {
+        samples s;
+        _u32 num_blocks = sizes_mb[i] * 256;
+        if (samples_init(&s, repeats[i]) < 0)
+            return -1;
+        for (_u32 r = 0; r < repeats[i]; r++) {
+            double start = now_ns();
+            if (format("bench.disk", 4096, num_blocks, num_blocks / 4) < 0)
+                return -1;
+            unload();
+            samples_add(&s, now_ns() - start);
+        }
+        sprintf(name, "format_%umb", sizes_mb[i]);
+        report(name, &s, 1, 0);
+    }
+    return 0;
+}
+
+static int bench_files(void) {
+    char name[64];
+    samples create, open;
+    if (fresh_image(1024, 16384, 4096) < 0 || mkdir("/files") != 0
+        || samples_init(&create, NUM_FILES) < 0 || samples_init(&open, NUM_FILES) < 0)
+        return -1;
+    for (int i = 0; i < NUM_FILES; i++) {
+        sprintf(name, "/files/f%d", i);
+        double start = now_ns();
+        my_file *file = my_fopen(name);
+        if (file == NULL || my_fclose(file) != 0)
+            return -1;
+        samples_add(&create, now_ns() - start);
+    }
+    for (int i = 0; i < NUM_FILES; i++) {
+        sprintf(name, "/files/f%d", (i * 7919) % NUM_FILES);
+        double start = now_ns();
+        my_file *file = my_fopen(name);
+        if (file == NULL || my_fclose(file) != 0)
+            return -1;
+        samples_add(&open, now_ns() - start);
+    }
+    report("create_file", &create, 1, 0);
+    report("open_file", &open, 1, 0);
+
+    // Counters, timed in batches since a single call is below clock resolution
+    samples counters;
+    if (samples_init(&counters, 1000) < 0)
+        return -1;
+    volatile _u32 sink = 0;
+    for (int i = 0; i < 1000; i++) {
+        double start = now_ns();
+        for (int j = 0; j < COUNTER_BATCH / 2; j++)
+            sink += num_free_blocks() + num_free_inodes();
+        samples_add(&counters, now_ns() - start);
+    }
+    report("num_free_counts", &counters, COUNTER_BATCH, 0);
+    return unload();
+}
+
+static int bench_mkdir(void) {
+    char name[64];
+    samples s;
+    if (fresh_image(1024, 16384, 4096) < 0 || samples_init(&s, FANOUT * (FANOUT + 1)) < 0)
+        return -1;
+    for (int i = 0; i < FANOUT; i++) {
+        sprintf(name, "/d%d", i);
+        double start = now_ns();
+        if (mkdir(name) != 0)
+            return -1;
+        samples_add(&s, now_ns() - start);
+        for (int j = 0; j < FANOUT; j++) {
+            sprintf(name, "/d%d/s%d", i, j);
+            start = now_ns();
+            if (mkdir(name) != 0)
+                return -1;
+            samples_add(&s, now_ns() - start);
+        }
+    }
+    report("mkdir_fanout", &s, 1, 0);
+
+    // Lookup: resolving a three level path, with the dentry cache warm
+    samples lookup;
+    if (samples_init(&lookup, 10000) < 0 || mkdir("/d3/s7/leaf") != 0)
+        return -1;
+    for (int i = 0; i < 10000; i++) {
+        sprintf(name, "/d%d/s%d/leaf", 3, 7);
+        double start = now_ns();
+        if (chdir(name) != 0)
+            return -1;
+        samples_add(&lookup, now_ns() - start);
+    }
+    chdir("/");
+    report("lookup_path", &lookup, 1, 0);
+    return unload();
+}
+
+static int bench_io(const char *write_name, const char *read_name, _u32 piece) {
+    _u32 count = IO_FILE_SIZE / piece;
+    samples writes, reads;
+    if (fresh_image(4096, 32768, 1024) < 0 || samples_init(&writes, count) < 0 || samples_init(&reads, count) < 0)
+        return -1;
+    my_file *file = my_fopen("/data");
+    if (file == NULL)
+        return -1;
+    for (_u32 i = 0; i < count; i++) {
+        double start = now_ns();
+        if (my_fputc(file, io_data + (size_t) i * piece, piece) != 0)
+            return -1;
+        samples_add(&writes, now_ns() - start);
+    }
+    my_fclose(file);
+    file = my_fopen("/data");
+    for (_u32 i = 0; i < count; i++) {
+        double start = now_ns();
+        if (my_fgetc(file, io_data + (size_t) i * piece, piece) != 0)
+            return -1;
+        samples_add(&reads, now_ns() - start);
+    }
+    my_fclose(file);
+    report(write_name, &writes, 1, piece);
+    report(read_name, &reads, 1, piece);
+    return unload();
+}
+
+int main()
+{
+    for (int i = 0; i < IO_FILE_SIZE; i++)
+        io_data[i] = (Byte) (i * 31 + i / 4096);
+    printf("{\n  \"write_buffer_size\": %d,\n  \"benchmarks\": [\n", WRITE_BUFFER);
+    if (bench_format() < 0 || bench_files() < 0 || bench_mkdir() < 0
+        || bench_io("fputc_small", "fgetc_small", SMALL_IO) < 0
+        || bench_io("fputc_large", "fgetc_large", LARGE_IO) < 0) {
+        fprintf(stderr, "benchmark failed\n");
+        remove("bench.disk");
+        return -1;
+    }
+    printf("\n  ]\n}\n");
+    remove("bench.disk");
+    return 0;
+}
@@ -0,0 +1,77 @@
+/*Benchmark for concurrent access. 1 to 16 threads each write and then read
+back their own files, and the aggregate throughput is reported for every
+thread count. Throughput only scales with the number of cores available.*/
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "filesystem.h"
+
+#define FILES_PER_THREAD 4
+#define FILE_SIZE (256 * 1024)
+#define CHUNK 4096
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *worker(void *arg) {
+    int thread = (int) (long) arg;
+    char name[32];
+    Byte chunk[CHUNK];
+    memset(chunk, thread, CHUNK);
+    for (int i = 0; i < FILES_PER_THREAD; i++) {
+        sprintf(name, "t%d-%d", thread, i);
+        my_file *file = my_fopen(name);
+        if (file == NULL)
+            return (void *) -1;
+        for (int written = 0; written < FILE_SIZE; written += CHUNK) {
+            if (my_fputc(file, chunk, CHUNK) != 0)
+                return (void *) -1;
+        }
+        my_fseek(file, 0);
+        for (int read = 0; read < FILE_SIZE; read += CHUNK) {
+            if (my_fgetc(file, chunk, CHUNK) != 0)
+                return (void *) -1;
+        }
+        my_fclose(file);
+    }
+    return NULL;
+}
+
+static int run(int threads) {
+    if (format("bench.disk", 4096, 32768, 1024) < 0)
+        return -1;
+    unload();
+    if (load("bench.disk", 64) < 0)
+        return -1;
+    pthread_t ids[threads];
+    void *result;
+    double start = now();
+    for (long i = 0; i < threads; i++)
+        pthread_create(&ids[i], NULL, worker, (void *) i);
+    int failed = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(ids[i], &result);
+        failed |= result != NULL;
+    }
+    unload();
+    double elapsed = now() - start;
+    if (failed)
+        return -1;
+    double megabytes = 2.0 * threads * FILES_PER_THREAD * FILE_SIZE / (1024 * 1024);
+    printf("%2d threads: %8.1f MB/s\n", threads, megabytes / elapsed);
+    return 0;
+}
+
+int main()
+{
+    int counts[] = {1, 2, 4, 8, 16};
+    for (int i = 0; i < 5; i++) {
+        if (run(counts[i]) < 0)
+            return -1;
+    }
+    remove("bench.disk");
+    return 0;
+}
@@ -0,0 +1,66 @@
+/*Benchmark for the write_buffer_size block cache. Creates a batch of files 
+in the root directory with different buffer sizes and reports the write 
+syscalls issued (from /proc/self/io) and the time taken.*/
+#include <string.h>
+#include <time.h>
+#include "filesystem.h"
+
+#define NUM_FILES 80
+
+static long write_syscalls(void) {
+    FILE *io = fopen("/proc/self/io", "r");
+    char line[64];
+    long value = -1;
+    if (io == NULL) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), io) != NULL) {
+        if (sscanf(line, "syscw: %ld", &value) == 1) {
+            break;
+        }
+    }
+    fclose(io);
+    return value;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int run(_u32 write_buffer_size) {
+    char name[32];
+    if (format("bench.disk", 1024, 8192, 128) < 0)
+        return -1;
+    unload();
+    if (load("bench.disk", write_buffer_size) < 0)
+        return -1;
+    long before = write_syscalls();
+    double start = now();
+    for (int i = 0; i < NUM_FILES; i++) {
+        sprintf(name, "f%d", i);
+        my_file *file = my_fopen(name);
+        if (file == NULL)
+            return -1;
+        my_fputc(file, (Byte *) "hello", 6);
+        my_fclose(file);
+    }
+    unload();
+    double elapsed = now() - start;
+    long after = write_syscalls();
+    printf("write_buffer_size %4u: %6ld write syscalls, %8.1f us/create\n",
+           write_buffer_size, after - before, elapsed * 1e6 / NUM_FILES);
+    return 0;
+}
+
+int main()
+{
+    _u32 sizes[] = {0, 8, 64, 512};
+    for (int i = 0; i < 4; i++) {
+        if (run(sizes[i]) < 0)
+            return -1;
+    }
+    remove("bench.disk");
+    return 0;
+}
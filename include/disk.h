@@ -0,0 +1,80 @@
+#ifndef DISK_H
+#define DISK_H
+
+#include <stddef.h>
+
+/*Host-side access to the disk image file. These calls live in their own 
+translation unit because the system headers they need declare mkdir(), 
+chdir() and fsync() with signatures that clash with filesystem.h.
+
+All transfers are positional (pread/pwrite), so no file offset is shared 
+between callers and independent requests can be issued concurrently.*/
+
+/*Opens the image for reading and writing, creating or truncating it if 
+create is set. Returns a file descriptor or -1 on error.*/
+int disk_open(const char *path, int create);
+
+/*Sets the size of the image to length bytes. Blocks that have never been 
+written take no space and read back as zeros. Returns 0 on success.*/
+int disk_resize(int fd, unsigned long long length);
+
+/*Closes an image opened with disk_open(). Returns 0 on success.*/
+int disk_close(int fd);
+
+/*Reads length bytes at offset. Returns 0 on success, -1 on error or if 
+the image ends first.*/
+int disk_pread(int fd, void *buffer, size_t length, unsigned long long offset);
+
+/*Writes length bytes at offset. Returns 0 on success, -1 on error.*/
+int disk_pwrite(int fd, const void *buffer, size_t length, unsigned long long offset);
+
+/*Writes count separate buffers of length bytes each to consecutive 
+locations starting at offset, with as few pwritev calls as possible. 
+Returns 0 on success, -1 on error.*/
+int disk_pwritev(int fd, unsigned char **buffers, int count, size_t length, unsigned long long offset);
+
+/*Reads consecutive locations starting at offset into count separate 
+buffers of length bytes each. Returns 0 on success, -1 on error.*/
+int disk_preadv(int fd, unsigned char **buffers, int count, size_t length, unsigned long long offset);
+
+/*One transfer for disk_ring_run(): count buffers of length bytes each, 
+moved to or from consecutive locations starting at offset.*/
+typedef struct disk_op {
+  unsigned char **buffers;
+  int count;
+  size_t length;
+  unsigned long long offset;
+} disk_op;
+
+/*An io_uring instance that keeps several transfers in flight at once*/
+typedef struct disk_ring disk_ring;
+
+/*Sets up an io_uring with room for depth transfers in flight. Returns NULL 
+if the kernel does not provide io_uring, in which case callers use the 
+pread/pwrite calls above.*/
+disk_ring *disk_ring_create(unsigned depth);
+
+/*Reads (or, if write is set, writes) num_ops transfers on the image fd 
+through ring, keeping up to its depth of them in flight. Transfers that 
+complete short are finished with preadv/pwritev. Returns 0 on success, -1 
+if any transfer failed.*/
+int disk_ring_run(disk_ring *ring, int fd, int write, disk_op *ops, int num_ops);
+
+/*Tears down a ring created by disk_ring_create()*/
+void disk_ring_destroy(disk_ring *ring);
+
+/*Forces written data out to stable storage. Returns 0 on success.*/
+int disk_flush(int fd);
+
+/*Maps the first length bytes of the image into memory for reading and 
+writing. Returns the mapping or NULL if the image is shorter than length 
+or cannot be mapped.*/
+unsigned char *disk_map(int fd, size_t length);
+
+/*Flushes a mapping back to the image file. Returns 0 on success.*/
+int disk_sync_map(unsigned char *map, size_t length);
+
+/*Removes a mapping created by disk_map(). Returns 0 on success.*/
+int disk_unmap(unsigned char *map, size_t length);
+
+#endif
@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <pthread.h>
 
 #ifndef TRUE
 #define TRUE 1
@@ -23,11 +24,25 @@ typedef struct inode {
     _u32 blocks[7];
 } inode_t;
 
+/*num_uninit_inode_table_blocks counts the blocks at the end of the inode 
+table that have never been written. They hold only free inodes and are 
+zeroed the first time one of their inodes is used. A journaled disk has 
+journal_blocks blocks of metadata journal starting at journal_start, right 
+after the root directory; both are 0 on a disk without one. Blocks that 
+cp() shares between files are counted in a table of refcount_blocks blocks 
+starting at refcount_start, holding a uint16_t per block. format() lays it 
+out after the journal with FS_FORMAT_REFCOUNT, otherwise it is made by the 
+first cp(), so both are 0 until then.*/
 typedef struct rootblock {
     _u32 block_size;
     _u32 num_blocks;
     _u32 num_free_bitmap_blocks;
     _u32 num_inode_table_blocks;
+    _u32 num_uninit_inode_table_blocks;
+    _u32 journal_start;
+    _u32 journal_blocks;
+    _u32 refcount_start;
+    _u32 refcount_blocks;
 } rootblock_t;
 
 /*A directory entry consists of an index to the inode for the entry. 
@@ -52,14 +67,37 @@ typedef struct directory {
 It records the index of the inode associated with the file and - to prevent 
 repeatedly reading it from disk - also has the inode itself. pos records the 
 current position in the file. The buffer entry is a block size sized buffer 
-containing the current block the file is looking at. Dirty records whether 
-the buffer has been modified (i.e., written to). */
+containing the current block the file is looking at: block buffer_block of 
+the file, of which the first buffer_length bytes lie within the file. Dirty 
+records whether the buffer has been modified (i.e., written to) since it 
+was last written back, dirty_start and dirty_end the bytes of it that were, 
+and buffer_generation the inode's generation when it was read in. The 
+inode is shared with every other open handle on the same file, and is 
+written to the inode table when the file is closed or synced. lock 
+serialises threads that use the same handle. 
+ 
+Sequential reads are served from the readahead buffer, which holds ra_count 
+blocks of the file starting at block ra_start. ra_window is the number of 
+blocks the next refill reads; it doubles while reads stay sequential, that 
+is while each read starts at ra_next, where the previous one ended. */
 typedef struct my_file {
     _u32 inode_num;
     inode_t *inode;
     _u32 pos;
     Byte *buffer;
     char dirty;
+    _u32 dirty_start;
+    _u32 dirty_end;
+    _u32 buffer_block;
+    _u32 buffer_length;
+    _u32 buffer_generation;
+    pthread_mutex_t lock;
+    Byte *readahead;
+    _u32 ra_start;
+    _u32 ra_count;
+    _u32 ra_window;
+    _u32 ra_next;
+    _u32 ra_generation;
 } my_file;
 
 /**************** PRIMITIVE ACCESS OPERATIONS ********************/
@@ -69,6 +107,22 @@ int read_block(_u32 index, Byte *buffer);
 the same size as the block size. Returns 0 on success, a negative number on error*/
 int write_block(_u32 index, Byte *content);
 
+/*One block of a batched transfer: the block's index and a block-sized buffer*/
+typedef struct block_request {
+    _u32 index;
+    Byte *buffer;
+} block_request_t;
+
+/*Reads count blocks, each into the buffer of its request. The requests are 
+sorted by index in place and runs of adjacent blocks are read with a single 
+call. Returns 0 on success, a negative number on error.*/
+int read_blocks(block_request_t *requests, _u32 count);
+/*Writes count blocks from the buffers of their requests, as if by 
+write_block() for each. The requests are sorted by index in place, so an 
+index should appear only once, and runs of adjacent blocks that go to the 
+disk are written with a single call. Returns 0 on success, a negative number on error*/
+int write_blocks(block_request_t *requests, _u32 count);
+
 /**************** INITIALIZATION OPERATIONS *********************/
 /*Formats the disk creating appropriate root blocks, free bitmap blocks, 
 inode blocks and root directory. returns 0 on success, a negative number on error*/
@@ -87,11 +141,57 @@ _u32 num_free_blocks();
 /*returns the number of free inodes on the disk*/
 _u32 num_free_inodes();
 
+/*Ways of accessing the disk image, see set_io_mode()*/
+#define FS_IO_PREAD 0
+#define FS_IO_MMAP 1
+#define FS_IO_URING 2
+
+/*Selects how the next load() or format() accesses the disk image: with 
+positional pread/pwrite calls on a file descriptor (FS_IO_PREAD, the default) 
+or by mapping the whole image into memory (FS_IO_MMAP), in which case fsync() 
+becomes an msync(). FS_IO_URING submits batched transfers through io_uring, 
+keeping several in flight, and falls back to FS_IO_PREAD on kernels without 
+it. Returns 0 on success.*/
+int set_io_mode(int mode);
+
+/*Sets how many transfers FS_IO_URING keeps in flight from the next load() 
+or format() on. The default is 32. Returns 0 on success, -1 if depth is 0.*/
+int set_io_queue_depth(_u32 depth);
+
+/*Options for format(), see set_format_flags()*/
+#define FS_FORMAT_LAZY_ITABLE 1
+#define FS_FORMAT_JOURNAL 2
+#define FS_FORMAT_REFCOUNT 4
+
+/*Selects options for the next format(). With FS_FORMAT_LAZY_ITABLE only the 
+first inode table block is written, the rest is initialised as it comes 
+into use. FS_FORMAT_JOURNAL reserves a metadata journal of 1/64 of the disk 
+(at least 16 and at most 4096 blocks): directory, inode table and bitmap 
+changes are then committed to it in groups, with sequential writes, and 
+load() replays whatever was committed but had not reached its place yet. 
+FS_FORMAT_REFCOUNT reserves the table cp() counts shared blocks in, which 
+is otherwise made by the first cp() from one free run of blocks. 
+A block freed while the journal holds a copy of it is only counted free, 
+and reused, once the journal starts over, at the latest at fsync(). 
+Returns 0 on success, -1 for an unknown flag.*/
+int set_format_flags(_u32 flags);
+
+/*Sets when a journaled disk commits, from the next load() or format() on: 
+once the changes of finished operations fill max_blocks blocks (default 
+128) or the oldest is interval_ms old (default 5000), checked as operations 
+finish. An operation that would find the running transaction half full 
+(of the journal or of the write buffer) has it committed before it starts. 
+fsync() and unload() always commit. A journaled disk keeps at least 
+2 * max_blocks blocks in its write buffer. Returns 0 on success, -1 if 
+max_blocks is 0.*/
+int set_journal_commit(_u32 interval_ms, _u32 max_blocks);
+
 /*Unloads the loaded file system. Returns 0 on success.*/
 int unload(void);
 
-/*This function writes all blocks that need to  be written back to the disk (see the load function's write_buffer_size for detals)*/
-// void fsync(void);
+/*This function writes all blocks that need to  be written back to the disk (see the load function's write_buffer_size for detals), 
+including what open files still hold in their block buffers.*/
+void fsync(void);
 
 /**************** DIRECTORY OPERATIONS *********************/
 /* Makes a directory. name is either a full path (if it begins with '/', 
@@ -102,23 +202,64 @@ int mkdir(char *name);
 or a relative path with regards to the current location in the file system. 
 All entries except the last must already exist. If recursive is true, then 
 all entries below the removed directory are also removed. If false and the 
-directory is not empty, return an error. Returns 0 on success.*/
-// int rmdir(char *name,char recursive);
+directory is not empty, return an error. Returns 0 on success. 
+The current directory and the directories above it can't be removed, nor can a subtree 
+holding a file that is open.*/
+int rmdir(char *name,char recursive);
 /* Sets the current working directory. name is either a full path 
 (if it begins with '/', or a relative path with regards to the current location 
-in the file system. All entries must already exist. Returns 0 on success.*/
+in the file system. All entries must already exist. Returns 0 on success. 
+There is one current directory per process, shared by all its threads.*/
 int chdir(char *name);
 /* Returns the full path to the current directory*/
 char *cwd(void);
-/* Returns a sorted list of directory entries as a string separated by \n*/
+/* Returns a sorted list of directory entries as a string separated by \n. 
+These are the entries of the current directory, '.' and '..' left out, and the caller frees the string. 
+The sorted list is kept with the directory and only rebuilt after the directory changes.*/
 char *ls(void);
 
+/*A directory opened with my_opendir(). Entries are read straight from the 
+directory's blocks into window, which holds window_length bytes of the 
+directory starting at window_start, and offset is where the next entry 
+starts. generation is the directory's generation when the window was read, 
+so that it is read again once the directory changes. index is the 
+directory's in-memory index, which stays allocated while the handle is 
+open. entry is the entry my_readdir() returned last, and its name points 
+into name.*/
+typedef struct my_dir {
+    _u32 inode_num;
+    struct dir_index *index;
+    _u32 offset;
+    Byte *window;
+    _u32 window_start;
+    _u32 window_length;
+    _u32 generation;
+    direntry_t entry;
+    char name[256];
+} my_dir;
+
+/* Opens the directory name, a full or relative path, for reading with my_readdir(). Returns NULL on error.*/
+my_dir *my_opendir(char *name);
+/* Returns the next entry of dir, '.' and '..' included, in the order they are stored, or NULL after the last. 
+The entry belongs to dir and stays valid until the next call. Entries added or removed meanwhile may or may not be seen.*/
+direntry_t *my_readdir(my_dir *dir);
+/* Closes a directory opened with my_opendir(). Returns 0 on success.*/
+int my_closedir(my_dir *dir);
+
 /**************** FILE OPERATIONS *********************/
-/* removes a file named name. name is either a full path (if it begins with '/', or a relative path with regards to the current location in the file system. Returns 0 on success.*/
+/* removes a file named name. name is either a full path (if it begins with '/', or a relative path with regards to the current location in the file system. Returns 0 on success. 
+Blocks the file shares with a copy made by cp() stay with the copy. A file that is open can't be removed.*/
 int rm(char *name);
-/* moves a file (pointed to by the string src) to dest. We assume dest ends with a filename which identifies the new name of the file being moved. Returns 0 on success.*/
+/* moves a file (pointed to by the string src) to dest. We assume dest ends with a filename which identifies the new name of the file being moved. Returns 0 on success. 
+Only the direntry moves, so no data block is touched, and directories can be moved too, 
+though not into themselves. An existing dest is replaced if it is of the same type, is not 
+open and, for a directory, is empty.*/
 int mv(char *src, char *dest);
-/* copies a file (pointed to by the string src) to dest.  The file is renamed to the last element of dest. src and dest can be absolute or relative paths. Returns 0 on success.*/
+/* copies a file (pointed to by the string src) to dest.  The file is renamed to the last element of dest. src and dest can be absolute or relative paths. 
+The copy shares the data and indirect blocks of src, so it costs one inode and one directory entry 
+whatever the size of the file. A shared block is copied the first time either file writes to it. 
+When the disk has no refcount table and no free run to make one from, the data is copied instead. 
+dest must not exist yet. Returns 0 on success.*/
 int cp(char *src, char *dest);
 
 /**************** FILE CREATION and I/O OPERATIONS ************/
@@ -126,9 +267,14 @@ int cp(char *src, char *dest);
 my_file *my_fopen(char *filename);
 /* closes the file and does any cleanup necessary. Returns 0 on success.*/
 int my_fclose(my_file *file);
-/*reads num bytes from file into buffer. Returns 0 on success.*/
+/*reads num bytes from file into buffer. Returns 0 on success. What this 
+handle has written is read back from its buffer, which stays in place.*/
 int my_fgetc(my_file *file, Byte *buffer, _u32 num);
-/*writes num bytes from file into buffer. Returns 0 on success.*/
+/*writes num bytes from file into buffer. Returns 0 on success. Writes 
+smaller than a block collect in the handle's buffer until the position 
+moves to another block, or until my_fclose() or fsync(). Other handles see 
+them from then on; they are merged into the block as it is then, so writes 
+to other bytes of it through other handles are kept.*/
 int my_fputc(my_file *file, Byte *buffer, _u32 num);
 /*sets the current position for reading/writing to pos within the file. Returns 0 on success.*/
 int my_fseek(my_file *file, _u32 pos);
@@ -140,8 +286,182 @@ int lock(char *file);
 int unlock(char *file);
 
 /*************** FILE SYSTEM VERIFICATION FUNCTIONS***********/
+/*Phases of fsck_run(), each timed in fsck_report_t.phase_ms*/
+#define FSCK_SCAN 0    // inode table read and block pointers followed
+#define FSCK_WALK 1    // directory tree walked from the root
+#define FSCK_COMPARE 2 // claimed blocks compared with the free bitmap
+#define FSCK_REPAIR 3
+#define FSCK_PHASES 4
+
+/*What fsck_run() found. A block is leaked when the bitmap marks it used 
+but nothing refers to it, and unmarked the other way round. A double 
+allocation is a block one inode points at when another one already does 
+and cp() did not share it, a bad pointer points outside the data area, a 
+dangling entry names an inode that is not in use and an orphan is an inode 
+in use that no directory entry names.*/
+typedef struct fsck_report {
+    _u32 used_inodes;
+    _u32 used_blocks;
+    _u32 directories;
+    _u32 leaked_blocks;
+    _u32 unmarked_blocks;
+    _u32 double_allocations;
+    _u32 bad_pointers;
+    _u32 dangling_entries;
+    _u32 orphan_inodes;
+    _u32 repaired;
+    _u32 threads;
+    double phase_ms[FSCK_PHASES];
+} fsck_report_t;
+
+/*Checks the loaded file system in one pass over the inode table, read in 
+large sequential runs, and a walk of the directory tree, both spread over 
+threads worker threads (0 for one per CPU, at most 8). With repair set, 
+dangling entries are removed, orphans freed and the free bitmap rebuilt; 
+double allocations and bad pointers are only reported. Nothing else may 
+use the file system meanwhile. report, if not NULL, receives the counts 
+and the time spent in each phase. Returns the number of problems found 
+or -1 on error.*/
+int fsck_run(int repair, _u32 threads, fsck_report_t *report);
+
+/*Checks and repairs the loaded file system, see fsck_run(). Returns the 
+number of problems found, 0 if it is consistent, or -1 on error.*/
 int fsck(void);
 
+/*************** STATISTICS ***********/
+/*Operations counted by fs_stats(), indexes into fs_stats_t.ops*/
+#define FS_OP_FORMAT 0
+#define FS_OP_LOAD 1
+#define FS_OP_UNLOAD 2
+#define FS_OP_FSYNC 3
+#define FS_OP_MKDIR 4
+#define FS_OP_CHDIR 5
+#define FS_OP_CWD 6
+#define FS_OP_FOPEN 7
+#define FS_OP_FCLOSE 8
+#define FS_OP_FGETC 9
+#define FS_OP_FPUTC 10
+#define FS_OP_FSEEK 11
+#define FS_OP_FSCK 12
+#define FS_OP_CP 13
+#define FS_OP_MV 14
+#define FS_OP_RM 15
+#define FS_OP_RMDIR 16
+#define FS_OP_LS 17
+#define FS_OP_OPENDIR 18
+#define FS_OP_READDIR 19
+#define FS_OP_CLOSEDIR 20
+#define FS_OPS 21
+
+/*Regions of the disk, indexes into fs_stats_t.block_reads and block_writes. 
+FS_REGION_DIRECTORY is the part of the data area holding directories, 
+FS_REGION_REFCOUNT the table of block owners cp() sets up in the data area.*/
+#define FS_REGION_ROOTBLOCK 0
+#define FS_REGION_BITMAP 1
+#define FS_REGION_ITABLE 2
+#define FS_REGION_JOURNAL 3
+#define FS_REGION_DIRECTORY 4
+#define FS_REGION_DATA 5
+#define FS_REGION_REFCOUNT 6
+#define FS_REGIONS 7
+
+/*Latency histogram buckets: bucket i counts calls that took from 2^i up to 
+2^(i+1) nanoseconds, the last one everything longer.*/
+#define FS_LATENCY_BUCKETS 32
+
+/*Each thread times one call in FS_STATS_SAMPLE of every operation, so that 
+the clock is rarely read*/
+#define FS_STATS_SAMPLE 8
+
+/*Calls of one operation and the ones that failed. timed is the number of 
+calls that were timed, and total_ns and latency cover only those.*/
+typedef struct fs_op_stats {
+    unsigned long long calls;
+    unsigned long long errors;
+    unsigned long long timed;
+    unsigned long long total_ns;
+    unsigned long long latency[FS_LATENCY_BUCKETS];
+} fs_op_stats_t;
+
+/*What fs_stats() reports. Block reads and writes are blocks moved between 
+the library and the disk image, bytes_read and bytes_written the same in 
+bytes, and a seek is a transfer that does not start where the same 
+thread's previous one ended. Cache hits and misses are block reads answered 
+by the write buffer or not, dentry hits and misses path lookups answered by 
+the dentry cache or not. threads is the number of threads that have recorded anything.*/
+typedef struct fs_stats {
+    fs_op_stats_t ops[FS_OPS];
+    unsigned long long block_reads[FS_REGIONS];
+    unsigned long long block_writes[FS_REGIONS];
+    unsigned long long bytes_read;
+    unsigned long long bytes_written;
+    unsigned long long seeks;
+    unsigned long long cache_hits;
+    unsigned long long cache_misses;
+    unsigned long long dentry_hits;
+    unsigned long long dentry_misses;
+    unsigned long long threads;
+} fs_stats_t;
+
+/*Fills in stats with everything counted since the program started or the 
+last fs_stats_reset(), across mounts. Each thread counts into its own 
+counters, which are added up here. Returns 0 on success.*/
+int fs_stats(fs_stats_t *stats);
+
+/*Starts counting from zero again*/
+void fs_stats_reset(void);
+
+/*Returns the name of operation op (e.g. "my_fopen"), or NULL*/
+const char *fs_op_name(int op);
+
+/*************** TRACING ***********/
+#define FS_TRACE_MAGIC 0x52545346 // "FSTR"
+#define FS_TRACE_VERSION 1
+
+/*Kinds of access in a trace record. Block reads and writes are the 
+requests made to the block layer, before the write buffer; inode reads 
+and writes are accesses to the inode table, whose index is the inode.*/
+#define FS_TRACE_READ 0
+#define FS_TRACE_WRITE 1
+#define FS_TRACE_INODE_READ 2
+#define FS_TRACE_INODE_WRITE 3
+
+/*op of a record made outside any operation, e.g. by read_block() itself*/
+#define FS_TRACE_NO_OP 255
+
+/*A trace file starts with this header, giving the geometry of the traced 
+disk, and goes on with fs_trace_record_t records*/
+typedef struct fs_trace_header {
+    _u32 magic;
+    _u32 version;
+    _u32 block_size;
+    _u32 num_blocks;
+    _u32 inode_table_start;
+    _u32 num_inodes;
+} fs_trace_header_t;
+
+/*One access: nanoseconds since trace_start(), the block or inode index, its 
+region (an FS_REGION_ value), the kind of access and the operation that 
+made it (an FS_OP_ value or FS_TRACE_NO_OP).*/
+typedef struct fs_trace_record {
+    uint64_t time_ns;
+    _u32 index;
+    Byte region;
+    Byte access;
+    Byte op;
+    Byte reserved;
+} fs_trace_record_t;
+
+/*Starts recording every block and inode access of the loaded file system 
+to the file path, replacing a trace already running. Records are buffered 
+and written in batches. The trace ends with trace_stop() or unload(). 
+Returns 0 on success.*/
+int trace_start(char *path);
+
+/*Writes out what is buffered and closes the trace. Returns 0 on success, 
+-1 if no trace is running or it could not be written.*/
+int trace_stop(void);
+
 //own helper functions
 int get_positive_bits(Byte b);
 
@@ -151,6 +471,16 @@ int write_inode(_u32 index, _u32 *buffer);
 
 _u32 get_first_free_inode();
 
-int update_bitmap(_u32 num);
+_u32 allocate_inode();
+
+int free_inode(_u32 index);
+
+void get_dcache_stats(_u32 *hits, _u32 *misses);
+
+_u32 allocate_blocks(_u32 goal, _u32 count, _u32 *allocated);
+
+_u32 allocate_block(_u32 goal);
+
+int free_block(_u32 index);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,355 @@
+/*
+* Host I/O for the disk image, kept apart from filesystem.c (see disk.h).
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "disk.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/*Opens the image. Returns a file descriptor or -1 on error.*/
+int disk_open(const char *path, int create) {
+  int flags = O_RDWR | O_CLOEXEC;
+  if (create) {
+    flags |= O_CREAT | O_TRUNC;
+  }
+  return open(path, flags, 0644);
+}
+
+/*Extends the image with ftruncate(), which leaves a hole rather than 
+writing zeros.*/
+int disk_resize(int fd, unsigned long long length) {
+  int result;
+  do {
+    result = ftruncate(fd, length);
+  } while (result < 0 && errno == EINTR);
+  return result;
+}
+
+int disk_close(int fd) {
+  return close(fd);
+}
+
+/*Reads length bytes at offset, retrying short reads. Returns 0 on success.*/
+int disk_pread(int fd, void *buffer, size_t length, unsigned long long offset) {
+  unsigned char *bytes = buffer;
+  while (length > 0) {
+    ssize_t got = pread(fd, bytes, length, offset);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0) {
+      return -1;
+    }
+    bytes += got;
+    length -= got;
+    offset += got;
+  }
+  return 0;
+}
+
+/*Writes length bytes at offset, retrying short writes. Returns 0 on success.*/
+int disk_pwrite(int fd, const void *buffer, size_t length, unsigned long long offset) {
+  const unsigned char *bytes = buffer;
+  while (length > 0) {
+    ssize_t put = pwrite(fd, bytes, length, offset);
+    if (put < 0 && errno == EINTR) {
+      continue;
+    }
+    if (put <= 0) {
+      return -1;
+    }
+    bytes += put;
+    length -= put;
+    offset += put;
+  }
+  return 0;
+}
+
+/*Transfers count buffers of length bytes to or from consecutive locations 
+starting at offset, IOV_MAX buffers per call. A short transfer falls back 
+to finishing that buffer on its own. Returns 0 on success.*/
+static int disk_vector(int fd, unsigned char **buffers, int count, size_t length, unsigned long long offset, int writing) {
+  struct iovec iov[IOV_MAX];
+  int done = 0;
+  while (done < count) {
+    int batch = count - done < IOV_MAX ? count - done : IOV_MAX;
+    for (int i = 0; i < batch; i++) {
+      iov[i].iov_base = buffers[done + i];
+      iov[i].iov_len = length;
+    }
+    ssize_t moved = writing ? pwritev(fd, iov, batch, offset) : preadv(fd, iov, batch, offset);
+    if (moved < 0 && errno == EINTR) {
+      continue;
+    }
+    if (moved <= 0) {
+      return -1;
+    }
+    // Whole buffers that made it, then the rest of a partly moved one
+    int whole = moved / length;
+    size_t partial = moved % length;
+    done += whole;
+    offset += (unsigned long long) whole * length;
+    if (partial > 0) {
+      int result = writing
+        ? disk_pwrite(fd, buffers[done] + partial, length - partial, offset + partial)
+        : disk_pread(fd, buffers[done] + partial, length - partial, offset + partial);
+      if (result < 0) {
+        return -1;
+      }
+      done++;
+      offset += length;
+    }
+  }
+  return 0;
+}
+
+int disk_pwritev(int fd, unsigned char **buffers, int count, size_t length, unsigned long long offset) {
+  return disk_vector(fd, buffers, count, length, offset, 1);
+}
+
+int disk_preadv(int fd, unsigned char **buffers, int count, size_t length, unsigned long long offset) {
+  return disk_vector(fd, buffers, count, length, offset, 0);
+}
+
+/*The submission and completion queues shared with the kernel. The ring is 
+driven with raw system calls, so liburing is not needed. One thread at a 
+time uses it.*/
+struct disk_ring {
+  int fd;
+  unsigned depth;
+  pthread_mutex_t lock;
+  void *sq_map;
+  size_t sq_map_length;
+  void *cq_map;
+  size_t cq_map_length;
+  struct io_uring_sqe *sqes;
+  size_t sqes_length;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+};
+
+disk_ring *disk_ring_create(unsigned depth) {
+  if (depth == 0) {
+    return NULL;
+  }
+  disk_ring *ring = calloc(1, sizeof(disk_ring));
+  if (ring == NULL) {
+    return NULL;
+  }
+  pthread_mutex_init(&ring->lock, NULL);
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring->fd = syscall(__NR_io_uring_setup, depth, &params);
+  if (ring->fd < 0) {
+    pthread_mutex_destroy(&ring->lock);
+    free(ring);
+    return NULL;
+  }
+  ring->depth = depth < params.sq_entries ? depth : params.sq_entries;
+  ring->sq_map_length = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_map_length = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  // Newer kernels let both queues share one mapping
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_map_length > ring->sq_map_length) {
+      ring->sq_map_length = ring->cq_map_length;
+    }
+    ring->cq_map_length = 0;
+  }
+  ring->sqes_length = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sq_map = mmap(NULL, ring->sq_map_length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  ring->cq_map = ring->cq_map_length == 0 ? ring->sq_map
+    : mmap(NULL, ring->cq_map_length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+  ring->sqes = mmap(NULL, ring->sqes_length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED) {
+    if (ring->sq_map == MAP_FAILED) {
+      ring->sq_map = NULL;
+    }
+    if (ring->cq_map == MAP_FAILED) {
+      ring->cq_map = NULL;
+    }
+    if (ring->sqes == MAP_FAILED) {
+      ring->sqes = NULL;
+    }
+    disk_ring_destroy(ring);
+    return NULL;
+  }
+  unsigned char *sq = ring->sq_map;
+  unsigned char *cq = ring->cq_map;
+  ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+  ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+  return ring;
+}
+
+/*Submits to_submit queued entries and waits for at least one completion*/
+static int ring_enter(disk_ring *ring, unsigned to_submit) {
+  int result;
+  do {
+    result = syscall(__NR_io_uring_enter, ring->fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+  } while (result < 0 && errno == EINTR);
+  return result;
+}
+
+/*Takes the completions waiting in the ring, repeating in full any transfer 
+that failed or came up short, and sets failed if a repeat fails too. 
+Returns the number of completions taken.*/
+static unsigned ring_reap(disk_ring *ring, int fd, int write, disk_op *ops, int *failed) {
+  unsigned reaped = 0;
+  unsigned head = *ring->cq_head;
+  while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    disk_op *op = &ops[cqe->user_data];
+    if (cqe->res < 0 || (size_t) cqe->res != op->count * op->length) {
+      // Positional transfers can simply be repeated in full
+      int result = write
+        ? disk_pwritev(fd, op->buffers, op->count, op->length, op->offset)
+        : disk_preadv(fd, op->buffers, op->count, op->length, op->offset);
+      *failed |= result < 0;
+    }
+    head++;
+    reaped++;
+  }
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  return reaped;
+}
+
+int disk_ring_run(disk_ring *ring, int fd, int write, disk_op *ops, int num_ops) {
+  // Every transfer gets its own iovecs, which must live until it completes
+  int total = 0;
+  for (int i = 0; i < num_ops; i++) {
+    total += ops[i].count;
+  }
+  struct iovec *iov = malloc(total * sizeof(struct iovec));
+  int *first_iov = malloc(num_ops * sizeof(int));
+  if (iov == NULL || first_iov == NULL) {
+    free(iov);
+    free(first_iov);
+    return -1;
+  }
+  for (int i = 0, next = 0; i < num_ops; i++) {
+    first_iov[i] = next;
+    for (int j = 0; j < ops[i].count; j++, next++) {
+      iov[next].iov_base = ops[i].buffers[j];
+      iov[next].iov_len = ops[i].length;
+    }
+  }
+  int failed = 0;
+  int submitted = 0;
+  unsigned in_flight = 0;
+  pthread_mutex_lock(&ring->lock);
+  while (submitted < num_ops || in_flight > 0) {
+    // Top the submission queue up to the ring's depth
+    unsigned queued = 0;
+    unsigned tail = *ring->sq_tail;
+    while (submitted < num_ops && in_flight < ring->depth) {
+      unsigned index = tail & *ring->sq_mask;
+      struct io_uring_sqe *sqe = &ring->sqes[index];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+      sqe->fd = fd;
+      sqe->addr = (unsigned long) &iov[first_iov[submitted]];
+      sqe->len = ops[submitted].count;
+      sqe->off = ops[submitted].offset;
+      sqe->user_data = submitted;
+      ring->sq_array[index] = index;
+      tail++;
+      submitted++;
+      in_flight++;
+      queued++;
+    }
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+    if (ring_enter(ring, queued) < 0) {
+      // Nothing was submitted: take the entries back and finish synchronously
+      __atomic_store_n(ring->sq_tail, tail - queued, __ATOMIC_RELEASE);
+      in_flight -= queued;
+      for (int i = submitted - queued; i < num_ops; i++) {
+        int result = write
+          ? disk_pwritev(fd, ops[i].buffers, ops[i].count, ops[i].length, ops[i].offset)
+          : disk_preadv(fd, ops[i].buffers, ops[i].count, ops[i].length, ops[i].offset);
+        failed |= result < 0;
+      }
+      // The transfers submitted earlier still use iov and the buffers, so 
+      // they are waited for. Their completions show up in the ring even 
+      // if waiting in the kernel fails.
+      while ((in_flight -= ring_reap(ring, fd, write, ops, &failed)) > 0) {
+        ring_enter(ring, 0);
+      }
+      break;
+    }
+    in_flight -= ring_reap(ring, fd, write, ops, &failed);
+  }
+  pthread_mutex_unlock(&ring->lock);
+  free(iov);
+  free(first_iov);
+  return failed ? -1 : 0;
+}
+
+void disk_ring_destroy(disk_ring *ring) {
+  if (ring == NULL) {
+    return;
+  }
+  if (ring->sqes != NULL) {
+    munmap(ring->sqes, ring->sqes_length);
+  }
+  if (ring->cq_map != NULL && ring->cq_map != ring->sq_map) {
+    munmap(ring->cq_map, ring->cq_map_length);
+  }
+  if (ring->sq_map != NULL) {
+    munmap(ring->sq_map, ring->sq_map_length);
+  }
+  close(ring->fd);
+  pthread_mutex_destroy(&ring->lock);
+  free(ring);
+}
+
+/*Forces written data out to stable storage. fdatasync() is used because 
+the library defines its own fsync().*/
+int disk_flush(int fd) {
+  return fdatasync(fd);
+}
+
+/*Maps the first length bytes of the image. Returns NULL on failure.*/
+unsigned char *disk_map(int fd, size_t length) {
+  struct stat info;
+  if (fstat(fd, &info) < 0 || (size_t) info.st_size < length) {
+    return NULL;
+  }
+  void *map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    return NULL;
+  }
+  return map;
+}
+
+/*Writes the dirty pages of a mapping back to the image. Returns 0 on success.*/
+int disk_sync_map(unsigned char *map, size_t length) {
+  return msync(map, length, MS_SYNC);
+}
+
+/*Removes a mapping. Returns 0 on success.*/
+int disk_unmap(unsigned char *map, size_t length) {
+  return munmap(map, length);
+}
@@ -6,952 +6,5708 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/sysinfo.h>
 #include "filesystem.h"
+#include "disk.h"
 
-FILE * fp = NULL;
+// File descriptor of the mounted disk image, -1 when nothing is loaded
+static int fd = -1;
+
+// How the next load() or format() will access the disk image
+static int io_mode = FS_IO_PREAD;
+static _u32 queue_depth = 32;
+static _u32 format_flags = 0;
+static _u32 commit_interval = 5000;
+static _u32 commit_blocks = 128;
+
+#define DIR_TABLE_SIZE 64
+#define DIR_NONE ((_u32) -1)
+
+/*One live entry of a directory, as held by the directory's in-memory index.*/
+typedef struct dir_slot {
+  _u32 inode_num;
+  Byte type;
+  Byte name_length; // on-disk length of the name field, including the terminator
+  _u32 offset;      // byte offset of the direntry within the directory
+  _u32 hash;
+  _u32 next;        // next slot in the same hash chain, or DIR_NONE
+  char *name;
+} dir_slot;
+
+/*A direntry whose type byte is 0 is a free slot left behind by a removed 
+entry. Its name_length still gives its size, so a later name that is no 
+longer than the old one can reuse it.*/
+typedef struct dir_hole {
+  _u32 offset;
+  Byte name_length;
+} dir_hole;
+
+/*In-memory index of a directory. The directory is parsed once, the first 
+time it is used, into a hash table from name to slot. Creates and removals 
+update the index and the on-disk entries together.*/
+typedef struct dir_index {
+  _u32 inode_num;
+  inode_t inode;
+  _u32 num_entries;
+  _u32 capacity;
+  dir_slot *slots;
+  _u32 *buckets;    // head slot of each hash chain, or DIR_NONE
+  _u32 num_buckets; // a power of two
+  dir_hole *holes;
+  _u32 num_holes;
+  pthread_rwlock_t lock;  // readers look names up, writers add and remove entries
+  _u32 generation;        // bumped by every change to the entries
+  pthread_mutex_t listing_lock; // guards the fields below, taken before lock
+  char *listing;          // sorted names for ls(), NULL until it is asked for
+  _u32 listing_length;
+  _u32 listing_generation; // generation the listing was built from
+  _u32 openers;           // my_dir handles reading it, guarded by table_lock
+  Byte forgotten;         // dropped from dir_table while handles were still open
+  Byte removed;           // unlinked by rm/rmdir/mv, names nothing and takes no new entries
+  struct dir_index *next; // next index in the same dir_table bucket
+} dir_index;
+
+#define ICACHE_SIZE 256
+
+/*In-core inode shared by every open my_file on the same file. The inode 
+is the first member so that a my_file's inode pointer leads back here.*/
+typedef struct incore_inode {
+  inode_t inode;
+  _u32 inode_num;
+  _u32 refs;
+  char detached;          // dropped from the table by unload() while still open
+  _u32 generation;        // bumped by every write, so readahead can tell it is stale
+  char dirty;             // changed since it was last stored in the inode table
+  pthread_rwlock_t lock;  // readers use my_fgetc, writers my_fputc
+  struct incore_inode *next;
+} incore_inode;
+
+#define DCACHE_SIZE 1024
+
+#define RA_MIN_BLOCKS 4
+#define RA_MAX_BYTES (128 * 1024)
+
+/*A dentry cache entry: the child found under name in directory parent*/
+typedef struct dentry {
+  _u32 parent;
+  _u32 child;
+  Byte type;
+  _u32 hash;
+  char *name; // NULL when the entry is empty
+} dentry;
+
+/*The disk is split into allocation groups, one per free bitmap block: 
+group g covers the blocks bitmap block g describes and a matching slice of 
+the inode table. A descriptor counts what is still free in its group, so 
+the allocator can keep an inode, its data and its directory together 
+without scanning the bitmap. The descriptors are built from the bitmap and 
+the inode map when the disk is loaded and kept up to date along with them.*/
+typedef struct group_desc {
+  _u32 free_blocks;
+  _u32 free_inodes;
+} group_desc;
+
+/*What a removal frees. The inodes and blocks are collected first and freed 
+in sorted order afterwards, so that each inode table block and each bitmap 
+block changes, and is written, once however many of its entries go. 
+directories lists the freed inodes that were directories.*/
+typedef struct release_set {
+  _u32 *inodes;
+  _u32 num_inodes;
+  _u32 inodes_capacity;
+  _u32 *blocks;
+  _u32 num_blocks;
+  _u32 blocks_capacity;
+  _u32 *directories;
+  _u32 num_directories;
+  _u32 directories_capacity;
+} release_set;
+
+/*The currently mounted filesystem. The rootblock is read and checked once 
+by load() (or built by format()) and the geometry derived from it is kept 
+here, so the primitives below never have to go back to disk for it.*/
+typedef struct mounted_fs {
+  rootblock_t rb;
+  _u32 bitmap_start;      // index of the first free bitmap block
+  _u32 inode_table_start; // index of the first inode table block
+  _u32 data_start;        // index of the first block after the inode table
+  _u32 inodes_per_block;
+  _u32 num_inodes;
+  uint64_t *bitmap;       // in-memory copy of the free bitmap, one bit per block
+  _u32 bitmap_words;
+  _u32 free_blocks;       // running count of clear bits
+  Byte *bitmap_dirty;     // one flag per bitmap block changed since the last flush
+  uint64_t *directory_blocks; // one bit per block last used by a directory, for fs_stats()
+  uint16_t *refcounts;    // extra owners of each block, NULL until the disk has a refcount table
+  Byte *refcount_dirty;   // one flag per refcount table block changed since the last flush
+  uint64_t *inode_map;    // one bit per inode, set when the inode is in use
+  _u32 free_inodes;
+  _u32 inode_hint;        // no free inode lies below this index
+  _u32 blocks_per_group;  // the blocks one bitmap block describes
+  _u32 inodes_per_group;  // a whole number of inode table blocks
+  _u32 num_groups;
+  group_desc *groups;     // allocated along with the bitmap
+  _u32 *deferred;         // freed blocks the journal still logs, in use until it starts over
+  _u32 num_deferred;
+  _u32 deferred_capacity;
+  _u32 deferred_restarts; // journal.restarts when the last of them was freed
+  dir_index *dir_table[DIR_TABLE_SIZE]; // loaded directory indexes, by inode number
+  dir_index *dir_removed; // forgotten removed directories, freed at unload
+  incore_inode *icache[ICACHE_SIZE]; // inodes of open files, by inode number
+  dentry *dcache;         // DCACHE_SIZE entries, direct-mapped on (parent, name)
+  _u32 dcache_hits;
+  _u32 dcache_misses;
+  _u32 cwd;               // inode of the current working directory, shared by all threads
+  Byte *map;              // the whole image when mounted in FS_IO_MMAP mode
+  size_t map_length;
+  disk_ring *ring;        // set when mounted in FS_IO_URING mode
+  struct my_file **files; // open handles, so that fsync() can write them back
+  _u32 num_files;
+  _u32 files_capacity;
+} mounted_fs;
+
+static mounted_fs fs;
+
+/*Write-back buffer behind write_block(). Changed blocks are kept here, in a 
+hash table keyed on block index, until write_buffer_size of them have 
+changed, and are then written back to the disk in block order.*/
+typedef struct block_cache {
+  _u32 capacity;   // write_buffer_size, 0 means write-through
+  _u32 num_dirty;  // number of buffered blocks
+  _u32 table_size; // number of hash slots, a power of two
+  _u32 *slots;     // entry + 1 for each occupied slot, 0 when empty
+  _u32 *block_nums;
+  Byte *data;      // capacity blocks of block_size bytes
+  Byte *journaled; // per entry, set while the block belongs to the running transaction
+  Byte **committed; // per entry, what an earlier transaction committed for a block the running one changed again, or NULL
+} block_cache;
+
+static block_cache cache;
+
+#define JOURNAL_MIN_BLOCKS 16
+#define JOURNAL_MAX_BLOCKS 4096
+#define JOURNAL_HEADER 0x4a484452     // "JHDR"
+#define JOURNAL_DESCRIPTOR 0x4a445343 // "JDSC"
+#define JOURNAL_COMMIT 0x4a434d54     // "JCMT"
+
+/*Metadata journal of a mount whose rootblock has journal_blocks set. 
+Blocks written as metadata are held in the write buffer, flagged as part of 
+the running transaction, until it commits: the descriptor blocks listing 
+where they belong, copies of the blocks and a commit block go into the 
+journal as one sequential write, followed by a sync. Committed blocks then 
+reach their home locations with the rest of the write buffer, and once 
+they are all there (a checkpoint) the journal starts over. The first 
+journal block is a header giving the sequence number replay starts from. 
+Operations run between journal_start() and journal_stop(), and a 
+transaction is committed when none is in progress, so an operation's 
+changes are committed together. An operation only starts while the running 
+transaction has room for half a transaction (and half the write buffer) 
+more; only one that changes more than that by itself is committed in parts 
+once the journal or the write buffer fills. All fields are guarded by 
+cache_lock.*/
+typedef struct journal_state {
+  _u32 start;          // header block, the records follow it
+  _u32 blocks;         // size of the journal, header included
+  _u32 head;           // where the next transaction goes
+  _u32 sequence;       // sequence number of the running transaction
+  _u32 num_running;    // blocks in the running transaction
+  _u32 max_running;    // most blocks that one transaction can hold
+  _u32 active;         // operations in progress
+  char committing;     // a commit is waiting for operations to finish
+  unsigned long long first_change; // when the running transaction got its first block, in ms
+  uint64_t *logged;    // one bit per block with a copy in the journal, cleared when it starts over
+  _u32 restarts;       // times the journal has started over
+} journal_state;
+
+/*Header, descriptor and commit blocks all start with this. A descriptor is 
+followed by the count block indexes whose copies come after it; a commit 
+gives the number of blocks in the transaction and their checksum.*/
+typedef struct journal_record {
+  _u32 magic;
+  _u32 sequence;
+  _u32 count;
+  _u32 checksum;
+} journal_record;
+
+static journal_state journal;
+static pthread_cond_t journal_cond = PTHREAD_COND_INITIALIZER;
+// Operations this thread has started, and whether its writes are metadata
+static __thread _u32 journal_handles;
+static __thread _u32 journal_meta;
+
+#define ITABLE_LOCKS 64
+#define DCACHE_LOCKS 64
+
+/*Locking. alloc_lock guards the block bitmap and the inode map, cache_lock 
+the write buffer and table_lock the tables of directory indexes and in-core 
+inodes. Read-modify-writes of inode table blocks take one of the striped 
+itable_locks, and dentry cache slots one of the dcache_locks. Every 
+directory index and in-core inode has its own reader/writer lock. Locks are 
+taken in the order: files, my_file, inode or directory, itable, alloc, 
+cache, where files_lock guards the list of open handles. refcount_lock 
+serialises making the refcount table and is taken before alloc_lock. cp() 
+takes the source's inode lock while it holds the destination directory's. 
+rename_lock serialises moves between directories and comes first; a move 
+locks its two directories in inode order, then the directory it moves. 
+fs.cwd is read and written atomically, and set or checked by a removal 
+only under the lock of the directory it names. stats_lock is never held together with any other lock, and trace_lock is 
+taken last.*/
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t files_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t refcount_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t rename_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t itable_locks[ITABLE_LOCKS] = {[0 ... ITABLE_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER};
+static pthread_mutex_t dcache_locks[DCACHE_LOCKS] = {[0 ... DCACHE_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER};
+
+static int cache_init(_u32 capacity);
+static int cache_flush(void);
+static void cache_destroy(void);
+static int bitmap_init(void);
+static int bitmap_load(void);
+static int bitmap_flush(void);
+static void bitmap_set(_u32 index);
+static _u32 bitmap_count_used(_u32 start, _u32 end);
+static _u32 group_block_end(_u32 group);
+static _u32 group_inode_start(_u32 group);
+static _u32 inode_goal(_u32 inode_num);
+static _u32 allocate_inode_near(_u32 parent, Byte type);
+static int inode_map_init(void);
+static _u32 itable_end(void);
+static int itable_init(_u32 block_index);
+static int inode_map_load(void);
+static void inode_map_set(_u32 index, int used);
+static void inode_map_destroy(void);
+static void dir_destroy_all(void);
+static int dcache_init(void);
+static void dcache_destroy(void);
+static void dcache_invalidate(_u32 parent, const char *name);
+static int attach_io_mode(void);
+static int cache_insert_locked(_u32 index, Byte *content);
+static void bitmap_destroy(void);
+static int release_deferred(void);
+static void icache_destroy(void);
+static int files_flush(void);
+static int journal_commit_locked(void);
+static void cache_drop_committed_locked(void);
+static int journal_checkpoint(void);
+static int journal_load(void);
+static void journal_start(void);
+static void journal_stop(void);
+static void meta_begin(void);
+static void meta_end(void);
+static int sync_image(void);
+static int do_unload(void);
+static int do_my_fclose(my_file *file);
+static int refcount_load(void);
+static void refcount_destroy(void);
+static int refcount_flush_locked(void);
+static int release_block(release_set *set, _u32 block, int depth);
+static int release_blocks(release_set *set);
+static uint16_t refcount_get(_u32 index);
+static _u32 unshare_block(_u32 block, _u32 goal, int indirect);
+
+/************************ STATISTICS ************************/
+
+/*Counters of one thread. Only the owning thread changes them, with relaxed 
+atomic stores, so counting never takes a lock and fs_stats() can still read 
+them at any time. The counters of every thread are kept in a list under 
+stats_lock, and folded into stats_retired when the thread exits. Every 
+public operation is a thin wrapper that times its do_ function.*/
+typedef struct thread_stats {
+  fs_stats_t counts;
+  unsigned long long next_offset; // byte offset just past this thread's last transfer
+  struct thread_stats *next;
+  struct thread_stats *prev;
+} thread_stats;
+
+#define STATS_WORDS (sizeof(fs_stats_t) / sizeof(unsigned long long))
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+static thread_stats *stats_threads;
+static fs_stats_t stats_retired;  // counts of the threads that have exited
+static fs_stats_t stats_baseline; // totals at the last fs_stats_reset()
+static __thread thread_stats *my_stats;
+// Calls of each operation left before this thread times the next one
+static __thread Byte stats_countdown[FS_OPS];
+// Operation this thread is in, for the trace
+static __thread Byte current_op = FS_TRACE_NO_OP;
+// Set while this thread reads or writes the contents of a directory
+static __thread _u32 stats_directory;
+
+static const char *op_names[FS_OPS] = {
+  "format", "load", "unload", "fsync", "mkdir", "chdir", "cwd",
+  "my_fopen", "my_fclose", "my_fgetc", "my_fputc", "my_fseek", "fsck_run", "cp",
+  "mv", "rm", "rmdir", "ls", "my_opendir", "my_readdir", "my_closedir"
+};
+
+/*Nanoseconds on a monotonic clock*/
+static unsigned long long stats_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*Adds n to a counter of the calling thread*/
+static void stats_add(unsigned long long *counter, unsigned long long n) {
+  __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+/*Adds the counters in counts to total*/
+static void stats_sum(fs_stats_t *total, fs_stats_t *counts) {
+  unsigned long long *to = (unsigned long long *) total;
+  unsigned long long *from = (unsigned long long *) counts;
+  for (size_t i = 0; i < STATS_WORDS; i++) {
+    to[i] += __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+  }
+}
+
+/*Key destructor, run as a thread that has counted something exits*/
+static void stats_thread_exit(void *arg) {
+  thread_stats *stats = arg;
+  pthread_mutex_lock(&stats_lock);
+  stats_sum(&stats_retired, &stats->counts);
+  if (stats->prev != NULL) {
+    stats->prev->next = stats->next;
+  } else {
+    stats_threads = stats->next;
+  }
+  if (stats->next != NULL) {
+    stats->next->prev = stats->prev;
+  }
+  pthread_mutex_unlock(&stats_lock);
+  my_stats = NULL;
+  free(stats);
+}
+
+static void stats_key_create(void) {
+  pthread_key_create(&stats_key, stats_thread_exit);
+}
+
+/*Returns the counters of the calling thread, setting them up the first 
+time. Returns NULL if they can't be allocated, and nothing is counted.*/
+static fs_stats_t *thread_counts(void) {
+  if (my_stats != NULL) {
+    return &my_stats->counts;
+  }
+  pthread_once(&stats_once, stats_key_create);
+  thread_stats *stats = calloc(1, sizeof(thread_stats));
+  if (stats == NULL) {
+    return NULL;
+  }
+  stats->counts.threads = 1;
+  pthread_mutex_lock(&stats_lock);
+  stats->next = stats_threads;
+  if (stats_threads != NULL) {
+    stats_threads->prev = stats;
+  }
+  stats_threads = stats;
+  pthread_mutex_unlock(&stats_lock);
+  pthread_setspecific(stats_key, stats);
+  my_stats = stats;
+  return &stats->counts;
+}
+
+/*Called as operation op starts. Returns the time to pass to stats_op(), 
+or 0 if this call is not one of those that are timed.*/
+static unsigned long long stats_start(int op) {
+  current_op = op;
+  if (stats_countdown[op] > 0) {
+    stats_countdown[op]--;
+    return 0;
+  }
+  stats_countdown[op] = FS_STATS_SAMPLE - 1;
+  return stats_clock();
+}
+
+/*Records a call of operation op, given what stats_start() returned*/
+static void stats_op(int op, unsigned long long start, int failed) {
+  unsigned long long ns = start == 0 ? 0 : stats_clock() - start;
+  current_op = FS_TRACE_NO_OP;
+  fs_stats_t *counts = thread_counts();
+  if (counts == NULL) {
+    return;
+  }
+  fs_op_stats_t *stats = &counts->ops[op];
+  stats_add(&stats->calls, 1);
+  stats_add(&stats->errors, failed != 0);
+  if (start == 0) {
+    return;
+  }
+  int bucket = ns == 0 ? 0 : 63 - __builtin_clzll(ns);
+  stats_add(&stats->timed, 1);
+  stats_add(&stats->total_ns, ns);
+  stats_add(&stats->latency[bucket < FS_LATENCY_BUCKETS ? bucket : FS_LATENCY_BUCKETS - 1], 1);
+}
+
+/*Remembers that block index holds part of a directory, while the calling 
+thread is working on one*/
+static void stats_mark_directory(_u32 index) {
+  if (stats_directory == 0 || fs.directory_blocks == NULL || index < fs.data_start) {
+    return;
+  }
+  uint64_t bit = 1ull << (index % 64);
+  if (!(__atomic_load_n(&fs.directory_blocks[index / 64], __ATOMIC_RELAXED) & bit)) {
+    __atomic_fetch_or(&fs.directory_blocks[index / 64], bit, __ATOMIC_RELAXED);
+  }
+}
+
+/*Returns the region of the disk block index lies in. Data blocks count as 
+directory blocks if the last one to use them was a directory.*/
+static int block_region(_u32 index) {
+  if (index < fs.bitmap_start) {
+    return FS_REGION_ROOTBLOCK;
+  }
+  if (index < fs.inode_table_start) {
+    return FS_REGION_BITMAP;
+  }
+  if (index < fs.data_start) {
+    return FS_REGION_ITABLE;
+  }
+  if (index >= fs.rb.journal_start && index - fs.rb.journal_start < fs.rb.journal_blocks) {
+    return FS_REGION_JOURNAL;
+  }
+  // The refcount table can appear while other threads do I/O
+  _u32 refcount_start = __atomic_load_n(&fs.rb.refcount_start, __ATOMIC_RELAXED);
+  if (index >= refcount_start && index - refcount_start < __atomic_load_n(&fs.rb.refcount_blocks, __ATOMIC_RELAXED)) {
+    return FS_REGION_REFCOUNT;
+  }
+  stats_mark_directory(index);
+  if (fs.directory_blocks != NULL
+      && __atomic_load_n(&fs.directory_blocks[index / 64], __ATOMIC_RELAXED) & (1ull << (index % 64))) {
+    return FS_REGION_DIRECTORY;
+  }
+  return FS_REGION_DATA;
+}
+
+/*Records a transfer of count blocks starting at first to or from the disk image*/
+static void stats_transfer(_u32 first, _u32 count, int write) {
+  fs_stats_t *counts = thread_counts();
+  if (counts == NULL) {
+    return;
+  }
+  unsigned long long offset = (unsigned long long) first * fs.rb.block_size;
+  unsigned long long length = (unsigned long long) count * fs.rb.block_size;
+  // thread_counts() has set up my_stats
+  if (my_stats->next_offset != offset) {
+    stats_add(&counts->seeks, 1);
+  }
+  my_stats->next_offset = offset + length;
+  unsigned long long *blocks = write ? counts->block_writes : counts->block_reads;
+  for (_u32 i = 0; i < count; i++) {
+    stats_add(&blocks[block_region(first + i)], 1);
+  }
+  stats_add(write ? &counts->bytes_written : &counts->bytes_read, length);
+}
+
+/*Records block reads that were and weren't answered by the write buffer*/
+static void stats_cache(_u32 hits, _u32 misses) {
+  fs_stats_t *counts = thread_counts();
+  if (counts != NULL) {
+    stats_add(&counts->cache_hits, hits);
+    stats_add(&counts->cache_misses, misses);
+  }
+}
+
+/*Records a path lookup that was or wasn't answered by the dentry cache*/
+static void stats_dentry(int hit) {
+  fs_stats_t *counts = thread_counts();
+  if (counts != NULL) {
+    stats_add(hit ? &counts->dentry_hits : &counts->dentry_misses, 1);
+  }
+}
+
+/*Adds up the counters of every thread, including those that have exited, 
+into total. The caller holds stats_lock.*/
+static void stats_total(fs_stats_t *total) {
+  memset(total, 0, sizeof(fs_stats_t));
+  stats_sum(total, &stats_retired);
+  for (thread_stats *thread = stats_threads; thread != NULL; thread = thread->next) {
+    stats_sum(total, &thread->counts);
+  }
+}
+
+/*Reports the counters of every thread, see include/filesystem.h. 
+Returns 0 on success.*/
+int fs_stats(fs_stats_t *stats) {
+  if (stats == NULL) {
+    return -1;
+  }
+  fs_stats_t total;
+  pthread_mutex_lock(&stats_lock);
+  stats_total(&total);
+  unsigned long long *to = (unsigned long long *) stats;
+  unsigned long long *from = (unsigned long long *) &total;
+  unsigned long long *baseline = (unsigned long long *) &stats_baseline;
+  for (size_t i = 0; i < STATS_WORDS; i++) {
+    to[i] = from[i] - baseline[i];
+  }
+  pthread_mutex_unlock(&stats_lock);
+  // Threads are counted since the start, not since the last reset
+  stats->threads = total.threads;
+  return 0;
+}
+
+/*Starts counting from zero again. The counters themselves are left alone, 
+since other threads may be changing them; fs_stats() subtracts the totals 
+taken here instead.*/
+void fs_stats_reset(void) {
+  fs_stats_t total;
+  pthread_mutex_lock(&stats_lock);
+  stats_total(&total);
+  stats_baseline = total;
+  pthread_mutex_unlock(&stats_lock);
+}
+
+/*Returns the name of operation op, or NULL*/
+const char *fs_op_name(int op) {
+  if (op < 0 || op >= FS_OPS) {
+    return NULL;
+  }
+  return op_names[op];
+}
+
+/************************ TRACING ************************/
+
+#define TRACE_BUFFER 4096
+
+/*A running block access trace. Records from every thread are collected in 
+one buffer under trace_lock and appended to the file TRACE_BUFFER at a 
+time. active lets the block layer skip all of this, without taking the 
+lock, when no trace is running.*/
+typedef struct trace_state {
+  FILE *file;
+  int active;
+  unsigned long long start;   // stats_clock() when the trace started
+  _u32 count;                 // records in buffer
+  fs_trace_record_t buffer[TRACE_BUFFER];
+} trace_state;
+
+static trace_state trace;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*Appends the buffered records to the trace file. The caller holds 
+trace_lock. Returns 0 on success, -1 on error.*/
+static int trace_write_locked(void) {
+  _u32 count = trace.count;
+  trace.count = 0;
+  return fwrite(trace.buffer, sizeof(fs_trace_record_t), count, trace.file) == count ? 0 : -1;
+}
+
+/*Records count accesses of one kind, to the indexes starting at first*/
+static void trace_access(_u32 first, _u32 count, int access) {
+  if (!__atomic_load_n(&trace.active, __ATOMIC_RELAXED)) {
+    return;
+  }
+  unsigned long long now = stats_clock();
+  pthread_mutex_lock(&trace_lock);
+  for (_u32 i = 0; trace.file != NULL && i < count; i++) {
+    fs_trace_record_t *record = &trace.buffer[trace.count++];
+    record->time_ns = now - trace.start;
+    record->index = first + i;
+    record->region = access >= FS_TRACE_INODE_READ ? FS_REGION_ITABLE : block_region(first + i);
+    record->access = access;
+    record->op = current_op;
+    record->reserved = 0;
+    if (trace.count == TRACE_BUFFER) {
+      trace_write_locked();
+    }
+  }
+  pthread_mutex_unlock(&trace_lock);
+}
+
+/*Starts a trace of the loaded file system, see include/filesystem.h. 
+Returns 0 on success.*/
+int trace_start(char *path) {
+  if (fd < 0 || path == NULL) {
+    return -1;
+  }
+  trace_stop();
+  FILE *file = fopen(path, "wb");
+  if (file == NULL) {
+    return -1;
+  }
+  fs_trace_header_t header;
+  header.magic = FS_TRACE_MAGIC;
+  header.version = FS_TRACE_VERSION;
+  header.block_size = fs.rb.block_size;
+  header.num_blocks = fs.rb.num_blocks;
+  header.inode_table_start = fs.inode_table_start;
+  header.num_inodes = fs.num_inodes;
+  if (fwrite(&header, sizeof(header), 1, file) != 1) {
+    fclose(file);
+    return -1;
+  }
+  pthread_mutex_lock(&trace_lock);
+  trace.file = file;
+  trace.count = 0;
+  trace.start = stats_clock();
+  __atomic_store_n(&trace.active, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&trace_lock);
+  return 0;
+}
+
+/*Writes out the rest of the trace and closes it. Returns 0 on success.*/
+int trace_stop(void) {
+  pthread_mutex_lock(&trace_lock);
+  if (trace.file == NULL) {
+    pthread_mutex_unlock(&trace_lock);
+    return -1;
+  }
+  __atomic_store_n(&trace.active, 0, __ATOMIC_RELAXED);
+  int result = trace_write_locked();
+  if (fclose(trace.file) != 0) {
+    result = -1;
+  }
+  trace.file = NULL;
+  pthread_mutex_unlock(&trace_lock);
+  return result;
+}
+
+/*Fills in the mounted filesystem context from a rootblock. 
+Returns 0 on success, -1 if the geometry does not describe a valid disk.*/
+static int mount_rootblock(rootblock_t *rb) {
+  if (rb->block_size < sizeof(rootblock_t) || rb->block_size < sizeof(inode_t)) {
+    return -1;
+  }
+  // rootblock + bitmap + inode table must leave room for the root directory
+  if ((unsigned long long) 1 + rb->num_free_bitmap_blocks + rb->num_inode_table_blocks >= rb->num_blocks) {
+    return -1;
+  }
+  // The root directory's inode is in the first inode table block, which is always written
+  if (rb->num_inode_table_blocks == 0 || rb->num_uninit_inode_table_blocks >= rb->num_inode_table_blocks) {
+    return -1;
+  }
+  // The free bitmap needs a bit for every block
+  if ((unsigned long long) rb->num_free_bitmap_blocks * rb->block_size * 8 < rb->num_blocks) {
+    return -1;
+  }
+  // A journal lies in the data area, after the root directory
+  if (rb->journal_blocks > 0 && (rb->journal_blocks < JOURNAL_MIN_BLOCKS
+      || rb->journal_start <= 1 + rb->num_free_bitmap_blocks + rb->num_inode_table_blocks
+      || (unsigned long long) rb->journal_start + rb->journal_blocks > rb->num_blocks)) {
+    return -1;
+  }
+  // So does the refcount table, with a uint16_t for every block
+  if (rb->refcount_blocks > 0 && (rb->refcount_start <= 1 + rb->num_free_bitmap_blocks + rb->num_inode_table_blocks
+      || (unsigned long long) rb->refcount_start + rb->refcount_blocks > rb->num_blocks
+      || (unsigned long long) rb->refcount_blocks * rb->block_size < (unsigned long long) rb->num_blocks * sizeof(uint16_t))) {
+    return -1;
+  }
+  fs.rb = *rb;
+  fs.bitmap_start = 1;
+  fs.inode_table_start = 1 + rb->num_free_bitmap_blocks;
+  fs.data_start = fs.inode_table_start + rb->num_inode_table_blocks;
+  fs.inodes_per_block = rb->block_size / sizeof(inode_t);
+  fs.num_inodes = rb->num_inode_table_blocks * fs.inodes_per_block;
+  fs.blocks_per_group = rb->block_size * 8;
+  fs.num_groups = (rb->num_blocks + fs.blocks_per_group - 1) / fs.blocks_per_group;
+  _u32 table_blocks = (rb->num_inode_table_blocks + fs.num_groups - 1) / fs.num_groups;
+  fs.inodes_per_group = table_blocks * fs.inodes_per_block;
+  return 0;
+}
 
 /*Loads a filesystem which has already been formatted. The write_buffer_size records 
 how many blocks must change before they are written back to the disk. Returns 0 on success.*/
+static int do_load(char *diskname, _u32 write_buffer_size) {
+  if (fd >= 0) {
+    do_unload();
+  }
+  fd = disk_open(diskname, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  // The rootblock is read once here and cached for the lifetime of the mount
+  rootblock_t rb;
+  if (disk_pread(fd, &rb, sizeof(rootblock_t), 0) < 0 || mount_rootblock(&rb) < 0) {
+    disk_close(fd);
+    fd = -1;
+    return -1;
+  }
+  // Metadata waits in the write buffer for its transaction to commit
+  if (fs.rb.journal_blocks > 0 && write_buffer_size < 2 * commit_blocks) {
+    write_buffer_size = 2 * commit_blocks;
+  }
+  if (attach_io_mode() < 0 || journal_load() < 0 || cache_init(write_buffer_size) < 0
+      || bitmap_load() < 0 || refcount_load() < 0 || inode_map_load() < 0 || dcache_init() < 0) {
+    do_unload();
+    return -1;
+  }
+  return 0;
+}
+
 int load(char *diskname, _u32 write_buffer_size) {
-  if (fp != NULL) {
-    unload();
+  unsigned long long start = stats_start(FS_OP_LOAD);
+  int result = do_load(diskname, write_buffer_size);
+  stats_op(FS_OP_LOAD, start, result < 0);
+  return result;
+}
+
+/*Returns the rootblock of the mounted filesystem or NULL if nothing is loaded. 
+The rootblock is owned by the filesystem and stays valid until unload().*/
+rootblock_t * get_rootblock() {
+  if (fd < 0) {
+    return NULL;
+  }
+  return &fs.rb;
+}
+
+/*Selects how the next load() or format() accesses the disk image. 
+Returns 0 on success, -1 for an unknown mode.*/
+int set_io_mode(int mode) {
+  if (mode != FS_IO_PREAD && mode != FS_IO_MMAP && mode != FS_IO_URING) {
+    return -1;
+  }
+  io_mode = mode;
+  return 0;
+}
+
+/*Sets the number of transfers kept in flight in FS_IO_URING mode. 
+Returns 0 on success, -1 if depth is 0.*/
+int set_io_queue_depth(_u32 depth) {
+  if (depth == 0) {
+    return -1;
+  }
+  queue_depth = depth;
+  return 0;
+}
+
+/*Sets when a journaled mount commits its running transaction, from the 
+next load() or format() on. Returns 0 on success, -1 if max_blocks is 0.*/
+int set_journal_commit(_u32 interval_ms, _u32 max_blocks) {
+  if (max_blocks == 0) {
+    return -1;
+  }
+  commit_interval = interval_ms;
+  commit_blocks = max_blocks;
+  return 0;
+}
+
+/*Switches a freshly opened image over to the selected I/O mode. In 
+FS_IO_MMAP mode the whole image is mapped and block access becomes a copy 
+to or from the mapping. Returns 0 on success.*/
+static int attach_io_mode(void) {
+  if (io_mode == FS_IO_URING) {
+    // Without io_uring the plain pread/pwrite path is used
+    fs.ring = disk_ring_create(queue_depth);
+    return 0;
+  }
+  if (io_mode != FS_IO_MMAP) {
+    return 0;
+  }
+  fs.map_length = (size_t) fs.rb.num_blocks * fs.rb.block_size;
+  fs.map = disk_map(fd, fs.map_length);
+  return fs.map == NULL ? -1 : 0;
+}
+
+/*Returns a pointer to block index inside the mapping*/
+static Byte *mapped_block(_u32 index) {
+  return fs.map + (size_t) index * fs.rb.block_size;
+}
+
+/*Reads count blocks starting at first straight from the disk image, 
+bypassing the block cache.*/
+static int disk_read_run(_u32 first, _u32 count, Byte *buffer) {
+  size_t length = (size_t) count * fs.rb.block_size;
+  stats_transfer(first, count, 0);
+  if (fs.map != NULL) {
+    memcpy(buffer, mapped_block(first), length);
+    return 0;
+  }
+  return disk_pread(fd, buffer, length, (unsigned long long) first * fs.rb.block_size);
+}
+
+/*Writes count blocks starting at first straight to the disk image, 
+bypassing the block cache.*/
+static int disk_write_run(_u32 first, _u32 count, Byte *content) {
+  size_t length = (size_t) count * fs.rb.block_size;
+  stats_transfer(first, count, 1);
+  if (fs.map != NULL) {
+    memcpy(mapped_block(first), content, length);
+    return 0;
+  }
+  return disk_pwrite(fd, content, length, (unsigned long long) first * fs.rb.block_size);
+}
+
+static int disk_read_block(_u32 index, Byte *buffer) {
+  return disk_read_run(index, 1, buffer);
+}
+
+static int disk_write_block(_u32 index, Byte *content) {
+  return disk_write_run(index, 1, content);
+}
+
+/*Looks up block index in the write buffer. Returns the entry holding it, 
+or -1 if the block has not been changed since the last flush.*/
+static int cache_lookup(_u32 index) {
+  _u32 mask = cache.table_size - 1;
+  for (_u32 slot = (index * 2654435761u) & mask; cache.slots[slot] != 0; slot = (slot + 1) & mask) {
+    _u32 entry = cache.slots[slot] - 1;
+    if (cache.block_nums[entry] == index) {
+      return entry;
+    }
+  }
+  return -1;
+}
+
+#define TRANSFER_RUN 256
+#define READ_BATCH 64
+
+/*Orders batched requests by block index*/
+static int compare_block_requests(const void *a, const void *b) {
+  _u32 block_a = ((const block_request_t *) a)->index;
+  _u32 block_b = ((const block_request_t *) b)->index;
+  return (block_a > block_b) - (block_a < block_b);
+}
+
+/*Issues the runs of a sorted request list through the io_uring, with up to 
+the queue depth of them in flight at once. Returns 0 on success, -1 on error.*/
+static int ring_transfer(block_request_t *requests, _u32 count, int write) {
+  Byte **buffers = malloc(count * sizeof(Byte *));
+  disk_op *ops = malloc(count * sizeof(disk_op));
+  if (buffers == NULL || ops == NULL) {
+    free(buffers);
+    free(ops);
+    return -1;
+  }
+  int num_ops = 0;
+  for (_u32 i = 0; i < count;) {
+    _u32 first = requests[i].index;
+    _u32 length = 0;
+    while (i + length < count && length < TRANSFER_RUN && requests[i + length].index == first + length) {
+      buffers[i + length] = requests[i + length].buffer;
+      length++;
+    }
+    ops[num_ops].buffers = buffers + i;
+    ops[num_ops].count = length;
+    ops[num_ops].length = fs.rb.block_size;
+    ops[num_ops].offset = (unsigned long long) first * fs.rb.block_size;
+    num_ops++;
+    stats_transfer(first, length, write);
+    i += length;
+  }
+  int result = disk_ring_run(fs.ring, fd, write, ops, num_ops);
+  free(buffers);
+  free(ops);
+  return result;
+}
+
+/*Moves a list of blocks, sorted by index, between the disk image and their 
+buffers, bypassing the write buffer. Adjacent blocks go out together with a 
+single vectored call. Returns 0 on success, -1 on error.*/
+static int disk_transfer(block_request_t *requests, _u32 count, int write) {
+  if (fs.ring != NULL && count > 1) {
+    return ring_transfer(requests, count, write);
+  }
+  Byte *run[TRANSFER_RUN];
+  for (_u32 i = 0; i < count;) {
+    _u32 first = requests[i].index;
+    _u32 length = 0;
+    while (i + length < count && length < TRANSFER_RUN && requests[i + length].index == first + length) {
+      run[length] = requests[i + length].buffer;
+      length++;
+    }
+    unsigned long long offset = (unsigned long long) first * fs.rb.block_size;
+    stats_transfer(first, length, write);
+    if (fs.map != NULL) {
+      for (_u32 j = 0; j < length; j++) {
+        if (write) {
+          memcpy(mapped_block(first + j), run[j], fs.rb.block_size);
+        } else {
+          memcpy(run[j], mapped_block(first + j), fs.rb.block_size);
+        }
+      }
+    } else if ((write ? disk_pwritev(fd, run, length, fs.rb.block_size, offset)
+                      : disk_preadv(fd, run, length, fs.rb.block_size, offset)) < 0) {
+      return -1;
+    }
+    i += length;
+  }
+  return 0;
+}
+
+/*Adds entry to the hash table of the write buffer*/
+static void cache_link(_u32 entry) {
+  _u32 mask = cache.table_size - 1;
+  _u32 slot = (cache.block_nums[entry] * 2654435761u) & mask;
+  while (cache.slots[slot] != 0) {
+    slot = (slot + 1) & mask;
+  }
+  cache.slots[slot] = entry + 1;
+}
+
+/*Writes back the buffered blocks that are not part of the running 
+transaction and drops them from the write buffer, keeping the rest. The 
+caller holds cache_lock. Returns 0 on success, -1 on error.*/
+static int cache_flush_unjournaled_locked(void) {
+  _u32 count = cache.num_dirty - journal.num_running;
+  if (count == 0) {
+    return 0;
+  }
+  block_request_t requests[count];
+  count = 0;
+  for (_u32 i = 0; i < cache.num_dirty; i++) {
+    if (!cache.journaled[i]) {
+      requests[count].index = cache.block_nums[i];
+      requests[count].buffer = cache.data + (size_t) i * fs.rb.block_size;
+      count++;
+    }
+  }
+  qsort(requests, count, sizeof(block_request_t), compare_block_requests);
+  int result = disk_transfer(requests, count, 1);
+  // Move the blocks that stay to the front and index them again
+  _u32 kept = 0;
+  for (_u32 i = 0; i < cache.num_dirty; i++) {
+    if (cache.journaled[i]) {
+      if (kept != i) {
+        memcpy(cache.data + (size_t) kept * fs.rb.block_size, cache.data + (size_t) i * fs.rb.block_size, fs.rb.block_size);
+        cache.block_nums[kept] = cache.block_nums[i];
+        cache.journaled[kept] = 1;
+        cache.journaled[i] = 0;
+        cache.committed[kept] = cache.committed[i];
+        cache.committed[i] = NULL;
+      }
+      kept++;
+    }
+  }
+  cache.num_dirty = kept;
+  memset(cache.slots, 0, cache.table_size * sizeof(_u32));
+  for (_u32 i = 0; i < kept; i++) {
+    cache_link(i);
+  }
+  return result;
+}
+
+/*Writes every buffered block back to the disk in block order and empties 
+the write buffer. On a journaled mount the running transaction is 
+committed first; while an operation is still in progress only the blocks 
+outside it are written, unless it has the whole buffer. The caller holds 
+cache_lock. Returns 0 on success, -1 on error.*/
+static int cache_flush_locked(void) {
+  if (cache.num_dirty == 0) {
+    return 0;
+  }
+  if (journal.num_running > 0) {
+    if (journal.active > 0 && journal.num_running < cache.num_dirty) {
+      return cache_flush_unjournaled_locked();
+    }
+    if (journal_commit_locked() < 0) {
+      return -1;
+    }
+  }
+  block_request_t requests[cache.num_dirty];
+  for (_u32 i = 0; i < cache.num_dirty; i++) {
+    requests[i].index = cache.block_nums[i];
+    requests[i].buffer = cache.data + (size_t) i * fs.rb.block_size;
+  }
+  qsort(requests, cache.num_dirty, sizeof(block_request_t), compare_block_requests);
+  int result = disk_transfer(requests, cache.num_dirty, 1);
+  memset(cache.slots, 0, cache.table_size * sizeof(_u32));
+  cache.num_dirty = 0;
+  return result;
+}
+
+/*Milliseconds on a monotonic clock*/
+static unsigned long long now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*Number of block indexes a descriptor block has room for*/
+static _u32 journal_per_descriptor(void) {
+  return (fs.rb.block_size - sizeof(journal_record)) / sizeof(_u32);
+}
+
+/*Folds block index and its contents into a running FNV-1a checksum*/
+static _u32 journal_checksum(_u32 hash, _u32 index, Byte *block) {
+  for (int i = 0; i < 4; i++) {
+    hash = (hash ^ ((index >> (8 * i)) & 0xff)) * 16777619u;
+  }
+  for (_u32 i = 0; i < fs.rb.block_size; i++) {
+    hash = (hash ^ block[i]) * 16777619u;
+  }
+  return hash;
+}
+
+/*Writes the journal header, making replay start at the running transaction*/
+static int journal_write_header(void) {
+  Byte header[fs.rb.block_size];
+  memset(header, 0, fs.rb.block_size);
+  journal_record *record = (journal_record *) header;
+  record->magic = JOURNAL_HEADER;
+  record->sequence = journal.sequence;
+  return disk_write_run(journal.start, 1, header);
+}
+
+/*Writes home the committed contents kept for blocks that the running 
+transaction has changed again, and drops them. With the blocks outside the 
+transaction written too, every committed transaction is then in place. The 
+caller holds cache_lock. Returns 0 on success, -1 on error.*/
+static int cache_write_committed_locked(void) {
+  block_request_t requests[journal.num_running];
+  _u32 count = 0;
+  for (_u32 i = 0; i < cache.num_dirty; i++) {
+    if (cache.committed[i] != NULL) {
+      requests[count].index = cache.block_nums[i];
+      requests[count].buffer = cache.committed[i];
+      count++;
+    }
+  }
+  qsort(requests, count, sizeof(block_request_t), compare_block_requests);
+  int result = disk_transfer(requests, count, 1);
+  cache_drop_committed_locked();
+  return result;
+}
+
+/*Forgets the committed contents kept for the running transaction's blocks, 
+once they are on the disk one way or another. The caller holds cache_lock.*/
+static void cache_drop_committed_locked(void) {
+  for (_u32 i = 0; i < cache.num_dirty; i++) {
+    free(cache.committed[i]);
+    cache.committed[i] = NULL;
+  }
+}
+
+/*Notes that the journal has started over: it holds nothing but the 
+running transaction, whose blocks it logs again. The caller holds 
+cache_lock.*/
+static void journal_restarted_locked(void) {
+  memset(journal.logged, 0, (fs.rb.num_blocks + 63) / 64 * sizeof(uint64_t));
+  for (_u32 i = 0; i < cache.num_dirty; i++) {
+    if (cache.journaled[i]) {
+      journal.logged[cache.block_nums[i] / 64] |= (uint64_t) 1 << (cache.block_nums[i] % 64);
+    }
+  }
+  journal.restarts++;
+}
+
+/*Commits the running transaction: the blocks outside it go home first, so 
+that nothing committed points at data that never arrived, then its records 
+are written to the journal in one go and synced. When the journal is too 
+full, its committed transactions are checkpointed first, which includes 
+the committed contents of blocks the running transaction has changed 
+again. The caller holds cache_lock. Returns 0 on success, -1 on error.*/
+static int journal_commit_locked(void) {
+  if (journal.num_running == 0) {
+    return 0;
+  }
+  if (cache_flush_unjournaled_locked() < 0) {
+    return -1;
+  }
+  _u32 block_size = fs.rb.block_size;
+  _u32 per_descriptor = journal_per_descriptor();
+  _u32 length = journal.num_running + (journal.num_running + per_descriptor - 1) / per_descriptor + 1;
+  if (journal.head + length > journal.start + journal.blocks) {
+    // Everything committed so far is now in place on the disk
+    if (cache_write_committed_locked() < 0 || sync_image() < 0) {
+      return -1;
+    }
+    journal.head = journal.start + 1;
+    if (journal_write_header() < 0) {
+      return -1;
+    }
+    journal_restarted_locked();
+  }
+  Byte *records = calloc(length, block_size);
+  if (records == NULL) {
+    return -1;
+  }
+  journal_record *descriptor = NULL;
+  _u32 next = 0;
+  _u32 checksum = 2166136261u;
+  for (_u32 i = 0; i < cache.num_dirty; i++) {
+    if (!cache.journaled[i]) {
+      continue;
+    }
+    if (descriptor == NULL || descriptor->count == per_descriptor) {
+      descriptor = (journal_record *) (records + (size_t) next++ * block_size);
+      descriptor->magic = JOURNAL_DESCRIPTOR;
+      descriptor->sequence = journal.sequence;
+    }
+    ((_u32 *) (descriptor + 1))[descriptor->count++] = cache.block_nums[i];
+    Byte *copy = records + (size_t) next++ * block_size;
+    memcpy(copy, cache.data + (size_t) i * block_size, block_size);
+    checksum = journal_checksum(checksum, cache.block_nums[i], copy);
+  }
+  journal_record *commit = (journal_record *) (records + (size_t) next * block_size);
+  commit->magic = JOURNAL_COMMIT;
+  commit->sequence = journal.sequence;
+  commit->count = journal.num_running;
+  commit->checksum = checksum;
+  int result = disk_write_run(journal.head, length, records);
+  free(records);
+  if (result < 0 || sync_image() < 0) {
+    return -1;
+  }
+  memset(cache.journaled, 0, cache.num_dirty);
+  cache_drop_committed_locked();
+  journal.num_running = 0;
+  journal.head += length;
+  journal.sequence++;
+  return 0;
+}
+
+/*Commits the running transaction once no operation is in progress, then 
+writes the whole write buffer home and empties the journal. Returns 0 on 
+success, -1 on error.*/
+static int journal_checkpoint(void) {
+  if (journal.blocks == 0) {
+    return 0;
+  }
+  pthread_mutex_lock(&cache_lock);
+  journal.committing = 1;
+  while (journal.active > 0) {
+    pthread_cond_wait(&journal_cond, &cache_lock);
+  }
+  int result = cache_flush_locked();
+  if (result == 0 && sync_image() == 0) {
+    journal.head = journal.start + 1;
+    result = journal_write_header();
+    if (result == 0) {
+      journal_restarted_locked();
+    }
+  }
+  journal.committing = 0;
+  pthread_cond_broadcast(&journal_cond);
+  pthread_mutex_unlock(&cache_lock);
+  return result;
+}
+
+/*Begins an operation. Only the outermost call of a thread counts, and it 
+waits while a checkpoint is waiting for operations to finish, so it must 
+be made before any other lock is taken. When the running transaction is 
+half full, it is committed first, once the operations in progress have 
+finished, so that the new one fits in whole.*/
+static void journal_start(void) {
+  if (journal.blocks == 0 || journal_handles++ > 0) {
+    return;
+  }
+  _u32 room = (cache.capacity < journal.max_running ? cache.capacity : journal.max_running) / 2;
+  pthread_mutex_lock(&cache_lock);
+  for (;;) {
+    while (journal.committing) {
+      pthread_cond_wait(&journal_cond, &cache_lock);
+    }
+    if (journal.num_running < room) {
+      break;
+    }
+    journal.committing = 1;
+    while (journal.active > 0) {
+      pthread_cond_wait(&journal_cond, &cache_lock);
+    }
+    int result = journal_commit_locked();
+    journal.committing = 0;
+    pthread_cond_broadcast(&journal_cond);
+    if (result < 0) {
+      // Let the operation run, its writes report the error
+      break;
+    }
+  }
+  journal.active++;
+  pthread_mutex_unlock(&cache_lock);
+}
+
+/*Ends an operation. The last one to finish commits the running transaction 
+once it holds commit_blocks blocks or is commit_interval ms old.*/
+static void journal_stop(void) {
+  if (journal.blocks == 0 || --journal_handles > 0) {
+    return;
+  }
+  pthread_mutex_lock(&cache_lock);
+  if (--journal.active == 0) {
+    if (journal.committing) {
+      pthread_cond_broadcast(&journal_cond);
+    } else if (journal.num_running > 0 && (journal.num_running >= commit_blocks
+               || now_ms() - journal.first_change >= commit_interval)) {
+      journal_commit_locked();
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+}
+
+/*Blocks written between meta_begin() and meta_end() by this thread are 
+metadata and go through the journal*/
+static void meta_begin(void) {
+  journal_meta++;
+}
+
+static void meta_end(void) {
+  journal_meta--;
+}
+
+/*Replays the committed transactions left in the journal onto their home 
+blocks, in order, stopping at the first one that is incomplete. The 
+rootblock is read again in case it was among them. Returns 0 on success, 
+-1 on error.*/
+static int journal_replay(void) {
+  _u32 block_size = fs.rb.block_size;
+  _u32 blocks = journal.blocks;
+  Byte *region = malloc((size_t) blocks * block_size);
+  block_request_t *requests = malloc(blocks * sizeof(block_request_t));
+  if (region == NULL || requests == NULL || disk_read_run(journal.start, blocks, region) < 0
+      || ((journal_record *) region)->magic != JOURNAL_HEADER) {
+    free(region);
+    free(requests);
+    return -1;
+  }
+  journal.sequence = ((journal_record *) region)->sequence;
+  _u32 per_descriptor = journal_per_descriptor();
+  int replayed = 0;
+  int result = 0;
+  for (_u32 pos = 1; result == 0 && pos < blocks;) {
+    _u32 count = 0;
+    _u32 checksum = 2166136261u;
+    int committed = 0;
+    while (pos < blocks) {
+      journal_record *record = (journal_record *) (region + (size_t) pos * block_size);
+      if (record->sequence != journal.sequence) {
+        break;
+      }
+      if (record->magic == JOURNAL_COMMIT) {
+        committed = record->count == count && record->checksum == checksum;
+        pos++;
+        break;
+      }
+      if (record->magic != JOURNAL_DESCRIPTOR || record->count > per_descriptor
+          || pos + 1 + record->count > blocks) {
+        break;
+      }
+      _u32 *indexes = (_u32 *) (record + 1);
+      for (_u32 i = 0; i < record->count; i++) {
+        requests[count].index = indexes[i];
+        requests[count].buffer = region + (size_t) (pos + 1 + i) * block_size;
+        checksum = journal_checksum(checksum, indexes[i], requests[count].buffer);
+        count++;
+      }
+      pos += 1 + record->count;
+    }
+    for (_u32 i = 0; committed && i < count; i++) {
+      committed = requests[i].index < fs.rb.num_blocks;
+    }
+    if (!committed) {
+      break;
+    }
+    qsort(requests, count, sizeof(block_request_t), compare_block_requests);
+    result = disk_transfer(requests, count, 1);
+    journal.sequence++;
+    replayed = 1;
+  }
+  free(region);
+  free(requests);
+  if (result < 0 || !replayed) {
+    return result;
+  }
+  // The blocks are in place before the header stops them being replayed again
+  rootblock_t rb;
+  if (sync_image() < 0 || journal_write_header() < 0 || sync_image() < 0
+      || disk_pread(fd, &rb, sizeof(rootblock_t), 0) < 0 || mount_rootblock(&rb) < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+/*Sets up the journal of a freshly opened image, replaying what it holds. 
+Images without one are mounted without journaling. Returns 0 on success.*/
+static int journal_load(void) {
+  memset(&journal, 0, sizeof(journal));
+  if (fs.rb.journal_blocks == 0) {
+    return 0;
+  }
+  journal.start = fs.rb.journal_start;
+  journal.blocks = fs.rb.journal_blocks;
+  journal.head = journal.start + 1;
+  _u32 per_descriptor = journal_per_descriptor();
+  // Descriptors, copies and the commit block must fit behind the header
+  journal.max_running = (journal.blocks - 2) * per_descriptor / (per_descriptor + 1);
+  if (journal_replay() < 0) {
+    memset(&journal, 0, sizeof(journal));
+    return -1;
+  }
+  journal.logged = calloc((fs.rb.num_blocks + 63) / 64, sizeof(uint64_t));
+  return journal.logged == NULL ? -1 : 0;
+}
+
+static int cache_flush(void) {
+  pthread_mutex_lock(&cache_lock);
+  int result = cache_flush_locked();
+  pthread_mutex_unlock(&cache_lock);
+  return result;
+}
+
+/*Returns whether block index is sitting in the write buffer*/
+static int cache_holds(_u32 index) {
+  if (cache.capacity == 0) {
+    return 0;
+  }
+  pthread_mutex_lock(&cache_lock);
+  int held = cache.num_dirty > 0 && cache_lookup(index) >= 0;
+  pthread_mutex_unlock(&cache_lock);
+  return held;
+}
+
+/*Sets up a write buffer holding up to capacity changed blocks. A capacity 
+of 0 makes write_block() write straight through to the disk.*/
+static int cache_init(_u32 capacity) {
+  memset(&cache, 0, sizeof(cache));
+  if (capacity == 0) {
+    return 0;
+  }
+  cache.table_size = 1;
+  while (cache.table_size < 2 * capacity) {
+    cache.table_size *= 2;
+  }
+  cache.slots = calloc(cache.table_size, sizeof(_u32));
+  cache.block_nums = malloc(capacity * sizeof(_u32));
+  cache.data = malloc((size_t) capacity * fs.rb.block_size);
+  cache.journaled = calloc(capacity, 1);
+  cache.committed = calloc(capacity, sizeof(Byte *));
+  if (cache.slots == NULL || cache.block_nums == NULL || cache.data == NULL || cache.journaled == NULL
+      || cache.committed == NULL) {
+    free(cache.slots);
+    free(cache.block_nums);
+    free(cache.data);
+    free(cache.journaled);
+    free(cache.committed);
+    memset(&cache, 0, sizeof(cache));
+    return -1;
+  }
+  cache.capacity = capacity;
+  return 0;
+}
+
+static void cache_destroy(void) {
+  for (_u32 i = 0; cache.committed != NULL && i < cache.num_dirty; i++) {
+    free(cache.committed[i]);
+  }
+  free(cache.committed);
+  free(cache.slots);
+  free(cache.block_nums);
+  free(cache.data);
+  free(cache.journaled);
+  memset(&cache, 0, sizeof(cache));
+}
+
+/*Read a disk block from index, writing it to buffer. 
+Returns 0 on success, a negative number on error.*/
+int read_block(_u32 index, Byte *buffer) {
+  if (fd < 0 || index >= fs.rb.num_blocks) {
+    return -1;
+  }
+  trace_access(index, 1, FS_TRACE_READ);
+  // A buffered block is newer than its copy on disk
+  if (cache.capacity > 0) {
+    pthread_mutex_lock(&cache_lock);
+    int entry = cache_lookup(index);
+    if (entry >= 0) {
+      memcpy(buffer, cache.data + (size_t) entry * fs.rb.block_size, fs.rb.block_size);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    if (entry >= 0) {
+      stats_cache(1, 0);
+      return 0;
+    }
+  }
+  stats_cache(0, 1);
+  return disk_read_block(index, buffer);
+}
+
+/*Write a disk block, filling it with content at index. content should be 
+the same size as the block size. Returns 0 on success, a negative number on error*/
+int write_block(_u32 index, Byte *content) {
+  if (fd < 0 || index >= fs.rb.num_blocks) {
+    return -1;
+  }
+  trace_access(index, 1, FS_TRACE_WRITE);
+  if (cache.capacity == 0) {
+    return disk_write_block(index, content);
+  }
+  pthread_mutex_lock(&cache_lock);
+  int result = cache_insert_locked(index, content);
+  pthread_mutex_unlock(&cache_lock);
+  return result;
+}
+
+/*Reads count blocks, each into the buffer of its request. The requests are 
+sorted by index in place and runs of adjacent blocks are read with a single 
+call. Returns 0 on success, a negative number on error.*/
+int read_blocks(block_request_t *requests, _u32 count) {
+  if (fd < 0) {
+    return -1;
+  }
+  for (_u32 i = 0; i < count; i++) {
+    if (requests[i].index >= fs.rb.num_blocks) {
+      return -1;
+    }
+    trace_access(requests[i].index, 1, FS_TRACE_READ);
+  }
+  qsort(requests, count, sizeof(block_request_t), compare_block_requests);
+  // Blocks sitting in the write buffer take precedence over their copies on 
+  // disk. They are copied before the rest is read, all under cache_lock, so 
+  // a block flushed meanwhile is either copied here or already on the disk.
+  block_request_t *misses = requests;
+  _u32 num_misses = count;
+  _u32 hits = 0;
+  if (cache.capacity > 0) {
+    pthread_mutex_lock(&cache_lock);
+    for (_u32 i = 0; cache.num_dirty > 0 && i < count; i++) {
+      int entry = cache_lookup(requests[i].index);
+      if (entry < 0) {
+        if (misses != requests) {
+          misses[num_misses++] = requests[i];
+        }
+        continue;
+      }
+      if (misses == requests) {
+        misses = malloc(count * sizeof(block_request_t));
+        if (misses == NULL) {
+          pthread_mutex_unlock(&cache_lock);
+          return -1;
+        }
+        memcpy(misses, requests, i * sizeof(block_request_t));
+        num_misses = i;
+      }
+      memcpy(requests[i].buffer, cache.data + (size_t) entry * fs.rb.block_size, fs.rb.block_size);
+      hits++;
+    }
+    pthread_mutex_unlock(&cache_lock);
+  }
+  stats_cache(hits, count - hits);
+  int result = disk_transfer(misses, num_misses, 0);
+  if (misses != requests) {
+    free(misses);
+  }
+  return result;
+}
+
+/*Writes count blocks from the buffers of their requests, as if by 
+write_block() for each. Without a write buffer the sorted runs go straight 
+to the disk. Returns 0 on success, a negative number on error*/
+int write_blocks(block_request_t *requests, _u32 count) {
+  if (fd < 0) {
+    return -1;
+  }
+  for (_u32 i = 0; i < count; i++) {
+    if (requests[i].index >= fs.rb.num_blocks) {
+      return -1;
+    }
+    trace_access(requests[i].index, 1, FS_TRACE_WRITE);
+  }
+  qsort(requests, count, sizeof(block_request_t), compare_block_requests);
+  if (cache.capacity == 0) {
+    return disk_transfer(requests, count, 1);
+  }
+  int result = 0;
+  pthread_mutex_lock(&cache_lock);
+  for (_u32 i = 0; result == 0 && i < count; i++) {
+    result = cache_insert_locked(requests[i].index, requests[i].buffer);
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return result;
+}
+
+/*Stores a changed block in the write buffer, flushing the buffer once it 
+is full. The caller holds cache_lock. Returns 0 on success, -1 on error.*/
+static int cache_insert_locked(_u32 index, Byte *content) {
+  stats_mark_directory(index);
+  // Repeated writes to a block that is already buffered are absorbed
+  int entry = cache_lookup(index);
+  int journal_it = journal.blocks > 0 && journal_meta > 0 && (entry < 0 || !cache.journaled[entry]);
+  if (entry < 0) {
+    entry = cache.num_dirty++;
+    cache.block_nums[entry] = index;
+    cache_link(entry);
+  } else if (journal_it) {
+    // The buffered contents may be all that is left of an earlier commit 
+    // if the journal has to start over before this transaction commits
+    cache.committed[entry] = malloc(fs.rb.block_size);
+    if (cache.committed[entry] == NULL) {
+      return -1;
+    }
+    memcpy(cache.committed[entry], cache.data + (size_t) entry * fs.rb.block_size, fs.rb.block_size);
+  }
+  memcpy(cache.data + (size_t) entry * fs.rb.block_size, content, fs.rb.block_size);
+  if (journal_it) {
+    cache.journaled[entry] = 1;
+    journal.logged[index / 64] |= (uint64_t) 1 << (index % 64);
+    if (journal.num_running++ == 0) {
+      journal.first_change = now_ms();
+    }
+    // A transaction has to fit into the journal
+    if (journal.num_running == journal.max_running && journal_commit_locked() < 0) {
+      return -1;
+    }
+  }
+  // Once write_buffer_size blocks have changed they all go back to disk
+  if (cache.num_dirty == cache.capacity) {
+    return cache_flush_locked();
+  }
+  return 0;
+}
+
+/*Copies those of the count blocks starting at first that sit in the write 
+buffer into buffer, and stores the stretches between them, which are still 
+to be read from the disk, in runs with their destinations in buffers. As 
+both happen under cache_lock, a block flushed meanwhile is either copied 
+here or already on the disk. The caller holds cache_lock if there is a 
+write buffer, and has room for one more run than it holds blocks. Returns 
+the number of runs stored and adds the number of blocks copied to hits.*/
+static int cache_split_run_locked(_u32 first, _u32 count, Byte *buffer, disk_op *runs, Byte **buffers, _u32 *hits) {
+  _u32 block_size = fs.rb.block_size;
+  int num_runs = 0;
+  _u32 start = 0;
+  for (_u32 i = 0; i <= count; i++) {
+    int entry = i < count && cache.num_dirty > 0 ? cache_lookup(first + i) : -1;
+    if (i < count && entry < 0) {
+      continue;
+    }
+    if (i > start) {
+      buffers[num_runs] = buffer + (size_t) start * block_size;
+      runs[num_runs].buffers = &buffers[num_runs];
+      runs[num_runs].count = 1;
+      runs[num_runs].length = (size_t) (i - start) * block_size;
+      runs[num_runs].offset = (unsigned long long) (first + start) * block_size;
+      num_runs++;
+    }
+    if (i < count) {
+      memcpy(buffer + (size_t) i * block_size, cache.data + (size_t) entry * block_size, block_size);
+      (*hits)++;
+    }
+    start = i + 1;
+  }
+  return num_runs;
+}
+
+/*Reads count consecutive blocks starting at first into buffer with a single 
+seek and read. Blocks sitting in the write buffer take precedence over 
+their copies on disk and split the read around them. Returns 0 on success, 
+a negative number on error.*/
+static int read_block_run(_u32 first, _u32 count, Byte *buffer) {
+  if (fd < 0 || count == 0 || first >= fs.rb.num_blocks || count > fs.rb.num_blocks - first) {
+    return -1;
+  }
+  trace_access(first, count, FS_TRACE_READ);
+  if (cache.capacity == 0) {
+    stats_cache(0, count);
+    return disk_read_run(first, count, buffer);
+  }
+  pthread_mutex_lock(&cache_lock);
+  disk_op runs[cache.num_dirty + 1];
+  Byte *buffers[cache.num_dirty + 1];
+  _u32 hits = 0;
+  int num_runs = cache_split_run_locked(first, count, buffer, runs, buffers, &hits);
+  pthread_mutex_unlock(&cache_lock);
+  stats_cache(hits, count - hits);
+  for (int i = 0; i < num_runs; i++) {
+    if (disk_read_run(runs[i].offset / fs.rb.block_size, runs[i].length / fs.rb.block_size, buffers[i]) < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*Reads a batch of block runs, each into its own contiguous buffer, through 
+the io_uring so that they are all in flight together. Blocks sitting in 
+the write buffer are copied instead and split the runs around them. 
+Returns 0 on success.*/
+static int ring_read_runs(disk_op *ops, int count) {
+  _u32 block_size = fs.rb.block_size;
+  _u32 blocks = 0;
+  for (int i = 0; i < count; i++) {
+    trace_access(ops[i].offset / block_size, ops[i].length / block_size, FS_TRACE_READ);
+    blocks += ops[i].length / block_size;
+  }
+  if (cache.capacity > 0) {
+    pthread_mutex_lock(&cache_lock);
+  }
+  // Every block copied splits a run in two at most
+  _u32 room = count + cache.num_dirty;
+  disk_op runs[room];
+  Byte *buffers[room];
+  _u32 hits = 0;
+  int num_runs = 0;
+  for (int i = 0; i < count; i++) {
+    num_runs += cache_split_run_locked(ops[i].offset / block_size, ops[i].length / block_size, ops[i].buffers[0],
+                                       runs + num_runs, buffers + num_runs, &hits);
+  }
+  if (cache.capacity > 0) {
+    pthread_mutex_unlock(&cache_lock);
+  }
+  stats_cache(hits, blocks - hits);
+  for (int i = 0; i < num_runs; i++) {
+    stats_transfer(runs[i].offset / block_size, runs[i].length / block_size, 0);
+  }
+  return num_runs == 0 ? 0 : disk_ring_run(fs.ring, fd, 0, runs, num_runs);
+}
+
+/*Writes count consecutive blocks starting at first with a single seek and 
+write. Buffered copies of those blocks are refreshed so the write buffer 
+never hands out stale data. Returns 0 on success, a negative number on error.*/
+static int write_block_run(_u32 first, _u32 count, Byte *content) {
+  if (fd < 0 || count == 0 || first >= fs.rb.num_blocks || count > fs.rb.num_blocks - first) {
+    return -1;
+  }
+  trace_access(first, count, FS_TRACE_WRITE);
+  if (journal.blocks > 0 && journal_meta > 0) {
+    // Metadata has to wait for its transaction
+    int result = 0;
+    pthread_mutex_lock(&cache_lock);
+    for (_u32 i = 0; result == 0 && i < count; i++) {
+      result = cache_insert_locked(first + i, content + (size_t) i * fs.rb.block_size);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return result;
+  }
+  if (cache.capacity > 0) {
+    pthread_mutex_lock(&cache_lock);
+    for (_u32 i = 0; cache.num_dirty > 0 && i < count; i++) {
+      int entry = cache_lookup(first + i);
+      if (entry >= 0) {
+        memcpy(cache.data + (size_t) entry * fs.rb.block_size, content + (size_t) i * fs.rb.block_size, fs.rb.block_size);
+      }
+    }
+    pthread_mutex_unlock(&cache_lock);
+  }
+  return disk_write_run(first, count, content);
+}
+
+/*Writes all blocks that need to be written back to the disk*/
+static void do_fsync(void) {
+  if (fd < 0) {
+    return;
+  }
+  journal_start();
+  files_flush();
+  bitmap_flush();
+  journal_stop();
+  if (journal.blocks > 0) {
+    // Blocks freed while the journal logged them can be reused once it 
+    // has started over
+    if (journal_checkpoint() == 0 && release_deferred() > 0) {
+      journal_checkpoint();
+    }
+    return;
+  }
+  cache_flush();
+  sync_image();
+}
+
+void fsync(void) {
+  unsigned long long start = stats_start(FS_OP_FSYNC);
+  do_fsync();
+  stats_op(FS_OP_FSYNC, start, fd < 0);
+}
+
+/*Waits for everything written to the image to reach the disk*/
+static int sync_image(void) {
+  if (fs.map != NULL) {
+    return disk_sync_map(fs.map, fs.map_length);
+  }
+  return disk_flush(fd);
+}
+
+/*Returns the number of free blocks on the disk or -1 on failure.*/
+_u32 num_free_blocks() {
+  if (fd < 0) {
+    return -1;
+  }
+  return __atomic_load_n(&fs.free_blocks, __ATOMIC_RELAXED);
+}
+
+/*Returns the number of free inodes on the disk or -1 on failure.*/
+_u32 num_free_inodes() {
+  if (fd < 0) {
+    return -1;
+  }
+  return __atomic_load_n(&fs.free_inodes, __ATOMIC_RELAXED);
+}
+
+/*Unloads the loaded file system. Returns 0 on success.*/
+static int do_unload(void) {
+  if (fd < 0) {
+    return -1;
+  }
+  // Write back anything still sitting in file buffers and the write buffer. 
+  // Files left open can still be closed, but no longer take part.
+  files_flush();
+  free(fs.files);
+  bitmap_flush();
+  if (journal.blocks > 0 && journal_checkpoint() == 0 && release_deferred() > 0) {
+    journal_checkpoint();
+  }
+  cache_flush();
+  trace_stop();
+  cache_destroy();
+  free(journal.logged);
+  memset(&journal, 0, sizeof(journal));
+  bitmap_destroy();
+  refcount_destroy();
+  inode_map_destroy();
+  dir_destroy_all();
+  dcache_destroy();
+  icache_destroy();
+  if (fs.map != NULL) {
+    disk_sync_map(fs.map, fs.map_length);
+    disk_unmap(fs.map, fs.map_length);
+  }
+  disk_ring_destroy(fs.ring);
+  if (disk_close(fd) < 0) {
+    fd = -1;
+    memset(&fs, 0, sizeof(fs));
+    return -1;
+  }
+  fd = -1;
+  memset(&fs, 0, sizeof(fs));
+  return 0;
+}
+
+int unload(void) {
+  unsigned long long start = stats_start(FS_OP_UNLOAD);
+  int result = do_unload();
+  stats_op(FS_OP_UNLOAD, start, result < 0);
+  return result;
+}
+
+/*Selects options for the next format(). Returns 0 on success, -1 for an unknown flag.*/
+int set_format_flags(_u32 flags) {
+  if (flags & ~(FS_FORMAT_LAZY_ITABLE | FS_FORMAT_JOURNAL | FS_FORMAT_REFCOUNT)) {
+    return -1;
+  }
+  format_flags = flags;
+  return 0;
+}
+
+/*Formats the disk creating appropriate root blocks, free bitmap blocks, 
+inode blocks and root directory. The image is sized without writing its 
+data area, and the metadata goes out in two large writes. returns 0 on 
+success, a negative number on error*/
+static int do_format(char *diskname, _u32 block_size, _u32 num_blocks, _u32 num_inodes) {
+  // Rootblock or inode doesn't fit into block
+  if (block_size < sizeof(rootblock_t) || block_size < sizeof(inode_t)) {
+    return -1;
+  }
+  if (fd >= 0) {
+    do_unload();
+  }
+  // Create rootblock, with room for at least num_inodes inodes
+  rootblock_t rb;
+  memset(&rb, 0, sizeof(rootblock_t));
+  rb.block_size = block_size;
+  rb.num_blocks = num_blocks;
+  rb.num_free_bitmap_blocks = (num_blocks + block_size * 8 - 1) / (block_size * 8);
+  _u32 inodes_per_block = block_size / sizeof(inode_t);
+  rb.num_inode_table_blocks = num_inodes / inodes_per_block + (num_inodes % inodes_per_block != 0);
+  // The first inode table block holds the root directory's inode and is always written
+  if ((format_flags & FS_FORMAT_LAZY_ITABLE) && rb.num_inode_table_blocks > 0) {
+    rb.num_uninit_inode_table_blocks = rb.num_inode_table_blocks - 1;
+  }
+  // The journal follows the root directory block, 1/64 of the disk within bounds
+  if (format_flags & FS_FORMAT_JOURNAL) {
+    rb.journal_start = 2 + rb.num_free_bitmap_blocks + rb.num_inode_table_blocks;
+    rb.journal_blocks = num_blocks / 64;
+    if (rb.journal_blocks < JOURNAL_MIN_BLOCKS) {
+      rb.journal_blocks = JOURNAL_MIN_BLOCKS;
+    } else if (rb.journal_blocks > JOURNAL_MAX_BLOCKS) {
+      rb.journal_blocks = JOURNAL_MAX_BLOCKS;
+    }
+  }
+  // and the refcount table follows the journal, it is all zeros to begin with
+  if (format_flags & FS_FORMAT_REFCOUNT) {
+    rb.refcount_start = 2 + rb.num_free_bitmap_blocks + rb.num_inode_table_blocks + rb.journal_blocks;
+    rb.refcount_blocks = ((size_t) num_blocks * sizeof(uint16_t) + block_size - 1) / block_size;
+  }
+  if (mount_rootblock(&rb) < 0) {
+    return -1;
+  }
+  fd = disk_open(diskname, 1);
+  if (fd < 0) {
+    return -1;
+  }
+  // Blocks that are never written read as zeros, so free blocks cost nothing
+  if (disk_resize(fd, (unsigned long long) num_blocks * block_size) < 0
+      || bitmap_init() < 0 || inode_map_init() < 0 || dcache_init() < 0) {
+    do_unload();
+    return -1;
+  }
+  // Mark the rootblock, bitmap, inode table, root directory block, journal 
+  // and refcount table as used
+  for (_u32 i = 0; i <= fs.data_start; i++) {
+    bitmap_set(i);
+  }
+  for (_u32 i = 0; i < rb.journal_blocks; i++) {
+    bitmap_set(rb.journal_start + i);
+  }
+  for (_u32 i = 0; i < rb.refcount_blocks; i++) {
+    bitmap_set(rb.refcount_start + i);
+  }
+  inode_map_set(0, 1);
+
+  // The root directory holds '.' and '..', both of which lead back to it. 
+  // The journal header, if any, is written along with it.
+  _u32 root_blocks = rb.journal_blocks > 0 ? 2 : 1;
+  Byte *root_dir = calloc(root_blocks, block_size);
+  _u32 metadata_blocks = fs.data_start - rb.num_uninit_inode_table_blocks;
+  Byte *metadata = calloc(metadata_blocks, block_size);
+  if (root_dir == NULL || metadata == NULL) {
+    free(root_dir);
+    free(metadata);
+    do_unload();
+    return -1;
+  }
+  const char *names[2] = {".", ".."};
+  _u32 num_entries = 2;
+  _u32 offset = sizeof(_u32);
+  memcpy(root_dir, &num_entries, sizeof(_u32));
+  for (int i = 0; i < 2; i++) {
+    _u32 inode_num = 0;
+    memcpy(root_dir + offset, &inode_num, sizeof(_u32));
+    root_dir[offset + 4] = 'D';
+    root_dir[offset + 5] = strlen(names[i]) + 1;
+    strcpy((char *) root_dir + offset + 6, names[i]);
+    offset += 6 + strlen(names[i]) + 1;
+  }
+  inode_t root_inode;
+  memset(&root_inode, 0, sizeof(inode_t));
+  root_inode.size = offset;
+  root_inode.blocks[0] = fs.data_start;
+
+  // Rootblock, bitmap and the initialised inode table blocks are contiguous
+  memcpy(metadata, &rb, sizeof(rootblock_t));
+  memcpy(metadata + (size_t) fs.bitmap_start * block_size, fs.bitmap, (size_t) rb.num_free_bitmap_blocks * block_size);
+  memcpy(metadata + (size_t) fs.inode_table_start * block_size, &root_inode, sizeof(inode_t));
+  int result = disk_write_run(0, metadata_blocks, metadata);
+  if (rb.journal_blocks > 0) {
+    journal_record *header = (journal_record *) (root_dir + block_size);
+    header->magic = JOURNAL_HEADER;
+    header->sequence = 1;
+  }
+  if (result == 0) {
+    result = disk_write_run(fs.data_start, root_blocks, root_dir);
+  }
+  free(metadata);
+  free(root_dir);
+  // The freshly formatted disk stays loaded, in the selected I/O mode
+  if (result < 0 || attach_io_mode() < 0 || journal_load() < 0
+      || (rb.journal_blocks > 0 && cache_init(2 * commit_blocks) < 0) || refcount_load() < 0) {
+    do_unload();
+    return -1;
+  }
+  return 0;
+}
+
+int format(char *diskname, _u32 block_size, _u32 num_blocks, _u32 num_inodes) {
+  unsigned long long start = stats_start(FS_OP_FORMAT);
+  int result = do_format(diskname, block_size, num_blocks, num_inodes);
+  stats_op(FS_OP_FORMAT, start, result < 0);
+  return result;
+}
+
+/*Number of block pointers that fit in an indirect block*/
+static _u32 pointers_per_block(void) {
+  return fs.rb.block_size / sizeof(_u32);
+}
+
+/*Allocates a zero-filled block near goal for use as an indirect block. 
+Returns the block or 0 if the disk is full.*/
+static _u32 allocate_indirect_block(_u32 goal) {
+  _u32 index = allocate_block(goal);
+  if (index == (_u32) -1) {
+    return 0;
+  }
+  Byte zeros[fs.rb.block_size];
+  memset(zeros, 0, fs.rb.block_size);
+  meta_begin();
+  int result = write_block(index, zeros);
+  meta_end();
+  if (result < 0) {
+    free_block(index);
+    return 0;
+  }
+  return index;
+}
+
+/*Follows (and with create, fills in) slot within the indirect block index. 
+Returns the pointer stored in the slot, 0 for a hole, or -1 on error.*/
+static _u32 indirect_slot(_u32 index, _u32 slot, _u32 value) {
+  Byte block[fs.rb.block_size];
+  if (read_block(index, block) < 0) {
+    return -1;
+  }
+  _u32 *pointers = (_u32 *) block;
+  if (value != 0) {
+    pointers[slot] = value;
+    meta_begin();
+    int result = write_block(index, block);
+    meta_end();
+    if (result < 0) {
+      return -1;
+    }
+  }
+  return pointers[slot];
+}
+
+/*Points the inode pointer *slot at a block of the file's own, see 
+unshare_block(). Returns 0 on success, -1 on error.*/
+static int unshare_pointer(_u32 *slot, _u32 goal, int indirect) {
+  _u32 block = unshare_block(*slot, goal, indirect);
+  if (block == (_u32) -1) {
+    return -1;
+  }
+  *slot = block;
+  return 0;
+}
+
+/*Maps block file_block of a file to a disk block through the 5 direct, 
+the single-indirect and the double-indirect pointers. Returns the disk 
+block, or 0 if that part of the file has no block yet. When create is 
+set, missing data and indirect blocks are allocated next to goal and the 
+inode is updated in memory. Blocks on the way that cp() shares with 
+another file are copied first, from the top down, so the block returned 
+can be written. Returns -1 on error or if the file would grow past the 
+largest size the pointers can address.*/
+static _u32 bmap(inode_t *inode, _u32 file_block, int create, _u32 goal) {
+  _u32 per_block = pointers_per_block();
+  _u32 *slot;
+  _u32 data;
+  if (file_block < 5) {
+    slot = &inode->blocks[file_block];
+    if (*slot == 0 && create) {
+      data = allocate_block(goal);
+      if (data == (_u32) -1) {
+        return -1;
+      }
+      *slot = data;
+    } else if (create && unshare_pointer(slot, goal, 0) < 0) {
+      return -1;
+    }
+    return *slot;
+  }
+  file_block -= 5;
+  _u32 indirect;
+  _u32 index;
+  if (file_block < per_block) {
+    slot = &inode->blocks[5];
+    index = file_block;
+    if (*slot != 0 && create && unshare_pointer(slot, goal, 1) < 0) {
+      return -1;
+    }
+  } else {
+    file_block -= per_block;
+    if (file_block / per_block >= per_block) {
+      return -1;
+    }
+    // The double-indirect block points at single-indirect blocks
+    if (inode->blocks[6] == 0) {
+      if (!create || (inode->blocks[6] = allocate_indirect_block(goal)) == 0) {
+        return create ? -1 : 0;
+      }
+    } else if (create && unshare_pointer(&inode->blocks[6], goal, 1) < 0) {
+      return -1;
+    }
+    indirect = indirect_slot(inode->blocks[6], file_block / per_block, 0);
+    if (indirect == (_u32) -1) {
+      return -1;
+    }
+    if (indirect == 0) {
+      if (!create || (indirect = allocate_indirect_block(goal)) == 0) {
+        return create ? -1 : 0;
+      }
+      if (indirect_slot(inode->blocks[6], file_block / per_block, indirect) == (_u32) -1) {
+        return -1;
+      }
+    } else if (create) {
+      _u32 shared = indirect;
+      if (unshare_pointer(&indirect, goal, 1) < 0 || (indirect != shared
+          && indirect_slot(inode->blocks[6], file_block / per_block, indirect) == (_u32) -1)) {
+        return -1;
+      }
+    }
+    index = file_block % per_block;
+    slot = &indirect;
+  }
+  if (*slot == 0) {
+    if (!create || (*slot = allocate_indirect_block(goal)) == 0) {
+      return create ? -1 : 0;
+    }
+  }
+  data = indirect_slot(*slot, index, 0);
+  if (data == 0 && create) {
+    data = allocate_block(goal);
+    if (data == (_u32) -1 || indirect_slot(*slot, index, data) == (_u32) -1) {
+      return -1;
+    }
+  } else if (data != (_u32) -1 && create) {
+    _u32 shared = data;
+    if (unshare_pointer(&data, goal, 0) < 0
+        || (data != shared && indirect_slot(*slot, index, data) == (_u32) -1)) {
+      return -1;
+    }
+  }
+  return data;
+}
+
+/*Finds the indirect block holding the pointer to file_block, which must be 
+past the direct blocks, and stores the pointer's position in index. Returns 
+the indirect block, 0 if there is none yet, or -1 on error.*/
+static _u32 bmap_indirect(inode_t *inode, _u32 file_block, _u32 *index) {
+  _u32 per_block = pointers_per_block();
+  file_block -= 5;
+  if (file_block < per_block) {
+    *index = file_block;
+    return inode->blocks[5];
+  }
+  file_block -= per_block;
+  if (file_block / per_block >= per_block) {
+    return -1;
+  }
+  *index = file_block % per_block;
+  if (inode->blocks[6] == 0) {
+    return 0;
+  }
+  return indirect_slot(inode->blocks[6], file_block / per_block, 0);
+}
+
+/*Read-only bmap_run() for blocks behind an indirect block. The indirect 
+block is read once and the run is taken from consecutive pointers in it, 
+so it ends at the indirect block's last pointer at the latest.*/
+static _u32 bmap_scan(inode_t *inode, _u32 file_block, _u32 count, _u32 *run) {
+  _u32 index;
+  _u32 indirect = bmap_indirect(inode, file_block, &index);
+  *run = 1;
+  if (indirect == 0 || indirect == (_u32) -1) {
+    return indirect;
+  }
+  _u32 per_block = pointers_per_block();
+  _u32 pointers[per_block];
+  if (read_block(indirect, (Byte *) pointers) < 0) {
+    return -1;
+  }
+  _u32 first = pointers[index];
+  if (first == 0) {
+    return 0;
+  }
+  while (*run < count && index + *run < per_block && pointers[index + *run] == first + *run) {
+    *run += 1;
+  }
+  return first;
+}
+
+/*Maps file_block and as many of the following count - 1 file blocks as are 
+stored right after it on the disk. The length of that run is stored in run. 
+New blocks are allocated after the previous block of the file so that 
+sequential writes end up contiguous, or else near its first block, which 
+lies in the inode's group. Returns the first disk block, 0 for a 
+hole (with run set to 1), or -1 on error.*/
+static _u32 bmap_run(inode_t *inode, _u32 file_block, _u32 count, int create, _u32 *run) {
+  if (!create && file_block >= 5) {
+    return bmap_scan(inode, file_block, count, run);
+  }
+  _u32 goal = inode->blocks[0] != 0 ? inode->blocks[0] : fs.data_start;
+  if (create && file_block > 0) {
+    _u32 previous = bmap(inode, file_block - 1, 0, 0);
+    if (previous != 0 && previous != (_u32) -1) {
+      goal = previous + 1;
+    }
+  }
+  _u32 first = bmap(inode, file_block, create, goal);
+  *run = 1;
+  if (first == 0 || first == (_u32) -1) {
+    return first;
+  }
+  while (*run < count) {
+    _u32 next = bmap(inode, file_block + *run, create, first + *run);
+    if (next != first + *run) {
+      break;
+    }
+    *run += 1;
+  }
+  return first;
+}
+
+/*Copies an inode_t into the on-disk form and writes it. Returns 0 on success.*/
+static int store_inode(_u32 index, inode_t *inode) {
+  _u32 buffer[8];
+  buffer[0] = inode->size;
+  for (int i = 0; i < 7; i++) {
+    buffer[i + 1] = inode->blocks[i];
+  }
+  return write_inode(index, buffer);
+}
+
+/*Reads an inode into an inode_t. Returns 0 on success.*/
+static int load_inode(_u32 index, inode_t *inode) {
+  _u32 buffer[8];
+  if (read_inode(index, buffer) < 0) {
+    return -1;
+  }
+  inode->size = buffer[0];
+  for (int i = 0; i < 7; i++) {
+    inode->blocks[i] = buffer[i + 1];
+  }
+  return 0;
+}
+
+/*Reads num bytes at offset of the data described by inode. Holes read as 
+zeros. Returns 0 on success, -1 on error.*/
+static int inode_read(inode_t *inode, _u32 offset, Byte *buffer, _u32 num) {
+  _u32 block_size = fs.rb.block_size;
+  Byte block[block_size];
+  // With io_uring, runs are collected and read READ_BATCH at a time
+  disk_op ops[READ_BATCH];
+  Byte *destinations[READ_BATCH];
+  int pending = 0;
+  _u32 done = 0;
+  while (done < num) {
+    _u32 file_block = (offset + done) / block_size;
+    _u32 block_offset = (offset + done) % block_size;
+    _u32 remaining = num - done;
+    _u32 run;
+    if (block_offset == 0 && remaining >= block_size) {
+      // Whole blocks: read each contiguous run with a single transfer
+      _u32 first = bmap_run(inode, file_block, remaining / block_size, 0, &run);
+      if (first == (_u32) -1) {
+        return -1;
+      }
+      if (first == 0) {
+        memset(buffer + done, 0, block_size);
+      } else if (fs.ring != NULL) {
+        destinations[pending] = buffer + done;
+        ops[pending].buffers = &destinations[pending];
+        ops[pending].count = 1;
+        ops[pending].length = (size_t) run * block_size;
+        ops[pending].offset = (unsigned long long) first * block_size;
+        if (++pending == READ_BATCH) {
+          if (ring_read_runs(ops, pending) < 0) {
+            return -1;
+          }
+          pending = 0;
+        }
+      } else if (read_block_run(first, run, buffer + done) < 0) {
+        return -1;
+      }
+      done += run * block_size;
+    } else {
+      _u32 index = bmap_run(inode, file_block, 1, 0, &run);
+      _u32 chunk = block_size - block_offset;
+      if (chunk > remaining) {
+        chunk = remaining;
+      }
+      if (index == (_u32) -1) {
+        return -1;
+      }
+      if (index == 0) {
+        memset(block, 0, block_size);
+      } else if (read_block(index, block) < 0) {
+        return -1;
+      }
+      memcpy(buffer + done, block + block_offset, chunk);
+      done += chunk;
+    }
+  }
+  if (pending > 0 && ring_read_runs(ops, pending) < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+/*Writes num bytes at offset of the data described by inode, allocating 
+blocks as needed and growing inode->size. The caller stores the inode. 
+Returns the number of bytes written, which is less than num on error.*/
+static _u32 inode_write(inode_t *inode, _u32 offset, Byte *buffer, _u32 num) {
+  _u32 block_size = fs.rb.block_size;
+  Byte block[block_size];
+  _u32 done = 0;
+  while (done < num) {
+    _u32 file_block = (offset + done) / block_size;
+    _u32 block_offset = (offset + done) % block_size;
+    _u32 remaining = num - done;
+    _u32 run;
+    if (block_offset == 0 && remaining >= block_size) {
+      // Whole blocks: map (allocating as needed) a contiguous run and write it in one go
+      _u32 first = bmap_run(inode, file_block, remaining / block_size, 1, &run);
+      if (first == 0 || first == (_u32) -1 || write_block_run(first, run, buffer + done) < 0) {
+        break;
+      }
+      done += run * block_size;
+    } else {
+      // Part of a block: read, modify and write it back
+      _u32 index = bmap_run(inode, file_block, 1, 1, &run);
+      _u32 chunk = block_size - block_offset;
+      if (chunk > remaining) {
+        chunk = remaining;
+      }
+      if (index == 0 || index == (_u32) -1 || read_block(index, block) < 0) {
+        break;
+      }
+      memcpy(block + block_offset, buffer + done, chunk);
+      if (write_block(index, block) < 0) {
+        break;
+      }
+      done += chunk;
+    }
+  }
+  if (offset + done > inode->size) {
+    inode->size = offset + done;
+  }
+  return done;
+}
+
+/************************ DIRECTORY INDEX ************************/
+
+/*FNV-1a hash of a directory entry name*/
+static _u32 dir_hash(const char *name) {
+  _u32 hash = 2166136261u;
+  for (; *name != '\0'; name++) {
+    hash = (hash ^ (Byte) *name) * 16777619u;
+  }
+  return hash;
+}
+
+/*Links slot into the hash chain for its name*/
+static void dir_link(dir_index *dir, _u32 slot) {
+  _u32 bucket = dir->slots[slot].hash & (dir->num_buckets - 1);
+  dir->slots[slot].next = dir->buckets[bucket];
+  dir->buckets[bucket] = slot;
+}
+
+/*Makes room for one more slot, growing the slot array and, once the chains 
+would get longer than one entry on average, the hash table. Returns 0 on success.*/
+static int dir_reserve(dir_index *dir) {
+  if (dir->num_entries == dir->capacity) {
+    _u32 capacity = dir->capacity * 2;
+    dir_slot *slots = realloc(dir->slots, capacity * sizeof(dir_slot));
+    if (slots == NULL) {
+      return -1;
+    }
+    dir->slots = slots;
+    dir->capacity = capacity;
+  }
+  if (dir->num_entries == dir->num_buckets) {
+    _u32 num_buckets = dir->num_buckets * 2;
+    _u32 *buckets = malloc(num_buckets * sizeof(_u32));
+    if (buckets == NULL) {
+      return -1;
+    }
+    free(dir->buckets);
+    dir->buckets = buckets;
+    dir->num_buckets = num_buckets;
+    memset(dir->buckets, 0xff, num_buckets * sizeof(_u32));
+    for (_u32 i = 0; i < dir->num_entries; i++) {
+      dir_link(dir, i);
+    }
+  }
+  return 0;
+}
+
+/*Adds a slot for an entry that is already on disk. Returns 0 on success.*/
+static int dir_insert(dir_index *dir, const char *name, _u32 inode_num, Byte type, Byte name_length, _u32 offset) {
+  if (dir_reserve(dir) < 0) {
+    return -1;
+  }
+  dir_slot *slot = &dir->slots[dir->num_entries];
+  slot->name = malloc(strlen(name) + 1);
+  if (slot->name == NULL) {
+    return -1;
+  }
+  strcpy(slot->name, name);
+  slot->inode_num = inode_num;
+  slot->type = type;
+  slot->name_length = name_length;
+  slot->offset = offset;
+  slot->hash = dir_hash(name);
+  dir_link(dir, dir->num_entries);
+  dir->num_entries++;
+  return 0;
+}
+
+/*Remembers a free direntry slot for reuse. Returns 0 on success.*/
+static int dir_add_hole(dir_index *dir, _u32 offset, Byte name_length) {
+  dir_hole *holes = realloc(dir->holes, (dir->num_holes + 1) * sizeof(dir_hole));
+  if (holes == NULL) {
+    return -1;
+  }
+  dir->holes = holes;
+  dir->holes[dir->num_holes].offset = offset;
+  dir->holes[dir->num_holes].name_length = name_length;
+  dir->num_holes++;
+  return 0;
+}
+
+static void dir_free(dir_index *dir) {
+  pthread_rwlock_destroy(&dir->lock);
+  pthread_mutex_destroy(&dir->listing_lock);
+  free(dir->listing);
+  for (_u32 i = 0; i < dir->num_entries; i++) {
+    free(dir->slots[i].name);
+  }
+  free(dir->slots);
+  free(dir->buckets);
+  free(dir->holes);
+  free(dir);
+}
+
+/*Parses a directory into a new index. Returns NULL on error.*/
+static dir_index *dir_parse(_u32 inode_num) {
+  dir_index *dir = calloc(1, sizeof(dir_index));
+  if (dir == NULL) {
+    return NULL;
+  }
+  pthread_rwlock_init(&dir->lock, NULL);
+  pthread_mutex_init(&dir->listing_lock, NULL);
+  dir->inode_num = inode_num;
+  dir->capacity = 8;
+  dir->num_buckets = 8;
+  dir->slots = malloc(dir->capacity * sizeof(dir_slot));
+  dir->buckets = malloc(dir->num_buckets * sizeof(_u32));
+  if (dir->slots == NULL || dir->buckets == NULL || load_inode(inode_num, &dir->inode) < 0) {
+    dir_free(dir);
+    return NULL;
+  }
+  memset(dir->buckets, 0xff, dir->num_buckets * sizeof(_u32));
+  // A directory that has never had an entry is empty, it doesn't even hold the count
+  if (dir->inode.size <= sizeof(_u32)) {
+    return dir;
+  }
+  Byte *data = malloc(dir->inode.size + 1);
+  stats_directory++;
+  int result = data == NULL ? -1 : inode_read(&dir->inode, 0, data, dir->inode.size);
+  stats_directory--;
+  if (result < 0) {
+    free(data);
+    dir_free(dir);
+    return NULL;
+  }
+  data[dir->inode.size] = '\0';
+  _u32 offset = sizeof(_u32);
+  while (offset + 6 < dir->inode.size) {
+    _u32 entry_inode;
+    memcpy(&entry_inode, data + offset, sizeof(_u32));
+    Byte type = data[offset + 4];
+    Byte name_length = data[offset + 5];
+    if (name_length == 0 || offset + 6 + name_length > dir->inode.size) {
+      break;
+    }
+    // Names are null-terminated, a reused slot may be longer than its name
+    data[offset + 6 + name_length - 1] = '\0';
+    result = type == 0
+      ? dir_add_hole(dir, offset, name_length)
+      : dir_insert(dir, (char *) data + offset + 6, entry_inode, type, name_length, offset);
+    if (result < 0) {
+      free(data);
+      dir_free(dir);
+      return NULL;
+    }
+    offset += 6 + name_length;
+  }
+  free(data);
+  return dir;
+}
+
+/*Returns the loaded index of directory inode_num or NULL. The caller holds 
+table_lock.*/
+static dir_index *dir_find_locked(_u32 inode_num) {
+  dir_index *dir = fs.dir_table[inode_num % DIR_TABLE_SIZE];
+  while (dir != NULL && dir->inode_num != inode_num) {
+    dir = dir->next;
+  }
+  return dir;
+}
+
+/*Returns the index of directory inode_num, parsing it the first time it is 
+asked for. The directory is read without table_lock, so other directories 
+can be looked up meanwhile; if another thread loads it first, its index is 
+the one kept. Returns NULL on error.*/
+static dir_index *dir_get(_u32 inode_num) {
+  pthread_mutex_lock(&table_lock);
+  dir_index *dir = dir_find_locked(inode_num);
+  pthread_mutex_unlock(&table_lock);
+  if (dir != NULL) {
+    return dir;
+  }
+  dir_index *parsed = dir_parse(inode_num);
+  if (parsed == NULL) {
+    return NULL;
+  }
+  pthread_mutex_lock(&table_lock);
+  dir = dir_find_locked(inode_num);
+  if (dir == NULL) {
+    dir_index **bucket = &fs.dir_table[inode_num % DIR_TABLE_SIZE];
+    parsed->next = *bucket;
+    *bucket = parsed;
+    dir = parsed;
+    parsed = NULL;
+  }
+  pthread_mutex_unlock(&table_lock);
+  if (parsed != NULL) {
+    dir_free(parsed);
+  }
+  return dir;
+}
+
+/*Frees dir, which has left dir_table, unless my_dir handles still read 
+it: then the last my_closedir() frees it. The caller holds table_lock.*/
+static void dir_drop_locked(dir_index *dir) {
+  if (dir->openers > 0) {
+    __atomic_store_n(&dir->forgotten, 1, __ATOMIC_RELEASE);
+  } else {
+    dir_free(dir);
+  }
+}
+
+/*Drops the index of directory inode_num, if it is loaded*/
+static void dir_forget(_u32 inode_num) {
+  dir_index **link = &fs.dir_table[inode_num % DIR_TABLE_SIZE];
+  pthread_mutex_lock(&table_lock);
+  while (*link != NULL) {
+    if ((*link)->inode_num == inode_num) {
+      dir_index *dir = *link;
+      *link = dir->next;
+      if (dir->removed) {
+        // Threads that found it before the removal may still wait on its lock
+        dir->next = fs.dir_removed;
+        fs.dir_removed = dir;
+      } else {
+        dir_drop_locked(dir);
+      }
+      break;
+    }
+    link = &(*link)->next;
+  }
+  pthread_mutex_unlock(&table_lock);
+}
+
+static void dir_destroy_all(void) {
+  pthread_mutex_lock(&table_lock);
+  for (int i = 0; i < DIR_TABLE_SIZE; i++) {
+    while (fs.dir_table[i] != NULL) {
+      dir_index *dir = fs.dir_table[i];
+      fs.dir_table[i] = dir->next;
+      dir_drop_locked(dir);
+    }
+  }
+  while (fs.dir_removed != NULL) {
+    dir_index *dir = fs.dir_removed;
+    fs.dir_removed = dir->next;
+    dir_drop_locked(dir);
+  }
+  pthread_mutex_unlock(&table_lock);
+}
+
+/*Looks a name up in a directory. Returns its slot or NULL if there is none.*/
+static dir_slot *dir_lookup(dir_index *dir, const char *name) {
+  if (dir->removed) {
+    return NULL;
+  }
+  _u32 hash = dir_hash(name);
+  for (_u32 i = dir->buckets[hash & (dir->num_buckets - 1)]; i != DIR_NONE; i = dir->slots[i].next) {
+    if (dir->slots[i].hash == hash && strcmp(dir->slots[i].name, name) == 0) {
+      return &dir->slots[i];
+    }
+  }
+  return NULL;
+}
+
+/*Writes the live entry count at the start of the directory. Returns 0 on success.*/
+static int dir_write_count(dir_index *dir) {
+  _u32 count = dir->num_entries;
+  stats_directory++;
+  _u32 written = inode_write(&dir->inode, 0, (Byte *) &count, sizeof(_u32));
+  stats_directory--;
+  return written == sizeof(_u32) ? 0 : -1;
+}
+
+/*Adds an entry to a directory, both on disk and in its index. The direntry 
+goes into the first free slot that is large enough, otherwise it is 
+appended. The caller holds dir's write lock. Returns 0 on success, -1 on error.*/
+static int dir_add(dir_index *dir, const char *name, _u32 inode_num, Byte type) {
+  size_t length = strlen(name) + 1;
+  if (length < 2 || length > 255 || dir->removed) {
+    return -1;
+  }
+  Byte name_length = length;
+  _u32 offset = dir->inode.size < sizeof(_u32) ? sizeof(_u32) : dir->inode.size;
+  for (_u32 i = 0; i < dir->num_holes; i++) {
+    if (dir->holes[i].name_length >= name_length) {
+      // Reuse the hole, keeping its size so the entries after it don't move
+      offset = dir->holes[i].offset;
+      name_length = dir->holes[i].name_length;
+      dir->holes[i] = dir->holes[--dir->num_holes];
+      break;
+    }
+  }
+  Byte entry[6 + name_length];
+  memset(entry, 0, sizeof(entry));
+  memcpy(entry, &inode_num, sizeof(_u32));
+  entry[4] = type;
+  entry[5] = name_length;
+  memcpy(entry + 6, name, length);
+  dir->generation++;
+  meta_begin();
+  stats_directory++;
+  int result = 0;
+  if (inode_write(&dir->inode, offset, entry, sizeof(entry)) != sizeof(entry)
+      || dir_insert(dir, name, inode_num, type, name_length, offset) < 0
+      || dir_write_count(dir) < 0
+      || store_inode(dir->inode_num, &dir->inode) < 0) {
+    result = -1;
+  }
+  stats_directory--;
+  meta_end();
+  return result;
+}
+
+/*Removes an entry from a directory. Its on-disk slot is marked free for 
+later reuse, so only the block holding it and the entry count change. 
+The caller holds dir's write lock. Returns 0 on success, -1 if there is no 
+such entry.*/
+static int dir_remove(dir_index *dir, const char *name) {
+  dir_slot *slot = dir_lookup(dir, name);
+  if (slot == NULL) {
+    return -1;
+  }
+  _u32 index = slot - dir->slots;
+  dcache_invalidate(dir->inode_num, name);
+  dir->generation++;
+  Byte type = 0;
+  meta_begin();
+  stats_directory++;
+  _u32 written = inode_write(&dir->inode, slot->offset + 4, &type, 1);
+  stats_directory--;
+  meta_end();
+  if (written != 1 || dir_add_hole(dir, slot->offset, slot->name_length) < 0) {
+    return -1;
+  }
+  // Unlink the slot from its chain
+  _u32 *link = &dir->buckets[slot->hash & (dir->num_buckets - 1)];
+  while (*link != index) {
+    link = &dir->slots[*link].next;
+  }
+  *link = slot->next;
+  free(slot->name);
+  // Move the last slot into the gap and repoint whatever linked to it
+  _u32 last = --dir->num_entries;
+  if (index != last) {
+    dir->slots[index] = dir->slots[last];
+    link = &dir->buckets[dir->slots[index].hash & (dir->num_buckets - 1)];
+    while (*link != last) {
+      link = &dir->slots[*link].next;
+    }
+    *link = index;
+  }
+  meta_begin();
+  int result = dir_write_count(dir);
+  meta_end();
+  return result;
+}
+
+/*Allocates an empty inode for an entry of type type in directory parent, 
+along with its first data block, and writes it to the inode table. Both 
+come from the same group. The new inode is stored in inode. Returns its 
+index or -1 on error.*/
+static _u32 create_inode(inode_t *inode, _u32 parent, Byte type) {
+  _u32 inode_num = allocate_inode_near(parent, type);
+  if (inode_num == (_u32) -1) {
+    return -1;
+  }
+  memset(inode, 0, sizeof(inode_t));
+  // The first free block of the inode's group holds the new entry's data
+  inode->blocks[0] = allocate_block(inode_goal(inode_num));
+  if (inode->blocks[0] == (_u32) -1) {
+    pthread_mutex_lock(&alloc_lock);
+    inode_map_set(inode_num, 0);
+    pthread_mutex_unlock(&alloc_lock);
+    return -1;
+  }
+  if (store_inode(inode_num, inode) < 0) {
+    free_block(inode->blocks[0]);
+    free_inode(inode_num);
+    return -1;
+  }
+  return inode_num;
+}
+
+/*Links inode_num into dir under name, undoing create_inode() if that 
+fails. The bitmap blocks that changed are written back. The caller holds 
+dir's write lock. Returns 0 on success.*/
+static int link_inode(dir_index *dir, const char *name, Byte type, _u32 inode_num, inode_t *inode) {
+  if (dir_add(dir, name, inode_num, type) < 0) {
+    free_block(inode->blocks[0]);
+    free_inode(inode_num);
+    bitmap_flush();
+    return -1;
+  }
+  return bitmap_flush();
+}
+
+/*Creates a new, empty file or directory called name inside dir. The inode 
+and its first data block are written before the direntry that points to 
+them. The new inode is stored in inode. The caller holds dir's write lock. 
+Returns its index or -1 on error.*/
+static _u32 create_entry(dir_index *dir, const char *name, Byte type, inode_t *inode) {
+  _u32 inode_num = create_inode(inode, dir->inode_num, type);
+  if (inode_num == (_u32) -1 || link_inode(dir, name, type, inode_num, inode) < 0) {
+    return -1;
+  }
+  return inode_num;
+}
+
+/************************ PATH RESOLUTION ************************/
+
+static int dcache_init(void) {
+  fs.dcache = calloc(DCACHE_SIZE, sizeof(dentry));
+  return fs.dcache == NULL ? -1 : 0;
+}
+
+static void dcache_destroy(void) {
+  if (fs.dcache == NULL) {
+    return;
+  }
+  for (int i = 0; i < DCACHE_SIZE; i++) {
+    free(fs.dcache[i].name);
+  }
+  free(fs.dcache);
+  fs.dcache = NULL;
+}
+
+static _u32 dcache_hash(_u32 parent, const char *name) {
+  return dir_hash(name) ^ (parent * 2654435761u);
+}
+
+/*Drops the cached lookup of name in parent, if there is one*/
+static void dcache_invalidate(_u32 parent, const char *name) {
+  if (fs.dcache == NULL) {
+    return;
+  }
+  _u32 slot = dcache_hash(parent, name) % DCACHE_SIZE;
+  dentry *entry = &fs.dcache[slot];
+  pthread_mutex_lock(&dcache_locks[slot % DCACHE_LOCKS]);
+  if (entry->name != NULL && entry->parent == parent && strcmp(entry->name, name) == 0) {
+    free(entry->name);
+    entry->name = NULL;
+  }
+  pthread_mutex_unlock(&dcache_locks[slot % DCACHE_LOCKS]);
+}
+
+/*Returns whether the root directory has an entry for directory inode_num. 
+Only used for directories without a '..' entry, which the original mkdir() 
+could only make in the root.*/
+static int dir_in_root(_u32 inode_num) {
+  dir_index *root = dir_get(0);
+  if (root == NULL) {
+    return 0;
+  }
+  int found = 0;
+  pthread_rwlock_rdlock(&root->lock);
+  for (_u32 i = 0; i < root->num_entries && !found; i++) {
+    found = root->slots[i].inode_num == inode_num && root->slots[i].type == 'D';
+  }
+  pthread_rwlock_unlock(&root->lock);
+  return found;
+}
+
+/*Looks name up in directory parent, going through the dentry cache first. 
+The child's type is stored in type. Returns the child's inode or -1 if 
+there is no such entry.*/
+static _u32 lookup(_u32 parent, const char *name, Byte *type) {
+  _u32 hash = dcache_hash(parent, name);
+  dentry *entry = &fs.dcache[hash % DCACHE_SIZE];
+  pthread_mutex_t *entry_lock = &dcache_locks[hash % DCACHE_SIZE % DCACHE_LOCKS];
+  pthread_mutex_lock(entry_lock);
+  if (entry->name != NULL && entry->hash == hash && entry->parent == parent && strcmp(entry->name, name) == 0) {
+    _u32 child = entry->child;
+    *type = entry->type;
+    pthread_mutex_unlock(entry_lock);
+    __atomic_fetch_add(&fs.dcache_hits, 1, __ATOMIC_RELAXED);
+    stats_dentry(1);
+    return child;
+  }
+  pthread_mutex_unlock(entry_lock);
+  __atomic_fetch_add(&fs.dcache_misses, 1, __ATOMIC_RELAXED);
+  stats_dentry(0);
+  dir_index *dir = dir_get(parent);
+  if (dir == NULL) {
+    return -1;
+  }
+  pthread_rwlock_rdlock(&dir->lock);
+  dir_slot *slot = dir_lookup(dir, name);
+  if (slot == NULL) {
+    pthread_rwlock_unlock(&dir->lock);
+    // Directories created before '..' was recorded were all made in the root
+    if (strcmp(name, "..") == 0 && (parent == 0 || dir_in_root(parent))) {
+      *type = 'D';
+      return 0;
+    }
+    return -1;
+  }
+  _u32 child = slot->inode_num;
+  *type = slot->type;
+  // Replace whatever was cached in this slot. The directory stays locked so
+  // that a concurrent dir_remove() can't be undone by a stale entry.
+  char *copy = malloc(strlen(name) + 1);
+  if (copy != NULL) {
+    strcpy(copy, name);
+    pthread_mutex_lock(entry_lock);
+    free(entry->name);
+    entry->name = copy;
+    entry->hash = hash;
+    entry->parent = parent;
+    entry->child = child;
+    entry->type = *type;
+    pthread_mutex_unlock(entry_lock);
+  }
+  pthread_rwlock_unlock(&dir->lock);
+  return child;
+}
+
+/*Walks path from the root (if it begins with '/') or from the current 
+directory. If last is NULL every component is resolved. Otherwise the final 
+component is not looked up but copied into last, which must hold 256 
+characters. The type of the inode reached is stored in type. Returns the 
+inode reached (the parent of last, if last is given) or -1 on error.*/
+static _u32 resolve_path(const char *path, char *last, Byte *type) {
+  _u32 current = path[0] == '/' ? 0 : __atomic_load_n(&fs.cwd, __ATOMIC_RELAXED);
+  *type = 'D';
+  const char *component = path;
+  while (*component != '\0') {
+    while (*component == '/') {
+      component++;
+    }
+    size_t length = strcspn(component, "/");
+    if (length == 0) {
+      break;
+    }
+    if (length > 254) {
+      return -1;
+    }
+    char name[length + 1];
+    memcpy(name, component, length);
+    name[length] = '\0';
+    component += length;
+    const char *rest = component + strspn(component, "/");
+    if (last != NULL && *rest == '\0') {
+      strcpy(last, name);
+      return *type == 'D' ? current : (_u32) -1;
+    }
+    // Every component before the last has to be a directory
+    if (*type != 'D') {
+      return -1;
+    }
+    if (strcmp(name, ".") != 0) {
+      current = lookup(current, name, type);
+      if (current == (_u32) -1) {
+        return -1;
+      }
+    }
+    component = rest;
+  }
+  if (last != NULL) {
+    // Nothing left to name, e.g. "/" or "a/.."
+    return -1;
+  }
+  return current;
+}
+
+/*Reports how often path lookups were answered by the dentry cache*/
+void get_dcache_stats(_u32 *hits, _u32 *misses) {
+  *hits = __atomic_load_n(&fs.dcache_hits, __ATOMIC_RELAXED);
+  *misses = __atomic_load_n(&fs.dcache_misses, __ATOMIC_RELAXED);
+}
+
+/*Makes directory inode_num the current directory, unless it has been 
+removed. Removals check the current directory under the write lock of each 
+directory they take, so either one sees the change made here or this sees 
+the removal. Returns 0 on success.*/
+static int set_cwd(_u32 inode_num) {
+  dir_index *dir = dir_get(inode_num);
+  if (dir == NULL) {
+    return -1;
+  }
+  pthread_rwlock_rdlock(&dir->lock);
+  int result = dir->removed ? -1 : 0;
+  if (result == 0) {
+    __atomic_store_n(&fs.cwd, inode_num, __ATOMIC_RELAXED);
+  }
+  pthread_rwlock_unlock(&dir->lock);
+  return result;
+}
+
+/* Sets the current working directory. name is either a full path 
+(if it begins with '/', or a relative path with regards to the current location 
+in the file system. All entries must already exist. Returns 0 on success.*/
+static int do_chdir(char *name) {
+  if (fd < 0) {
+    return -1;
+  }
+  char last[256];
+  Byte type;
+  _u32 parent = resolve_path(name, last, &type);
+  dir_index *dir = parent == (_u32) -1 ? NULL : dir_get(parent);
+  if (dir == NULL || strcmp(last, ".") == 0 || strcmp(last, "..") == 0) {
+    // "/" and paths ending in "." or ".." name the directory they reach
+    _u32 inode_num = resolve_path(name, NULL, &type);
+    return inode_num == (_u32) -1 || type != 'D' ? -1 : set_cwd(inode_num);
+  }
+  // The entry is looked up under the parent's lock, so the inode it names 
+  // is a whole directory that can't be removed or reused meanwhile
+  pthread_rwlock_rdlock(&dir->lock);
+  dir_slot *slot = dir_lookup(dir, last);
+  int result = slot == NULL || slot->type != 'D' ? -1 : set_cwd(slot->inode_num);
+  pthread_rwlock_unlock(&dir->lock);
+  return result;
+}
+
+int chdir(char *name) {
+  unsigned long long start = stats_start(FS_OP_CHDIR);
+  int result = do_chdir(name);
+  stats_op(FS_OP_CHDIR, start, result != 0);
+  return result;
+}
+
+/* Returns the full path to the current directory*/
+static char *do_cwd(void) {
+  if (fd < 0) {
+    return NULL;
+  }
+  // Build the path backwards by following '..' up to the root
+  size_t capacity = 256;
+  size_t start = capacity - 1;
+  char *path = malloc(capacity);
+  if (path == NULL) {
+    return NULL;
+  }
+  path[start] = '\0';
+  _u32 current = __atomic_load_n(&fs.cwd, __ATOMIC_RELAXED);
+  while (current != 0) {
+    Byte type;
+    _u32 parent = lookup(current, "..", &type);
+    dir_index *dir = parent == (_u32) -1 ? NULL : dir_get(parent);
+    if (dir == NULL) {
+      free(path);
+      return NULL;
+    }
+    char component[256] = "";
+    pthread_rwlock_rdlock(&dir->lock);
+    for (_u32 i = 0; i < dir->num_entries; i++) {
+      if (dir->slots[i].inode_num == current && dir->slots[i].type == 'D'
+          && strcmp(dir->slots[i].name, ".") != 0 && strcmp(dir->slots[i].name, "..") != 0) {
+        strcpy(component, dir->slots[i].name);
+        break;
+      }
+    }
+    pthread_rwlock_unlock(&dir->lock);
+    if (component[0] == '\0') {
+      free(path);
+      return NULL;
+    }
+    size_t length = strlen(component) + 1;
+    if (length > start) {
+      // Grow the buffer, keeping the part built so far at its end
+      size_t used = capacity - start;
+      char *bigger = malloc(capacity * 2 + length);
+      if (bigger == NULL) {
+        free(path);
+        return NULL;
+      }
+      memcpy(bigger + capacity * 2 + length - used, path + start, used);
+      free(path);
+      path = bigger;
+      capacity = capacity * 2 + length;
+      start = capacity - used;
+    }
+    start -= length;
+    path[start] = '/';
+    memcpy(path + start + 1, component, length - 1);
+    current = parent;
+  }
+  if (path[start] == '\0') {
+    path[--start] = '/';
+  }
+  memmove(path, path + start, capacity - start);
+  return path;
+}
+
+char *cwd(void) {
+  unsigned long long start = stats_start(FS_OP_CWD);
+  char *result = do_cwd();
+  stats_op(FS_OP_CWD, start, result == NULL);
+  return result;
+}
+
+/************************ DIRECTORY LISTING ************************/
+
+/*Bytes of a directory a my_dir window holds: whole blocks, enough for the 
+longest direntry wherever it starts*/
+static _u32 dir_window_size(void) {
+  _u32 block_size = fs.rb.block_size;
+  return block_size * (1 + (6 + 255 + block_size - 1) / block_size);
+}
+
+/*Sets up iter to read directory dir from its first entry. Returns 0 on 
+success.*/
+static int dir_iter_init(my_dir *iter, dir_index *dir) {
+  iter->window = malloc(dir_window_size());
+  if (iter->window == NULL) {
+    return -1;
+  }
+  iter->inode_num = dir->inode_num;
+  iter->index = dir;
+  iter->offset = sizeof(_u32);
+  iter->window_start = 0;
+  iter->window_length = 0;
+  iter->generation = 0;
+  return 0;
+}
+
+/*Makes the window of iter cover length bytes at offset of dir, reading it 
+again from the block that holds offset if it doesn't. The caller holds 
+dir's lock. Returns 0 on success, -1 on error.*/
+static int dir_iter_window(my_dir *iter, dir_index *dir, _u32 offset, _u32 length) {
+  if (offset >= iter->window_start && offset + length <= iter->window_start + iter->window_length) {
+    return 0;
+  }
+  _u32 start = offset - offset % fs.rb.block_size;
+  _u32 size = dir->inode.size - start < dir_window_size() ? dir->inode.size - start : dir_window_size();
+  iter->window_length = 0;
+  stats_directory++;
+  int result = inode_read(&dir->inode, start, iter->window, size);
+  stats_directory--;
+  if (result < 0 || offset + length > start + size) {
+    return -1;
+  }
+  iter->window_start = start;
+  iter->window_length = size;
+  return 0;
+}
+
+/*Returns the next live entry of the directory iter reads, or NULL after 
+the last one, once the directory has been removed, or on error. Free slots 
+are skipped.*/
+static direntry_t *dir_iter_next(my_dir *iter) {
+  dir_index *dir = iter->index;
+  if (__atomic_load_n(&dir->forgotten, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+  direntry_t *result = NULL;
+  pthread_rwlock_rdlock(&dir->lock);
+  if (iter->generation != dir->generation) {
+    iter->window_length = 0;
+    iter->generation = dir->generation;
+  }
+  while (result == NULL && iter->offset + 6 < dir->inode.size) {
+    _u32 offset = iter->offset;
+    if (dir_iter_window(iter, dir, offset, 6) < 0) {
+      break;
+    }
+    Byte name_length = iter->window[offset - iter->window_start + 5];
+    if (name_length == 0 || dir_iter_window(iter, dir, offset, 6 + name_length) < 0) {
+      break;
+    }
+    Byte *entry = iter->window + (offset - iter->window_start);
+    iter->offset += 6 + name_length;
+    if (entry[4] == 0) {
+      continue;
+    }
+    memcpy(&iter->entry.inode_num, entry, sizeof(_u32));
+    iter->entry.type = entry[4];
+    iter->entry.name_length = name_length;
+    // A reused slot may be longer than the name it holds
+    memcpy(iter->name, entry + 6, name_length);
+    iter->name[name_length - 1] = '\0';
+    iter->entry.name = iter->name;
+    result = &iter->entry;
+  }
+  pthread_rwlock_unlock(&dir->lock);
+  return result;
+}
+
+/*Lets go of an index my_opendir() took, freeing it if it has been dropped 
+meanwhile and this was the last handle on it.*/
+static void dir_close(dir_index *dir) {
+  pthread_mutex_lock(&table_lock);
+  if (--dir->openers == 0 && __atomic_load_n(&dir->forgotten, __ATOMIC_RELAXED)) {
+    dir_free(dir);
+  }
+  pthread_mutex_unlock(&table_lock);
+}
+
+/* Opens a directory for my_readdir(). The handle keeps the directory's 
+index, which isn't freed before the handle is closed. Returns NULL on error.*/
+static my_dir *do_my_opendir(char *name) {
+  if (fd < 0) {
+    return NULL;
+  }
+  Byte type;
+  _u32 inode_num = resolve_path(name, NULL, &type);
+  if (inode_num == (_u32) -1 || type != 'D' || dir_get(inode_num) == NULL) {
+    return NULL;
+  }
+  // The index may have been dropped again since, by a rmdir()
+  pthread_mutex_lock(&table_lock);
+  dir_index *index = dir_find_locked(inode_num);
+  if (index != NULL) {
+    index->openers++;
+  }
+  pthread_mutex_unlock(&table_lock);
+  my_dir *dir = index == NULL ? NULL : malloc(sizeof(my_dir));
+  if (dir == NULL || dir_iter_init(dir, index) < 0) {
+    free(dir);
+    if (index != NULL) {
+      dir_close(index);
+    }
+    return NULL;
+  }
+  return dir;
+}
+
+my_dir *my_opendir(char *name) {
+  unsigned long long start = stats_start(FS_OP_OPENDIR);
+  my_dir *result = do_my_opendir(name);
+  stats_op(FS_OP_OPENDIR, start, result == NULL);
+  return result;
+}
+
+direntry_t *my_readdir(my_dir *dir) {
+  unsigned long long start = stats_start(FS_OP_READDIR);
+  direntry_t *result = fd < 0 || dir == NULL ? NULL : dir_iter_next(dir);
+  stats_op(FS_OP_READDIR, start, 0);
+  return result;
+}
+
+static int do_my_closedir(my_dir *dir) {
+  if (dir == NULL) {
+    return -1;
+  }
+  dir_close(dir->index);
+  free(dir->window);
+  free(dir);
+  return 0;
+}
+
+int my_closedir(my_dir *dir) {
+  unsigned long long start = stats_start(FS_OP_CLOSEDIR);
+  int result = do_my_closedir(dir);
+  stats_op(FS_OP_CLOSEDIR, start, result != 0);
+  return result;
+}
+
+/*Orders the names of a listing*/
+static int compare_names(const void *a, const void *b) {
+  return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/*Builds the sorted listing of dir from its blocks, read with the same 
+iterator as my_readdir(). The names are gathered into one buffer and sorted 
+through an array of pointers into it. The caller holds dir's listing_lock. 
+Returns 0 on success.*/
+static int dir_build_listing(dir_index *dir) {
+  pthread_rwlock_rdlock(&dir->lock);
+  _u32 generation = dir->generation;
+  _u32 capacity = dir->inode.size;
+  pthread_rwlock_unlock(&dir->lock);
+  my_dir iter;
+  char *names = malloc(capacity + 1);
+  _u32 *offsets = malloc((capacity / 7 + 1) * sizeof(_u32));
+  if (names == NULL || offsets == NULL || dir_iter_init(&iter, dir) < 0) {
+    free(names);
+    free(offsets);
+    return -1;
+  }
+  // A directory of size bytes has room for at most size / 7 entries and 
+  // size bytes of names, unless it grows meanwhile
+  _u32 length = 0;
+  _u32 count = 0;
+  for (direntry_t *entry = dir_iter_next(&iter); entry != NULL; entry = dir_iter_next(&iter)) {
+    if (strcmp(entry->name, ".") == 0 || strcmp(entry->name, "..") == 0) {
+      continue;
+    }
+    _u32 name_length = strlen(entry->name) + 1;
+    if (length + name_length > capacity || count == capacity / 7 + 1) {
+      break;
+    }
+    offsets[count++] = length;
+    memcpy(names + length, entry->name, name_length);
+    length += name_length;
+  }
+  free(iter.window);
+  char **sorted = malloc((count + 1) * sizeof(char *));
+  char *listing = malloc(length + 1);
+  if (sorted == NULL || listing == NULL) {
+    free(names);
+    free(offsets);
+    free(sorted);
+    free(listing);
+    return -1;
+  }
+  for (_u32 i = 0; i < count; i++) {
+    sorted[i] = names + offsets[i];
+  }
+  qsort(sorted, count, sizeof(char *), compare_names);
+  _u32 used = 0;
+  for (_u32 i = 0; i < count; i++) {
+    size_t name_length = strlen(sorted[i]);
+    memcpy(listing + used, sorted[i], name_length);
+    used += name_length;
+    if (i + 1 < count) {
+      listing[used++] = '\n';
+    }
+  }
+  listing[used] = '\0';
+  free(names);
+  free(offsets);
+  free(sorted);
+  free(dir->listing);
+  dir->listing = listing;
+  dir->listing_length = used;
+  dir->listing_generation = generation;
+  return 0;
+}
+
+/* Returns the sorted entries of the current directory, separated by \n, in 
+a string the caller frees. The listing is kept with the directory index and 
+only built again once the directory has changed. Returns NULL on error.*/
+static char *do_ls(void) {
+  if (fd < 0) {
+    return NULL;
+  }
+  dir_index *dir = dir_get(__atomic_load_n(&fs.cwd, __ATOMIC_RELAXED));
+  if (dir == NULL) {
+    return NULL;
+  }
+  char *copy = NULL;
+  pthread_mutex_lock(&dir->listing_lock);
+  pthread_rwlock_rdlock(&dir->lock);
+  int stale = dir->listing == NULL || dir->listing_generation != dir->generation;
+  pthread_rwlock_unlock(&dir->lock);
+  if (!stale || dir_build_listing(dir) == 0) {
+    copy = malloc(dir->listing_length + 1);
+    if (copy != NULL) {
+      memcpy(copy, dir->listing, dir->listing_length + 1);
+    }
+  }
+  pthread_mutex_unlock(&dir->listing_lock);
+  return copy;
+}
+
+char *ls(void) {
+  unsigned long long start = stats_start(FS_OP_LS);
+  char *result = do_ls();
+  stats_op(FS_OP_LS, start, result == NULL);
+  return result;
+}
+
+/************************ IN-CORE INODES ************************/
+
+/*Returns the in-core copy of inode inode_num with one more reference, 
+loading it from the inode table if no open file holds it yet. Returns 
+NULL on error.*/
+static incore_inode *iget(_u32 inode_num) {
+  incore_inode **bucket = &fs.icache[inode_num % ICACHE_SIZE];
+  pthread_mutex_lock(&table_lock);
+  for (incore_inode *ic = *bucket; ic != NULL; ic = ic->next) {
+    if (ic->inode_num == inode_num) {
+      ic->refs++;
+      pthread_mutex_unlock(&table_lock);
+      return ic;
+    }
+  }
+  incore_inode *ic = calloc(1, sizeof(incore_inode));
+  if (ic == NULL || load_inode(inode_num, &ic->inode) < 0) {
+    pthread_mutex_unlock(&table_lock);
+    free(ic);
+    return NULL;
+  }
+  pthread_rwlock_init(&ic->lock, NULL);
+  ic->inode_num = inode_num;
+  ic->refs = 1;
+  ic->next = *bucket;
+  *bucket = ic;
+  pthread_mutex_unlock(&table_lock);
+  return ic;
+}
+
+/*Drops a reference taken by iget(), freeing the in-core inode with the last one*/
+static void iput(incore_inode *ic) {
+  pthread_mutex_lock(&table_lock);
+  if (--ic->refs > 0) {
+    pthread_mutex_unlock(&table_lock);
+    return;
+  }
+  if (!ic->detached) {
+    incore_inode **link = &fs.icache[ic->inode_num % ICACHE_SIZE];
+    while (*link != ic) {
+      link = &(*link)->next;
+    }
+    *link = ic->next;
+  }
+  pthread_mutex_unlock(&table_lock);
+  pthread_rwlock_destroy(&ic->lock);
+  free(ic);
+}
+
+/*Empties the table of in-core inodes. Files that are still open keep their 
+inode until they are closed.*/
+static void icache_destroy(void) {
+  pthread_mutex_lock(&table_lock);
+  for (int i = 0; i < ICACHE_SIZE; i++) {
+    for (incore_inode *ic = fs.icache[i]; ic != NULL; ic = ic->next) {
+      ic->detached = 1;
+    }
+    fs.icache[i] = NULL;
+  }
+  pthread_mutex_unlock(&table_lock);
+}
+
+/*Stores the in-core inode ic in the inode table if it has changed since it 
+was last stored. Returns 0 on success.*/
+static int inode_writeback(incore_inode *ic) {
+  int result = 0;
+  pthread_rwlock_wrlock(&ic->lock);
+  if (ic->dirty) {
+    result = store_inode(ic->inode_num, &ic->inode);
+    if (result == 0) {
+      ic->dirty = 0;
+    }
+  }
+  pthread_rwlock_unlock(&ic->lock);
+  return result;
+}
+
+/************************ FILE BUFFERS ************************/
+
+/*Brings the block buffer of file up to date with what was written through 
+other handles since it was read in, keeping the bytes this handle has 
+changed. The caller holds the handle lock and ic's lock. Returns 0 on success.*/
+static int file_merge_locked(my_file *file) {
+  incore_inode *ic = (incore_inode *) file->inode;
+  if (file->buffer_generation == ic->generation) {
+    return 0;
+  }
+  _u32 block_size = fs.rb.block_size;
+  unsigned long long start = (unsigned long long) file->buffer_block * block_size;
+  _u32 length = 0;
+  if (start < file->inode->size) {
+    length = file->inode->size - start < block_size ? file->inode->size - start : block_size;
+  }
+  Byte current[block_size];
+  memset(current + length, 0, block_size - length);
+  if (length > 0 && inode_read(file->inode, start, current, length) < 0) {
+    return -1;
+  }
+  memcpy(current + file->dirty_start, file->buffer + file->dirty_start, file->dirty_end - file->dirty_start);
+  memcpy(file->buffer, current, block_size);
+  if (length > file->buffer_length) {
+    file->buffer_length = length;
+  }
+  file->buffer_generation = ic->generation;
+  return 0;
+}
+
+/*Writes the block buffer of file back if it is dirty, allocating the block 
+if need be and growing the file when the buffer reaches past its end. The 
+bytes this handle changed are merged into the block as the file has it, 
+and the whole block goes out in one write; the inode itself is only 
+changed in core. The caller holds the handle lock. Returns 0 on success.*/
+static int file_writeback(my_file *file) {
+  if (!file->dirty) {
+    return 0;
+  }
+  incore_inode *ic = (incore_inode *) file->inode;
+  _u32 run;
+  int result = -1;
+  pthread_rwlock_wrlock(&ic->lock);
+  ic->dirty = 1;
+  _u32 index = file_merge_locked(file) < 0 ? (_u32) -1 : bmap_run(file->inode, file->buffer_block, 1, 1, &run);
+  if (index != 0 && index != (_u32) -1 && write_block(index, file->buffer) == 0) {
+    _u32 end = file->buffer_block * fs.rb.block_size + file->buffer_length;
+    if (end > file->inode->size) {
+      file->inode->size = end;
+    }
+    ic->generation++;
+    file->buffer_generation = ic->generation;
+    file->dirty = 0;
+    result = 0;
+  }
+  pthread_rwlock_unlock(&ic->lock);
+  return result;
+}
+
+/*Whether the block buffer of file holds file_block as the file has it now. 
+A clean buffer goes stale when the block is written through another handle.*/
+static int file_buffer_valid(my_file *file, _u32 file_block) {
+  if (file->buffer_block != file_block) {
+    return 0;
+  }
+  if (file->dirty) {
+    return 1;
+  }
+  incore_inode *ic = (incore_inode *) file->inode;
+  pthread_rwlock_rdlock(&ic->lock);
+  int valid = file->buffer_generation == ic->generation;
+  pthread_rwlock_unlock(&ic->lock);
+  return valid;
+}
+
+/*Points the block buffer of file at file_block, reading in the part of it 
+that lies within the file and zeroing the rest. The caller holds the handle 
+lock and has written back the previous contents. Returns 0 on success.*/
+static int file_load_block(my_file *file, _u32 file_block) {
+  incore_inode *ic = (incore_inode *) file->inode;
+  _u32 block_size = fs.rb.block_size;
+  unsigned long long start = (unsigned long long) file_block * block_size;
+  _u32 length = 0;
+  int result = 0;
+  pthread_rwlock_rdlock(&ic->lock);
+  if (start < file->inode->size) {
+    length = file->inode->size - start < block_size ? file->inode->size - start : block_size;
+  }
+  memset(file->buffer + length, 0, block_size - length);
+  if (length > 0 && inode_read(file->inode, start, file->buffer, length) < 0) {
+    result = -1;
+  }
+  file->buffer_block = result == 0 ? file_block : (_u32) -1;
+  file->buffer_length = length;
+  file->buffer_generation = ic->generation;
+  pthread_rwlock_unlock(&ic->lock);
+  return result;
+}
+
+/*Writes back the block buffers of all open files, then their inodes. 
+Returns 0 on success.*/
+static int files_flush(void) {
+  int result = 0;
+  pthread_mutex_lock(&files_lock);
+  for (_u32 i = 0; i < fs.num_files; i++) {
+    my_file *file = fs.files[i];
+    pthread_mutex_lock(&file->lock);
+    if (file_writeback(file) < 0) {
+      result = -1;
+    }
+    pthread_mutex_unlock(&file->lock);
+    if (inode_writeback((incore_inode *) file->inode) < 0) {
+      result = -1;
+    }
+  }
+  pthread_mutex_unlock(&files_lock);
+  return result;
+}
+
+/*Adds file to the list of open handles. Returns 0 on success.*/
+static int files_add(my_file *file) {
+  int result = 0;
+  pthread_mutex_lock(&files_lock);
+  if (fs.num_files == fs.files_capacity) {
+    _u32 capacity = fs.files_capacity == 0 ? 16 : fs.files_capacity * 2;
+    my_file **files = realloc(fs.files, capacity * sizeof(my_file *));
+    if (files == NULL) {
+      result = -1;
+    } else {
+      fs.files = files;
+      fs.files_capacity = capacity;
+    }
+  }
+  if (result == 0) {
+    fs.files[fs.num_files++] = file;
+  }
+  pthread_mutex_unlock(&files_lock);
+  return result;
+}
+
+/*Drops file from the list of open handles, if it is still there*/
+static void files_remove(my_file *file) {
+  pthread_mutex_lock(&files_lock);
+  for (_u32 i = 0; i < fs.num_files; i++) {
+    if (fs.files[i] == file) {
+      fs.files[i] = fs.files[--fs.num_files];
+      break;
+    }
+  }
+  pthread_mutex_unlock(&files_lock);
+}
+
+/* Opens a file for reading and writing. returns NULL on error. 
+filename is an absolute or relative path to a file.*/
+static my_file *do_my_fopen(char *filename) {
+  if (fd < 0) {
+    return NULL;
+  }
+  char name[256];
+  Byte type;
+  _u32 parent = resolve_path(filename, name, &type);
+  dir_index *dir = parent == (_u32) -1 ? NULL : dir_get(parent);
+  if (dir == NULL) {
+    return NULL;
+  }
+  _u32 inode_num = -1;
+  incore_inode *ic = NULL;
+  // The inode is taken while the directory is locked, so rm() either sees 
+  // the file open or has unlinked it already
+  pthread_rwlock_rdlock(&dir->lock);
+  dir_slot *slot = dir_lookup(dir, name);
+  if (slot != NULL) {
+    // File exists, but we may be trying to open a directory instead of a file
+    type = slot->type;
+    inode_num = slot->inode_num;
+    ic = type == 'F' ? iget(inode_num) : NULL;
+  }
+  pthread_rwlock_unlock(&dir->lock);
+  if (slot == NULL) {
+    // If we get here, file doesn't exist. Another thread may create it
+    // before we get the write lock, so look again once we hold it.
+    journal_start();
+    pthread_rwlock_wrlock(&dir->lock);
+    slot = dir_lookup(dir, name);
+    if (slot != NULL) {
+      type = slot->type;
+      inode_num = slot->inode_num;
+    } else {
+      inode_t inode;
+      type = 'F';
+      inode_num = create_entry(dir, name, 'F', &inode);
+    }
+    ic = inode_num != (_u32) -1 && type == 'F' ? iget(inode_num) : NULL;
+    pthread_rwlock_unlock(&dir->lock);
+    journal_stop();
+  }
+  if (ic == NULL) {
+    return NULL;
+  }
+  my_file * file = malloc(sizeof(my_file));
+  if (file == NULL || (file->buffer = malloc(fs.rb.block_size)) == NULL) {
+    free(file);
+    iput(ic);
+    return NULL;
+  }
+  file->inode_num = inode_num;
+  file->inode = &ic->inode;
+  file->pos = 0;
+  file->dirty = 0;
+  file->dirty_start = 0;
+  file->dirty_end = 0;
+  file->buffer_block = -1;
+  file->buffer_length = 0;
+  file->buffer_generation = 0;
+  pthread_mutex_init(&file->lock, NULL);
+  file->readahead = NULL;
+  file->ra_start = 0;
+  file->ra_count = 0;
+  file->ra_window = RA_MIN_BLOCKS;
+  file->ra_next = 0;
+  file->ra_generation = 0;
+  if (files_add(file) < 0) {
+    do_my_fclose(file);
+    return NULL;
+  }
+  return file;
+}
+
+my_file *my_fopen(char *filename) {
+  unsigned long long start = stats_start(FS_OP_FOPEN);
+  my_file *result = do_my_fopen(filename);
+  stats_op(FS_OP_FOPEN, start, result == NULL);
+  return result;
+}
+
+/*writes num bytes from file into buffer. Returns 0 on success. Writes 
+smaller than a block are copied into the handle's block buffer, which is 
+written back when a write moves on to another block; larger ones go 
+straight to the disk. Either way the new size and block map stay in core 
+until the file is closed or synced.*/
+static int do_my_fputc(my_file *file, Byte *buffer, _u32 num) {
+  if (fd < 0 || file == NULL) {
+    return -1;
+  }
+  incore_inode *ic = (incore_inode *) file->inode;
+  _u32 block_size = fs.rb.block_size;
+  int result = 0;
+  journal_start();
+  pthread_mutex_lock(&file->lock);
+  if (num >= block_size) {
+    if (file_writeback(file) < 0) {
+      result = -1;
+    } else {
+      // The write may cover the buffered block
+      file->buffer_block = -1;
+      pthread_rwlock_wrlock(&ic->lock);
+      _u32 written = inode_write(file->inode, file->pos, buffer, num);
+      ic->generation++;
+      ic->dirty = 1;
+      file->pos += written;
+      pthread_rwlock_unlock(&ic->lock);
+      if (written != num) {
+        result = -1;
+      }
+    }
+  }
+  for (_u32 done = 0; num < block_size && done < num;) {
+    _u32 file_block = file->pos / block_size;
+    _u32 offset = file->pos % block_size;
+    if (!file_buffer_valid(file, file_block)
+        && (file_writeback(file) < 0 || file_load_block(file, file_block) < 0)) {
+      result = -1;
+      break;
+    }
+    _u32 chunk = block_size - offset < num - done ? block_size - offset : num - done;
+    // The changed bytes are kept as one range, so a write apart from it 
+    // sends the earlier one back first
+    if (file->dirty && (offset > file->dirty_end || offset + chunk < file->dirty_start)
+        && file_writeback(file) < 0) {
+      result = -1;
+      break;
+    }
+    memcpy(file->buffer + offset, buffer + done, chunk);
+    if (!file->dirty) {
+      file->dirty_start = offset;
+      file->dirty_end = offset + chunk;
+    } else {
+      file->dirty_start = offset < file->dirty_start ? offset : file->dirty_start;
+      file->dirty_end = offset + chunk > file->dirty_end ? offset + chunk : file->dirty_end;
+    }
+    file->dirty = 1;
+    if (offset + chunk > file->buffer_length) {
+      file->buffer_length = offset + chunk;
+    }
+    file->pos += chunk;
+    done += chunk;
+  }
+  pthread_mutex_unlock(&file->lock);
+  journal_stop();
+  return result;
+}
+
+int my_fputc(my_file *file, Byte *buffer, _u32 num) {
+  unsigned long long start = stats_start(FS_OP_FPUTC);
+  int result = do_my_fputc(file, buffer, num);
+  stats_op(FS_OP_FPUTC, start, result != 0);
+  return result;
+}
+
+/* Closes the file and does any cleanup necessary. The buffered block and 
+the inode are written back first. Returns 0 on success.*/
+static int do_my_fclose(my_file *file) {
+  if (file == NULL) {
+    return -1;
+  }
+  incore_inode *ic = (incore_inode *) file->inode;
+  int result = 0;
+  files_remove(file);
+  if (fd >= 0) {
+    journal_start();
+    pthread_mutex_lock(&file->lock);
+    result = file_writeback(file);
+    pthread_mutex_unlock(&file->lock);
+    if (inode_writeback(ic) < 0 || bitmap_flush() < 0) {
+      result = -1;
+    }
+    journal_stop();
+  }
+  iput(ic);
+  pthread_mutex_destroy(&file->lock);
+  free(file->readahead);
+  free(file->buffer);
+  free(file);
+  return result;
+}
+
+int my_fclose(my_file *file) {
+  unsigned long long start = stats_start(FS_OP_FCLOSE);
+  int result = do_my_fclose(file);
+  stats_op(FS_OP_FCLOSE, start, result != 0);
+  return result;
+}
+
+/*Number of blocks the readahead buffer can hold*/
+static _u32 readahead_capacity(void) {
+  _u32 blocks = RA_MAX_BYTES / fs.rb.block_size;
+  return blocks < RA_MIN_BLOCKS ? RA_MIN_BLOCKS : blocks;
+}
+
+/*Refills the readahead buffer of file with the window of blocks starting 
+at file_block. The window doubles when the read that missed carries on 
+from where the previous one ended, and falls back to RA_MIN_BLOCKS when it 
+doesn't. Mapping the window goes through its indirect block once rather 
+than once per block. Returns 0 on success.*/
+static int readahead_fill(my_file *file, _u32 file_block, int sequential) {
+  _u32 capacity = readahead_capacity();
+  if (file->readahead == NULL) {
+    file->readahead = malloc((size_t) capacity * fs.rb.block_size);
+    if (file->readahead == NULL) {
+      return -1;
+    }
+  }
+  if (!sequential) {
+    file->ra_window = RA_MIN_BLOCKS;
+  } else if (file->ra_count > 0 && file->ra_window < capacity) {
+    file->ra_window = file->ra_window * 2 < capacity ? file->ra_window * 2 : capacity;
+  }
+  // Never read past the end of the file
+  unsigned long long start = (unsigned long long) file_block * fs.rb.block_size;
+  unsigned long long length = (unsigned long long) file->ra_window * fs.rb.block_size;
+  if (start + length > file->inode->size) {
+    length = file->inode->size - start;
+  }
+  file->ra_count = 0;
+  if (inode_read(file->inode, start, file->readahead, length) < 0) {
+    return -1;
+  }
+  file->ra_start = file_block;
+  file->ra_count = (length + fs.rb.block_size - 1) / fs.rb.block_size;
+  file->ra_generation = ((incore_inode *) file->inode)->generation;
+  return 0;
+}
+
+/*Copies num bytes at the position of file into buffer, going through the 
+readahead buffer. The caller holds the handle and inode locks. Returns 0 
+on success.*/
+static int readahead_read(my_file *file, Byte *buffer, _u32 num) {
+  incore_inode *ic = (incore_inode *) file->inode;
+  _u32 block_size = fs.rb.block_size;
+  // Anything written since the buffer was filled makes it stale
+  if (file->ra_generation != ic->generation) {
+    file->ra_count = 0;
+  }
+  int sequential = file->pos == file->ra_next;
+  _u32 done = 0;
+  while (done < num) {
+    _u32 pos = file->pos + done;
+    _u32 file_block = pos / block_size;
+    if (file_block >= file->ra_start && file_block < file->ra_start + file->ra_count) {
+      // Copy what the buffer holds from pos on
+      _u32 offset = pos - file->ra_start * block_size;
+      _u32 chunk = file->ra_count * block_size - offset;
+      if (chunk > num - done) {
+        chunk = num - done;
+      }
+      memcpy(buffer + done, file->readahead + offset, chunk);
+      done += chunk;
+    } else if (num - done >= readahead_capacity() * block_size) {
+      // A read this large gains nothing from the buffer
+      if (inode_read(file->inode, pos, buffer + done, num - done) < 0) {
+        return -1;
+      }
+      done = num;
+    } else if (readahead_fill(file, file_block, sequential) < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*reads num bytes from file into buffer. Returns 0 on success. The bytes 
+this handle has changed in its block buffer are copied from there, so 
+reads need not write the buffer back.*/
+static int do_my_fgetc(my_file *file, Byte *buffer, _u32 num) {
+  if (fd < 0 || file == NULL) {
+    return -1;
+  }
+  incore_inode *ic = (incore_inode *) file->inode;
+  _u32 block_size = fs.rb.block_size;
+  int result = -1;
+  pthread_mutex_lock(&file->lock);
+  pthread_rwlock_rdlock(&ic->lock);
+  // The end of the file may still be in the block buffer, whose bytes past 
+  // the stored size are all ones this handle wrote
+  unsigned long long block_start = (unsigned long long) file->buffer_block * block_size;
+  _u32 size = file->inode->size;
+  _u32 end = size;
+  if (file->dirty && block_start + file->buffer_length > end) {
+    end = block_start + file->buffer_length;
+  }
+  _u32 stored = file->pos < size ? size - file->pos : 0;
+  if (num <= end - file->pos && readahead_read(file, buffer, num < stored ? num : stored) == 0) {
+    if (file->dirty) {
+      unsigned long long from = block_start + file->dirty_start;
+      unsigned long long to = block_start + file->dirty_end;
+      from = from > file->pos ? from : file->pos;
+      to = to < (unsigned long long) file->pos + num ? to : (unsigned long long) file->pos + num;
+      if (from < to) {
+        memcpy(buffer + (from - file->pos), file->buffer + (from - block_start), to - from);
+      }
+    }
+    file->pos += num;
+    file->ra_next = file->pos;
+    result = 0;
+  }
+  pthread_rwlock_unlock(&ic->lock);
+  pthread_mutex_unlock(&file->lock);
+  return result;
+}
+
+int my_fgetc(my_file *file, Byte *buffer, _u32 num) {
+  unsigned long long start = stats_start(FS_OP_FGETC);
+  int result = do_my_fgetc(file, buffer, num);
+  stats_op(FS_OP_FGETC, start, result != 0);
+  return result;
+}
+
+/*sets the current position for reading/writing to pos within the file. Returns 0 on success.*/
+static int do_my_fseek(my_file *file, _u32 pos) {
+  if (file == NULL) {
+    return -1;
+  }
+  if (fd < 0) {
+    return -1;
+  }
+  incore_inode *ic = (incore_inode *) file->inode;
+  int result = -1;
+  pthread_mutex_lock(&file->lock);
+  pthread_rwlock_rdlock(&ic->lock);
+  // Seeking to the end is allowed so that the file can be appended to. 
+  // The end may still be in the block buffer.
+  _u32 size = file->inode->size;
+  if (file->dirty && file->buffer_block * fs.rb.block_size + file->buffer_length > size) {
+    size = file->buffer_block * fs.rb.block_size + file->buffer_length;
+  }
+  if (pos <= size) {
+    file->pos = pos;
+    result = 0;
+  }
+  pthread_rwlock_unlock(&ic->lock);
+  pthread_mutex_unlock(&file->lock);
+  return result;
+}
+
+int my_fseek(my_file *file, _u32 pos) {
+  unsigned long long start = stats_start(FS_OP_FSEEK);
+  int result = do_my_fseek(file, pos);
+  stats_op(FS_OP_FSEEK, start, result != 0);
+  return result;
+}
+
+/* Makes a directory. name is either a full path (if it begins with '/', 
+or a relative path with regards to the current location in the file system. 
+All entries except the last must already exist. Returns 0 on success.*/
+static int do_mkdir(char *name) {
+  if (fd < 0) {
+    return -1;
+  }
+  char last[256];
+  Byte type;
+  _u32 parent = resolve_path(name, last, &type);
+  dir_index *dir = parent == (_u32) -1 ? NULL : dir_get(parent);
+  if (dir == NULL || strcmp(last, ".") == 0 || strcmp(last, "..") == 0) {
+    return -1;
+  }
+  journal_start();
+  pthread_rwlock_wrlock(&dir->lock);
+  // Check that the name isn't taken already
+  if (dir_lookup(dir, last) != NULL) {
+    pthread_rwlock_unlock(&dir->lock);
+    journal_stop();
+    return -1;
+  }
+  // Every directory starts with '.' and '..', which are in place before
+  // the directory can be reached from its parent
+  inode_t inode;
+  _u32 inode_num = create_inode(&inode, parent, 'D');
+  if (inode_num != (_u32) -1) {
+    // A removed directory that had the inode leaves its index behind
+    dir_forget(inode_num);
+  }
+  dir_index *new_dir = inode_num == (_u32) -1 ? NULL : dir_get(inode_num);
+  int result = -1;
+  if (new_dir != NULL && dir_add(new_dir, ".", inode_num, 'D') == 0 && dir_add(new_dir, "..", parent, 'D') == 0) {
+    inode = new_dir->inode;
+    result = link_inode(dir, last, 'D', inode_num, &inode);
+  }
+  pthread_rwlock_unlock(&dir->lock);
+  journal_stop();
+  return result;
+}
+
+int mkdir(char *name) {
+  unsigned long long start = stats_start(FS_OP_MKDIR);
+  int result = do_mkdir(name);
+  stats_op(FS_OP_MKDIR, start, result != 0);
+  return result;
+}
+
+// Finds the first free inode at or after the hint. The caller holds alloc_lock.
+static _u32 find_free_inode(void) {
+  if (fd < 0 || fs.inode_map == NULL) {
+    return -1;
+  }
+  // Everything below the hint is known to be in use
+  for (_u32 word = fs.inode_hint / 64; word * 64 < fs.num_inodes; word++) {
+    uint64_t free_bits = ~fs.inode_map[word];
+    if (word == fs.inode_hint / 64) {
+      free_bits &= ~(uint64_t) 0 << (fs.inode_hint % 64);
+    }
+    if (free_bits != 0) {
+      _u32 index = word * 64 + __builtin_ctzll(free_bits);
+      if (index >= fs.num_inodes) {
+        break;
+      }
+      fs.inode_hint = index;
+      return index;
+    }
+  }
+  fs.inode_hint = fs.num_inodes;
+  return -1;
+}
+
+/*Returns the block just past the last one of group*/
+static _u32 group_block_end(_u32 group) {
+  unsigned long long end = (unsigned long long) (group + 1) * fs.blocks_per_group;
+  return end < fs.rb.num_blocks ? end : fs.rb.num_blocks;
+}
+
+/*Returns the first inode of group, which is num_inodes for a group past 
+the end of the inode table*/
+static _u32 group_inode_start(_u32 group) {
+  unsigned long long start = (unsigned long long) group * fs.inodes_per_group;
+  return start < fs.num_inodes ? start : fs.num_inodes;
+}
+
+/*Returns the block the data of inode inode_num is best placed near: the 
+first block of its group that lies in the data area.*/
+static _u32 inode_goal(_u32 inode_num) {
+  _u32 goal = inode_num / fs.inodes_per_group * fs.blocks_per_group;
+  return goal < fs.data_start ? fs.data_start : goal;
+}
+
+/*Finds the first free inode of group. The caller holds alloc_lock. 
+Returns its index or -1 if the group is full.*/
+static _u32 group_find_free_inode(_u32 group) {
+  _u32 end = group_inode_start(group + 1);
+  for (_u32 index = group_inode_start(group); index < end; index = (index / 64 + 1) * 64) {
+    uint64_t free_bits = ~fs.inode_map[index / 64] & (~(uint64_t) 0 << (index % 64));
+    if (free_bits != 0) {
+      _u32 found = (index / 64) * 64 + __builtin_ctzll(free_bits);
+      return found < end ? found : (_u32) -1;
+    }
+  }
+  return -1;
+}
+
+/*Returns whether the inode table slice of group has been initialised, at 
+least in part, so that an inode in it costs no zeroing of the table*/
+static int group_itable_ready(_u32 group) {
+  return fs.inode_table_start + group_inode_start(group) / fs.inodes_per_block < itable_end();
+}
+
+/*Picks the group for a new entry of directory parent. A new directory 
+goes to the group with the most free blocks among those with at least the 
+average number of free inodes, so that directories, and the files that 
+follow them, spread over the disk. Groups whose part of a lazily 
+initialised inode table hasn't been reached yet are left out, as the table 
+would have to be zeroed up to them. Anything else stays in its directory's 
+group while that has room, or else takes the next group that does. Ties go 
+to the group nearest the parent's. The caller holds alloc_lock. Returns the 
+group or -1 if no inode is free.*/
+static _u32 group_choose(_u32 parent, Byte type) {
+  _u32 home = parent / fs.inodes_per_group;
+  if (type == 'D') {
+    _u32 average = fs.free_inodes / fs.num_groups;
+    _u32 best = -1;
+    for (_u32 i = 0; i < fs.num_groups; i++) {
+      group_desc *group = &fs.groups[(home + i) % fs.num_groups];
+      if (group->free_inodes > 0 && group->free_inodes >= average && group_itable_ready((home + i) % fs.num_groups)
+          && (best == (_u32) -1 || group->free_blocks > fs.groups[best].free_blocks)) {
+        best = (home + i) % fs.num_groups;
+      }
+    }
+    if (best != (_u32) -1) {
+      return best;
+    }
+  }
+  // A group with free inodes but no free blocks will do when nothing else has room
+  for (int full = 0; full < 2; full++) {
+    for (_u32 i = 0; i < fs.num_groups; i++) {
+      group_desc *group = &fs.groups[(home + i) % fs.num_groups];
+      if (group->free_inodes > 0 && (full || group->free_blocks > 0)) {
+        return (home + i) % fs.num_groups;
+      }
+    }
+  }
+  return -1;
+}
+
+/*Reserves an inode for a new entry of type type in directory parent, in 
+the group group_choose() picks. Returns its index or -1 if none is free.*/
+static _u32 allocate_inode_near(_u32 parent, Byte type) {
+  pthread_mutex_lock(&alloc_lock);
+  _u32 index = -1;
+  if (fd >= 0 && fs.inode_map != NULL && fs.groups != NULL) {
+    _u32 group = group_choose(parent, type);
+    index = group == (_u32) -1 ? (_u32) -1 : group_find_free_inode(group);
+  }
+  if (index != (_u32) -1) {
+    inode_map_set(index, 1);
+  }
+  pthread_mutex_unlock(&alloc_lock);
+  return index;
+}
+
+// Gets index of the first free inode or -1 on error.
+_u32 get_first_free_inode() {
+  pthread_mutex_lock(&alloc_lock);
+  _u32 index = find_free_inode();
+  pthread_mutex_unlock(&alloc_lock);
+  return index;
+}
+
+// Reserves the first free inode and returns its index, or -1 if there is none.
+_u32 allocate_inode() {
+  pthread_mutex_lock(&alloc_lock);
+  _u32 index = find_free_inode();
+  if (index != (_u32) -1) {
+    inode_map_set(index, 1);
+  }
+  pthread_mutex_unlock(&alloc_lock);
+  return index;
+}
+
+// Clears inode index on disk and returns it to the free inodes.
+int free_inode(_u32 index) {
+  _u32 empty[8] = {0};
+  return write_inode(index, empty);
+}
+
+// Reads inode at index in inode table into buffer
+int read_inode(_u32 index, _u32 *buffer) {
+  if (fd < 0) {
+    return -1;
+  }
+  // index is out of bounds
+  if (index >= fs.num_inodes) {
+    return -1;
+  }
+  trace_access(index, 1, FS_TRACE_INODE_READ);
+  _u32 block_index = fs.inode_table_start + index / fs.inodes_per_block;
+  _u32 offset = (index % fs.inodes_per_block) * sizeof(inode_t);
+  // Inodes in the uninitialised part of the table are all free
+  if (block_index >= itable_end()) {
+    memset(buffer, 0, sizeof(inode_t));
+    return 0;
+  }
+  // With the image mapped, an inode that isn't buffered is read in place
+  if (fs.map != NULL && !cache_holds(block_index)) {
+    trace_access(block_index, 1, FS_TRACE_READ);
+    memcpy(buffer, mapped_block(block_index) + offset, sizeof(inode_t));
+    return 0;
   }
-  fp = fopen(diskname, "r+");
-  if (fp == NULL) {
+  Byte block[fs.rb.block_size];
+  if (read_block(block_index, block) < 0) {
     return -1;
   }
-  fseek(fp, 0, SEEK_SET);
+  memcpy(buffer, block + offset, sizeof(inode_t));
   return 0;
 }
 
-/*Returns the rootblock or NULL on failure*/
-rootblock_t * get_rootblock() {
-  if (fp == NULL) {
-    return NULL;
+ // Writes inode to index in inode table
+int write_inode(_u32 index, _u32 *buffer) {
+  if (fd < 0) {
+    return -1;
   }
-  fseek(fp, 0, SEEK_SET);
-  rootblock_t * rb = malloc(sizeof(rootblock_t));
-  _u32 buffer[4];
-  if (fread(buffer, sizeof(_u32), 4, fp) < 0) {
-    free(rb);
-    return NULL;
+  // index is out of bounds
+  if (index >= fs.num_inodes) {
+    return -1;
+  }
+  trace_access(index, 1, FS_TRACE_INODE_WRITE);
+  // Inodes share a block, so update it in place through the block layer
+  _u32 block_index = fs.inode_table_start + index / fs.inodes_per_block;
+  _u32 offset = (index % fs.inodes_per_block) * sizeof(inode_t);
+  if (block_index >= itable_end() && itable_init(block_index) < 0) {
+    return -1;
+  }
+  if (fs.map != NULL && cache.capacity == 0) {
+    // Write-through on a mapped image: store the inode in place
+    trace_access(block_index, 1, FS_TRACE_WRITE);
+    memcpy(mapped_block(block_index) + offset, buffer, sizeof(inode_t));
+  } else {
+    pthread_mutex_t *lock = &itable_locks[block_index % ITABLE_LOCKS];
+    Byte block[fs.rb.block_size];
+    meta_begin();
+    pthread_mutex_lock(lock);
+    int result = read_block(block_index, block);
+    if (result == 0) {
+      memcpy(block + offset, buffer, sizeof(inode_t));
+      result = write_block(block_index, block);
+    }
+    pthread_mutex_unlock(lock);
+    meta_end();
+    if (result < 0) {
+      return -1;
+    }
   }
-  rb->block_size = buffer[0];
-  rb->num_blocks = buffer[1];
-  rb->num_free_bitmap_blocks = buffer[2];
-  rb->num_inode_table_blocks = buffer[3];
-  return rb;
+  // An inode is free exactly when all of its fields are zero
+  int used = 0;
+  for (int i = 0; i < 8; i++) {
+    used |= buffer[i] != 0;
+  }
+  pthread_mutex_lock(&alloc_lock);
+  inode_map_set(index, used);
+  pthread_mutex_unlock(&alloc_lock);
+  return 0;
 }
 
-/*Read a disk block from index, writing it to buffer. 
-Returns 0 on success, a negative number on error.*/
-int read_block(_u32 index, Byte *buffer) {
-  rootblock_t * rb = get_rootblock();
-  if (fp == NULL || rb == NULL) {
+/*Returns the block just past the initialised part of the inode table*/
+static _u32 itable_end(void) {
+  return fs.data_start - __atomic_load_n(&fs.rb.num_uninit_inode_table_blocks, __ATOMIC_ACQUIRE);
+}
+
+/*Initialises the inode table up to and including block_index by writing 
+zeros, then records the new boundary in the rootblock. Inodes are handed 
+out lowest first within each group, so the table is initialised from the 
+front up to the last group in use. Returns 0 on 
+success, -1 on error.*/
+static int itable_init(_u32 block_index) {
+  int result = 0;
+  meta_begin();
+  pthread_mutex_lock(&alloc_lock);
+  _u32 first = itable_end();
+  if (block_index >= first) {
+    _u32 count = block_index + 1 - first;
+    Byte *zeros = calloc(count, fs.rb.block_size);
+    Byte rootblock[fs.rb.block_size];
+    memset(rootblock, 0, fs.rb.block_size);
+    rootblock_t rb = fs.rb;
+    rb.num_uninit_inode_table_blocks -= count;
+    memcpy(rootblock, &rb, sizeof(rootblock_t));
+    // The zeroed blocks reach the disk before the rootblock that covers them
+    if (zeros == NULL || write_block_run(first, count, zeros) < 0 || write_block(0, rootblock) < 0) {
+      result = -1;
+    } else {
+      __atomic_store_n(&fs.rb.num_uninit_inode_table_blocks, rb.num_uninit_inode_table_blocks, __ATOMIC_RELEASE);
+    }
+    free(zeros);
+  }
+  pthread_mutex_unlock(&alloc_lock);
+  meta_end();
+  return result;
+}
+
+/*Sets up an inode allocation map with every inode free. 
+Returns 0 on success, -1 on error.*/
+static int inode_map_init(void) {
+  fs.inode_map = calloc((fs.num_inodes + 63) / 64, sizeof(uint64_t));
+  if (fs.inode_map == NULL) {
     return -1;
   }
-  if (index >= rb->num_blocks) {
-    free(rb);
+  fs.free_inodes = fs.num_inodes;
+  fs.inode_hint = 0;
+  for (_u32 group = 0; fs.groups != NULL && group < fs.num_groups; group++) {
+    fs.groups[group].free_inodes = group_inode_start(group + 1) - group_inode_start(group);
+  }
+  return 0;
+}
+
+/*Builds the inode allocation map with a single pass over the inode table. 
+Returns 0 on success, -1 on error.*/
+static int inode_map_load(void) {
+  if (inode_map_init() < 0) {
     return -1;
   }
-  fseek(fp, index * rb->block_size, SEEK_SET);
-  // Read full block
-  if (fread(buffer, sizeof(Byte), rb->block_size, fp) < 0) {
-    free(rb);
+  // Only the initialised part of the inode table has to be read. It is 
+  // read in batches of TRANSFER_RUN blocks.
+  _u32 num_blocks = itable_end() - fs.inode_table_start;
+  Byte *buffer = malloc((size_t) TRANSFER_RUN * fs.rb.block_size);
+  block_request_t requests[TRANSFER_RUN];
+  if (buffer == NULL) {
+    inode_map_destroy();
     return -1;
   }
-  free(rb);
+  for (_u32 first = 0; first < num_blocks; first += TRANSFER_RUN) {
+    _u32 count = num_blocks - first < TRANSFER_RUN ? num_blocks - first : TRANSFER_RUN;
+    for (_u32 i = 0; i < count; i++) {
+      requests[i].index = fs.inode_table_start + first + i;
+      requests[i].buffer = buffer + (size_t) i * fs.rb.block_size;
+    }
+    if (read_blocks(requests, count) < 0) {
+      free(buffer);
+      inode_map_destroy();
+      return -1;
+    }
+    for (_u32 j = 0; j < count * fs.inodes_per_block; j++) {
+      _u32 *inode = (_u32 *) (buffer + j * sizeof(inode_t));
+      for (int k = 0; k < 8; k++) {
+        if (inode[k] != 0) {
+          inode_map_set(first * fs.inodes_per_block + j, 1);
+          break;
+        }
+      }
+    }
+  }
+  free(buffer);
   return 0;
 }
 
-/*Write a disk block, filling it with content at index. content should be 
-the same size as the block size. Returns 0 on success, a negative number on error*/
-int write_block(_u32 index, Byte *content) {
-  rootblock_t * rb = get_rootblock();
-  if (fp == NULL || rb == NULL) {
+/*Marks inode index as used or free, keeping the free count and the 
+next-free hint up to date.*/
+static void inode_map_set(_u32 index, int used) {
+  if (fs.inode_map == NULL) {
+    return;
+  }
+  uint64_t bit = (uint64_t) 1 << (index % 64);
+  int was_used = (fs.inode_map[index / 64] & bit) != 0;
+  if (used && !was_used) {
+    fs.inode_map[index / 64] |= bit;
+    fs.free_inodes--;
+    if (fs.groups != NULL) {
+      fs.groups[index / fs.inodes_per_group].free_inodes--;
+    }
+  } else if (!used && was_used) {
+    fs.inode_map[index / 64] &= ~bit;
+    fs.free_inodes++;
+    if (fs.groups != NULL) {
+      fs.groups[index / fs.inodes_per_group].free_inodes++;
+    }
+    if (index < fs.inode_hint) {
+      fs.inode_hint = index;
+    }
+  }
+}
+
+static void inode_map_destroy(void) {
+  free(fs.inode_map);
+  fs.inode_map = NULL;
+}
+
+/*Given a decimal number 0 <= b <= 255, calculate the 
+number of 1's if this number is converted to binary.*/
+int get_positive_bits(Byte b) {
+  return __builtin_popcount(b);
+}
+
+/*Sets up an empty in-memory free bitmap, held as 64-bit words. 
+Returns 0 on success, -1 on error.*/
+static int bitmap_init(void) {
+  _u32 bitmap_bytes = fs.rb.num_free_bitmap_blocks * fs.rb.block_size;
+  fs.bitmap_words = (bitmap_bytes + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+  fs.bitmap = calloc(fs.bitmap_words, sizeof(uint64_t));
+  fs.bitmap_dirty = calloc(fs.rb.num_free_bitmap_blocks, sizeof(Byte));
+  fs.directory_blocks = calloc(fs.bitmap_words, sizeof(uint64_t));
+  fs.groups = calloc(fs.num_groups, sizeof(group_desc));
+  if (fs.bitmap == NULL || fs.bitmap_dirty == NULL || fs.directory_blocks == NULL || fs.groups == NULL) {
+    bitmap_destroy();
+    return -1;
+  }
+  fs.free_blocks = fs.rb.num_blocks;
+  for (_u32 group = 0; group < fs.num_groups; group++) {
+    fs.groups[group].free_blocks = group_block_end(group) - group * fs.blocks_per_group;
+  }
+  // The root directory's first block, the rest are found as they are used
+  fs.directory_blocks[fs.data_start / 64] |= 1ull << (fs.data_start % 64);
+  return 0;
+}
+
+/*Reads the free bitmap into memory and counts the free blocks. Bit i of 
+the bitmap is bit i % 8 of byte i / 8, so on a little-endian host the 
+bytes can be copied straight into the words. Returns 0 on success, -1 on error.*/
+static int bitmap_load(void) {
+  if (bitmap_init() < 0) {
     return -1;
   }
-  if (index >= rb->num_blocks) {
-    free(rb);
+  Byte *bytes = (Byte *) fs.bitmap;
+  block_request_t *requests = malloc(fs.rb.num_free_bitmap_blocks * sizeof(block_request_t));
+  if (requests == NULL) {
+    bitmap_destroy();
     return -1;
   }
-  fseek(fp, index * rb->block_size, SEEK_SET);
-  // Write full block
-  if (fwrite(content, sizeof(Byte), rb->block_size, fp) < 0) {
-    free(rb);
+  for (_u32 i = 0; i < fs.rb.num_free_bitmap_blocks; i++) {
+    requests[i].index = fs.bitmap_start + i;
+    requests[i].buffer = bytes + (size_t) i * fs.rb.block_size;
+  }
+  int result = read_blocks(requests, fs.rb.num_free_bitmap_blocks);
+  free(requests);
+  if (result < 0) {
+    bitmap_destroy();
     return -1;
   }
-  free(rb);
+  _u32 used = 0;
+  for (_u32 i = 0; i < fs.bitmap_words; i++) {
+    used += __builtin_popcountll(fs.bitmap[i]);
+  }
+  fs.free_blocks = fs.rb.num_blocks - used;
+  for (_u32 group = 0; group < fs.num_groups; group++) {
+    fs.groups[group].free_blocks -= bitmap_count_used(group * fs.blocks_per_group, group_block_end(group));
+  }
   return 0;
 }
 
-/*Returns the number of free blocks on the disk or -1 on failure.*/
-_u32 num_free_blocks() {
-  rootblock_t * rb = get_rootblock();
-  if (fp == NULL || rb == NULL) {
-    return -1;
+/*Returns the number of used blocks from start up to end, counted a word 
+at a time*/
+static _u32 bitmap_count_used(_u32 start, _u32 end) {
+  _u32 used = 0;
+  while (start < end) {
+    uint64_t bits = fs.bitmap[start / 64] >> (start % 64);
+    _u32 span = 64 - start % 64;
+    if (end - start < span) {
+      span = end - start;
+      bits &= ((uint64_t) 1 << span) - 1;
+    }
+    used += __builtin_popcountll(bits);
+    start += span;
   }
-  _u32 free_blocks = rb->num_blocks;
-  // Iterate through free bitmap blocks
-  for (int i = 1; i < (rb->num_free_bitmap_blocks + 1); i++) {
-    Byte buffer[rb->block_size];
-    if (read_block(i, buffer) < 0) {
-      free(rb);
-      return -1;
+  return used;
+}
+
+static void bitmap_destroy(void) {
+  free(fs.bitmap);
+  free(fs.bitmap_dirty);
+  free(fs.directory_blocks);
+  free(fs.groups);
+  free(fs.deferred);
+  fs.bitmap = NULL;
+  fs.bitmap_dirty = NULL;
+  fs.directory_blocks = NULL;
+  fs.groups = NULL;
+}
+
+/*Writes back those of the num_blocks blocks held in bytes, which belong 
+at start on the disk, that dirty flags, and clears their flags. The caller 
+holds alloc_lock and has begun a metadata write. Returns 0 on success, -1 
+on error.*/
+static int write_dirty_locked(_u32 start, _u32 num_blocks, Byte *bytes, Byte *dirty) {
+  int result = 0;
+  // The dirty blocks go out as one batch, so neighbours share a write
+  block_request_t requests[TRANSFER_RUN];
+  _u32 count = 0;
+  for (_u32 i = 0; result == 0 && i < num_blocks; i++) {
+    if (dirty[i]) {
+      requests[count].index = start + i;
+      requests[count].buffer = bytes + (size_t) i * fs.rb.block_size;
+      count++;
     }
-    // Iterate through each byte of a single block
-    for (int j = 0; j < rb->block_size; j++) {
-      if (buffer[j] != 0) {
-        free_blocks -= get_positive_bits(buffer[j]);
+    if (count == TRANSFER_RUN || (count > 0 && i + 1 == num_blocks)) {
+      result = write_blocks(requests, count);
+      for (_u32 j = 0; result == 0 && j < count; j++) {
+        dirty[requests[j].index - start] = 0;
       }
+      count = 0;
     }
   }
-  // free(rb);
-  return free_blocks;
+  return result;
 }
 
-/*Returns the number of free inodes on the disk or -1 on failure.*/
-_u32 num_free_inodes() {
-  rootblock_t * rb = get_rootblock();
-  if (fp == NULL || rb == NULL) {
-    return -1;
-  }
-  _u32 free_inodes = rb->num_inode_table_blocks * (rb->block_size / 32);
-  // Iterate through inode blocks
-  for (int i = rb->num_free_bitmap_blocks + 1; i < (1 + rb->num_free_bitmap_blocks + rb->num_inode_table_blocks); i++) {
-    Byte buffer[rb->block_size];
-    int num_inodes_per_block = free_inodes / rb->num_inode_table_blocks;
-    // Read num_inodes_per_block inodes into buffer
-    if (read_block(i, buffer) < 0) {
-      free(rb);
-      return -1;
-    }
-    // Iterate through each inode in current block
-    for (int j = 0; j < num_inodes_per_block; j++) {
-      // flag = 1 means inode is free, 0 occupied
-      int flag = 1;
-      // Check all entries of each inode
-      for (int k = 0; k < sizeof(inode_t); k++) {
-        if (buffer[j*sizeof(inode_t)+k] != 0) {
-          flag = 0;
-          break;
-        }
-      }
-      if (flag != 1) {
-        free_inodes -= 1;
-      }
+/*Writes back only the bitmap and refcount table blocks that changed since 
+the last flush. Returns 0 on success, -1 on error.*/
+static int bitmap_flush(void) {
+  if (fs.bitmap == NULL) {
+    return 0;
+  }
+  pthread_mutex_lock(&alloc_lock);
+  meta_begin();
+  int result = write_dirty_locked(fs.bitmap_start, fs.rb.num_free_bitmap_blocks, (Byte *) fs.bitmap, fs.bitmap_dirty);
+  if (result == 0) {
+    result = refcount_flush_locked();
+  }
+  meta_end();
+  pthread_mutex_unlock(&alloc_lock);
+  return result;
+}
+
+static int bitmap_test(_u32 index) {
+  return (fs.bitmap[index / 64] >> (index % 64)) & 1;
+}
+
+/*Marks block index as used and its bitmap block as dirty*/
+static void bitmap_set(_u32 index) {
+  if (!bitmap_test(index)) {
+    fs.bitmap[index / 64] |= (uint64_t) 1 << (index % 64);
+    fs.bitmap_dirty[index / (fs.rb.block_size * 8)] = 1;
+    fs.free_blocks--;
+    fs.groups[index / fs.blocks_per_group].free_blocks--;
+  }
+}
+
+/*Marks block index as free and its bitmap block as dirty*/
+static void bitmap_clear(_u32 index) {
+  if (bitmap_test(index)) {
+    fs.bitmap[index / 64] &= ~((uint64_t) 1 << (index % 64));
+    fs.bitmap_dirty[index / (fs.rb.block_size * 8)] = 1;
+    fs.free_blocks++;
+    fs.groups[index / fs.blocks_per_group].free_blocks++;
+  }
+}
+
+/*Returns the first free block at or after start and before end, 
+or end if there is none. Whole words of used blocks are skipped at once.*/
+static _u32 bitmap_find_free(_u32 start, _u32 end) {
+  while (start < end) {
+    uint64_t free_bits = ~fs.bitmap[start / 64] & (~(uint64_t) 0 << (start % 64));
+    if (free_bits != 0) {
+      _u32 found = (start / 64) * 64 + __builtin_ctzll(free_bits);
+      return found < end ? found : end;
     }
+    start = (start / 64 + 1) * 64;
   }
-  // free(rb);
-  return free_inodes;
+  return end;
 }
 
-/*Unloads the loaded file system. Returns 0 on success.*/
-int unload(void) {
-  if (fp == NULL) {
+/*Returns the number of free blocks in the run starting at start, 
+looking at no more than max blocks.*/
+static _u32 bitmap_free_run(_u32 start, _u32 max) {
+  _u32 run = 0;
+  while (run < max && start + run < fs.rb.num_blocks) {
+    _u32 bit = start + run;
+    uint64_t used_bits = fs.bitmap[bit / 64] >> (bit % 64);
+    _u32 span = used_bits != 0 ? (_u32) __builtin_ctzll(used_bits) : 64 - bit % 64;
+    run += span;
+    if (used_bits != 0) {
+      break;
+    }
+  }
+  if (run > max) {
+    run = max;
+  }
+  if (start + run > fs.rb.num_blocks) {
+    run = fs.rb.num_blocks - start;
+  }
+  return run;
+}
+
+/*Allocates up to count contiguous blocks, searching from goal and wrapping 
+around to the start of the data area. The length of the run actually taken 
+is stored in allocated. Returns the first block of the run, or -1 if the 
+disk is full. The changed bitmap blocks are written by bitmap_flush().*/
+_u32 allocate_blocks(_u32 goal, _u32 count, _u32 *allocated) {
+  if (fd < 0 || fs.bitmap == NULL || count == 0) {
     return -1;
   }
-  if (fclose(fp) < 0) {
+  if (goal < fs.data_start || goal >= fs.rb.num_blocks) {
+    goal = fs.data_start;
+  }
+  pthread_mutex_lock(&alloc_lock);
+  if (fs.free_blocks == 0) {
+    pthread_mutex_unlock(&alloc_lock);
     return -1;
   }
-  fp = NULL;
-  return 0;
+  _u32 first = bitmap_find_free(goal, fs.rb.num_blocks);
+  if (first == fs.rb.num_blocks) {
+    first = bitmap_find_free(fs.data_start, goal);
+    if (first == goal) {
+      pthread_mutex_unlock(&alloc_lock);
+      return -1;
+    }
+  }
+  _u32 run = bitmap_free_run(first, count);
+  for (_u32 i = 0; i < run; i++) {
+    bitmap_set(first + i);
+    // Whatever used the block before, it is not part of a directory until one writes it
+    __atomic_fetch_and(&fs.directory_blocks[(first + i) / 64], ~(1ull << ((first + i) % 64)), __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&alloc_lock);
+  if (allocated != NULL) {
+    *allocated = run;
+  }
+  return first;
 }
 
-/*Formats the disk creating appropriate root blocks, free bitmap blocks, 
-inode blocks and root directory. returns 0 on success, a negative number on error*/
-int format(char *diskname, _u32 block_size, _u32 num_blocks, _u32 num_inodes) {
-  // Rootblock doesn't fit into block
-  if (block_size < sizeof(rootblock_t)) {
+/*Allocates a single block, preferring goal. Returns the block or -1 if the disk is full.*/
+_u32 allocate_block(_u32 goal) {
+  return allocate_blocks(goal, 1, NULL);
+}
+
+/*Returns a block to the free bitmap. Returns 0 on success, -1 on error.*/
+int free_block(_u32 index) {
+  if (fd < 0 || fs.bitmap == NULL || index < fs.data_start || index >= fs.rb.num_blocks) {
     return -1;
   }
-  fp = fopen(diskname, "wb");
-  if (fp == NULL) {
-    return -1;
+  pthread_mutex_lock(&alloc_lock);
+  bitmap_clear(index);
+  pthread_mutex_unlock(&alloc_lock);
+  return 0;
+}
+
+/************************ SHARED BLOCKS ************************/
+
+/*cp() shares the blocks of a file with the copy instead of copying them. 
+The refcount table holds a count for every block of the owners it has 
+besides the first, so a block that belongs to one file counts 0. Copying 
+a file only counts the blocks its inode points at: the blocks behind a 
+shared indirect block are counted once that block is copied itself, which 
+bmap() does from the top down before anything below it is written. The 
+table is guarded by alloc_lock and written back by bitmap_flush().*/
+
+/*Returns the number of owners block index has besides the first*/
+static uint16_t refcount_get(_u32 index) {
+  uint16_t *counts = __atomic_load_n(&fs.refcounts, __ATOMIC_ACQUIRE);
+  return counts == NULL ? 0 : __atomic_load_n(&counts[index], __ATOMIC_RELAXED);
+}
+
+/*Adds delta to the count of block index and marks its table block as 
+dirty. The caller holds alloc_lock.*/
+static void refcount_change_locked(_u32 index, int delta) {
+  __atomic_store_n(&fs.refcounts[index], fs.refcounts[index] + delta, __ATOMIC_RELAXED);
+  fs.refcount_dirty[(size_t) index * sizeof(uint16_t) / fs.rb.block_size] = 1;
+}
+
+/*Reads the refcount table of a disk that has one, with a single read. 
+Returns 0 on success, -1 on error.*/
+static int refcount_load(void) {
+  if (fs.rb.refcount_blocks == 0) {
+    return 0;
   }
-  // Create rootblock
-  rootblock_t * rb = malloc(sizeof(rootblock_t));
-  rb->block_size = block_size;
-  rb->num_blocks = num_blocks;
-  rb->num_free_bitmap_blocks = num_blocks / block_size / 8;
-  rb->num_inode_table_blocks = num_inodes / (block_size / sizeof(inode_t));
-  // Write rootblock to disk
-  if (fwrite(rb, sizeof(rootblock_t), 1, fp) < 0) {
-    free(rb);
+  uint16_t *counts = malloc((size_t) fs.rb.refcount_blocks * fs.rb.block_size);
+  fs.refcount_dirty = calloc(fs.rb.refcount_blocks, sizeof(Byte));
+  if (counts == NULL || fs.refcount_dirty == NULL
+      || read_block_run(fs.rb.refcount_start, fs.rb.refcount_blocks, (Byte *) counts) < 0) {
+    free(counts);
+    refcount_destroy();
     return -1;
   }
-  // Create buffer that will hold trailing zeros for rootblock
-  Byte zero_buffer[block_size - sizeof(rootblock_t)];
-  // Allocate 0's
-  for (int i = 0; i < block_size - sizeof(rootblock_t); i++) {
-    zero_buffer[i] = 0;
+  fs.refcounts = counts;
+  return 0;
+}
+
+static void refcount_destroy(void) {
+  free(fs.refcounts);
+  free(fs.refcount_dirty);
+  fs.refcounts = NULL;
+  fs.refcount_dirty = NULL;
+}
+
+/*Writes back the refcount table blocks that changed. The caller holds 
+alloc_lock and has begun a metadata write. Returns 0 on success.*/
+static int refcount_flush_locked(void) {
+  if (fs.refcounts == NULL) {
+    return 0;
+  }
+  return write_dirty_locked(fs.rb.refcount_start, fs.rb.refcount_blocks, (Byte *) fs.refcounts, fs.refcount_dirty);
+}
+
+/*Allocates count contiguous blocks, taking the first free run that is 
+long enough. Returns the first block or -1 if there is no such run.*/
+static _u32 allocate_extent(_u32 count) {
+  _u32 goal = fs.data_start;
+  for (;;) {
+    _u32 run;
+    _u32 first = allocate_blocks(goal, count, &run);
+    if (first == (_u32) -1 || run == count) {
+      return first;
+    }
+    for (_u32 i = 0; i < run; i++) {
+      free_block(first + i);
+    }
+    // allocate_blocks() wraps around once it reaches the end of the disk
+    if (first < goal || first + run >= fs.rb.num_blocks) {
+      return -1;
+    }
+    goal = first + run;
+  }
+}
+
+/*Gives the disk a refcount table, all zeros, the first time a file is 
+copied. It is one run of blocks, so that load() reads it in one go, and is 
+written before the rootblock points at it. Returns 0 on success.*/
+static int refcount_create(void) {
+  pthread_mutex_lock(&refcount_lock);
+  if (fs.refcounts != NULL) {
+    pthread_mutex_unlock(&refcount_lock);
+    return 0;
+  }
+  _u32 block_size = fs.rb.block_size;
+  _u32 blocks = ((size_t) fs.rb.num_blocks * sizeof(uint16_t) + block_size - 1) / block_size;
+  uint16_t *counts = calloc(blocks, block_size);
+  Byte *dirty = calloc(blocks, sizeof(Byte));
+  _u32 start = counts == NULL || dirty == NULL ? (_u32) -1 : allocate_extent(blocks);
+  int result = -1;
+  if (start != (_u32) -1) {
+    meta_begin();
+    result = write_block_run(start, blocks, (Byte *) counts);
+    pthread_mutex_lock(&alloc_lock);
+    if (result == 0) {
+      Byte rootblock[block_size];
+      memset(rootblock, 0, block_size);
+      rootblock_t rb = fs.rb;
+      rb.refcount_start = start;
+      rb.refcount_blocks = blocks;
+      memcpy(rootblock, &rb, sizeof(rootblock_t));
+      result = write_block(0, rootblock);
+    }
+    if (result == 0) {
+      __atomic_store_n(&fs.rb.refcount_start, start, __ATOMIC_RELAXED);
+      __atomic_store_n(&fs.rb.refcount_blocks, blocks, __ATOMIC_RELAXED);
+      fs.refcount_dirty = dirty;
+      __atomic_store_n(&fs.refcounts, counts, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    meta_end();
+  }
+  if (result < 0) {
+    for (_u32 i = 0; start != (_u32) -1 && i < blocks; i++) {
+      free_block(start + i);
+    }
+    free(counts);
+    free(dirty);
+  }
+  pthread_mutex_unlock(&refcount_lock);
+  return result;
+}
+
+/*Returns a block with the contents of block that the file being written 
+owns alone: block itself if nobody shares it, otherwise a copy allocated 
+near goal, in which case block loses an owner. The blocks an indirect 
+block points at gain the copy as an owner. Returns -1 on error.*/
+static _u32 unshare_block(_u32 block, _u32 goal, int indirect) {
+  if (refcount_get(block) == 0) {
+    return block;
   }
-  // Write trailing zeros to rootblock
-  if (fwrite(zero_buffer, sizeof(Byte), block_size - sizeof(rootblock_t), fp) < 0) {
-    free(rb);
+  _u32 per_block = pointers_per_block();
+  _u32 contents[per_block];
+  _u32 copy = allocate_block(goal);
+  if (copy == (_u32) -1) {
     return -1;
   }
-  fclose(fp);
-  fp = fopen(diskname, "ab+");
-  if (fp == NULL) {
-    free(rb);
+  if (read_block(block, (Byte *) contents) < 0) {
+    free_block(copy);
     return -1;
   }
+  if (indirect) {
+    meta_begin();
+  }
+  int result = write_block(copy, (Byte *) contents);
+  if (indirect) {
+    meta_end();
+  }
+  pthread_mutex_lock(&alloc_lock);
+  int overflow = 0;
+  for (_u32 i = 0; indirect && i < per_block; i++) {
+    overflow |= contents[i] != 0 && contents[i] < fs.rb.num_blocks && fs.refcounts[contents[i]] == UINT16_MAX;
+  }
+  // The other owners may have let go of the block meanwhile
+  if (result < 0 || overflow || fs.refcounts[block] == 0) {
+    bitmap_clear(copy);
+    pthread_mutex_unlock(&alloc_lock);
+    return result < 0 || overflow ? (_u32) -1 : block;
+  }
+  for (_u32 i = 0; indirect && i < per_block; i++) {
+    if (contents[i] != 0 && contents[i] < fs.rb.num_blocks) {
+      refcount_change_locked(contents[i], 1);
+    }
+  }
+  refcount_change_locked(block, -1);
+  pthread_mutex_unlock(&alloc_lock);
+  return copy;
+}
+
+/*Adds delta to the counts of the blocks inode points at directly. Adding 
+fails, changing nothing, if a count is at its maximum. The caller holds 
+alloc_lock. Returns 0 on success.*/
+static int refcount_share_locked(inode_t *inode, int delta) {
+  for (int i = 0; delta > 0 && i < 7; i++) {
+    if (inode->blocks[i] != 0 && fs.refcounts[inode->blocks[i]] == UINT16_MAX) {
+      return -1;
+    }
+  }
+  for (int i = 0; i < 7; i++) {
+    if (inode->blocks[i] != 0) {
+      refcount_change_locked(inode->blocks[i], delta);
+    }
+  }
+  return 0;
+}
 
-  // Number of occupied blocks on disk
-  _u32 num_occupied_blocks = 1 + rb->num_free_bitmap_blocks + rb->num_inode_table_blocks + 1; // + 1 for rootblock, + 1 for root dir
-  // Calculate the number of 8 positive-bit (FF) bytes
-  _u32 num_8_bit_blocks = 0;
-  for (int i = 7; i < num_occupied_blocks; i = i + 8) {
-    num_8_bit_blocks += 1;
+/*Copies the data of src into dest, an inode without blocks, for a cp() 
+that can't share them. The blocks taken before an error are added to set. 
+Returns 0 on success.*/
+static int copy_data(inode_t *src, inode_t *dest, release_set *set) {
+  _u32 chunk = TRANSFER_RUN * fs.rb.block_size;
+  Byte *buffer = malloc(chunk);
+  int result = buffer == NULL ? -1 : 0;
+  for (_u32 offset = 0; result == 0 && offset < src->size; offset += chunk) {
+    _u32 num = src->size - offset < chunk ? src->size - offset : chunk;
+    if (inode_read(src, offset, buffer, num) < 0 || inode_write(dest, offset, buffer, num) != num) {
+      result = -1;
+    }
   }
-  _u32 num_occupied_bitmap_blocks = 0; // number of bitmap blocks with at least 1 non-zero entry
-  int num_bits_per_block = block_size * 8; // number of bits per block
-  int current;
-  for (int i = 0; i < rb->num_free_bitmap_blocks; i++) {
-    current = i * num_bits_per_block;
-    if (num_8_bit_blocks > current) {
-      num_occupied_bitmap_blocks++;
+  free(buffer);
+  for (int i = 0; result < 0 && i < 7; i++) {
+    if (dest->blocks[i] != 0) {
+      release_block(set, dest->blocks[i], i < 5 ? 0 : i - 4);
     }
   }
-  // First dealing with non-empty bitmap blocks
-  for (int i = 0; i < num_occupied_bitmap_blocks; i++) {
-    Byte buffer[block_size];
-    for (int j = 0; j < num_8_bit_blocks && j < block_size; j++) {
-      buffer[j] = 255;
+  return result;
+}
+
+/* Copies the file src to dest, which must not exist yet. The new inode 
+points at the blocks of src, whose counts go up by one, so nothing but 
+the inode and the direntry is written whatever the size of the file. 
+Without a refcount table, or with a count at its maximum, the data is 
+copied instead. Returns 0 on success.*/
+static int do_cp(char *src, char *dest) {
+  if (fd < 0) {
+    return -1;
+  }
+  Byte type;
+  _u32 src_num = resolve_path(src, NULL, &type);
+  if (src_num == (_u32) -1 || type != 'F') {
+    return -1;
+  }
+  char last[256];
+  _u32 parent = resolve_path(dest, last, &type);
+  dir_index *dir = parent == (_u32) -1 ? NULL : dir_get(parent);
+  if (dir == NULL || strcmp(last, ".") == 0 || strcmp(last, "..") == 0) {
+    return -1;
+  }
+  journal_start();
+  // What open handles still buffer for src belongs in the copy
+  if (files_flush() < 0) {
+    journal_stop();
+    return -1;
+  }
+  // The table needs a free run of blocks, on a fragmented disk there may be none
+  refcount_create();
+  incore_inode *ic = iget(src_num);
+  if (ic == NULL) {
+    journal_stop();
+    return -1;
+  }
+  int result = -1;
+  release_set set;
+  memset(&set, 0, sizeof(set));
+  pthread_rwlock_wrlock(&dir->lock);
+  // src can't be written, and so can't stop sharing, until the copy is linked
+  pthread_rwlock_wrlock(&ic->lock);
+  inode_t inode = ic->inode;
+  if (dir_lookup(dir, last) == NULL) {
+    pthread_mutex_lock(&alloc_lock);
+    int shared = fs.refcounts == NULL ? -1 : refcount_share_locked(&inode, 1);
+    pthread_mutex_unlock(&alloc_lock);
+    int copied = -1;
+    if (shared < 0) {
+      memset(&inode, 0, sizeof(inode_t));
+      copied = copy_data(&ic->inode, &inode, &set);
     }
-    if (num_occupied_blocks % 8 != 0) {
-      int result = 2;
-      for (int k = 1; k <= num_occupied_blocks % 8; k++) {
-        result *= k;
+    _u32 inode_num = shared < 0 && copied < 0 ? (_u32) -1 : allocate_inode_near(dir->inode_num, 'F');
+    if (inode_num != (_u32) -1 && store_inode(inode_num, &inode) == 0
+        && dir_add(dir, last, inode_num, 'F') == 0) {
+      result = 0;
+    } else {
+      if (inode_num != (_u32) -1) {
+        free_inode(inode_num);
+      }
+      if (shared == 0) {
+        pthread_mutex_lock(&alloc_lock);
+        refcount_share_locked(&inode, -1);
+        pthread_mutex_unlock(&alloc_lock);
+      } else if (copied == 0) {
+        for (int i = 0; i < 7; i++) {
+          if (inode.blocks[i] != 0) {
+            release_block(&set, inode.blocks[i], i < 5 ? 0 : i - 4);
+          }
+        }
       }
-      result -= 1;
-      buffer[num_8_bit_blocks] = result;
     }
-    for (int j = num_8_bit_blocks + 1; j < block_size; j++) {
-      buffer[j] = 0;
+  }
+  pthread_rwlock_unlock(&ic->lock);
+  pthread_rwlock_unlock(&dir->lock);
+  iput(ic);
+  if (bitmap_flush() < 0) {
+    result = -1;
+  }
+  journal_stop();
+  if (release_blocks(&set) < 0) {
+    result = -1;
+  }
+  return result;
+}
+
+int cp(char *src, char *dest) {
+  unsigned long long start = stats_start(FS_OP_CP);
+  int result = do_cp(src, dest);
+  stats_op(FS_OP_CP, start, result != 0);
+  return result;
+}
+
+/************************ MOVING AND REMOVING ************************/
+
+/*Appends value to a growing array. Returns 0 on success.*/
+static int release_push(_u32 **items, _u32 *count, _u32 *capacity, _u32 value) {
+  if (*count == *capacity) {
+    _u32 larger = *capacity == 0 ? 64 : *capacity * 2;
+    _u32 *grown = realloc(*items, larger * sizeof(_u32));
+    if (grown == NULL) {
+      return -1;
     }
-    if (write_block(i + 1, buffer) < 0) {
-      free(rb);
+    *items = grown;
+    *capacity = larger;
+  }
+  (*items)[(*count)++] = value;
+  return 0;
+}
+
+static int compare_u32(const void *a, const void *b) {
+  _u32 x = *(const _u32 *) a;
+  _u32 y = *(const _u32 *) b;
+  return x < y ? -1 : x > y;
+}
+
+/*Drops one owner of block. A block nobody else shares goes into set, and 
+with depth > 0 it is an indirect block whose pointers are released at 
+depth - 1 as well. Returns 0 on success, -1 on error.*/
+static int release_block(release_set *set, _u32 block, int depth) {
+  if (block < fs.data_start || block >= fs.rb.num_blocks) {
+    return 0;
+  }
+  pthread_mutex_lock(&alloc_lock);
+  int shared = fs.refcounts != NULL && fs.refcounts[block] > 0;
+  if (shared) {
+    refcount_change_locked(block, -1);
+  }
+  pthread_mutex_unlock(&alloc_lock);
+  if (shared) {
+    return 0;
+  }
+  if (depth > 0) {
+    _u32 per_block = pointers_per_block();
+    _u32 pointers[per_block];
+    if (read_block(block, (Byte *) pointers) < 0) {
       return -1;
     }
+    for (_u32 i = 0; i < per_block; i++) {
+      if (pointers[i] != 0 && release_block(set, pointers[i], depth - 1) < 0) {
+        return -1;
+      }
+    }
   }
-  int fully_free_blocks = rb->num_free_bitmap_blocks - num_occupied_bitmap_blocks;
-  // Write the remaining free bitmap blocks
-  for (int i = 0; i < fully_free_blocks; i++) {
-    Byte buffer[block_size];
-    for (int j = 0; j < block_size; j++) {
-      buffer[j] = 0;
+  return release_push(&set->blocks, &set->num_blocks, &set->blocks_capacity, block);
+}
+
+/*Clears the inodes of set in the inode table, reading and writing each 
+inode table block once, and adds the blocks they owned alone to set. 
+Returns 0 on success, -1 on error.*/
+static int release_inodes(release_set *set) {
+  qsort(set->inodes, set->num_inodes, sizeof(_u32), compare_u32);
+  Byte block[fs.rb.block_size];
+  inode_t freed[fs.inodes_per_block];
+  int result = 0;
+  for (_u32 i = 0; result == 0 && i < set->num_inodes;) {
+    _u32 block_index = fs.inode_table_start + set->inodes[i] / fs.inodes_per_block;
+    pthread_mutex_t *lock = &itable_locks[block_index % ITABLE_LOCKS];
+    _u32 count = 0;
+    meta_begin();
+    pthread_mutex_lock(lock);
+    result = read_block(block_index, block);
+    for (; result == 0 && i < set->num_inodes
+         && fs.inode_table_start + set->inodes[i] / fs.inodes_per_block == block_index; i++) {
+      _u32 offset = (set->inodes[i] % fs.inodes_per_block) * sizeof(inode_t);
+      trace_access(set->inodes[i], 1, FS_TRACE_INODE_WRITE);
+      memcpy(&freed[count++], block + offset, sizeof(inode_t));
+      memset(block + offset, 0, sizeof(inode_t));
     }
-    if (write_block(i + 1 + num_occupied_bitmap_blocks, buffer) < 0) {
-      free(rb);
-      return -1;
+    if (result == 0) {
+      result = write_block(block_index, block);
+    }
+    pthread_mutex_unlock(lock);
+    meta_end();
+    pthread_mutex_lock(&alloc_lock);
+    for (_u32 j = i - count; result == 0 && j < i; j++) {
+      inode_map_set(set->inodes[j], 0);
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    for (_u32 j = 0; result == 0 && j < count; j++) {
+      for (int k = 0; result == 0 && k < 7; k++) {
+        if (freed[j].blocks[k] != 0) {
+          result = release_block(set, freed[j].blocks[k], k < 5 ? 0 : k - 4);
+        }
+      }
     }
   }
+  return result;
+}
+
+/*Frees the blocks on fs.deferred if the journal has started over since the 
+last of them was freed. The caller holds alloc_lock and cache_lock. Returns 
+whether any were.*/
+static int release_deferred_locked(void) {
+  if (fs.num_deferred == 0 || journal.restarts == fs.deferred_restarts) {
+    return 0;
+  }
+  for (_u32 i = 0; i < fs.num_deferred; i++) {
+    bitmap_clear(fs.deferred[i]);
+  }
+  fs.num_deferred = 0;
+  return 1;
+}
+
+/*Frees the deferred blocks the journal no longer logs and writes the 
+bitmap back. Call outside journal_start() and journal_stop(). Returns 1 if 
+any were freed, 0 if none were and -1 on error.*/
+static int release_deferred(void) {
+  if (journal.blocks == 0) {
+    return 0;
+  }
+  journal_start();
+  pthread_mutex_lock(&alloc_lock);
+  pthread_mutex_lock(&cache_lock);
+  int result = release_deferred_locked();
+  pthread_mutex_unlock(&cache_lock);
+  pthread_mutex_unlock(&alloc_lock);
+  if (result > 0 && bitmap_flush() < 0) {
+    result = -1;
+  }
+  journal_stop();
+  return result;
+}
 
-  // Initializing root directory and '.' with '..'
-  direntry_t curr_dir;
-  curr_dir.inode_num = 0; // 4
-  curr_dir.type = 'D'; // 1
-  curr_dir.name_length = 2; // 1
-  curr_dir.name = ".\0";
+/*Frees the blocks of set in the bitmap, which is then written back with a 
+write per changed bitmap block, and empties set. On a journaled disk a 
+block the journal still holds a copy of could be reused for file data and 
+overwritten by replay, so it stays in use on fs.deferred until the journal 
+starts over. Call outside journal_start() and journal_stop(). Returns 0 on 
+success.*/
+static int release_blocks(release_set *set) {
+  int result = 0;
+  if (set->num_blocks > 0) {
+    qsort(set->blocks, set->num_blocks, sizeof(_u32), compare_u32);
+    journal_start();
+    pthread_mutex_lock(&alloc_lock);
+    if (journal.blocks > 0) {
+      pthread_mutex_lock(&cache_lock);
+      release_deferred_locked();
+    }
+    for (_u32 i = 0; i < set->num_blocks; i++) {
+      _u32 block = set->blocks[i];
+      if (journal.blocks == 0 || !((journal.logged[block / 64] >> (block % 64)) & 1)) {
+        bitmap_clear(block);
+      } else if (release_push(&fs.deferred, &fs.num_deferred, &fs.deferred_capacity, block) < 0) {
+        // Left in use, the block is lost until fsck() finds it
+        result = -1;
+      } else {
+        fs.deferred_restarts = journal.restarts;
+      }
+    }
+    if (journal.blocks > 0) {
+      pthread_mutex_unlock(&cache_lock);
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    if (bitmap_flush() < 0) {
+      result = -1;
+    }
+    journal_stop();
+  }
+  free(set->inodes);
+  free(set->blocks);
+  free(set->directories);
+  memset(set, 0, sizeof(release_set));
+  return result;
+}
 
-  direntry_t parent_dir;
-  parent_dir.inode_num = 0; // 4
-  parent_dir.type = 'D'; // 1
-  parent_dir.name_length = 3; // 1
-  parent_dir.name = "..\0";
+/*Marks the directories of set as removed, drops the dentries under them 
+before their inodes can be reused and empties their indexes. Only the bare 
+index stays, for threads waiting on its lock. The caller holds their write 
+locks.*/
+static void release_directories(release_set *set) {
+  for (_u32 i = 0; i < set->num_directories; i++) {
+    dir_index *dir = dir_get(set->directories[i]);
+    if (dir != NULL) {
+      for (_u32 j = 0; j < dir->num_entries; j++) {
+        dcache_invalidate(dir->inode_num, dir->slots[j].name);
+        free(dir->slots[j].name);
+      }
+      free(dir->slots);
+      free(dir->buckets);
+      free(dir->holes);
+      dir->slots = NULL;
+      dir->buckets = NULL;
+      dir->holes = NULL;
+      dir->num_entries = dir->capacity = dir->num_buckets = dir->num_holes = 0;
+      dir->inode.size = 0;
+      dir->removed = 1;
+      dir->generation++;
+    }
+  }
+}
 
-  direntry_t direntry_array[2];
-  direntry_array[0] = curr_dir;
-  direntry_array[1] = parent_dir;
+/*Releases the write locks held on the directories of set, deepest first. 
+The indexes of removed directories stay in dir_table, so a path resolved 
+before the removal finds nothing there, until mkdir() reuses the inode.*/
+static void release_unlock(release_set *set) {
+  for (_u32 i = set->num_directories; i-- > 0;) {
+    dir_index *dir = dir_get(set->directories[i]);
+    if (dir != NULL) {
+      pthread_rwlock_unlock(&dir->lock);
+    }
+  }
+}
 
-  directory_t root_dir;
-  root_dir.num_entries = 2; // 4
-  root_dir.dir_entries = direntry_array;
-
-  int total_name_len = 0;
-  for (int i = 0; i < root_dir.num_entries; i++) {
-    total_name_len += strlen(root_dir.dir_entries[i].name) + 1;
+/*Returns whether an open file holds inode inode_num*/
+static int inode_is_open(_u32 inode_num) {
+  pthread_mutex_lock(&table_lock);
+  incore_inode *ic = fs.icache[inode_num % ICACHE_SIZE];
+  while (ic != NULL && ic->inode_num != inode_num) {
+    ic = ic->next;
   }
-  int root_dir_length = root_dir.num_entries * 6 + 4 + total_name_len;
+  pthread_mutex_unlock(&table_lock);
+  return ic != NULL;
+}
 
-  // Creating root directory inode
-  inode_t * root_dir_inode = malloc(sizeof(inode_t));
-  root_dir_inode->size = root_dir_length;
-  root_dir_inode->blocks[0] = 1 + rb->num_free_bitmap_blocks + rb->num_inode_table_blocks;
-  for (int i = 1; i < 7; i++) {
-    root_dir_inode->blocks[i] = 0;
+/*Returns whether directory dir holds nothing but '.' and '..'. The caller 
+holds its lock.*/
+static int dir_is_empty(dir_index *dir) {
+  for (_u32 i = 0; i < dir->num_entries; i++) {
+    if (strcmp(dir->slots[i].name, ".") != 0 && strcmp(dir->slots[i].name, "..") != 0) {
+      return 0;
+    }
   }
-  // Buffer to be written to disk
-  Byte * root_dir_inode_buffer = malloc(block_size);
-  memcpy(root_dir_inode_buffer, root_dir_inode, sizeof(inode_t));
-  int offset = sizeof(inode_t);
-  // Creating remaining empty inodes for the first inode block
-  for (int i = 0; i < (block_size / sizeof(inode_t)) - 1; i++) {
-    inode_t * empty_inode = malloc(sizeof(inode_t));
-    empty_inode->size = 0;
-    for (int j = 0; j < 7; j++) {
-      empty_inode->blocks[j] = 0;
+  return 1;
+}
+
+/*Returns 1 if directory dir lies in the subtree of directory ancestor 
+(or is ancestor), 0 if not and -1 on error. The caller holds rename_lock, 
+so no directory changes parent meanwhile.*/
+static int dir_within(_u32 dir, _u32 ancestor) {
+  for (_u32 depth = 0; depth < fs.num_inodes; depth++) {
+    if (dir == ancestor) {
+      return 1;
     }
-    memcpy(root_dir_inode_buffer + offset, empty_inode, sizeof(inode_t));
-    free(empty_inode);
-    offset += sizeof(inode_t);
-  }
-  // Write the first inode block
-  if (write_block(1 + rb->num_free_bitmap_blocks, root_dir_inode_buffer) < 0) {
-    free(rb);
-    free(root_dir_inode);
-    free(root_dir_inode_buffer);
-    return -1;
-  }
-  free(root_dir_inode);
-  free(root_dir_inode_buffer);
-
-  // Creating remaining empty inodes for the rest of the blocks
-  for (int i = 1; i < rb->num_inode_table_blocks; i++) {
-    Byte * empty_inode_buffer = malloc(block_size);
-    int offset = 0;
-    for (int j = 0; j < (block_size / sizeof(inode_t)); j++) {
-      inode_t * empty_inode = malloc(sizeof(inode_t));
-      if (empty_inode == NULL) {
-        free (rb);
-        return -1;
-      }
-      empty_inode->size = 0;
-      for (int k = 0; k < 7; k++) {
-        empty_inode->blocks[k] = 0;
-      }
-      memcpy(empty_inode_buffer + offset, empty_inode, sizeof(inode_t));
-      free(empty_inode);
-      offset += sizeof(inode_t);
+    if (dir == 0) {
+      return 0;
     }
-    if (write_block(1 + rb->num_free_bitmap_blocks + i, empty_inode_buffer) < 0) {
-      free(empty_inode_buffer);
-      free(rb);
+    Byte type;
+    dir = lookup(dir, "..", &type);
+    if (dir == (_u32) -1) {
       return -1;
     }
-    free(empty_inode_buffer);
   }
+  return -1;
+}
 
-  Byte * result_buffer = malloc(block_size);
-
-  _u32 num_entries_buffer[1];
-  num_entries_buffer[0] = root_dir.num_entries;
-  memcpy(result_buffer, num_entries_buffer, sizeof(_u32));
-  int current_offset = sizeof(_u32);
-  for (int i = 0; i < root_dir.num_entries; i++) {
-    _u32 u32_buffer[1]; // stores inode_num
-    u32_buffer[0] = root_dir.dir_entries[i].inode_num;
-    Byte byte_buffer[2]; // stores type and name_length
-    byte_buffer[0] = root_dir.dir_entries[i].type;
-    byte_buffer[1] = root_dir.dir_entries[i].name_length;
-    memcpy(result_buffer + current_offset, u32_buffer, sizeof(_u32));
-    current_offset += sizeof(_u32);
-    memcpy(result_buffer + current_offset, byte_buffer, 2 * sizeof(Byte));
-    current_offset += 2 * sizeof(Byte);
-    memcpy(result_buffer + current_offset, root_dir.dir_entries[i].name, strlen(root_dir.dir_entries[i].name) + 1);
-    current_offset += strlen(root_dir.dir_entries[i].name) + 1;
-  }
-  Byte remainder_buffer[block_size-root_dir_length];
-  for (int i = 0; i < block_size-root_dir_length; i++) {
-    remainder_buffer[i] = 0;
-  }
-  memcpy(result_buffer + current_offset, remainder_buffer, block_size-root_dir_length);
-  if (write_block(1 + rb->num_free_bitmap_blocks + rb->num_inode_table_blocks, result_buffer) < 0) {
-    free(result_buffer);
-    free(rb);
+/*Removes the entry name of dir, which a move out of directory from is 
+about to replace with an inode of type type, and adds what it named to 
+set. The caller holds the write locks of dir and from. Returns 0 on success.*/
+static int replace_entry(dir_index *dir, const char *name, Byte type, dir_index *from, release_set *set) {
+  dir_slot *slot = dir_lookup(dir, name);
+  _u32 inode_num = slot->inode_num;
+  if (slot->type != type || inode_is_open(inode_num)) {
     return -1;
   }
-  // Creating remaining empty blocks
-  for (int i = 1 + rb->num_free_bitmap_blocks + rb->num_inode_table_blocks + 1; i < num_blocks; i++) {
-    Byte buffer[block_size];
-    for (int j = 0; j < block_size; j++) {
-      buffer[j] = 0;
+  dir_index *old = NULL;
+  if (type == 'D') {
+    old = dir_get(inode_num);
+    // The directory moved out of is not empty, and is locked already. The 
+    // replaced one stays locked until it is unlinked, so nothing is made in it.
+    if (old == NULL || old == from) {
+      return -1;
     }
-    if (write_block(i, buffer) < 0) {
-      free(rb);
+    pthread_rwlock_wrlock(&old->lock);
+    if (!dir_is_empty(old) || inode_num == __atomic_load_n(&fs.cwd, __ATOMIC_RELAXED)
+        || release_push(&set->directories, &set->num_directories, &set->directories_capacity, inode_num) < 0) {
+      pthread_rwlock_unlock(&old->lock);
       return -1;
     }
   }
-  free(rb);
-  fclose(fp);
-  return 0;
+  int result = -1;
+  if (dir_remove(dir, name) == 0 && release_push(&set->inodes, &set->num_inodes, &set->inodes_capacity, inode_num) == 0) {
+    release_directories(set);
+    result = release_inodes(set);
+  }
+  release_unlock(set);
+  return result;
 }
 
-/* Opens a file for reading and writing. returns NULL on error. 
-filename is an absolute or relative path to a file.*/
-my_file *my_fopen(char *filename) {
-  rootblock_t * rb = get_rootblock();
-  if (rb == NULL) {
-    return NULL;
+/*Moves the entry src_name of from to dest_name in to. The new entry goes 
+in before the old one is removed, so a crash in between leaves the inode 
+with two names rather than none. The caller holds the write locks of both 
+directories. Returns 0 on success.*/
+static int move_entry(dir_index *from, const char *src_name, dir_index *to, const char *dest_name,
+                      _u32 inode_num, release_set *set) {
+  dir_slot *slot = dir_lookup(from, src_name);
+  if (slot == NULL || slot->inode_num != inode_num) {
+    return -1;
   }
-  for (int i = 0; i < strlen(filename) + 1; i++) {
-    if (filename[i] == '/') { // including '/' in filename shouldn't be allowed
-      free(rb);
-      return NULL;
-    }
+  Byte type = slot->type;
+  slot = dir_lookup(to, dest_name);
+  if (slot != NULL && slot->inode_num == inode_num) {
+    // Both names lead to the same inode already
+    return 0;
   }
-  // Read root directory inode
-  _u32 inode_buffer[8];
-  // hardcoding for root directory for now
-  if (read_inode(0, inode_buffer) < 0) {
-    free(rb);
-    return NULL;
+  if (slot != NULL && replace_entry(to, dest_name, type, from, set) < 0) {
+    return -1;
   }
-  // Root directory inode
-  inode_t inode;
-  inode.size = inode_buffer[0];
-  for (int i = 0; i < 7; i++) {
-    inode.blocks[i] = inode_buffer[i+1];
+  if (dir_add(to, dest_name, inode_num, type) < 0 || dir_remove(from, src_name) < 0) {
+    return -1;
   }
-  // Read root directory
-  Byte root_dir_buffer[rb->block_size];
-  if (read_block(inode.blocks[0], root_dir_buffer) < 0) {
-    free(rb);
-    return NULL;
+  if (type != 'D' || from == to) {
+    return 0;
   }
-  // Create an array of chars for filename
-  int name_length = strlen(filename) + 1;
-  char file_name[name_length];
-  for (int i = 0 ; i < name_length; i++) {
-    file_name[i] = filename[i];
-  }
-  // Check that file already exists
-  for (int i = 0; i < rb->block_size; i++) {
-    // Check if entry with type 'F' exists
-    if (root_dir_buffer[i] == 70 || root_dir_buffer[i] == 68) {
-      int temp = root_dir_buffer[i];
-      // Check if length of that entry matches the filename's length
-      if (root_dir_buffer[i+1] == name_length) {
-        int k = 0;
-        for (int j = i + 2; j < i + 2 + name_length; j++) {
-          if (root_dir_buffer[j] == file_name[k]) {
-            k++;
-          }
-        }
-        if (k == name_length) { // File exists and we need to return info about it
-          if (temp == 68) {
-            // We are trying to open a directory instead of a file
-            free(rb);
-            return NULL;
-          }
-          _u32 u32_buffer[1];
-          // Get index of existing file's inode and read it
-          fseek(fp, inode.blocks[0] * rb->block_size + i - sizeof(_u32), SEEK_SET);
-          if (fread(u32_buffer, sizeof(_u32), 1, fp) < 0) {
-            free(rb);
-            return NULL;
-          }
-          // Read the existing file's inode
-          _u32 existing_file_inode_buffer[8];
-          if (read_inode(u32_buffer[0], existing_file_inode_buffer) < 0) {
-            free(rb);
-            return NULL;
-          }
-          // Creating an inode for the file
-          inode_t * new_inode = malloc(sizeof(inode_t));
-          new_inode->size = existing_file_inode_buffer[0];
-          for (int i = 0; i < 7; i++) {
-            new_inode->blocks[i] = existing_file_inode_buffer[i+1];
-          }
-          // Creating the file
-          my_file * file = malloc(sizeof(my_file));
-          Byte data[rb->block_size];
-          if (read_block(new_inode->blocks[0], data) < 0) {
-            free(rb);
-            return NULL;
-          }
-          file->inode_num = u32_buffer[0];
-          file->inode = new_inode;
-          file->pos = 0;
-          file->buffer = data;
-          file->dirty = 0;
-          free(rb);
-          return file;
-        }
-      }
-    }
+  // A directory that changes parent has its '..' pointed at the new one
+  dir_index *moved = dir_get(inode_num);
+  if (moved == NULL) {
+    return -1;
   }
-  // If we get here, file doesn't exist
-  _u32 u32_buffer[1];
+  pthread_rwlock_wrlock(&moved->lock);
+  int result = (dir_lookup(moved, "..") == NULL || dir_remove(moved, "..") == 0)
+    && dir_add(moved, "..", to->inode_num, 'D') == 0 ? 0 : -1;
+  pthread_rwlock_unlock(&moved->lock);
+  return result;
+}
 
-  // Read num of directory entries
-  fseek(fp, inode.blocks[0] * rb->block_size, SEEK_SET);
-  if (fread(u32_buffer, sizeof(_u32), 1, fp) < 0) {
-    free(rb);
-    return NULL;
-  }
-  
-  _u32 num_root_dir_entries[1];
-  // Incrementing number of directory entries
-  num_root_dir_entries[0] = u32_buffer[0] + 1;
-  fseek(fp, inode.blocks[0] * rb->block_size, SEEK_SET);
-  if (fwrite(num_root_dir_entries, sizeof(_u32), 1, fp) < 0) {
-    free(rb);
-    return NULL;
-  }
-  // Creating a new direntry for the file
-  direntry_t direntry;
-  direntry.inode_num = get_first_free_inode(); // index of the inode where the file data is stored 
-  direntry.type = 'F';
-  direntry.name_length = strlen(filename) + 1; // +1 for null terminated string
-  direntry.name = filename;
-
-  _u32 buff[1];
-  buff[0] = direntry.inode_num;
-  fseek(fp, inode.blocks[0] * rb->block_size + inode.size, SEEK_SET);
-  if (fwrite(buff, sizeof(_u32), 1, fp) < 0) {
-    free(rb);
-    return NULL;
+/* Moves src to dest by moving its direntry, see include/filesystem.h. 
+Returns 0 on success.*/
+static int do_mv(char *src, char *dest) {
+  if (fd < 0) {
+    return -1;
   }
-  buff[0] = direntry.type;
-  if (fwrite(buff, sizeof(Byte), 1, fp) < 0) {
-    free(rb);
-    return NULL;
+  char src_name[256];
+  char dest_name[256];
+  Byte type;
+  _u32 src_parent = resolve_path(src, src_name, &type);
+  _u32 dest_parent = src_parent == (_u32) -1 ? (_u32) -1 : resolve_path(dest, dest_name, &type);
+  if (dest_parent == (_u32) -1 || strcmp(src_name, ".") == 0 || strcmp(src_name, "..") == 0
+      || strcmp(dest_name, ".") == 0 || strcmp(dest_name, "..") == 0) {
+    return -1;
   }
-  buff[0] = direntry.name_length;
-  if (fwrite(buff, sizeof(Byte), 1, fp) < 0) {
-    free(rb);
-    return NULL;
+  dir_index *from = dir_get(src_parent);
+  dir_index *to = dir_get(dest_parent);
+  if (from == NULL || to == NULL) {
+    return -1;
   }
-  if (fwrite(direntry.name, sizeof(Byte) * name_length, 1, fp) < 0) {
-    free(rb);
-    return NULL;
+  if (from != to) {
+    pthread_mutex_lock(&rename_lock);
   }
-
-  // Updating size of directory
-  inode_buffer[0] += 6 + name_length;
-  // Hardocding for root directory inode for now
-  if(write_inode(0, inode_buffer) < 0) {
-    free(rb);
-    return NULL;
+  _u32 inode_num = lookup(src_parent, src_name, &type);
+  int result = inode_num == (_u32) -1 ? -1 : 0;
+  // A directory can't move into its own subtree
+  if (result == 0 && type == 'D' && from != to && dir_within(dest_parent, inode_num) != 0) {
+    result = -1;
   }
-  // Creating an inode for the file
-  inode_t * new_inode = malloc(sizeof(inode_t));
-  // Initially the size is 0
-  new_inode->size = 0;
-  // Allocating the first free block for the file's data
-  new_inode->blocks[0] = rb->num_blocks - num_free_blocks();
-  for (int i = 1; i < 7; i++){
-    new_inode->blocks[i] = 0;
-  }
-  // Update bitmap
-  if (update_bitmap(1) < 0) {
-    free(rb);
-    return NULL;
+  if (result == 0) {
+    dir_index *first = from->inode_num < to->inode_num ? from : to;
+    dir_index *second = first == from ? to : from;
+    journal_start();
+    pthread_rwlock_wrlock(&first->lock);
+    if (second != first) {
+      pthread_rwlock_wrlock(&second->lock);
+    }
+    release_set set;
+    memset(&set, 0, sizeof(set));
+    result = move_entry(from, src_name, to, dest_name, inode_num, &set);
+    if (second != first) {
+      pthread_rwlock_unlock(&second->lock);
+    }
+    pthread_rwlock_unlock(&first->lock);
+    if (bitmap_flush() < 0) {
+      result = -1;
+    }
+    journal_stop();
+    if (release_blocks(&set) < 0) {
+      result = -1;
+    }
   }
-  // Creating a the file
-  my_file * file = malloc(sizeof(my_file));
-  Byte data[rb->block_size];
-  if (read_block(new_inode->blocks[0], data) < 0) {
-    free(rb);
-    return NULL;
+  if (from != to) {
+    pthread_mutex_unlock(&rename_lock);
   }
-  file->inode_num = direntry.inode_num;
-  file->inode = new_inode;
-  file->pos = 0;
-  file->buffer = data;
-  file->dirty = 0;
+  return result;
+}
 
-  _u32 buf_new[8];
-  buf_new[0] = new_inode->size;
-  for (int i = 1; i < 8; i++) {
-    buf_new[i] = new_inode->blocks[i-1];
-  }
-  // Write the file's inode
-  if (write_inode(file->inode_num, buf_new) < 0) {
-    free(rb);
-    return NULL;
-  }
-  free(rb);
-  return file;
+int mv(char *src, char *dest) {
+  unsigned long long start = stats_start(FS_OP_MV);
+  int result = do_mv(src, dest);
+  stats_op(FS_OP_MV, start, result != 0);
+  return result;
 }
 
-/*writes num bytes from file into buffer. Returns 0 on success.*/
-int my_fputc(my_file *file, Byte *buffer, _u32 num) {
-  rootblock_t * rb = get_rootblock();
-  if (rb == NULL) {
+/*Adds the subtree under directory dir_num, the directory included, to set, 
+write locking each directory as it is reached, parents before children. 
+The locks are held until the subtree is unlinked, so nothing can be made 
+or opened in it once it has been checked. They are those of the 
+directories in set, also on failure, and release_unlock() drops them. 
+Without recursive the directory must be empty. Returns 0 on success, -1 if 
+the directory isn't empty, is or holds the current directory, or holds a 
+file that is open.*/
+static int collect_subtree(release_set *set, _u32 dir_num, char recursive) {
+  dir_index *dir = dir_get(dir_num);
+  if (dir == NULL) {
+    return -1;
+  }
+  pthread_rwlock_wrlock(&dir->lock);
+  if (release_push(&set->directories, &set->num_directories, &set->directories_capacity, dir_num) < 0) {
+    pthread_rwlock_unlock(&dir->lock);
     return -1;
   }
-  _u32 current_size = file->inode->size;
-  // Case when pos == 0
-  if (file->pos == 0) {
-    // the amount of bytes we write is equal to or exceeds our file size
-    if (num >= current_size) {
-      file->inode->size = num;
+  // chdir() checks for removal under the lock held here
+  int result = dir_num == __atomic_load_n(&fs.cwd, __ATOMIC_RELAXED) ? -1
+    : release_push(&set->inodes, &set->num_inodes, &set->inodes_capacity, dir_num);
+  for (_u32 i = 0; result == 0 && i < dir->num_entries; i++) {
+    dir_slot *slot = &dir->slots[i];
+    if (strcmp(slot->name, ".") == 0 || strcmp(slot->name, "..") == 0) {
+      continue;
     }
-  } else {
-    // pos is > 0
-    if (file->pos + num > current_size) {
-      file->inode->size = file->pos + num;
+    if (!recursive || (slot->type != 'D' && inode_is_open(slot->inode_num))) {
+      result = -1;
+    } else if (slot->type == 'D') {
+      result = collect_subtree(set, slot->inode_num, recursive);
+    } else {
+      result = release_push(&set->inodes, &set->num_inodes, &set->inodes_capacity, slot->inode_num);
     }
   }
+  return result;
+}
 
-  _u32 inode_buffer[8];
-  if (read_inode(file->inode_num, inode_buffer) < 0) {
-    free(rb);
+/*Unlinks the entry name of dir and frees the inodes of set. The 
+directories in set are marked removed before their inodes are free to be 
+reused. The caller holds the write locks of dir and of the directories in 
+set. Returns 0 on success.*/
+static int unlink_entry(dir_index *dir, const char *name, release_set *set) {
+  if (dir_remove(dir, name) < 0) {
     return -1;
   }
-  inode_buffer[0] = file->inode->size;
+  release_directories(set);
+  return release_inodes(set);
+}
 
-  if (write_inode(file->inode_num, inode_buffer) < 0) {
-    free(rb);
+/* Removes the file name, freeing its inode and the blocks it does not 
+share with a copy. A file that is open can't be removed. Returns 0 on 
+success.*/
+static int do_rm(char *name) {
+  if (fd < 0) {
     return -1;
   }
-
-  fseek(fp, file->inode->blocks[0] * rb->block_size + file->pos, SEEK_SET);
-  if (fwrite(buffer, sizeof(Byte), num, fp) < 0) {
-    free(rb);
+  char last[256];
+  Byte type;
+  _u32 parent = resolve_path(name, last, &type);
+  dir_index *dir = parent == (_u32) -1 ? NULL : dir_get(parent);
+  if (dir == NULL || strcmp(last, ".") == 0 || strcmp(last, "..") == 0) {
     return -1;
   }
-
-  free(rb);
-  return 0;
+  release_set set;
+  memset(&set, 0, sizeof(set));
+  // my_fopen() takes the inode under the directory's lock, so holding the 
+  // write lock from the check to the unlink keeps the file from being opened
+  journal_start();
+  pthread_rwlock_wrlock(&dir->lock);
+  dir_slot *slot = dir_lookup(dir, last);
+  int result = slot == NULL || slot->type != 'F' || inode_is_open(slot->inode_num) ? -1 : 0;
+  if (result == 0) {
+    result = release_push(&set.inodes, &set.num_inodes, &set.inodes_capacity, slot->inode_num);
+  }
+  if (result == 0) {
+    result = unlink_entry(dir, last, &set);
+  }
+  pthread_rwlock_unlock(&dir->lock);
+  if (bitmap_flush() < 0) {
+    result = -1;
+  }
+  journal_stop();
+  if (release_blocks(&set) < 0) {
+    result = -1;
+  }
+  return result;
 }
 
-/* Closes the file and does any cleanup necessary. Returns 0 on success.*/
-int my_fclose(my_file *file) {
-  free(file->inode);
-  free(file);
-  return 0;
+int rm(char *name) {
+  unsigned long long start = stats_start(FS_OP_RM);
+  int result = do_rm(name);
+  stats_op(FS_OP_RM, start, result != 0);
+  return result;
 }
 
-/*reads num bytes from file into buffer. Returns 0 on success.*/
-int my_fgetc(my_file *file, Byte *buffer, _u32 num) {
-  if (num < 0 || num > file->inode->size) {
+/* Removes the directory name, and with recursive everything below it. 
+The subtree is collected first and then freed in one pass over the inode 
+table and one over the bitmap. Neither the current directory nor one 
+above it can be removed. Returns 0 on success.*/
+static int do_rmdir(char *name, char recursive) {
+  if (fd < 0) {
     return -1;
   }
-  for (int i = 0; i < num; i++) {
-    buffer[i] = file->buffer[i];
+  char last[256];
+  Byte type;
+  _u32 parent = resolve_path(name, last, &type);
+  dir_index *dir = parent == (_u32) -1 ? NULL : dir_get(parent);
+  if (dir == NULL || strcmp(last, ".") == 0 || strcmp(last, "..") == 0) {
+    return -1;
   }
-  return 0;
+  release_set set;
+  memset(&set, 0, sizeof(set));
+  // No directory changes parent while the subtree is collected
+  pthread_mutex_lock(&rename_lock);
+  _u32 inode_num = lookup(parent, last, &type);
+  int result = inode_num == (_u32) -1 || type != 'D' ? -1 : 0;
+  if (result == 0) {
+    // The parent and the whole subtree stay write locked from the checks 
+    // to the unlink
+    journal_start();
+    pthread_rwlock_wrlock(&dir->lock);
+    dir_slot *slot = dir_lookup(dir, last);
+    result = slot == NULL || slot->inode_num != inode_num ? -1 : collect_subtree(&set, inode_num, recursive);
+    if (result == 0) {
+      result = unlink_entry(dir, last, &set);
+    }
+    release_unlock(&set);
+    pthread_rwlock_unlock(&dir->lock);
+    if (bitmap_flush() < 0) {
+      result = -1;
+    }
+    journal_stop();
+  }
+  pthread_mutex_unlock(&rename_lock);
+  if (release_blocks(&set) < 0) {
+    result = -1;
+  }
+  return result;
 }
 
-/*sets the current position for reading/writing to pos within the file. Returns 0 on success.*/
-int my_fseek(my_file *file, _u32 pos) {
-  if (file == NULL) {
-    return -1;
+int rmdir(char *name, char recursive) {
+  unsigned long long start = stats_start(FS_OP_RMDIR);
+  int result = do_rmdir(name, recursive);
+  stats_op(FS_OP_RMDIR, start, result != 0);
+  return result;
+}
+
+/************************ FILE SYSTEM CHECK ************************/
+
+#define FSCK_MAX_THREADS 8
+
+/*A direntry naming an inode that is not in use*/
+typedef struct fsck_dangling {
+  _u32 dir;
+  char name[256];
+} fsck_dangling;
+
+/*Shared state of a running fsck_run(). The bitmaps are updated by the 
+workers with atomic operations; the directory queue and the list of 
+dangling entries are guarded by lock.*/
+typedef struct fsck_state {
+  uint64_t *expected;   // blocks the metadata and the used inodes account for
+  uint64_t *shared;     // blocks claimed more than once
+  uint64_t *used;       // inodes in use in the inode table
+  uint64_t *referenced; // inodes some directory entry names
+  uint64_t *visited;    // directories queued for the walk
+  _u32 next_chunk;      // next run of inode table blocks to scan
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  _u32 *queue;          // directories waiting to be walked
+  _u32 queue_length;
+  _u32 queue_capacity;
+  _u32 busy;            // workers walking a directory
+  fsck_dangling *dangling;
+  _u32 num_dangling;
+  int failed;           // set by any worker that hits an error
+  fsck_report_t *report;
+} fsck_state;
+
+/*Sets bit index in a shared bitmap. Returns whether it was set already.*/
+static int fsck_set(uint64_t *bits, _u32 index) {
+  uint64_t bit = (uint64_t) 1 << (index % 64);
+  return (__atomic_fetch_or(&bits[index / 64], bit, __ATOMIC_RELAXED) & bit) != 0;
+}
+
+static int fsck_test(uint64_t *bits, _u32 index) {
+  return (__atomic_load_n(&bits[index / 64], __ATOMIC_RELAXED) >> (index % 64)) & 1;
+}
+
+/*Returns whether block lies in the journal or the refcount table*/
+static int fsck_reserved(_u32 block) {
+  return (block >= fs.rb.journal_start && block - fs.rb.journal_start < fs.rb.journal_blocks)
+    || (block >= fs.rb.refcount_start && block - fs.rb.refcount_start < fs.rb.refcount_blocks);
+}
+
+/*Claims block for an inode. Returns whether it may be followed, that is 
+whether it lies in the data area outside the journal and refcount table. 
+A block cp() shared is claimed by each owner but followed only once.*/
+static int fsck_claim(fsck_state *state, _u32 block) {
+  if (block < fs.data_start || block >= fs.rb.num_blocks || fsck_reserved(block)) {
+    __atomic_fetch_add(&state->report->bad_pointers, 1, __ATOMIC_RELAXED);
+    return 0;
   }
-  rootblock_t * rb = get_rootblock();
-  if (rb == NULL) {
-    return -1;
+  if (fsck_set(state->expected, block)) {
+    fsck_set(state->shared, block);
+    if (refcount_get(block) > 0) {
+      return 0;
+    }
+    __atomic_fetch_add(&state->report->double_allocations, 1, __ATOMIC_RELAXED);
   }
-  if (pos < 0 || pos > file->inode->size - 1) {
-    free(rb);
-    return -1;
+  return 1;
+}
+
+/*Gives back the claims of an orphan, except on blocks another inode holds 
+too. A block cp() shared loses the orphan as an owner, and what lies 
+behind it stays with the others.*/
+static int fsck_unclaim(fsck_state *state, _u32 block) {
+  if (block < fs.data_start || block >= fs.rb.num_blocks || fsck_reserved(block)) {
+    return 0;
   }
-  _u32 diff = pos - file->pos;
-  file->pos = pos;
-  if (diff == 0) {
+  if (!fsck_test(state->shared, block)) {
+    __atomic_fetch_and(&state->expected[block / 64], ~((uint64_t) 1 << (block % 64)), __ATOMIC_RELAXED);
+  } else if (refcount_get(block) > 0) {
+    pthread_mutex_lock(&alloc_lock);
+    refcount_change_locked(block, -1);
+    pthread_mutex_unlock(&alloc_lock);
     return 0;
-  } else if (diff > 0) {
-    file->buffer += diff;
-  } else {
-    file->buffer -= diff;
   }
-  return 0;
+  return 1;
 }
 
-/* Makes a directory. name is either a full path (if it begins with '/', 
-or a relative path with regards to the current location in the file system. 
-All entries except the last must already exist. Returns 0 on success.*/
-int mkdir(char *name) {
-  rootblock_t * rb = get_rootblock();
-  if (rb == NULL) {
-    return -1;
+/*Applies visit to every block of an inode: the data blocks and the 
+indirect blocks, which are followed when visit accepts them. 
+Returns 0 on success, -1 if an indirect block can't be read.*/
+static int fsck_blocks(fsck_state *state, inode_t *inode, int (*visit)(fsck_state *, _u32)) {
+  _u32 per_block = pointers_per_block();
+  _u32 pointers[per_block];
+  _u32 inner[per_block];
+  for (int i = 0; i < 5; i++) {
+    if (inode->blocks[i] != 0) {
+      visit(state, inode->blocks[i]);
+    }
   }
-  if (name[0] == '/' && strlen(name) == 1) { // trying to create root directory
-    free(rb);
-    return -1;
+  if (inode->blocks[5] != 0 && visit(state, inode->blocks[5])) {
+    if (read_block(inode->blocks[5], (Byte *) pointers) < 0) {
+      return -1;
+    }
+    for (_u32 i = 0; i < per_block; i++) {
+      if (pointers[i] != 0) {
+        visit(state, pointers[i]);
+      }
+    }
   }
-  // Read root directory inode
-  _u32 inode_buffer[8];
-  // hardcoding for root directory for now
-  if (read_inode(0, inode_buffer) < 0) {
-    free(rb);
-    return -1;
+  if (inode->blocks[6] != 0 && visit(state, inode->blocks[6])) {
+    if (read_block(inode->blocks[6], (Byte *) pointers) < 0) {
+      return -1;
+    }
+    for (_u32 i = 0; i < per_block; i++) {
+      if (pointers[i] == 0 || !visit(state, pointers[i])) {
+        continue;
+      }
+      if (read_block(pointers[i], (Byte *) inner) < 0) {
+        return -1;
+      }
+      for (_u32 j = 0; j < per_block; j++) {
+        if (inner[j] != 0) {
+          visit(state, inner[j]);
+        }
+      }
+    }
   }
-  // Root directory inode
-  inode_t root_dir_inode;
-  root_dir_inode.size = inode_buffer[0];
-  for (int i = 0; i < 7; i++) {
-    root_dir_inode.blocks[i] = inode_buffer[i+1];
+  return 0;
+}
+
+/*Scan phase worker. Takes runs of TRANSFER_RUN inode table blocks, reads 
+each with one sequential read, and claims the blocks of every inode in use.*/
+static void *fsck_scan(void *arg) {
+  fsck_state *state = arg;
+  _u32 num_blocks = itable_end() - fs.inode_table_start;
+  Byte *buffer = malloc((size_t) TRANSFER_RUN * fs.rb.block_size);
+  if (buffer == NULL) {
+    __atomic_store_n(&state->failed, 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+  for (;;) {
+    _u32 first = __atomic_fetch_add(&state->next_chunk, TRANSFER_RUN, __ATOMIC_RELAXED);
+    if (first >= num_blocks) {
+      break;
+    }
+    _u32 count = num_blocks - first < TRANSFER_RUN ? num_blocks - first : TRANSFER_RUN;
+    if (read_block_run(fs.inode_table_start + first, count, buffer) < 0) {
+      __atomic_store_n(&state->failed, 1, __ATOMIC_RELAXED);
+      break;
+    }
+    for (_u32 j = 0; j < count * fs.inodes_per_block; j++) {
+      inode_t *inode = (inode_t *) (buffer + j * sizeof(inode_t));
+      _u32 *words = (_u32 *) inode;
+      int used = 0;
+      for (int k = 0; k < 8; k++) {
+        used |= words[k] != 0;
+      }
+      if (used) {
+        fsck_set(state->used, first * fs.inodes_per_block + j);
+        __atomic_fetch_add(&state->report->used_inodes, 1, __ATOMIC_RELAXED);
+        if (fsck_blocks(state, inode, fsck_claim) < 0) {
+          __atomic_store_n(&state->failed, 1, __ATOMIC_RELAXED);
+        }
+      }
+    }
   }
+  free(buffer);
+  return NULL;
+}
 
-  // Read root dir block
-  Byte root_dir_buffer[rb->block_size];
-  if (read_block(root_dir_inode.blocks[0], root_dir_buffer) < 0) {
-    free(rb);
+/*Checks the entries of one directory, queueing the subdirectories it 
+reaches for the first time and recording entries that dangle.*/
+static int fsck_directory(fsck_state *state, _u32 dir_num) {
+  inode_t inode;
+  if (load_inode(dir_num, &inode) < 0) {
     return -1;
   }
-
-  // Check if the path is absolute
-  int is_absolute = 0;
-  if (name[0] == '/') {
-    is_absolute = 1;
+  if (inode.size <= sizeof(_u32)) {
+    return 0;
   }
-
-  int name_length = strlen(name) + 1;
-  // new_name is only used if the path is absolute!!!
-  char new_name[name_length-1];
-  if (is_absolute == 1) {
-    // decrement the length since we don't include '/'
-    name_length -= 1;
-    for (int i = 0; i < name_length + 1; i++) {
-      new_name[i] = name[i+1];
-    }
-    name = new_name;
+  Byte *data = malloc(inode.size);
+  stats_directory++;
+  int result = data == NULL ? -1 : inode_read(&inode, 0, data, inode.size);
+  stats_directory--;
+  if (result < 0) {
+    free(data);
+    return -1;
   }
-  // Check that directory already exists
-  for (int i = 0; i < rb->block_size; i++) {
-    // Check if entry with type 'D' exists
-    if (root_dir_buffer[i] == 68) {
-      // Check if length of that entry matches the directory name's length
-      if (root_dir_buffer[i+1] == name_length) {
-        int k = 0;
-        for (int j = i + 2; j < i + 2 + name_length; j++) {
-          if (root_dir_buffer[j] == name[k]) {
-            k++;
-          }
+  _u32 offset = sizeof(_u32);
+  while (offset + 6 < inode.size) {
+    _u32 entry_inode;
+    memcpy(&entry_inode, data + offset, sizeof(_u32));
+    Byte type = data[offset + 4];
+    Byte name_length = data[offset + 5];
+    if (name_length == 0 || offset + 6 + name_length > inode.size) {
+      break;
+    }
+    char *name = (char *) data + offset + 6;
+    name[name_length - 1] = '\0';
+    offset += 6 + name_length;
+    if (type == 0 || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+      continue;
+    }
+    pthread_mutex_lock(&state->lock);
+    if (entry_inode >= fs.num_inodes || !fsck_test(state->used, entry_inode)) {
+      fsck_dangling *dangling = realloc(state->dangling, (state->num_dangling + 1) * sizeof(fsck_dangling));
+      if (dangling != NULL) {
+        state->dangling = dangling;
+        dangling[state->num_dangling].dir = dir_num;
+        strcpy(dangling[state->num_dangling].name, name);
+        state->num_dangling++;
+      }
+    } else {
+      fsck_set(state->referenced, entry_inode);
+      // A directory linked from two places is only walked once
+      if (type == 'D' && !fsck_set(state->visited, entry_inode)) {
+        _u32 *queue = state->queue;
+        if (state->queue_length == state->queue_capacity) {
+          queue = realloc(state->queue, 2 * state->queue_capacity * sizeof(_u32));
         }
-        if (k == name_length) { // Directory already exists
-          free(rb);
-          return -1;
+        if (queue == NULL) {
+          __atomic_store_n(&state->failed, 1, __ATOMIC_RELAXED);
+        } else {
+          if (queue != state->queue) {
+            state->queue = queue;
+            state->queue_capacity *= 2;
+          }
+          state->queue[state->queue_length++] = entry_inode;
+          pthread_cond_signal(&state->cond);
         }
       }
     }
+    pthread_mutex_unlock(&state->lock);
   }
-  // If we're here, directory doesn't exist
-  _u32 u32_buffer[1];
-  // Read num of directory entries
-  fseek(fp, root_dir_inode.blocks[0] * rb->block_size, SEEK_SET);
-  if (fread(u32_buffer, sizeof(_u32), 1, fp) < 0) {
-    free(rb);
-    return -1;
+  free(data);
+  return 0;
+}
+
+/*Walk phase worker. Takes directories off the shared queue until it is 
+empty and no other worker can add to it.*/
+static void *fsck_walk(void *arg) {
+  fsck_state *state = arg;
+  pthread_mutex_lock(&state->lock);
+  for (;;) {
+    while (state->queue_length == 0 && state->busy > 0) {
+      pthread_cond_wait(&state->cond, &state->lock);
+    }
+    if (state->queue_length == 0) {
+      break;
+    }
+    _u32 dir_num = state->queue[--state->queue_length];
+    state->busy++;
+    pthread_mutex_unlock(&state->lock);
+    int result = fsck_directory(state, dir_num);
+    __atomic_fetch_add(&state->report->directories, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&state->lock);
+    if (result < 0) {
+      __atomic_store_n(&state->failed, 1, __ATOMIC_RELAXED);
+    }
+    if (--state->busy == 0) {
+      pthread_cond_broadcast(&state->cond);
+    }
   }
-  _u32 num_root_dir_entries[1];
-  // Incrementing number of directory entries
-  num_root_dir_entries[0] = u32_buffer[0] + 1;
-  fseek(fp, root_dir_inode.blocks[0] * rb->block_size, SEEK_SET);
-  if (fwrite(num_root_dir_entries, sizeof(_u32), 1, fp) < 0) {
-    free(rb);
-    return -1;
+  pthread_cond_broadcast(&state->cond);
+  pthread_mutex_unlock(&state->lock);
+  return NULL;
+}
+
+/*Runs worker on threads threads and waits for all of them*/
+static void fsck_parallel(fsck_state *state, _u32 threads, void *(*worker)(void *)) {
+  pthread_t ids[FSCK_MAX_THREADS];
+  _u32 started = 0;
+  while (started + 1 < threads && pthread_create(&ids[started], NULL, worker, state) == 0) {
+    started++;
   }
-  // Creating a new direntry for the directory
-  direntry_t direntry;
-  direntry.inode_num = get_first_free_inode(); // index of the inode where the directory data will be stored
-  direntry.type = 'D';
-  direntry.name_length = name_length; // + 1 for null terminated string
-  direntry.name = name;
+  worker(state);
+  for (_u32 i = 0; i < started; i++) {
+    pthread_join(ids[i], NULL);
+  }
+}
 
-  // Write direntry to disk
-  _u32 buff[1];
-  buff[0] = direntry.inode_num;
-  fseek(fp, root_dir_inode.blocks[0] * rb->block_size + root_dir_inode.size, SEEK_SET);
-  if (fwrite(buff, sizeof(_u32), 1, fp) < 0) {
-    free(rb);
-    return -1;
+/*Milliseconds since start*/
+static double fsck_elapsed(struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double elapsed = (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+  *start = now;
+  return elapsed;
+}
+
+/*Runs the phases of fsck_run() on a prepared state. Returns the number of 
+problems found or -1 on error.*/
+static int fsck_check(fsck_state *state, int repair, _u32 threads) {
+  fsck_report_t *report = state->report;
+  _u32 block_words = (fs.rb.num_blocks + 63) / 64;
+  struct timespec clock;
+  clock_gettime(CLOCK_MONOTONIC, &clock);
+  // The rootblock, bitmap, inode table, journal and refcount table are always in use
+  for (_u32 i = 0; i < fs.data_start; i++) {
+    fsck_set(state->expected, i);
   }
-  buff[0] = direntry.type;
-  if (fwrite(buff, sizeof(Byte), 1, fp) < 0) {
-    free(rb);
-    return -1;
+  for (_u32 i = 0; i < fs.rb.journal_blocks; i++) {
+    fsck_set(state->expected, fs.rb.journal_start + i);
   }
-  buff[0] = direntry.name_length;
-  if (fwrite(buff, sizeof(Byte), 1, fp) < 0) {
-    free(rb);
-    return -1;
+  for (_u32 i = 0; i < fs.rb.refcount_blocks; i++) {
+    fsck_set(state->expected, fs.rb.refcount_start + i);
   }
-  if (fwrite(direntry.name, sizeof(Byte) * name_length, 1, fp) < 0) {
-    free(rb);
-    return -1;
+  // and so are blocks freed while the journal still logged them
+  pthread_mutex_lock(&alloc_lock);
+  for (_u32 i = 0; i < fs.num_deferred; i++) {
+    fsck_set(state->expected, fs.deferred[i]);
   }
+  pthread_mutex_unlock(&alloc_lock);
 
-  // Updating size of directory
-  inode_buffer[0] += 6 + name_length;
-  // Hardocding for root directory inode for now
-  if (write_inode(0, inode_buffer) < 0) {
-    free(rb);
+  // Scan: read the inode table and claim every block the inodes point at
+  fsck_parallel(state, threads, fsck_scan);
+  report->phase_ms[FSCK_SCAN] = fsck_elapsed(&clock);
+  if (state->failed || !fsck_test(state->used, 0)) {
     return -1;
   }
-  // Creating an inode for the file
-  inode_t * new_inode = malloc(sizeof(inode_t));
-  // Initially the size of the directory is 0
-  new_inode->size = 0;
-  // Allocating the first free block for the directory
-  new_inode->blocks[0] = rb->num_blocks - num_free_blocks();
-  for (int i = 1; i < 7; i++){
-    new_inode->blocks[i] = 0;
+
+  // Walk: follow the directory tree from the root
+  fsck_set(state->visited, 0);
+  fsck_set(state->referenced, 0);
+  state->queue[state->queue_length++] = 0;
+  fsck_parallel(state, threads, fsck_walk);
+  report->phase_ms[FSCK_WALK] = fsck_elapsed(&clock);
+  if (state->failed) {
+    return -1;
   }
-  _u32 buf_new[8];
-  buf_new[0] = new_inode->size;
-  for (int i = 1; i < 8; i++) {
-    buf_new[i] = new_inode->blocks[i-1];
+
+  // Compare: inodes nobody refers to, then the bitmap against the claims
+  report->dangling_entries = state->num_dangling;
+  for (_u32 i = 0; i < fs.num_inodes; i++) {
+    if (fsck_test(state->used, i) && !fsck_test(state->referenced, i)) {
+      report->orphan_inodes++;
+      inode_t inode;
+      // The blocks of an orphan that is going to be freed are leaks
+      if (repair && (load_inode(i, &inode) < 0 || fsck_blocks(state, &inode, fsck_unclaim) < 0)) {
+        return -1;
+      }
+    }
   }
-  // Write the file's inode
-  if (write_inode(direntry.inode_num, buf_new) < 0) {
-    free(rb);
-    return -1;
+  for (_u32 w = 0; w < block_words; w++) {
+    uint64_t mask = w + 1 < block_words || fs.rb.num_blocks % 64 == 0
+      ? ~(uint64_t) 0 : ((uint64_t) 1 << (fs.rb.num_blocks % 64)) - 1;
+    report->used_blocks += __builtin_popcountll(state->expected[w] & mask);
+    report->leaked_blocks += __builtin_popcountll(fs.bitmap[w] & ~state->expected[w] & mask);
+    report->unmarked_blocks += __builtin_popcountll(state->expected[w] & ~fs.bitmap[w] & mask);
   }
-  // Update bitmap
-  if (update_bitmap(1) < 0) {
-    free(rb);
-    return -1;
+  report->phase_ms[FSCK_COMPARE] = fsck_elapsed(&clock);
+  int problems = report->leaked_blocks + report->unmarked_blocks + report->double_allocations
+    + report->bad_pointers + report->dangling_entries + report->orphan_inodes;
+  if (!repair) {
+    return problems;
   }
-  return 0;
-}
 
-// // Gets index of the first free inode or -1 on error.
-_u32 get_first_free_inode() {
-  rootblock_t * rb = get_rootblock();
-  if (rb == NULL) {
-    return -1;
+  // Repair: drop dangling entries, free orphans and make the bitmap match. 
+  // Blocks claimed twice and bad pointers are only reported.
+  for (_u32 i = 0; i < state->num_dangling; i++) {
+    dir_index *dir = dir_get(state->dangling[i].dir);
+    journal_start();
+    if (dir != NULL) {
+      pthread_rwlock_wrlock(&dir->lock);
+      report->repaired += dir_remove(dir, state->dangling[i].name) == 0;
+      pthread_rwlock_unlock(&dir->lock);
+    }
+    journal_stop();
   }
-  // Read each inode block
-  for (int i = 1 + rb->num_free_bitmap_blocks; i < 1 + rb->num_free_bitmap_blocks + rb->num_inode_table_blocks; i++) {
-    Byte buffer[rb->block_size];
-    if (read_block(i, buffer) < 0) {
-      free(rb);
-      return -1;
+  journal_start();
+  for (_u32 i = 0; i < fs.num_inodes; i++) {
+    if (fsck_test(state->used, i) && !fsck_test(state->referenced, i)) {
+      report->repaired += free_inode(i) == 0;
     }
-    // Read each inode
-    for (int j = 0; j < rb->block_size / sizeof(inode_t); j++) {
-      int flag = 1; // 1 means free, 0 occupied
-      // Read each Byte
-      for (int k = j * sizeof(inode_t); k < j * sizeof(inode_t) + sizeof(inode_t); k++) {
-        if (buffer[k] != 0) {
-          flag = 0;
-          break;
-        }
-      }
-      if (flag == 1) {
-        _u32 free_inode_index = (i - (1 + rb->num_free_bitmap_blocks)) * (rb->block_size / sizeof(inode_t)) + j;
-        free(rb);
-        return free_inode_index;
+  }
+  pthread_mutex_lock(&alloc_lock);
+  for (_u32 i = 0; i < fs.rb.num_blocks; i++) {
+    if (fsck_test(state->expected, i) != bitmap_test(i)) {
+      if (fsck_test(state->expected, i)) {
+        bitmap_set(i);
+      } else {
+        bitmap_clear(i);
       }
+      report->repaired++;
     }
   }
-  free(rb);
-  return -1;
+  pthread_mutex_unlock(&alloc_lock);
+  int result = bitmap_flush();
+  journal_stop();
+  report->phase_ms[FSCK_REPAIR] = fsck_elapsed(&clock);
+  return result < 0 ? -1 : problems;
 }
 
-// Reads inode at index in inode table into buffer
-int read_inode(_u32 index, _u32 *buffer) {
-  rootblock_t * rb = get_rootblock();
-  if (rb == NULL) {
-    free(rb);
+/*Checks the loaded file system, see include/filesystem.h. Nothing else 
+may use the file system meanwhile.*/
+static int do_fsck_run(int repair, _u32 threads, fsck_report_t *report) {
+  if (fd < 0) {
     return -1;
   }
-  // index is out of bounds
-  if (index >= rb->num_inode_table_blocks * (rb->block_size / sizeof(inode_t)) || index < 0) {
-    free(rb);
-    return -1;
+  fsck_report_t local;
+  if (report == NULL) {
+    report = &local;
   }
-  int offset = 1 + rb->num_free_bitmap_blocks;
-  fseek(fp, offset * rb->block_size + index * sizeof(inode_t), SEEK_SET);
-  if (fread(buffer, sizeof(_u32), 8, fp) < 0) {
-    free(rb);
-    return -1;
+  memset(report, 0, sizeof(fsck_report_t));
+  if (threads == 0) {
+    threads = get_nprocs();
   }
-  free(rb);
-  return 0;
-}
-
- // Writes inode to index in inode table
-int write_inode(_u32 index, _u32 *buffer) {
-  rootblock_t * rb = get_rootblock();
-  if (rb == NULL) {
-    free(rb);
-    return -1;
+  threads = threads < 1 ? 1 : threads > FSCK_MAX_THREADS ? FSCK_MAX_THREADS : threads;
+  report->threads = threads;
+  // The inode table and bitmap on disk (or in the write buffer) have to be current
+  journal_start();
+  int flushed = files_flush();
+  if (bitmap_flush() < 0) {
+    flushed = -1;
   }
-  // index is out of bounds
-  if (index >= rb->num_inode_table_blocks * (rb->block_size / sizeof(inode_t)) || index < 0) {
-    free(rb);
+  journal_stop();
+  if (flushed < 0) {
     return -1;
   }
-  int offset = 1 + rb->num_free_bitmap_blocks;
-  fseek(fp, offset * rb->block_size + index * sizeof(inode_t), SEEK_SET);
-  if (fwrite(buffer, sizeof(_u32), 8, fp) < 0) {
-    free(rb);
-    return -1;
+  fsck_state state;
+  memset(&state, 0, sizeof(state));
+  _u32 block_words = (fs.rb.num_blocks + 63) / 64;
+  _u32 inode_words = (fs.num_inodes + 63) / 64;
+  state.expected = calloc(block_words, sizeof(uint64_t));
+  state.shared = calloc(block_words, sizeof(uint64_t));
+  state.used = calloc(inode_words, sizeof(uint64_t));
+  state.referenced = calloc(inode_words, sizeof(uint64_t));
+  state.visited = calloc(inode_words, sizeof(uint64_t));
+  state.queue_capacity = 64;
+  state.queue = malloc(state.queue_capacity * sizeof(_u32));
+  state.report = report;
+  pthread_mutex_init(&state.lock, NULL);
+  pthread_cond_init(&state.cond, NULL);
+  int result = -1;
+  if (state.expected != NULL && state.shared != NULL && state.used != NULL
+      && state.referenced != NULL && state.visited != NULL && state.queue != NULL) {
+    result = fsck_check(&state, repair, threads);
   }
-  free(rb);
-  return 0;
+  pthread_mutex_destroy(&state.lock);
+  pthread_cond_destroy(&state.cond);
+  free(state.expected);
+  free(state.shared);
+  free(state.used);
+  free(state.referenced);
+  free(state.visited);
+  free(state.queue);
+  free(state.dangling);
+  return result;
 }
 
-/*Given a decimal number 0 <= b <= 255, calculate the 
-number of 1's if this number is converted to binary.*/
-int get_positive_bits(Byte b) {
-  int result = 0;
-  for (int i = 0; i < 8; i++) {
-    if ((b >> i) & 1) {
-      result += 1;
-    }
-  }
+int fsck_run(int repair, _u32 threads, fsck_report_t *report) {
+  unsigned long long start = stats_start(FS_OP_FSCK);
+  int result = do_fsck_run(repair, threads, report);
+  stats_op(FS_OP_FSCK, start, result < 0);
   return result;
 }
 
-/* Increments the occupied bits by num
-and updates the bitmap accordingly */
-int update_bitmap(_u32 num) {
-  rootblock_t * rb = get_rootblock();
-  if (rb == NULL) {
-    return -1;
-  }
-  // Changing the free block bitmap
-  int num_occupied_blocks = rb->num_blocks - num_free_blocks() + num;
-  // number of 8 positive-bit (FF) bytes
-  _u32 num_8_bit_bytes = 0;
-  for (int i = 7; i < num_occupied_blocks; i = i + 8) {
-    num_8_bit_bytes += 1;
-  }
-  int blocks_to_write = 1; // we'll need to write 1 block in any case
-  int temp = num_8_bit_bytes;
-  for (int i = 0; i < rb->num_free_bitmap_blocks - 1; i++) {
-    if (temp <= rb->block_size) {
-      break;
-    } else if (temp - rb->block_size > 0) {
-      temp -= rb->block_size;
-      blocks_to_write += 1;
-    }
-  }
-  for (int i = 0; i < blocks_to_write; i++) {
-    Byte bitmap_buffer[rb->block_size];
-    // Write 8 positive-bit (FF) bytes
-    if (num_8_bit_bytes > rb->block_size) { // not the last block
-      for (int i = 0; i < rb->block_size; i++) {
-        bitmap_buffer[i] = 255;
-      }
-      num_8_bit_bytes -= rb->block_size;
-      if (write_block(i+1, bitmap_buffer) < 0) {
-        free(rb);
-        return -1;
-      }
-    } else { // last block case
-      for (int i = 0; i < num_8_bit_bytes; i++) {
-        bitmap_buffer[i] = 255;
-      }
-      int remainder = num_occupied_blocks % 8;
-      if (remainder != 0) {
-        int result = 2;
-        for (int i = 1; i < remainder; i++) {
-          result *= 2;
-        }
-        result -= 1;
-        bitmap_buffer[num_8_bit_bytes] = result;
-      } else {
-        bitmap_buffer[num_8_bit_bytes] = 1;
-      }
-      for (int i = num_8_bit_bytes + 1; i < rb->block_size; i++) {
-        bitmap_buffer[i] = 0;
-      }
-      if (write_block(i + 1, bitmap_buffer) < 0) {
-        free(rb);
-        return -1;
-      }
-    }
-  }
-  free(rb);
-  return 0;
-}
\ No newline at end of file
+/*Checks the loaded file system and repairs what it can. Returns the number 
+of problems found, 0 for a consistent file system, or -1 on error.*/
+int fsck(void) {
+  return fsck_run(1, 0, NULL);
+}
@@ -0,0 +1,123 @@
+#include <pthread.h>
+#include "testcase.h"
+
+#define NUM_REQUESTS 12
+
+// Out of order, with two runs of adjacent blocks and a few loners
+static _u32 indexes[NUM_REQUESTS]={3000,205,203,3001,204,1000,206,3002,4095,202,2000,207};
+
+static int check(_u32 write_buffer_size) {
+    load("batched_io.disk",write_buffer_size);
+    _u32 block_size=get_rootblock()->block_size;
+    Byte data[NUM_REQUESTS][block_size];
+    block_request_t requests[NUM_REQUESTS];
+    for (int i=0;i<NUM_REQUESTS;i++) {
+        memset(data[i],(Byte) (indexes[i]+write_buffer_size),block_size);
+        requests[i].index=indexes[i];
+        requests[i].buffer=data[i];
+    }
+    if (write_blocks(requests,NUM_REQUESTS)!=0)
+        return -1;
+    // Every buffer stays paired with its own index after sorting
+    for (int i=1;i<NUM_REQUESTS;i++) {
+        if (requests[i-1].index>requests[i].index || requests[i].buffer[0]!=(Byte) (requests[i].index+write_buffer_size))
+            return -1;
+    }
+    // Reads see the new contents whether or not they are still buffered
+    Byte copy[NUM_REQUESTS][block_size];
+    for (int i=0;i<NUM_REQUESTS;i++) {
+        requests[i].index=indexes[NUM_REQUESTS-1-i];
+        requests[i].buffer=copy[i];
+    }
+    if (read_blocks(requests,NUM_REQUESTS)!=0)
+        return -1;
+    for (int i=0;i<NUM_REQUESTS;i++) {
+        Byte single[block_size];
+        if (read_block(requests[i].index,single)!=0 || memcmp(single,requests[i].buffer,block_size)!=0)
+            return -1;
+        if (requests[i].buffer[block_size-1]!=(Byte) (requests[i].index+write_buffer_size))
+            return -1;
+    }
+    // Indexes past the end of the disk are rejected
+    requests[0].index=4096;
+    if (read_blocks(requests,1)==0 || write_blocks(requests,1)==0)
+        return -1;
+    unload();
+    return 0;
+}
+
+#define NUM_VERSIONS 2000
+#define RACE_BLOCKS 1024
+
+static _u32 published;
+
+// Writes RACE_BLOCKS blocks stamped with each version in turn, publishing a
+// version once it is written and then flushing it to the disk
+static void *rewrite(void *arg)
+{
+    Byte data[RACE_BLOCKS][128];
+    block_request_t requests[RACE_BLOCKS];
+    for (_u32 version=1;version<=NUM_VERSIONS;version++) {
+        for (int i=0;i<RACE_BLOCKS;i++) {
+            memset(data[i],0,128);
+            memcpy(data[i],&version,sizeof(_u32));
+            requests[i].index=1000+i;
+            requests[i].buffer=data[i];
+        }
+        if (write_blocks(requests,RACE_BLOCKS)!=0)
+            return (void *) -1;
+        __atomic_store_n(&published,version,__ATOMIC_RELEASE);
+        fsync();
+    }
+    return arg;
+}
+
+// A read racing with a flush never goes back to a version older than the one
+// published before it started
+static int race_flush(void)
+{
+    load("batched_io.disk",2*RACE_BLOCKS);
+    published=0;
+    pthread_t writer;
+    pthread_create(&writer,NULL,rewrite,NULL);
+    Byte data[RACE_BLOCKS][128];
+    block_request_t requests[RACE_BLOCKS];
+    int result=0;
+    _u32 seen;
+    do {
+        seen=__atomic_load_n(&published,__ATOMIC_ACQUIRE);
+        for (int i=0;i<RACE_BLOCKS;i++) {
+            requests[i].index=1000+i;
+            requests[i].buffer=data[i];
+        }
+        if (read_blocks(requests,RACE_BLOCKS)!=0)
+            result=-1;
+        for (int i=0;i<RACE_BLOCKS;i++) {
+            _u32 version;
+            memcpy(&version,data[i],sizeof(_u32));
+            if (version<seen)
+                result=-1;
+        }
+    } while (result==0 && seen<NUM_VERSIONS);
+    void *written;
+    pthread_join(writer,&written);
+    unload();
+    return written==NULL ? result : -1;
+}
+
+int main()
+{
+    format("batched_io.disk",128,4096,80);
+    unload();
+    if (check(0)!=0 || check(5)!=0 || race_flush()!=0)
+        return -1;
+    // What was left in the write buffer reached the disk at unload
+    load("batched_io.disk",0);
+    Byte block[128];
+    if (read_block(3002,block)!=0 || block[0]!=(Byte) (3002+5))
+        return -1;
+    unload();
+    remove("batched_io.disk");
+    printf("batched_io PASS\n");
+    return 0;
+}
@@ -0,0 +1,59 @@
+#include "testcase.h"
+
+#define NUM_BENCHMARKS 12
+
+// Every benchmark make bench runs, in the order it reports them
+static char *expected[NUM_BENCHMARKS]={"format_4mb","format_64mb","format_1024mb","create_file","open_file",
+    "num_free_counts","mkdir_fanout","lookup_path","fputc_small","fgetc_small","fputc_large","fgetc_large"};
+
+// Checks one result line: the fields come in a fixed order, with sane values
+static int check_result(char *line, int index)
+{
+    char name[64], rest[64];
+    double ops, seconds, ops_per_sec, p50, p99, mb_per_sec;
+    if (sscanf(line,"    {\"name\": \"%63[^\"]\", \"ops\": %lf, \"seconds\": %lf, \"ops_per_sec\": %lf, "
+        "\"p50_us\": %lf, \"p99_us\": %lf%63[^\n]",name,&ops,&seconds,&ops_per_sec,&p50,&p99,rest)!=7)
+        return -1;
+    if (index>=NUM_BENCHMARKS || strcmp(name,expected[index])!=0 || ops<1 || seconds<=0 || ops_per_sec<=0
+        || p50<0 || p99<p50)
+        return -1;
+    // Throughput runs also give MB/s. Every line but the last ends in a comma.
+    int throughput=strncmp(name,"fputc",5)==0 || strncmp(name,"fgetc",5)==0;
+    char *end=rest;
+    if (throughput && (sscanf(rest,", \"mb_per_sec\": %lf",&mb_per_sec)!=1 || mb_per_sec<=0 || (end=strchr(rest,'}'))==NULL))
+        return -1;
+    return strcmp(end,index==NUM_BENCHMARKS-1 ? "}" : "},")==0 ? 0 : -1;
+}
+
+int main()
+{
+    // make bench prints a JSON object holding one line for each benchmark
+    FILE *out=popen("make -s --no-print-directory bench","r");
+    char line[512];
+    int count=0, state=0;
+    if (out==NULL)
+        return -1;
+    while (fgets(line,sizeof(line),out)!=NULL) {
+        if (state==0 && strcmp(line,"{\n")==0)
+            state=1;
+        else if (state==1 && strcmp(line,"  \"write_buffer_size\": 64,\n")==0)
+            state=2;
+        else if (state==2 && strcmp(line,"  \"benchmarks\": [\n")==0)
+            state=3;
+        else if (state==3 && strcmp(line,"  ]\n")==0)
+            state=4;
+        else if (state==3 && check_result(line,count)==0)
+            count++;
+        else if (state==4 && strcmp(line,"}\n")==0)
+            state=5;
+        else
+            state=-1;
+    }
+    if (pclose(out)!=0 || state!=5 || count!=NUM_BENCHMARKS)
+        return -1;
+    // and leaves no image behind
+    if (fopen("bench.disk","r")!=NULL)
+        return -1;
+    printf("bench_json PASS\n");
+    return 0;
+}
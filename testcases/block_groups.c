@@ -0,0 +1,86 @@
+#include "testcase.h"
+
+// 1024 blocks and 20 inodes to a group with these sizes
+#define BLOCKS_PER_GROUP 1024
+#define INODES_PER_GROUP 20
+
+// Opens name and returns the group its inode is in
+static int inode_group(char *name)
+{
+    my_file *file=my_fopen(name);
+    if (file==NULL)
+        return -1;
+    int group=file->inode_num/INODES_PER_GROUP;
+    my_fclose(file);
+    return group;
+}
+
+// Checks that the direct blocks of name are contiguous and all in group
+static int check_blocks(char *name, int group)
+{
+    my_file *file=my_fopen(name);
+    if (file==NULL)
+        return -1;
+    for (int i=0;i<5;i++) {
+        if (file->inode->blocks[i]!=file->inode->blocks[0]+i || file->inode->blocks[i]/BLOCKS_PER_GROUP!=(_u32) group)
+            return -1;
+    }
+    return my_fclose(file);
+}
+
+int main()
+{
+    mount_fresh("block_groups.disk",128,4096,80,0);
+
+    // Directories spread over the groups, their files follow them
+    mkdir("/a");
+    mkdir("/b");
+    int a=inode_group("/a/x"), b=inode_group("/b/y");
+    if (a<=0 || b<=0 || a==b || inode_group("/root")!=0)
+        return -1;
+
+    // Files written in turn still get contiguous blocks, each in its own group
+    my_file *x=my_fopen("/a/x");
+    my_file *y=my_fopen("/b/y");
+    Byte block[128];
+    memset(block,'x',sizeof(block));
+    for (int i=0;i<5;i++) {
+        if (my_fputc(x,block,sizeof(block))!=0 || my_fputc(y,block,sizeof(block))!=0)
+            return -1;
+    }
+    my_fclose(x);
+    my_fclose(y);
+    if (check_blocks("/a/x",a)!=0 || check_blocks("/b/y",b)!=0 || inode_group("/a/z")!=a)
+        return -1;
+
+    // A full group passes its files on to the next one
+    char name[32];
+    _u32 free_inodes=num_free_inodes();
+    for (int i=0;i<INODES_PER_GROUP;i++) {
+        sprintf(name,"/a/f%d",i);
+        if (inode_group(name)<0)
+            return -1;
+    }
+    if (inode_group("/a/f19")!=(a+1)%4 || num_free_inodes()!=free_inodes-INODES_PER_GROUP)
+        return -1;
+
+    // The groups are counted again when the disk is loaded
+    remount("block_groups.disk",0);
+    if (inode_group("/b/new")!=b || check_blocks("/a/x",a)!=0 || fsck()!=0)
+        return -1;
+    unload();
+
+    // With a lazily initialised inode table, directories stay where the
+    // table has been written instead of spreading
+    set_format_flags(FS_FORMAT_LAZY_ITABLE);
+    format("block_groups.disk",128,4096,80);
+    set_format_flags(0);
+    _u32 uninit=get_rootblock()->num_uninit_inode_table_blocks;
+    mkdir("/c");
+    if (inode_group("/c/x")!=0 || get_rootblock()->num_uninit_inode_table_blocks!=uninit)
+        return -1;
+    unload();
+    remove("block_groups.disk");
+    printf("block_groups PASS\n");
+    return 0;
+}
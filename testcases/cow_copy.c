@@ -0,0 +1,125 @@
+#include "testcase.h"
+
+#define FILE_SIZE 100000
+
+// Reads the whole of name into buffer
+static int read_file(char *name, Byte *buffer)
+{
+    my_file *file=my_fopen(name);
+    if (file==NULL || file->inode->size!=FILE_SIZE || my_fgetc(file,buffer,FILE_SIZE)!=0)
+        return -1;
+    return my_fclose(file);
+}
+
+// Writes num bytes of buffer at pos in name
+static int write_at(char *name, _u32 pos, Byte *buffer, _u32 num)
+{
+    my_file *file=my_fopen(name);
+    if (file==NULL || my_fseek(file,pos)!=0 || my_fputc(file,buffer,num)!=0)
+        return -1;
+    return my_fclose(file);
+}
+
+// Takes every free block and gives back every other one
+static void fragment(void)
+{
+    static _u32 taken[4096];
+    int count=0;
+    while ((taken[count]=allocate_block(0))!=(_u32) -1)
+        count++;
+    for (int i=0;i<count;i+=2)
+        free_block(taken[i]);
+}
+
+int main()
+{
+    // Reaches the double indirect block with 128-byte blocks
+    mount_fresh("cow_copy.disk",128,4096,80,0);
+    static Byte data[FILE_SIZE], copy[FILE_SIZE], buffer[FILE_SIZE];
+    for (int i=0;i<FILE_SIZE;i++)
+        data[i]=(Byte) (i*7+i/128);
+    write_file("src",data,FILE_SIZE);
+    mkdir("/d");
+
+    // The first copy also makes the refcount table, 4096 two-byte counts
+    _u32 free_blocks=num_free_blocks();
+    if (cp("src","/d/copy")!=0 || free_blocks-num_free_blocks()!=64)
+        return -1;
+    free_blocks=num_free_blocks();
+    if (cp("/src","copy2")!=0 || num_free_blocks()!=free_blocks)
+        return -1;
+    if (check_file("/d/copy",data,FILE_SIZE)!=0)
+        return -1;
+
+    // Writing behind the double indirect block copies it, the single
+    // indirect block under it and the data block
+    if (write_at("/d/copy",50000,(Byte *) "copy",4)!=0 || free_blocks-num_free_blocks()!=3)
+        return -1;
+    memcpy(copy,data,FILE_SIZE);
+    memcpy(copy+50000,"copy",4);
+    if (check_file("src",data,FILE_SIZE)!=0 || check_file("/d/copy",copy,FILE_SIZE)!=0)
+        return -1;
+
+    // And the other way round, through a direct block
+    free_blocks=num_free_blocks();
+    if (write_at("src",10,(Byte *) "source",6)!=0 || free_blocks-num_free_blocks()!=1)
+        return -1;
+    if (check_file("/d/copy",copy,FILE_SIZE)!=0 || check_file("copy2",data,FILE_SIZE)!=0)
+        return -1;
+    memcpy(data+10,"source",6);
+
+    // Sharing survives a remount, and fsck counts shared blocks as fine.
+    // load() reads the table in, which counts as its own region.
+    unload();
+    fs_stats_reset();
+    load("cow_copy.disk",0);
+    fs_stats_t stats;
+    if (fs_stats(&stats)!=0 || stats.block_reads[FS_REGION_REFCOUNT]!=64)
+        return -1;
+    fsck_report_t report;
+    if (fsck_run(0,4,&report)!=0 || report.double_allocations!=0)
+        return -1;
+    static Byte block_data[20000];
+    memset(block_data,'w',sizeof(block_data));
+    if (write_at("copy2",0,block_data,sizeof(block_data))!=0)
+        return -1;
+    if (check_file("src",data,FILE_SIZE)!=0 || check_file("/d/copy",copy,FILE_SIZE)!=0
+        || read_file("copy2",buffer)!=0 || memcmp(buffer,block_data,sizeof(block_data))!=0)
+        return -1;
+
+    // A missing source, a directory and a name that is taken all fail
+    if (cp("missing","x")==0 || cp("/d","x")==0 || cp("src","copy2")==0 || cp("src","/none/x")==0)
+        return -1;
+    if (fsck()!=0)
+        return -1;
+    unload();
+
+    // On a disk too fragmented for the table the data is copied instead
+    format("cow_copy.disk",128,4096,80);
+    write_file("/small",data,3000);
+    fragment();
+    free_blocks=num_free_blocks();
+    if (cp("/small","/big")!=0 || get_rootblock()->refcount_blocks!=0
+        || free_blocks-num_free_blocks()!=25 || write_at("/big",0,(Byte *) "big",3)!=0)
+        return -1;
+    memcpy(copy,data,3000);
+    memcpy(copy,"big",3);
+    if (check_file("/small",data,3000)!=0 || check_file("/big",copy,3000)!=0)
+        return -1;
+
+    // A disk formatted with the table shares blocks from the first copy on
+    set_format_flags(FS_FORMAT_REFCOUNT);
+    format("cow_copy.disk",128,4096,80);
+    set_format_flags(0);
+    if (get_rootblock()->refcount_blocks!=64 || num_free_blocks()!=4096-1-4-20-1-64)
+        return -1;
+    write_file("/small",data,3000);
+    fragment();
+    free_blocks=num_free_blocks();
+    if (cp("/small","/big")!=0 || num_free_blocks()!=free_blocks)
+        return -1;
+    unload();
+    remove("cow_copy.disk");
+    printf("cow_copy PASS\n");
+    return 0;
+}
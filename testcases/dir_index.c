@@ -0,0 +1,43 @@
+#include "testcase.h"
+
+#define NUM_FILES 1500
+
+int main()
+{
+    // The root directory grows well past its first block
+    mount_fresh("dir_index.disk",128,8192,2048,0);
+    _u32 inodes[NUM_FILES];
+    char name[32];
+    for (int i=0;i<NUM_FILES;i++) {
+        sprintf(name,"file%d",i);
+        my_file *file=my_fopen(name);
+        if (file==NULL)
+            return -1;
+        inodes[i]=file->inode_num;
+        my_fputc(file,(Byte *) name,strlen(name)+1);
+        my_fclose(file);
+    }
+    if (mkdir("file7")==0)
+        return -1;
+
+    remount("dir_index.disk",0);
+    _u32 free_inodes=num_free_inodes();
+    for (int i=NUM_FILES-1;i>=0;i--) {
+        sprintf(name,"file%d",i);
+        my_file *file=my_fopen(name);
+        if (file==NULL || file->inode_num!=inodes[i])
+            return -1;
+        Byte buffer[32];
+        my_fgetc(file,buffer,strlen(name)+1);
+        my_fclose(file);
+        if (strcmp((char *)buffer,name)!=0)
+            return -1;
+    }
+    // Opening existing files must not create anything
+    if (num_free_inodes()!=free_inodes)
+        return -1;
+    unload();
+    remove("dir_index.disk");
+    printf("dir_index PASS\n");
+    return 0;
+}
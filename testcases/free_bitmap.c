@@ -0,0 +1,54 @@
+#include "testcase.h"
+
+int main()
+{
+    // 1 rootblock, 4 bitmap blocks, 20 inode table blocks and the root
+    // directory's block: 26 used blocks, which don't end on a byte boundary
+    format("free_bitmap.disk",128,4096,80);
+    if (num_free_blocks()!=4096-26)
+        return -1;
+    remount("free_bitmap.disk",0);
+    Byte bitmap[128];
+    if (read_block(1,bitmap)!=0 || bitmap[0]!=0xff || bitmap[2]!=0xff || bitmap[3]!=0x03 || bitmap[4]!=0)
+        return -1;
+
+    // A run is handed out across a word boundary and stops at a used block
+    _u32 allocated;
+    if (allocate_blocks(60,10,&allocated)!=60 || allocated!=10 || allocate_block(100)!=100)
+        return -1;
+    if (allocate_blocks(95,10,&allocated)!=95 || allocated!=5 || num_free_blocks()!=4096-26-16)
+        return -1;
+    // A goal in use moves on to the next free block
+    if (allocate_block(60)!=70 || free_block(70)!=0)
+        return -1;
+    for (_u32 i=60;i<70;i++)
+        free_block(i);
+    remount("free_bitmap.disk",0);
+    if (num_free_blocks()!=4096-26-6 || allocate_block(26)!=26)
+        return -1;
+    unload();
+
+    // Every block of a disk whose size isn't a whole number of words can be
+    // used, and no more
+    format("free_bitmap.disk",128,1000,80);
+    _u32 free_blocks=num_free_blocks(), total=0;
+    while (allocate_blocks(0,300,&allocated)!=(_u32) -1)
+        total+=allocated;
+    if (total!=free_blocks || num_free_blocks()!=0 || allocate_block(999)!=(_u32) -1)
+        return -1;
+    unload();
+
+    // An image whose bitmap has fewer bits than it has blocks is refused
+    format("free_bitmap.disk",128,4096,80);
+    unload();
+    FILE *image=fopen("free_bitmap.disk","r+b");
+    _u32 bitmap_blocks=1;
+    fseek(image,2*sizeof(_u32),SEEK_SET);
+    fwrite(&bitmap_blocks,sizeof(_u32),1,image);
+    fclose(image);
+    if (load("free_bitmap.disk",0)==0)
+        return -1;
+    remove("free_bitmap.disk");
+    printf("free_bitmap PASS\n");
+    return 0;
+}
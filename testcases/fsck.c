@@ -0,0 +1,77 @@
+#include "testcase.h"
+
+// Flips the bitmap bit of block index straight on disk
+static void flip_bit(_u32 index)
+{
+    rootblock_t *rb=get_rootblock();
+    Byte block[128];
+    _u32 bitmap_block=1+index/(rb->block_size*8);
+    read_block(bitmap_block,block);
+    block[(index%(rb->block_size*8))/8]^=1<<(index%8);
+    write_block(bitmap_block,block);
+}
+
+int main()
+{
+    mount_fresh("fsck.disk",128,4096,80,0);
+    static Byte data[2000];
+    memset(data,'k',sizeof(data));
+    mkdir("/a");
+    mkdir("/a/b");
+    char name[32];
+    for (int i=0;i<6;i++) {
+        sprintf(name,"/a/b/f%d",i);
+        write_file(name,data,i*400);
+    }
+    fsck_report_t report;
+    if (fsck_run(0,4,&report)!=0 || report.used_inodes!=9 || report.directories!=3
+        || report.used_blocks!=4096-num_free_blocks() || report.threads!=4)
+        return -1;
+
+    // Break it: a leaked block, a used block marked free, a file whose inode
+    // was freed under its entry, and a block shared by two files
+    my_file *file=my_fopen("/a/b/f5");
+    _u32 f5_block=file->inode->blocks[0];
+    my_fclose(file);
+    file=my_fopen("/a/b/f4");
+    _u32 f4_inode=file->inode_num;
+    my_fclose(file);
+    file=my_fopen("/a/b/f3");
+    _u32 f3_inode=file->inode_num;
+    my_fclose(file);
+    _u32 inode[8];
+    read_inode(f3_inode,inode);
+    inode[2]=f5_block;
+    write_inode(f3_inode,inode);
+    remount("fsck.disk",0);
+    flip_bit(4000);
+    flip_bit(f5_block);
+    free_inode(f4_inode);
+    remount("fsck.disk",0);
+
+    // f4's 13 data blocks and indirect block leak, with block 4000 and the
+    // block f3 no longer points at
+    if (fsck_run(0,2,&report)!=19 || report.leaked_blocks!=16 || report.unmarked_blocks!=1
+        || report.double_allocations!=1 || report.dangling_entries!=1 || report.orphan_inodes!=0)
+        return -1;
+    if (fsck()!=19)
+        return -1;
+    _u32 free_blocks=num_free_blocks();
+    remount("fsck.disk",0);
+    if (num_free_blocks()!=free_blocks || fsck_run(0,1,&report)!=1 || report.double_allocations!=1)
+        return -1;
+    if (check_file("/a/b/f5",data,2000)!=0)
+        return -1;
+
+    // An inode that no directory names is freed
+    _u32 orphan=allocate_inode();
+    _u32 orphan_inode[8]={1,0,0,0,0,0,0,0};
+    write_inode(orphan,orphan_inode);
+    _u32 free_inodes=num_free_inodes();
+    if (fsck()!=2 || num_free_inodes()!=free_inodes+1)
+        return -1;
+    unload();
+    remove("fsck.disk");
+    printf("fsck PASS\n");
+    return 0;
+}
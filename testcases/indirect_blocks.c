@@ -0,0 +1,50 @@
+#include "testcase.h"
+
+#define FILE_SIZE 100000
+
+int main()
+{
+    // 128 byte blocks: the file needs direct, single and double indirect blocks
+    mount_fresh("indirect_blocks.disk",128,4096,80,0);
+
+    Byte *data=malloc(FILE_SIZE);
+    for (int i=0;i<FILE_SIZE;i++)
+        data[i]=(Byte) (i*7+i/251);
+
+    my_file *file=my_fopen("big");
+    // Write in uneven chunks so that writes straddle block boundaries
+    for (int done=0,chunk=1;done<FILE_SIZE;done+=chunk,chunk=chunk*3%1000+1) {
+        if (chunk>FILE_SIZE-done)
+            chunk=FILE_SIZE-done;
+        if (my_fputc(file,data+done,chunk)!=0)
+            return -1;
+    }
+    my_fclose(file);
+
+    remount("indirect_blocks.disk",0);
+    // 782 data blocks, 1 single indirect, 1 double indirect and 24 of its children
+    if (num_free_blocks()!=4070-808)
+        return -1;
+    Byte *check=malloc(FILE_SIZE);
+    file=my_fopen("big");
+    if (file->inode->size!=FILE_SIZE)
+        return -1;
+    if (my_fgetc(file,check,FILE_SIZE)!=0 || memcmp(data,check,FILE_SIZE)!=0)
+        return -1;
+    // Reading past the end fails
+    if (my_fgetc(file,check,1)==0)
+        return -1;
+
+    // Overwrite a range in the middle and read it back
+    my_fseek(file,50000);
+    my_fputc(file,(Byte *) "overwritten",12);
+    my_fseek(file,49990);
+    my_fgetc(file,check,30);
+    if (memcmp(check,data+49990,10)!=0 || strcmp((char *)check+10,"overwritten")!=0 || memcmp(check+22,data+50012,8)!=0)
+        return -1;
+    my_fclose(file);
+    unload();
+    remove("indirect_blocks.disk");
+    printf("indirect_blocks PASS\n");
+    return 0;
+}
@@ -0,0 +1,73 @@
+#include "testcase.h"
+
+// Counts the inodes of the table that are free, i.e. all zeros, and stores
+// the lowest of them in first
+static _u32 count_free(_u32 num_inodes, _u32 *first)
+{
+    _u32 count=0;
+    *first=(_u32) -1;
+    for (_u32 i=0;i<num_inodes;i++) {
+        _u32 inode[8];
+        int used=0;
+        if (read_inode(i,inode)!=0)
+            return (_u32) -1;
+        for (int j=0;j<8;j++)
+            used|=inode[j]!=0;
+        if (!used && count++==0)
+            *first=i;
+    }
+    return count;
+}
+
+// Checks the inode map against the table
+static int check_map(_u32 num_inodes)
+{
+    _u32 first;
+    _u32 count=count_free(num_inodes,&first);
+    return count==num_free_inodes() && first==get_first_free_inode() ? 0 : -1;
+}
+
+int main()
+{
+    format("inode_map.disk",128,4096,80);
+    if (num_free_inodes()!=79 || get_first_free_inode()!=1 || check_map(80)!=0)
+        return -1;
+
+    // Files take the lowest inodes, and one cleared in the table is handed out
+    // again first
+    _u32 inode[8]={1,0,0,0,0,0,0,0}, empty[8]={0};
+    char name[32];
+    for (int i=0;i<5;i++) {
+        sprintf(name,"file%d",i);
+        my_file *file=my_fopen(name);
+        my_fclose(file);
+    }
+    if (num_free_inodes()!=74 || get_first_free_inode()!=6 || check_map(80)!=0)
+        return -1;
+    if (write_inode(3,empty)!=0 || num_free_inodes()!=75 || get_first_free_inode()!=3 || check_map(80)!=0)
+        return -1;
+
+    // Inodes written straight into the table are counted as well
+    if (write_inode(79,inode)!=0 || num_free_inodes()!=74 || check_map(80)!=0)
+        return -1;
+
+    // The map is built again from the table by load()
+    remount("inode_map.disk",0);
+    if (num_free_inodes()!=74 || get_first_free_inode()!=3 || check_map(80)!=0)
+        return -1;
+
+    // An allocated inode is in use until it is freed, but only the table
+    // survives a remount
+    if (allocate_inode()!=3 || get_first_free_inode()!=6 || num_free_inodes()!=73)
+        return -1;
+    if (free_inode(3)!=0 || write_inode(79,empty)!=0 || num_free_inodes()!=75 || check_map(80)!=0)
+        return -1;
+    allocate_inode();
+    remount("inode_map.disk",0);
+    if (num_free_inodes()!=75 || get_first_free_inode()!=3 || check_map(80)!=0)
+        return -1;
+    unload();
+    remove("inode_map.disk");
+    printf("inode_map PASS\n");
+    return 0;
+}
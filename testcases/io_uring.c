@@ -0,0 +1,52 @@
+#include "testcase.h"
+
+#define FILE_SIZE 20000
+
+int main()
+{
+    // Two files written in turns end up in many short runs
+    set_io_mode(FS_IO_URING);
+    set_io_queue_depth(8);
+    mount_fresh("io_uring.disk",128,4096,80,0);
+    my_file *a=my_fopen("a");
+    my_file *b=my_fopen("b");
+    Byte data[FILE_SIZE];
+    for (int i=0;i<FILE_SIZE;i++)
+        data[i]=(Byte) (i*7);
+    for (int i=0;i<FILE_SIZE;i+=500) {
+        my_fputc(a,data+i,500);
+        my_fputc(b,data+i,500);
+    }
+    Byte buffer[FILE_SIZE];
+    my_fseek(a,0);
+    if (my_fgetc(a,buffer,FILE_SIZE)!=0 || memcmp(buffer,data,FILE_SIZE)!=0)
+        return -1;
+    my_fclose(a);
+    my_fclose(b);
+    unload();
+
+    // Reads through the ring see what is still in the write buffer
+    load("io_uring.disk",16);
+    b=my_fopen("b");
+    my_fseek(b,FILE_SIZE);
+    my_fputc(b,data,1000);
+    my_fseek(b,0);
+    if (my_fgetc(b,buffer,FILE_SIZE)!=0 || memcmp(buffer,data,FILE_SIZE)!=0)
+        return -1;
+    if (my_fgetc(b,buffer,1000)!=0 || memcmp(buffer,data,1000)!=0)
+        return -1;
+    my_fclose(b);
+    unload();
+
+    // and the result reads back the same with pread
+    set_io_mode(FS_IO_PREAD);
+    load("io_uring.disk",0);
+    b=my_fopen("b");
+    if (b->inode->size!=FILE_SIZE+1000 || my_fgetc(b,buffer,FILE_SIZE)!=0 || memcmp(buffer,data,FILE_SIZE)!=0)
+        return -1;
+    my_fclose(b);
+    unload();
+    remove("io_uring.disk");
+    printf("io_uring PASS\n");
+    return 0;
+}
@@ -0,0 +1,185 @@
+#include "testcase.h"
+
+// Copies the image as it is on disk right now, as a crash would leave it
+static int copy_image(const char *from, const char *to)
+{
+    FILE *in=fopen(from,"rb");
+    FILE *out=fopen(to,"wb");
+    char buffer[4096];
+    size_t n;
+    if (in==NULL || out==NULL)
+        return -1;
+    while ((n=fread(buffer,1,sizeof(buffer),in))>0)
+        fwrite(buffer,1,n,out);
+    fclose(in);
+    fclose(out);
+    return 0;
+}
+
+// Reads the sequence number in the journal header of image
+static _u32 header_sequence(const char *image, _u32 journal_start)
+{
+    FILE *in=fopen(image,"rb");
+    _u32 record[2]={0,0};
+    if (in==NULL)
+        return 0;
+    fseek(in,(long) journal_start*128,SEEK_SET);
+    if (fread(record,sizeof(_u32),2,in)!=2)
+        record[1]=0;
+    fclose(in);
+    return record[1];
+}
+
+// Zeroes the journal of image after its header, as if the transaction
+// written there had never reached the disk
+static int lose_journal(const char *image, _u32 journal_start, _u32 journal_blocks)
+{
+    FILE *out=fopen(image,"r+b");
+    char zeros[128]={0};
+    if (out==NULL)
+        return -1;
+    fseek(out,(long) (journal_start+1)*128,SEEK_SET);
+    for (_u32 i=1;i<journal_blocks;i++)
+        fwrite(zeros,1,sizeof(zeros),out);
+    return fclose(out);
+}
+
+int main()
+{
+    set_format_flags(FS_FORMAT_JOURNAL);
+    format("journal.disk",128,4096,80);
+    set_format_flags(0);
+    // 64 journal blocks come out of the data area
+    if (get_rootblock()->journal_blocks!=64 || num_free_blocks()!=4070-64 || num_free_inodes()!=79)
+        return -1;
+    unload();
+
+    // Committed as each operation finishes, but still only in the write buffer
+    set_journal_commit(0,128);
+    load("journal.disk",0);
+    mkdir("/a");
+    write_file("/a/f",(Byte *) "journal",8);
+    mkdir("/b");
+    _u32 free_blocks=num_free_blocks(), free_inodes=num_free_inodes();
+    copy_image("journal.disk","journal-crash.disk");
+    unload();
+
+    // Replay puts the committed blocks in place
+    load("journal-crash.disk",0);
+    if (check_file("/a/f",(Byte *) "journal",8)!=0)
+        return -1;
+    if (num_free_blocks()!=free_blocks || num_free_inodes()!=free_inodes || mkdir("/b")==0)
+        return -1;
+    unload();
+
+    // Operations that were never committed are lost as a whole
+    set_journal_commit(1000000,1000);
+    load("journal.disk",0);
+    mkdir("/c");
+    mkdir("/c/d");
+    copy_image("journal.disk","journal-crash.disk");
+    remount("journal-crash.disk",0);
+    if (num_free_blocks()!=free_blocks || num_free_inodes()!=free_inodes || mkdir("/c")!=0)
+        return -1;
+    unload();
+
+    // but fsync() commits them
+    load("journal.disk",0);
+    mkdir("/e");
+    fsync();
+    copy_image("journal.disk","journal-crash.disk");
+    remount("journal-crash.disk",0);
+    if (mkdir("/e")==0 || mkdir("/c/d")==0)
+        return -1;
+    unload();
+
+    // A clean unload leaves nothing to replay
+    load("journal.disk",0);
+    if (mkdir("/c/d")==0 || mkdir("/e")==0)
+        return -1;
+    unload();
+
+    // Removals don't checkpoint the journal. The block of a directory it
+    // logs stays in use until it starts over, file data is free at once.
+    load("journal.disk",0);
+    char name[32];
+    free_blocks=num_free_blocks();
+    mkdir("/r");
+    for (int i=0;i<8;i++) {
+        sprintf(name,"/r/f%d",i);
+        write_file(name,(Byte *) "journal",8);
+    }
+    fs_stats_t stats;
+    fs_stats_reset();
+    for (int i=0;i<8;i++) {
+        sprintf(name,"/r/f%d",i);
+        if (rm(name)!=0)
+            return -1;
+    }
+    if (rmdir("/r",0)!=0 || fs_stats(&stats)!=0 || stats.block_writes[FS_REGION_JOURNAL]!=0
+        || num_free_blocks()!=free_blocks-1 || fsck()!=0)
+        return -1;
+    fsync();
+    if (num_free_blocks()!=free_blocks || fsck()!=0)
+        return -1;
+    unload();
+
+    // When the journal starts over, the blocks the next transaction changes
+    // again are put in place as they were committed, so losing that
+    // transaction leaves the ones before it whole
+    set_journal_commit(0,128);
+    load("journal.disk",0);
+    _u32 journal_start=get_rootblock()->journal_start, journal_blocks=get_rootblock()->journal_blocks;
+    int wrapped=-1;
+    for (int i=0;i<40 && wrapped<0;i++) {
+        _u32 sequence=header_sequence("journal.disk",journal_start);
+        sprintf(name,"/w%d",i);
+        if (mkdir(name)!=0)
+            return -1;
+        if (header_sequence("journal.disk",journal_start)!=sequence)
+            wrapped=i;
+    }
+    if (wrapped<1)
+        return -1;
+    free_inodes=num_free_inodes();
+    copy_image("journal.disk","journal-crash.disk");
+    unload();
+    lose_journal("journal-crash.disk",journal_start,journal_blocks);
+    load("journal-crash.disk",0);
+    sprintf(name,"/w%d",wrapped-1);
+    if (chdir(name)!=0 || chdir("/")!=0 || num_free_inodes()!=free_inodes+1 || fsck()!=0)
+        return -1;
+    sprintf(name,"/w%d",wrapped);
+    if (chdir(name)==0)
+        return -1;
+    unload();
+
+    // The running transaction is committed before an operation rather than
+    // part way through one, so a crash after any operation leaves whole ones
+    set_journal_commit(1000000,1000);
+    set_format_flags(FS_FORMAT_JOURNAL);
+    format("journal.disk",128,4096,400);
+    set_format_flags(0);
+    char crash[32];
+    for (int i=0;i<100;i++) {
+        sprintf(name,"/m%d",i);
+        mkdir(name);
+        sprintf(name,"/m%d/f",i);
+        my_fclose(my_fopen(name));
+        sprintf(crash,"journal-crash%d.disk",i);
+        copy_image("journal.disk",crash);
+    }
+    unload();
+    for (int i=0;i<100;i++) {
+        fsck_report_t report;
+        sprintf(crash,"journal-crash%d.disk",i);
+        if (load(crash,0)!=0 || fsck_run(0,1,&report)!=0)
+            return -1;
+        unload();
+        remove(crash);
+    }
+    remove("journal.disk");
+    remove("journal-crash.disk");
+    printf("journal PASS\n");
+    return 0;
+}
@@ -0,0 +1,48 @@
+#include "testcase.h"
+
+#define NUM_FILES 30
+
+int main()
+{
+    // A lazily initialised inode table looks just like a written one
+    set_format_flags(FS_FORMAT_LAZY_ITABLE);
+    format("lazy_format.disk",128,4096,80);
+    if (num_free_blocks()!=4070 || num_free_inodes()!=79)
+        return -1;
+    if (get_rootblock()->num_uninit_inode_table_blocks!=19)
+        return -1;
+
+    remount("lazy_format.disk",8);
+    if (num_free_blocks()!=4070 || num_free_inodes()!=79)
+        return -1;
+    char name[32];
+    for (int i=0;i<NUM_FILES;i++) {
+        sprintf(name,"file%d",i);
+        if (write_file(name,(Byte *) name,strlen(name)+1)!=0)
+            return -1;
+    }
+    // Inodes 0-30 live in the first 8 blocks of the inode table
+    if (get_rootblock()->num_uninit_inode_table_blocks!=12)
+        return -1;
+
+    remount("lazy_format.disk",0);
+    if (num_free_inodes()!=79-NUM_FILES || get_rootblock()->num_uninit_inode_table_blocks!=12)
+        return -1;
+    for (int i=0;i<NUM_FILES;i++) {
+        sprintf(name,"file%d",i);
+        if (check_file(name,(Byte *) name,strlen(name)+1)!=0)
+            return -1;
+    }
+    unload();
+
+    // A large image is sized without writing its data area
+    set_format_flags(0);
+    if (format("lazy_format.disk",4096,262144,65536)!=0 || num_free_blocks()!=262144-1-8-512-1)
+        return -1;
+    if (get_rootblock()->num_uninit_inode_table_blocks!=0 || num_free_inodes()!=65535)
+        return -1;
+    unload();
+    remove("lazy_format.disk");
+    printf("lazy_format PASS\n");
+    return 0;
+}
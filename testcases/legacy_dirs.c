@@ -0,0 +1,79 @@
+#include "testcase.h"
+
+// Finds name in the root directory by reading its block, returning its inode
+static _u32 root_entry(char *name)
+{
+    _u32 root[8];
+    Byte block[128];
+    if (read_inode(0,root)!=0 || read_block(root[1],block)!=0)
+        return -1;
+    for (_u32 offset=sizeof(_u32);offset+6<root[0];offset+=6+block[offset+5])
+        if (strcmp((char *) block+offset+6,name)==0)
+            return *(_u32 *) (block+offset);
+    return -1;
+}
+
+// Turns directory name in the root into one written by the original code,
+// which left a new directory empty: no '.' or '..' entries and a size of 0
+static int make_legacy(char *name)
+{
+    _u32 inode[8];
+    _u32 inode_num=root_entry(name);
+    if (inode_num==(_u32) -1 || read_inode(inode_num,inode)!=0)
+        return -1;
+    inode[0]=0;
+    return write_inode(inode_num,inode);
+}
+
+// Checks that chdir(name) succeeds and leaves the current directory at path
+static int check_chdir(char *name, char *path)
+{
+    char *current;
+    if (chdir(name)!=0 || (current=cwd())==NULL)
+        return -1;
+    int result=strcmp(current,path);
+    free(current);
+    return result;
+}
+
+int main()
+{
+    format("legacy_dirs.disk",128,4096,80);
+    write_file("hello_world",(Byte *) "hello",6);
+    mkdir("/testdir1");
+    mkdir("/testdir2");
+    unload();
+    // The directories are rewritten on a freshly loaded image, so that no
+    // index of them is held in memory
+    load("legacy_dirs.disk",0);
+    if (make_legacy("testdir1")!=0 || make_legacy("testdir2")!=0)
+        return -1;
+    unload();
+    if (load("legacy_dirs.disk",0)!=0)
+        return -1;
+    if (check_chdir("/testdir1","/testdir1")!=0 || check_chdir("..","/")!=0)
+        return -1;
+
+    // New directories below an old one find their way back up through it
+    mkdir("/testdir1/new");
+    if (check_chdir("/testdir1/new","/testdir1/new")!=0 || check_chdir("../..","/")!=0)
+        return -1;
+
+    // Old directories can be moved into old directories and removed
+    if (mv("/testdir2","/testdir1/moved")!=0 || check_chdir("/testdir1/moved","/testdir1/moved")!=0
+        || check_chdir("..","/testdir1")!=0 || check_chdir("/","/")!=0)
+        return -1;
+    remount("legacy_dirs.disk",0);
+    if (check_chdir("/testdir1/moved/..","/testdir1")!=0 || rmdir("/testdir1",0)==0)
+        return -1;
+    chdir("/");
+    if (rmdir("/testdir1",1)!=0 || chdir("/testdir1")==0)
+        return -1;
+
+    if (check_file("hello_world",(Byte *) "hello",6)!=0)
+        return -1;
+    unload();
+    remove("legacy_dirs.disk");
+    printf("legacy_dirs PASS\n");
+    return 0;
+}
@@ -0,0 +1,28 @@
+#include "testcase.h"
+
+int main()
+{
+    // Build the disk through a mapping of the image
+    set_io_mode(FS_IO_MMAP);
+    mount_fresh("mmap_mode.disk",128,4096,80,0);
+    mkdir("/testdir1");
+    Byte data[1000];
+    fill(data,1000,0);
+    write_file("/testdir1/hello_world",data,1000);
+    fsync();
+    unload();
+
+    // and read it back with pread
+    set_io_mode(FS_IO_PREAD);
+    load("mmap_mode.disk",0);
+    if (num_free_blocks()!=4070-10)
+        return -1;
+    if (num_free_inodes()!=77)
+        return -1;
+    if (check_file("/testdir1/hello_world",data,1000)!=0)
+        return -1;
+    unload();
+    remove("mmap_mode.disk");
+    printf("mmap_mode PASS\n");
+    return 0;
+}
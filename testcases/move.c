@@ -0,0 +1,69 @@
+#include "testcase.h"
+
+int main()
+{
+    mount_fresh("move.disk",128,4096,80,0);
+    static Byte data[10000], other[3000];
+    memset(data,'g',sizeof(data));
+    memset(other,'o',sizeof(other));
+    mkdir("/a");
+    mkdir("/a/b");
+    write_file("/f",data,sizeof(data));
+
+    // Renames and moves between directories touch no data block
+    _u32 free_blocks=num_free_blocks();
+    _u32 free_inodes=num_free_inodes();
+    if (mv("/f","/a/b/g")!=0 || mv("/a/b/g","/a/b/h")!=0 || mv("/a/b/h","h")!=0)
+        return -1;
+    if (num_free_blocks()!=free_blocks || num_free_inodes()!=free_inodes
+        || check_file("/h",data,sizeof(data))!=0 || mv("/f","/x")==0 || mv("/a/b/h","/x")==0)
+        return -1;
+
+    // A file that is replaced is freed, unless it is open
+    write_file("/a/other",other,sizeof(other));
+    free_blocks=num_free_blocks();
+    my_file *file=my_fopen("/a/other");
+    if (mv("/h","/a/other")==0)
+        return -1;
+    my_fclose(file);
+    if (mv("/h","/a/other")!=0 || num_free_blocks()!=free_blocks+25 || num_free_inodes()!=free_inodes
+        || check_file("/a/other",data,sizeof(data))!=0)
+        return -1;
+
+    // A directory takes its subtree along and its '..' follows it
+    write_file("/a/b/inner",other,100);
+    chdir("/a/b");
+    if (mv("/a/b","/c")!=0 || strcmp(cwd(),"/c")!=0 || check_file("inner",other,100)!=0)
+        return -1;
+    chdir("..");
+    if (strcmp(cwd(),"/")!=0)
+        return -1;
+
+    // Nothing moves into its own subtree, or over something of another type
+    // or a directory that isn't empty
+    mkdir("/e");
+    if (mv("/c","/c/x")==0 || mv("/a","/a/other/x")==0 || mv("/c","/a/other")==0
+        || mv("/a/other","/e")==0 || mv("/e","/c")==0)
+        return -1;
+    if (mv("/c","/e")!=0 || check_file("/e/inner",other,100)!=0 || num_free_inodes()!=free_inodes-1)
+        return -1;
+
+    // Replacing a copy frees none of the blocks it shares
+    cp("/a/other","/copy");
+    free_blocks=num_free_blocks();
+    if (mv("/e/inner","/copy")!=0 || num_free_blocks()!=free_blocks || check_file("/a/other",data,sizeof(data))!=0)
+        return -1;
+    mv("/copy","/e/inner");
+
+    fsck_report_t report;
+    if (fsck_run(0,2,&report)!=0 || report.directories!=3)
+        return -1;
+    remount("move.disk",0);
+    if (check_file("/a/other",data,sizeof(data))!=0 || chdir("/e")!=0 || strcmp(cwd(),"/e")!=0
+        || check_file("inner",other,100)!=0 || fsck()!=0)
+        return -1;
+    unload();
+    remove("move.disk");
+    printf("move PASS\n");
+    return 0;
+}
@@ -0,0 +1,51 @@
+#include "testcase.h"
+
+int main()
+{
+    mount_fresh("path_resolution.disk",128,4096,80,0);
+    if (mkdir("/a")!=0 || mkdir("/a/b")!=0)
+        return -1;
+    // Parents must exist
+    if (mkdir("/x/y")==0)
+        return -1;
+    if (chdir("a")!=0 || mkdir("c")!=0)
+        return -1;
+    if (write_file("b/file",(Byte *) "deep",5)!=0)
+        return -1;
+
+    if (chdir("/a/b")!=0)
+        return -1;
+    char *path=cwd();
+    if (strcmp(path,"/a/b")!=0)
+        return -1;
+    free(path);
+    if (chdir("../c")!=0)
+        return -1;
+    path=cwd();
+    if (strcmp(path,"/a/c")!=0)
+        return -1;
+    free(path);
+    // A file is not a directory
+    if (chdir("/a/b/file")==0 || my_fopen("/a/b/file/x")!=NULL)
+        return -1;
+
+    remount("path_resolution.disk",0);
+    path=cwd();
+    if (strcmp(path,"/")!=0)
+        return -1;
+    free(path);
+    for (int i=0;i<10;i++)
+        if (check_file("/a/./b/../b/file",(Byte *) "deep",5)!=0)
+            return -1;
+    _u32 hits,misses;
+    get_dcache_stats(&hits,&misses);
+    if (hits==0)
+        return -1;
+    // root, a, b, c and the file
+    if (num_free_inodes()!=75)
+        return -1;
+    unload();
+    remove("path_resolution.disk");
+    printf("path_resolution PASS\n");
+    return 0;
+}
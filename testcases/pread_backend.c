@@ -0,0 +1,106 @@
+#include <pthread.h>
+#include "testcase.h"
+#include "disk.h"
+
+#define NUM_THREADS 4
+#define CHUNK 4096
+#define ROUNDS 200
+#define FILE_SIZE 20000
+
+static int image;
+
+// Returns the file offset of fd as the kernel reports it
+static long file_offset(int fd)
+{
+    char path[64], line[64];
+    long offset=-1;
+    sprintf(path,"/proc/self/fdinfo/%d",fd);
+    FILE *info=fopen(path,"r");
+    if (info==NULL)
+        return -1;
+    while (fgets(line,sizeof(line),info)!=NULL && sscanf(line,"pos: %ld",&offset)!=1);
+    fclose(info);
+    return offset;
+}
+
+// Writes and reads back its own chunk of the image, over and over
+static void *transfer(void *arg)
+{
+    int thread=(int) (long) arg;
+    Byte data[CHUNK], buffer[CHUNK];
+    for (int round=0;round<ROUNDS;round++) {
+        fill(data,CHUNK,thread*ROUNDS+round);
+        if (disk_pwrite(image,data,CHUNK,(unsigned long long) thread*CHUNK)!=0
+            || disk_pread(image,buffer,CHUNK,(unsigned long long) thread*CHUNK)!=0 || memcmp(buffer,data,CHUNK)!=0)
+            return (void *) -1;
+    }
+    return NULL;
+}
+
+// Reads its own file in small pieces from scattered positions
+static void *read_file(void *arg)
+{
+    int thread=(int) (long) arg;
+    char name[16];
+    Byte data[FILE_SIZE], buffer[100];
+    sprintf(name,"/f%d",thread);
+    fill(data,FILE_SIZE,thread);
+    my_file *file=my_fopen(name);
+    if (file==NULL)
+        return (void *) -1;
+    _u32 pos=thread;
+    for (int round=0;round<ROUNDS;round++) {
+        pos=(pos*7919+round*131)%(FILE_SIZE-sizeof(buffer));
+        if (my_fseek(file,pos)!=0 || my_fgetc(file,buffer,sizeof(buffer))!=0 || memcmp(buffer,data+pos,sizeof(buffer))!=0)
+            return (void *) -1;
+    }
+    my_fclose(file);
+    return NULL;
+}
+
+// Runs body on NUM_THREADS threads at once, returning -1 if any fails
+static int run_threads(void *(*body)(void *))
+{
+    pthread_t ids[NUM_THREADS];
+    void *result;
+    int failed=0;
+    for (long i=0;i<NUM_THREADS;i++)
+        pthread_create(&ids[i],NULL,body,(void *) i);
+    for (int i=0;i<NUM_THREADS;i++) {
+        pthread_join(ids[i],&result);
+        failed|=result!=NULL;
+    }
+    return failed ? -1 : 0;
+}
+
+int main()
+{
+    // Transfers at different offsets of one descriptor don't disturb each
+    // other, and none of them moves its file offset
+    image=disk_open("pread_backend.img",1);
+    if (image<0 || disk_resize(image,NUM_THREADS*CHUNK)!=0 || run_threads(transfer)!=0 || file_offset(image)!=0)
+        return -1;
+    Byte byte;
+    if (disk_pread(image,&byte,1,NUM_THREADS*CHUNK)==0 || disk_close(image)!=0)
+        return -1;
+    remove("pread_backend.img");
+
+    // Threads reading different files through the filesystem all see their own
+    set_io_mode(FS_IO_PREAD);
+    mount_fresh("pread_backend.disk",128,4096,80,0);
+    char name[16];
+    static Byte data[FILE_SIZE];
+    for (int i=0;i<NUM_THREADS;i++) {
+        sprintf(name,"/f%d",i);
+        fill(data,FILE_SIZE,i);
+        if (write_file(name,data,FILE_SIZE)!=0)
+            return -1;
+    }
+    remount("pread_backend.disk",0);
+    if (run_threads(read_file)!=0)
+        return -1;
+    unload();
+    remove("pread_backend.disk");
+    printf("pread_backend PASS\n");
+    return 0;
+}
@@ -0,0 +1,53 @@
+#include "testcase.h"
+
+#define FILE_SIZE 100000
+
+int main()
+{
+    // Reaches the double indirect block with 128-byte blocks
+    mount_fresh("readahead.disk",128,4096,80,0);
+    static Byte data[FILE_SIZE], buffer[FILE_SIZE];
+    for (int i=0;i<FILE_SIZE;i++)
+        data[i]=(Byte) (i*13+i/128);
+    write_file("stream",data,FILE_SIZE);
+
+    // Small sequential reads that straddle block and window boundaries
+    my_file *file=my_fopen("stream");
+    for (int done=0;done<FILE_SIZE;) {
+        int num=FILE_SIZE-done<7 ? FILE_SIZE-done : 7;
+        if (my_fgetc(file,buffer+done,num)!=0)
+            return -1;
+        done+=num;
+    }
+    if (memcmp(buffer,data,FILE_SIZE)!=0 || my_fgetc(file,buffer,1)==0)
+        return -1;
+
+    // Jumping around resets the stream but still reads the right bytes
+    _u32 positions[]={99990,0,50000,50001,127,4096,70000};
+    for (int i=0;i<7;i++) {
+        my_fseek(file,positions[i]);
+        if (my_fgetc(file,buffer,10)!=0 || memcmp(buffer,data+positions[i],10)!=0)
+            return -1;
+    }
+
+    // A write through another handle is seen by the next read
+    my_fseek(file,60000);
+    my_fgetc(file,buffer,10);
+    my_file *writer=my_fopen("stream");
+    my_fseek(writer,60010);
+    my_fputc(writer,(Byte *) "readahead",9);
+    my_fclose(writer);
+    if (my_fgetc(file,buffer,9)!=0 || memcmp(buffer,"readahead",9)!=0)
+        return -1;
+    memcpy(data+60010,"readahead",9);
+
+    // A read larger than the window bypasses the buffer
+    my_fseek(file,3);
+    if (my_fgetc(file,buffer,FILE_SIZE-3)!=0 || memcmp(buffer,data+3,FILE_SIZE-3)!=0)
+        return -1;
+    my_fclose(file);
+    unload();
+    remove("readahead.disk");
+    printf("readahead PASS\n");
+    return 0;
+}
@@ -0,0 +1,122 @@
+#include <stdlib.h>
+#include "testcase.h"
+
+// Creates an empty file name
+static int touch(char *name)
+{
+    my_file *file=my_fopen(name);
+    if (file==NULL)
+        return -1;
+    return my_fclose(file);
+}
+
+// Checks that ls() of the current directory gives expected
+static int check_ls(char *expected)
+{
+    char *list=ls();
+    int result=list==NULL || strcmp(list,expected)!=0 ? -1 : 0;
+    free(list);
+    return result;
+}
+
+int main()
+{
+    mount_fresh("readdir.disk",128,4096,80,0);
+    mkdir("/d");
+    chdir("/d");
+    touch("pear");
+    touch("apple");
+    mkdir("fig");
+    touch("banana");
+
+    // Entries come back in the order they are stored, dot entries included
+    char *order[]={".","..","pear","apple","fig","banana"};
+    Byte types[]={'D','D','F','F','D','F'};
+    my_dir *dir=my_opendir("/d");
+    for (int i=0;i<6;i++) {
+        direntry_t *entry=my_readdir(dir);
+        if (entry==NULL || strcmp(entry->name,order[i])!=0 || entry->type!=types[i])
+            return -1;
+    }
+    if (my_readdir(dir)!=NULL || my_closedir(dir)!=0)
+        return -1;
+
+    // ls() sorts and leaves the dot entries out
+    if (check_ls("apple\nbanana\nfig\npear")!=0 || check_ls("apple\nbanana\nfig\npear")!=0)
+        return -1;
+
+    // Removed entries leave holes that are skipped, and the listing follows
+    // every change to the directory
+    rm("apple");
+    dir=my_opendir(".");
+    int count=0;
+    for (direntry_t *entry=my_readdir(dir);entry!=NULL;entry=my_readdir(dir)) {
+        if (strcmp(entry->name,"apple")==0)
+            return -1;
+        count++;
+    }
+    my_closedir(dir);
+    if (count!=5 || check_ls("banana\nfig\npear")!=0)
+        return -1;
+    touch("cherry");
+    mv("pear","/pear");
+    if (check_ls("banana\ncherry\nfig")!=0)
+        return -1;
+    mv("banana","zucchini");
+    if (check_ls("cherry\nfig\nzucchini")!=0)
+        return -1;
+
+    // A directory changing under an open iterator is read again
+    dir=my_opendir("/d");
+    my_readdir(dir);
+    touch("/d/date");
+    count=0;
+    while (my_readdir(dir)!=NULL)
+        count++;
+    my_closedir(dir);
+    if (count!=5)
+        return -1;
+
+    // Many entries spread over several blocks
+    char name[32];
+    for (int i=0;i<50;i++) {
+        sprintf(name,"/d/fig/entry%02d",i);
+        touch(name);
+    }
+    chdir("fig");
+    char *list=ls();
+    if (list==NULL || strncmp(list,"entry00\nentry01\n",16)!=0 || strlen(list)!=50*8-1)
+        return -1;
+    free(list);
+    dir=my_opendir(".");
+    count=0;
+    while (my_readdir(dir)!=NULL)
+        count++;
+    my_closedir(dir);
+    if (count!=52)
+        return -1;
+
+    // An empty directory lists nothing, files and missing paths can't be opened
+    mkdir("/empty");
+    chdir("/empty");
+    if (check_ls("")!=0 || my_opendir("/pear")!=NULL || my_opendir("/missing")!=NULL)
+        return -1;
+    chdir("/");
+    if (check_ls("d\nempty\npear")!=0 || fsck()!=0)
+        return -1;
+
+    // A directory removed while it is open reads as ended, and an open
+    // handle outlives unload()
+    mkdir("/gone");
+    dir=my_opendir("/gone");
+    if (my_readdir(dir)==NULL || rmdir("/gone",0)!=0 || my_readdir(dir)!=NULL || my_closedir(dir)!=0)
+        return -1;
+    dir=my_opendir("/d");
+    remount("readdir.disk",0);
+    if (my_readdir(dir)!=NULL || my_closedir(dir)!=0)
+        return -1;
+    unload();
+    remove("readdir.disk");
+    printf("readdir PASS\n");
+    return 0;
+}
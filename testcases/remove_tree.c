@@ -0,0 +1,101 @@
+#include <pthread.h>
+#include "testcase.h"
+
+static Byte data[5000];
+
+static int made;
+
+// Makes files in /race/sub until the directory is gone
+static void *make_files(void *arg)
+{
+    char name[32];
+    for (int i=0;;i++) {
+        sprintf(name,"/race/sub/f%d",i);
+        if (write_file(name,data,100)!=0)
+            break;
+        __atomic_store_n(&made,i+1,__ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+int main()
+{
+    mount_fresh("remove_tree.disk",128,4096,400,0);
+    memset(data,'q',sizeof(data));
+    _u32 free_blocks=num_free_blocks();
+    _u32 free_inodes=num_free_inodes();
+
+    // A file gives back its inode, data blocks and indirect block
+    write_file("/f",data,5000);
+    mkdir("/d");
+    my_file *file=my_fopen("/open");
+    if (rm("/f")!=0 || rm("/f")==0 || rm("/d")==0 || rm("/open")==0)
+        return -1;
+    my_fclose(file);
+    if (rm("/open")!=0 || rmdir("/d",0)!=0 || rmdir("/d",0)==0)
+        return -1;
+    if (num_free_blocks()!=free_blocks || num_free_inodes()!=free_inodes)
+        return -1;
+
+    // Blocks shared with a copy stay until the last owner goes. The first
+    // cp() makes the refcount table.
+    write_file("/src",data,3000);
+    cp("/src","/copy");
+    free_blocks=num_free_blocks();
+    if (rm("/src")!=0 || num_free_blocks()!=free_blocks)
+        return -1;
+    if (check_file("/copy",data,3000)!=0 || rm("/copy")!=0 || num_free_blocks()!=free_blocks+25)
+        return -1;
+    free_blocks=num_free_blocks();
+
+    // A tree of 3 directories and 150 files
+    mkdir("/t");
+    mkdir("/t/a");
+    mkdir("/t/a/b");
+    char name[32];
+    for (int i=0;i<150;i++) {
+        sprintf(name,i%3==0 ? "/t/f%d" : i%3==1 ? "/t/a/f%d" : "/t/a/b/f%d",i);
+        write_file(name,data,(i*37)%5000);
+    }
+    chdir("/t/a");
+    if (rmdir("/t",0)==0 || rmdir("/t",1)==0 || rmdir("/t/a/b",0)==0)
+        return -1;
+    chdir("/");
+
+    // Each bitmap block and inode table block is written once
+    fs_stats_t stats;
+    fs_stats_reset();
+    if (rmdir("/t",1)!=0 || fs_stats(&stats)!=0)
+        return -1;
+    if (num_free_blocks()!=free_blocks || num_free_inodes()!=free_inodes
+        || stats.block_writes[FS_REGION_BITMAP]>4 || stats.block_writes[FS_REGION_ITABLE]>40)
+        return -1;
+
+    // A new directory of the same name starts out empty
+    mkdir("/t");
+    if (chdir("/t/a")==0 || rmdir("/t",0)!=0 || fsck()!=0)
+        return -1;
+
+    // Nothing made in the subtree while rmdir() runs outlives it
+    for (int round=0;round<200;round++) {
+        mkdir("/race");
+        mkdir("/race/sub");
+        pthread_t maker;
+        made=0;
+        pthread_create(&maker,NULL,make_files,NULL);
+        while (__atomic_load_n(&made,__ATOMIC_ACQUIRE)<round%8+1);
+        while (rmdir("/race",1)!=0);
+        pthread_join(maker,NULL);
+        if (num_free_blocks()!=free_blocks || num_free_inodes()!=free_inodes)
+            return -1;
+    }
+    if (fsck()!=0)
+        return -1;
+    remount("remove_tree.disk",0);
+    if (num_free_blocks()!=free_blocks || num_free_inodes()!=free_inodes || fsck()!=0)
+        return -1;
+    unload();
+    remove("remove_tree.disk");
+    printf("remove_tree PASS\n");
+    return 0;
+}
@@ -0,0 +1,53 @@
+#include "testcase.h"
+
+// Reads or overwrites the rootblock of disk straight on the image
+static int rootblock_io(char *disk, rootblock_t *rb, int write)
+{
+    FILE *image=fopen(disk,"r+b");
+    if (image==NULL)
+        return -1;
+    size_t done=write ? fwrite(rb,sizeof(*rb),1,image) : fread(rb,sizeof(*rb),1,image);
+    fclose(image);
+    return done==1 ? 0 : -1;
+}
+
+int main()
+{
+    // load() reads the geometry once and hands out the same copy every time
+    mount_fresh("rootblock_cache.disk",128,4096,80,0);
+    rootblock_t *rb=get_rootblock();
+    if (rb==NULL || rb!=get_rootblock() || rb->block_size!=128 || rb->num_blocks!=4096
+        || rb->num_free_bitmap_blocks!=4 || rb->num_inode_table_blocks!=20)
+        return -1;
+
+    // No operation goes back to the disk for it
+    static Byte data[5000];
+    fill(data,sizeof(data),1);
+    fs_stats_t stats;
+    fs_stats_reset();
+    if (mkdir("/a")!=0 || write_file("/a/f",data,sizeof(data))!=0 || check_file("/a/f",data,sizeof(data))!=0)
+        return -1;
+    if (fs_stats(&stats)!=0 || stats.block_reads[FS_REGION_ROOTBLOCK]!=0 || stats.block_reads[FS_REGION_DATA]==0)
+        return -1;
+
+    // Even a rootblock clobbered under the mount goes unnoticed
+    rootblock_t saved, zero={0};
+    if (rootblock_io("rootblock_cache.disk",&saved,0)!=0 || rootblock_io("rootblock_cache.disk",&zero,1)!=0)
+        return -1;
+    _u32 free_blocks=num_free_blocks();
+    if (write_file("/a/g",data,600)!=0 || check_file("/a/g",data,600)!=0 || check_file("/a/f",data,sizeof(data))!=0
+        || num_free_blocks()!=free_blocks-5 || get_rootblock()->block_size!=128)
+        return -1;
+    unload();
+
+    // but the next load() checks what it reads
+    if (load("rootblock_cache.disk",0)==0 || get_rootblock()!=NULL)
+        return -1;
+    if (rootblock_io("rootblock_cache.disk",&saved,1)!=0 || load("rootblock_cache.disk",0)!=0
+        || check_file("/a/g",data,600)!=0 || fsck()!=0)
+        return -1;
+    unload();
+    remove("rootblock_cache.disk");
+    printf("rootblock_cache PASS\n");
+    return 0;
+}
@@ -0,0 +1,92 @@
+#include <pthread.h>
+#include "testcase.h"
+
+#define NUM_THREADS 3
+
+static unsigned long long sum(unsigned long long *counts, int num) {
+    unsigned long long total=0;
+    for (int i=0;i<num;i++)
+        total+=counts[i];
+    return total;
+}
+
+static void *worker(void *arg) {
+    char name[16];
+    sprintf(name,"/w%d",(int) (long) arg);
+    return write_file(name,(Byte *) "thread",6)!=0 ? (void *) -1 : NULL;
+}
+
+int main()
+{
+    mount_fresh("stats.disk",128,4096,80,0);
+    fs_stats_reset();
+    fs_stats_t stats;
+    if (fs_stats(&stats)!=0 || stats.ops[FS_OP_LOAD].calls!=0 || stats.bytes_read!=0)
+        return -1;
+
+    // Every call is counted, failures too, and the timed ones land in one latency bucket
+    mkdir("/a");
+    mkdir("/a");
+    my_file *file=my_fopen("/a/f");
+    Byte data[1000];
+    memset(data,'x',sizeof(data));
+    my_fputc(file,data,sizeof(data));
+    my_fseek(file,0);
+    my_fgetc(file,data,sizeof(data));
+    my_fclose(file);
+    fs_stats(&stats);
+    if (stats.ops[FS_OP_MKDIR].calls!=2 || stats.ops[FS_OP_MKDIR].errors!=1)
+        return -1;
+    if (stats.ops[FS_OP_FOPEN].calls!=1 || stats.ops[FS_OP_FPUTC].calls!=1 || stats.ops[FS_OP_FCLOSE].calls!=1)
+        return -1;
+    for (int op=0;op<FS_OPS;op++) {
+        if (sum(stats.ops[op].latency,FS_LATENCY_BUCKETS)!=stats.ops[op].timed)
+            return -1;
+        if (stats.ops[op].timed>stats.ops[op].calls || (stats.ops[op].calls>0 && stats.ops[op].timed==0))
+            return -1;
+    }
+    if (strcmp(fs_op_name(FS_OP_FGETC),"my_fgetc")!=0 || fs_op_name(FS_OPS)!=NULL)
+        return -1;
+
+    // Write-through, so every region written shows up, in whole blocks
+    if (stats.block_writes[FS_REGION_BITMAP]==0 || stats.block_writes[FS_REGION_ITABLE]==0
+        || stats.block_writes[FS_REGION_DIRECTORY]==0 || stats.block_writes[FS_REGION_DATA]<8
+        || stats.block_writes[FS_REGION_JOURNAL]!=0)
+        return -1;
+    if (stats.bytes_written!=sum(stats.block_writes,FS_REGIONS)*128 || stats.seeks==0)
+        return -1;
+    if (stats.dentry_misses==0 || stats.cache_hits!=0 || stats.cache_misses==0)
+        return -1;
+    unload();
+
+    // Reads of blocks in the write buffer are hits
+    load("stats.disk",16);
+    fs_stats_reset();
+    write_file("/a/g",data,sizeof(data));
+    file=my_fopen("/a/g");
+    my_fgetc(file,data,sizeof(data));
+    my_fclose(file);
+    fs_stats(&stats);
+    if (stats.cache_hits==0)
+        return -1;
+
+    // Threads that have exited still count
+    fs_stats_reset();
+    pthread_t ids[NUM_THREADS];
+    void *result;
+    for (long i=0;i<NUM_THREADS;i++)
+        pthread_create(&ids[i],NULL,worker,(void *) i);
+    for (int i=0;i<NUM_THREADS;i++) {
+        pthread_join(ids[i],&result);
+        if (result!=NULL)
+            return -1;
+    }
+    fs_stats(&stats);
+    if (stats.ops[FS_OP_FOPEN].calls!=NUM_THREADS || stats.ops[FS_OP_FPUTC].calls!=NUM_THREADS
+        || stats.threads<NUM_THREADS+1)
+        return -1;
+    unload();
+    remove("stats.disk");
+    printf("stats PASS\n");
+    return 0;
+}
@@ -0,0 +1,59 @@
+#ifndef TESTCASE_H
+#define TESTCASE_H
+
+#include <string.h>
+#include "filesystem.h"
+
+/*Setup shared by the testcases. Every testcase is built on its own with 
+make test case=<name>, so the helpers live here as static functions rather 
+than in a translation unit of their own.*/
+
+/*Formats disk with the given geometry, then loads it again with 
+write_buffer_size as load() takes it.*/
+static inline int mount_fresh(char *disk, _u32 block_size, _u32 num_blocks, _u32 num_inodes, _u32 write_buffer_size)
+{
+    if (format(disk,block_size,num_blocks,num_inodes)!=0)
+        return -1;
+    unload();
+    return load(disk,write_buffer_size);
+}
+
+/*Unloads the mounted filesystem and loads disk in its place.*/
+static inline int remount(char *disk, _u32 write_buffer_size)
+{
+    unload();
+    return load(disk,write_buffer_size);
+}
+
+/*Fills size bytes of data with a pattern that differs for each seed.*/
+static inline void fill(Byte *data, _u32 size, _u32 seed)
+{
+    for (_u32 i=0;i<size;i++)
+        data[i]=(Byte) (seed*31+i);
+}
+
+/*Creates name, or opens it if it exists, and writes size bytes of data 
+at its start.*/
+static inline int write_file(char *name, Byte *data, _u32 size)
+{
+    my_file *file=my_fopen(name);
+    if (file==NULL || my_fputc(file,data,size)!=0)
+        return -1;
+    return my_fclose(file);
+}
+
+/*Checks that name holds exactly the size bytes of data.*/
+static inline int check_file(char *name, Byte *data, _u32 size)
+{
+    my_file *file=my_fopen(name);
+    if (file==NULL)
+        return -1;
+    Byte *buffer=malloc(size ? size : 1);
+    int result=file->inode->size!=size || my_fgetc(file,buffer,size)!=0 || memcmp(buffer,data,size)!=0 ? -1 : 0;
+    free(buffer);
+    if (my_fclose(file)!=0)
+        return -1;
+    return result;
+}
+
+#endif
@@ -0,0 +1,121 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "testcase.h"
+
+#define NUM_THREADS 4
+#define NUM_FILES 20
+#define FILE_SIZE 300
+
+// Every thread works in its own directory, and they all look up a shared file
+static void *worker(void *arg) {
+    int thread=(int) (long) arg;
+    char name[32];
+    Byte data[FILE_SIZE];
+    sprintf(name,"/t%d",thread);
+    if (mkdir(name)!=0)
+        return (void *) -1;
+    for (int i=0;i<NUM_FILES;i++) {
+        sprintf(name,"/t%d/f%d",thread,i);
+        my_file *file=my_fopen(name);
+        if (file==NULL)
+            return (void *) -1;
+        fill(data,FILE_SIZE,thread*NUM_FILES+i);
+        // Write in two pieces so the file grows while others allocate
+        if (my_fputc(file,data,100)!=0 || my_fputc(file,data+100,FILE_SIZE-100)!=0)
+            return (void *) -1;
+        my_fclose(file);
+        my_file *shared=my_fopen("/shared");
+        Byte byte;
+        if (shared==NULL || my_fgetc(shared,&byte,1)!=0 || byte!='s')
+            return (void *) -1;
+        my_fclose(shared);
+    }
+    return NULL;
+}
+
+static int run(const char *disk, int threads, _u32 *free_blocks, _u32 *free_inodes) {
+    mount_fresh((char *) disk,128,8192,256,4);
+    my_file *shared=my_fopen("/shared");
+    my_fputc(shared,(Byte *) "s",1);
+    my_fclose(shared);
+    pthread_t ids[NUM_THREADS];
+    void *result;
+    if (threads) {
+        for (long i=0;i<NUM_THREADS;i++)
+            pthread_create(&ids[i],NULL,worker,(void *) i);
+        for (int i=0;i<NUM_THREADS;i++) {
+            pthread_join(ids[i],&result);
+            if (result!=NULL)
+                return -1;
+        }
+    } else {
+        for (long i=0;i<NUM_THREADS;i++)
+            if (worker((void *) i)!=NULL)
+                return -1;
+    }
+
+    remount((char *) disk,0);
+    char name[32];
+    Byte expected[FILE_SIZE];
+    for (int t=0;t<NUM_THREADS;t++) {
+        for (int i=0;i<NUM_FILES;i++) {
+            sprintf(name,"/t%d/f%d",t,i);
+            fill(expected,FILE_SIZE,t*NUM_FILES+i);
+            if (check_file(name,expected,FILE_SIZE)!=0)
+                return -1;
+        }
+    }
+    *free_blocks=num_free_blocks();
+    *free_inodes=num_free_inodes();
+    unload();
+    remove(disk);
+    return 0;
+}
+
+static int stop;
+
+// Moves into /c/d and back while the main thread removes /c. Once chdir()
+// has succeeded the directory has to stay until it is left.
+static void *wander(void *arg) {
+    while (!__atomic_load_n(&stop,__ATOMIC_ACQUIRE)) {
+        if (chdir("/c/d")!=0)
+            continue;
+        char *path=cwd();
+        int lost=path==NULL || strcmp(path,"/c/d")!=0;
+        free(path);
+        if (chdir("/")!=0 || lost)
+            return (void *) -1;
+    }
+    return NULL;
+}
+
+int main()
+{
+    _u32 serial_blocks, serial_inodes, blocks, inodes;
+    if (run("threads.disk",0,&serial_blocks,&serial_inodes)!=0)
+        return -1;
+    // Running the same work concurrently must use exactly the same space
+    if (run("threads.disk",1,&blocks,&inodes)!=0)
+        return -1;
+    if (blocks!=serial_blocks || inodes!=serial_inodes)
+        return -1;
+
+    // The current directory is shared, and rmdir() sees every chdir()
+    format("threads.disk",128,8192,256);
+    pthread_t wanderer;
+    void *result;
+    pthread_create(&wanderer,NULL,wander,NULL);
+    for (int round=0;round<5000;round++) {
+        mkdir("/c");
+        mkdir("/c/d");
+        while (rmdir("/c",1)!=0);
+    }
+    __atomic_store_n(&stop,1,__ATOMIC_RELEASE);
+    pthread_join(wanderer,&result);
+    if (result!=NULL || fsck()!=0)
+        return -1;
+    unload();
+    remove("threads.disk");
+    printf("threads PASS\n");
+    return 0;
+}
@@ -0,0 +1,56 @@
+#include "testcase.h"
+
+int main()
+{
+    mount_fresh("tracing.disk",128,4096,80,8);
+    if (trace_start("tracing.trace")!=0)
+        return -1;
+    mkdir("/a");
+    Byte data[1000];
+    memset(data,'t',sizeof(data));
+    write_file("/a/f",data,sizeof(data));
+    Byte block[128];
+    read_block(0,block);
+    if (trace_stop()!=0 || trace_stop()==0)
+        return -1;
+
+    FILE *trace=fopen("tracing.trace","rb");
+    fs_trace_header_t header;
+    if (trace==NULL || fread(&header,sizeof(header),1,trace)!=1)
+        return -1;
+    if (header.magic!=FS_TRACE_MAGIC || header.block_size!=128 || header.num_blocks!=4096 || header.num_inodes<80)
+        return -1;
+    fs_trace_record_t record;
+    int records=0, mkdir_directory=0, fputc_data=0, inode_writes=0, plain_read=0;
+    uint64_t last=0;
+    while (fread(&record,sizeof(record),1,trace)==1) {
+        records++;
+        // Records come in time order
+        if (record.time_ns<last)
+            return -1;
+        last=record.time_ns;
+        if (record.op==FS_OP_MKDIR && record.region==FS_REGION_DIRECTORY && record.access==FS_TRACE_WRITE)
+            mkdir_directory++;
+        if (record.op==FS_OP_FPUTC && record.region==FS_REGION_DATA && record.access==FS_TRACE_WRITE)
+            fputc_data++;
+        if (record.access==FS_TRACE_INODE_WRITE && record.index<header.num_inodes)
+            inode_writes++;
+        if (record.op==FS_TRACE_NO_OP && record.index==0 && record.region==FS_REGION_ROOTBLOCK)
+            plain_read++;
+    }
+    fclose(trace);
+    if (records==0 || mkdir_directory==0 || fputc_data<7 || inode_writes==0 || plain_read!=1)
+        return -1;
+
+    // unload() ends a trace that is still running
+    if (trace_start("tracing.trace")!=0)
+        return -1;
+    mkdir("/b");
+    unload();
+    if (trace_stop()==0)
+        return -1;
+    remove("tracing.trace");
+    remove("tracing.disk");
+    printf("tracing PASS\n");
+    return 0;
+}
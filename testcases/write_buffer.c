@@ -0,0 +1,88 @@
+#include "testcase.h"
+
+#define FILE_SIZE 3000
+
+int main()
+{
+    mount_fresh("write_buffer.disk",128,4096,80,0);
+    static Byte data[FILE_SIZE], buffer[FILE_SIZE];
+    for (int i=0;i<FILE_SIZE;i++)
+        data[i]=(Byte) (i*11+i/128);
+
+    // Small writes that straddle block boundaries stay in the handle until it moves on
+    my_file *file=my_fopen("log");
+    for (int done=0;done<FILE_SIZE;done+=30)
+        if (my_fputc(file,data+done,30)!=0)
+            return -1;
+    my_file *other=my_fopen("log");
+    if (other->inode->size>=FILE_SIZE)
+        return -1;
+
+    // The same handle can seek to the buffered end and read it back
+    if (my_fseek(file,FILE_SIZE)!=0 || my_fseek(file,10)!=0)
+        return -1;
+    if (my_fgetc(file,buffer,FILE_SIZE-10)!=0 || memcmp(buffer,data+10,FILE_SIZE-10)!=0)
+        return -1;
+
+    // Overwrite inside the file, then fsync makes it visible to other handles
+    my_fseek(file,1000);
+    my_fputc(file,(Byte *) "buffered",8);
+    memcpy(data+1000,"buffered",8);
+    fsync();
+    if (other->inode->size!=FILE_SIZE || my_fgetc(other,buffer,FILE_SIZE)!=0 || memcmp(buffer,data,FILE_SIZE)!=0)
+        return -1;
+
+    // A write through another handle is not lost by the clean buffer of the first
+    my_fseek(other,1010);
+    my_fputc(other,(Byte *) "other",5);
+    my_fclose(other);
+    memcpy(data+1010,"other",5);
+    my_fputc(file,(Byte *) "!",1);
+    data[1008]='!';
+    my_fclose(file);
+
+    // The inode was stored at close
+    remount("write_buffer.disk",0);
+    if (check_file("log",data,FILE_SIZE)!=0)
+        return -1;
+
+    // Two handles changing different bytes of one block both keep them,
+    // whichever writes back last
+    static Byte shared[100];
+    memset(shared,'x',100);
+    write_file("shared",shared,100);
+    file=my_fopen("shared");
+    other=my_fopen("shared");
+    my_fseek(file,10);
+    my_fputc(file,(Byte *) "first",5);
+    my_fseek(other,50);
+    my_fputc(other,(Byte *) "second",6);
+    memcpy(shared+10,"first",5);
+    memcpy(shared+50,"second",6);
+
+    // Reads are served from the handle's own changes without writing them back
+    my_fseek(file,100);
+    my_fputc(file,(Byte *) "tail",4);
+    if (my_fseek(file,96)!=0 || my_fgetc(file,buffer,8)!=0 || memcmp(buffer,"xxxxtail",8)!=0 || file->inode->size!=100)
+        return -1;
+    if (my_fseek(file,0)!=0 || my_fgetc(file,buffer,100)!=0 || memcmp(buffer+10,"first",5)!=0 || file->inode->size!=100)
+        return -1;
+    my_fclose(file);
+    my_fclose(other);
+    file=my_fopen("shared");
+    if (file->inode->size!=104 || my_fgetc(file,buffer,104)!=0 || memcmp(buffer,shared,100)!=0 || memcmp(buffer+100,"tail",4)!=0)
+        return -1;
+    my_fclose(file);
+
+    // unload() writes back files that were left open
+    file=my_fopen("left open");
+    my_fputc(file,(Byte *) "hello",6);
+    remount("write_buffer.disk",0);
+    my_fclose(file);
+    if (check_file("left open",(Byte *) "hello",6)!=0)
+        return -1;
+    unload();
+    remove("write_buffer.disk");
+    printf("write_buffer PASS\n");
+    return 0;
+}
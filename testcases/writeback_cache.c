@@ -0,0 +1,28 @@
+#include "testcase.h"
+
+int main()
+{
+    // Buffer up to 4 changed blocks before writing them back
+    mount_fresh("writeback_cache.disk",128,4096,80,4);
+    mkdir("/testdir1");
+    write_file("hello_world",(Byte *) "hello",6);
+    mkdir("/testdir2");
+    // Buffered blocks are visible before they reach the disk
+    if (num_free_blocks()!=4067)
+        return -1;
+    if (num_free_inodes()!=76)
+        return -1;
+    fsync();
+
+    remount("writeback_cache.disk",0);
+    if (num_free_blocks()!=4067)
+        return -1;
+    if (num_free_inodes()!=76)
+        return -1;
+    if (check_file("hello_world",(Byte *) "hello",6)!=0)
+        return -1;
+    unload();
+    remove("writeback_cache.disk");
+    printf("writeback_cache PASS\n");
+    return 0;
+}
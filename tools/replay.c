@@ -0,0 +1,280 @@
+/*Offline replay of a block access trace recorded with trace_start(). Feeds 
+the block accesses through simulated caches of several sizes and 
+replacement policies, and the inode accesses through simulated inode 
+caches, and reports the hit ratio and the disk I/O each would have caused. 
+ 
+    replay trace [size ...] 
+ 
+The sizes are in blocks (or inodes) and default to 16, 64, 256, 1024 and 
+4096. The policies are lru, fifo, clock and buffer. The first three cache 
+reads and writes and write dirty blocks back when they are evicted. buffer 
+is the write buffer of load(): only written blocks are held, reads hit 
+only those, and once write_buffer_size blocks have changed they are all 
+written back.*/
+#include <string.h>
+#include "filesystem.h"
+
+#define READ_CHUNK 4096
+#define MAX_SIZES 16
+
+#define POLICY_LRU 0
+#define POLICY_FIFO 1
+#define POLICY_CLOCK 2
+#define POLICY_BUFFER 3
+#define POLICIES 4
+
+#define NO_SLOT ((_u32) -1)
+
+static const char *policy_names[POLICIES] = {"lru", "fifo", "clock", "buffer"};
+
+/*A simulated cache of capacity slots over indexes below num_indexes*/
+typedef struct cache_sim {
+    int policy;
+    _u32 capacity;
+    _u32 used;
+    _u32 hand;          // next FIFO victim, or the clock hand
+    _u32 *slot_of;      // per index, its slot + 1 or 0 when not cached
+    _u32 *index_of;     // per slot
+    _u32 *prev;         // LRU list over the slots, most recent first
+    _u32 *next;
+    _u32 head;          // NO_SLOT while the list is empty
+    _u32 tail;
+    Byte *referenced;
+    Byte *dirty;
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long disk_reads;
+    unsigned long long disk_writes;
+} cache_sim;
+
+static int sim_init(cache_sim *sim, int policy, _u32 capacity, _u32 num_indexes) {
+    memset(sim, 0, sizeof(cache_sim));
+    sim->policy = policy;
+    sim->capacity = capacity;
+    sim->head = NO_SLOT;
+    sim->tail = NO_SLOT;
+    sim->slot_of = calloc(num_indexes, sizeof(_u32));
+    sim->index_of = malloc(capacity * sizeof(_u32));
+    sim->prev = malloc(capacity * sizeof(_u32));
+    sim->next = malloc(capacity * sizeof(_u32));
+    sim->referenced = calloc(capacity, 1);
+    sim->dirty = calloc(capacity, 1);
+    if (sim->slot_of == NULL || sim->index_of == NULL || sim->prev == NULL
+        || sim->next == NULL || sim->referenced == NULL || sim->dirty == NULL)
+        return -1;
+    return 0;
+}
+
+static void sim_free(cache_sim *sim) {
+    free(sim->slot_of);
+    free(sim->index_of);
+    free(sim->prev);
+    free(sim->next);
+    free(sim->referenced);
+    free(sim->dirty);
+}
+
+static void lru_unlink(cache_sim *sim, _u32 slot) {
+    if (sim->prev[slot] == NO_SLOT)
+        sim->head = sim->next[slot];
+    else
+        sim->next[sim->prev[slot]] = sim->next[slot];
+    if (sim->next[slot] == NO_SLOT)
+        sim->tail = sim->prev[slot];
+    else
+        sim->prev[sim->next[slot]] = sim->prev[slot];
+}
+
+static void lru_push(cache_sim *sim, _u32 slot) {
+    sim->prev[slot] = NO_SLOT;
+    sim->next[slot] = sim->head;
+    if (sim->head == NO_SLOT)
+        sim->tail = slot;
+    else
+        sim->prev[sim->head] = slot;
+    sim->head = slot;
+}
+
+/*Picks the slot to reuse once the cache is full, writing it back if dirty*/
+static _u32 sim_evict(cache_sim *sim) {
+    _u32 victim;
+    if (sim->policy == POLICY_LRU) {
+        victim = sim->tail;
+        lru_unlink(sim, victim);
+    } else if (sim->policy == POLICY_FIFO) {
+        victim = sim->hand;
+        sim->hand = (sim->hand + 1) % sim->capacity;
+    } else {
+        while (sim->referenced[sim->hand]) {
+            sim->referenced[sim->hand] = 0;
+            sim->hand = (sim->hand + 1) % sim->capacity;
+        }
+        victim = sim->hand;
+        sim->hand = (sim->hand + 1) % sim->capacity;
+    }
+    sim->disk_writes += sim->dirty[victim];
+    sim->slot_of[sim->index_of[victim]] = 0;
+    return victim;
+}
+
+/*The write buffer: writes are absorbed, and all of them go out together*/
+static void buffer_access(cache_sim *sim, _u32 index, int write) {
+    if (sim->slot_of[index] != 0) {
+        sim->hits++;
+        return;
+    }
+    sim->misses++;
+    if (!write) {
+        sim->disk_reads++;
+        return;
+    }
+    sim->index_of[sim->used] = index;
+    sim->slot_of[index] = ++sim->used;
+    if (sim->used == sim->capacity) {
+        for (_u32 i = 0; i < sim->used; i++)
+            sim->slot_of[sim->index_of[i]] = 0;
+        sim->disk_writes += sim->used;
+        sim->used = 0;
+    }
+}
+
+static void sim_access(cache_sim *sim, _u32 index, int write) {
+    if (sim->policy == POLICY_BUFFER) {
+        buffer_access(sim, index, write);
+        return;
+    }
+    _u32 slot = sim->slot_of[index];
+    if (slot != 0) {
+        slot--;
+        sim->hits++;
+        sim->referenced[slot] = 1;
+        sim->dirty[slot] |= write;
+        if (sim->policy == POLICY_LRU && slot != sim->head) {
+            lru_unlink(sim, slot);
+            lru_push(sim, slot);
+        }
+        return;
+    }
+    // Whole blocks are written, so only a read miss goes to the disk
+    sim->misses++;
+    sim->disk_reads += !write;
+    slot = sim->used < sim->capacity ? sim->used++ : sim_evict(sim);
+    sim->index_of[slot] = index;
+    sim->slot_of[index] = slot + 1;
+    sim->referenced[slot] = 1;
+    sim->dirty[slot] = write;
+    if (sim->policy == POLICY_LRU)
+        lru_push(sim, slot);
+}
+
+/*Writes back whatever is still dirty at the end of the trace*/
+static void sim_finish(cache_sim *sim) {
+    if (sim->policy == POLICY_BUFFER) {
+        sim->disk_writes += sim->used;
+        return;
+    }
+    for (_u32 i = 0; i < sim->used; i++)
+        sim->disk_writes += sim->dirty[i];
+}
+
+static void report(const char *kind, cache_sim *sim) {
+    unsigned long long accesses = sim->hits + sim->misses;
+    printf("%-6s %-6s %8u %9.4f %12llu %12llu %12llu\n", kind, policy_names[sim->policy], sim->capacity,
+           accesses == 0 ? 0.0 : (double) sim->hits / accesses,
+           sim->disk_reads, sim->disk_writes, sim->disk_reads + sim->disk_writes);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s trace [size ...]\n", argv[0]);
+        return 1;
+    }
+    _u32 sizes[MAX_SIZES] = {16, 64, 256, 1024, 4096};
+    int num_sizes = 5;
+    if (argc > 2) {
+        num_sizes = argc - 2 < MAX_SIZES ? argc - 2 : MAX_SIZES;
+        for (int i = 0; i < num_sizes; i++) {
+            sizes[i] = strtoul(argv[i + 2], NULL, 10);
+            if (sizes[i] == 0) {
+                fprintf(stderr, "bad size %s\n", argv[i + 2]);
+                return 1;
+            }
+        }
+    }
+    FILE *file = fopen(argv[1], "rb");
+    fs_trace_header_t header;
+    if (file == NULL || fread(&header, sizeof(header), 1, file) != 1
+        || header.magic != FS_TRACE_MAGIC || header.version != FS_TRACE_VERSION) {
+        fprintf(stderr, "%s is not a trace\n", argv[1]);
+        return 1;
+    }
+
+    cache_sim blocks[POLICIES][MAX_SIZES];
+    cache_sim inodes[MAX_SIZES];
+    for (int i = 0; i < num_sizes; i++) {
+        for (int policy = 0; policy < POLICIES; policy++) {
+            if (sim_init(&blocks[policy][i], policy, sizes[i], header.num_blocks) < 0)
+                return 1;
+        }
+        if (sim_init(&inodes[i], POLICY_LRU, sizes[i], header.num_inodes) < 0)
+            return 1;
+    }
+
+    unsigned long long accesses[4] = {0}, by_op[FS_OPS + 1] = {0}, by_region[FS_REGIONS] = {0};
+    double seconds = 0;
+    static fs_trace_record_t records[READ_CHUNK];
+    size_t count;
+    while ((count = fread(records, sizeof(fs_trace_record_t), READ_CHUNK, file)) > 0) {
+        for (size_t r = 0; r < count; r++) {
+            fs_trace_record_t *record = &records[r];
+            int write = record->access == FS_TRACE_WRITE || record->access == FS_TRACE_INODE_WRITE;
+            int inode = record->access >= FS_TRACE_INODE_READ;
+            if (record->access > FS_TRACE_INODE_WRITE
+                || record->index >= (inode ? header.num_inodes : header.num_blocks))
+                continue;
+            accesses[record->access]++;
+            by_op[record->op < FS_OPS ? record->op : FS_OPS]++;
+            if (record->region < FS_REGIONS)
+                by_region[record->region]++;
+            seconds = record->time_ns / 1e9;
+            for (int i = 0; i < num_sizes; i++) {
+                if (inode) {
+                    sim_access(&inodes[i], record->index, write);
+                    continue;
+                }
+                for (int policy = 0; policy < POLICIES; policy++)
+                    sim_access(&blocks[policy][i], record->index, write);
+            }
+        }
+    }
+    fclose(file);
+
+    static const char *region_names[FS_REGIONS] = {"rootblock", "bitmap", "itable", "journal", "directory", "data", "refcount"};
+    printf("%llu block reads, %llu block writes, %llu inode reads, %llu inode writes over %.3f s\n",
+           accesses[FS_TRACE_READ], accesses[FS_TRACE_WRITE],
+           accesses[FS_TRACE_INODE_READ], accesses[FS_TRACE_INODE_WRITE], seconds);
+    printf("by region:");
+    for (int i = 0; i < FS_REGIONS; i++)
+        printf(" %s %llu", region_names[i], by_region[i]);
+    printf("\nby operation:");
+    for (int op = 0; op < FS_OPS; op++) {
+        if (by_op[op] > 0)
+            printf(" %s %llu", fs_op_name(op), by_op[op]);
+    }
+    printf(" other %llu\n\n", by_op[FS_OPS]);
+    printf("%-6s %-6s %8s %9s %12s %12s %12s\n", "cache", "policy", "size", "hit_ratio", "disk_reads", "disk_writes", "io");
+    for (int policy = 0; policy < POLICIES; policy++) {
+        for (int i = 0; i < num_sizes; i++) {
+            sim_finish(&blocks[policy][i]);
+            report("block", &blocks[policy][i]);
+            sim_free(&blocks[policy][i]);
+        }
+    }
+    for (int i = 0; i < num_sizes; i++) {
+        sim_finish(&inodes[i]);
+        report("inode", &inodes[i]);
+        sim_free(&inodes[i]);
+    }
+    return 0;
+}